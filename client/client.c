@@ -7,6 +7,345 @@
 #include "client_helper.h"
 
 
+// Handles one text frame, returns -1 when the server is shutting down
+static int handle_text_frame(char *buffer) {
+    if (strncmp(buffer, "FILE_UPLOAD_REQUEST:", 20) == 0) {
+        char *colon1 = strchr(buffer + 20, ':');
+        if (colon1) {
+            *colon1 = '\0';
+            char *filename = buffer + 20;
+            char *target_username = colon1 + 1;
+            
+            // A chunked upload also names its transfer and where to start
+            uint32_t transfer_id = 0;
+            size_t offset = 0;
+            char *colon2 = strchr(target_username, ':');
+            if (colon2) {
+                *colon2 = '\0';
+                transfer_id = (uint32_t)strtoul(colon2 + 1, &colon2, 10);
+                offset = (*colon2 == ':') ? (size_t)strtoull(colon2 + 1, NULL, 10) : 0;
+            }
+            
+            printf("\n Server requesting upload of: %s to %s\n", filename, target_username);
+            printf("Starting file upload...\n");
+            
+            // Upload the file
+            if (upload_file_to_server(filename, target_username, transfer_id, offset) == 0) {
+                printf(" File upload completed successfully\n");
+            } else {
+                printf(" Failed to upload file: %s\n", filename);
+            }
+            
+            printf("Enter a command: ");
+            fflush(stdout);
+        }
+    } 
+    else if (strncmp(buffer, "FILE_DOWNLOAD:", 14) == 0) {
+        // Handle incoming file download
+        printf("\n Receiving file from server...\n");
+        if (receive_file_from_server(buffer) == 0) {
+            // Success message already printed in receive_file_from_server
+        } else {
+            printf(" Failed to receive file\n");
+            printf("Enter a command: ");
+            fflush(stdout);
+        }
+    } 
+    else if (strncmp(buffer, "FILE_TRANSFER_ABORT", 19) == 0) {
+        printf("\n %s\n", buffer);
+        char *name = strstr(buffer, "Upload of '");
+        char *name_end = name ? strstr(name, "' from ") : NULL;
+        if (name_end) {
+            // The relayed file was cut short, what arrived is not the file
+            name += 11;
+            *name_end = '\0';
+            if (discard_download(name) == 0) {
+                printf(" Incomplete file '%s' removed\n", name);
+            }
+        } else {
+            printf(" File transfer cancelled due to server shutdown\n");
+        }
+        printf("Enter a command: ");
+        fflush(stdout);
+    } 
+    else if (strncmp(buffer, "FILE_RESUME ", 12) == 0) {
+        if (answer_resume_offer(buffer) != 0) {
+            printf("\n Could not resume: %s\n", buffer);
+        }
+        printf("Enter a command: ");
+        fflush(stdout);
+    }
+    else if (strncmp(buffer, "RESUME_OK", 9) == 0) {
+        // Chunked transfers are on, any offers came just before
+    }
+    else if (strncmp(buffer, "SERVER_SHUTDOWN", 15) == 0) {
+        printf("\n %s\n", buffer);
+        printf(" Disconnecting from server...\n");
+        
+        // Set flag to stop receive thread
+        client_running = 0;
+        
+        // Don't try to send /exit if server is shutting down - connection might be closed
+        // Just break out of receive loop
+        printf("Server initiated shutdown - disconnecting gracefully\n");
+        return -1;
+    }
+    else {
+        // Handle regular text messages
+        printf("\nReceived: %s\n", buffer);
+        printf("Enter a command: ");
+        fflush(stdout);
+    }
+    
+    return 0;
+}
+
+
+
+// ==========================================
+// PROTOCOL V2
+// ==========================================
+
+#define ROSTER_SIZE 64
+
+typedef struct {
+    uint32_t user_id;
+    char username[17];
+} roster_entry_t;
+
+// Names of the members of the current room, keyed by user id
+static roster_entry_t roster[ROSTER_SIZE];
+static int roster_count = 0;
+static uint64_t current_room_id = 0;
+static char current_room[33];
+
+static void roster_add(uint32_t user_id, const char *name, size_t len) {
+    for (int i = 0; i < roster_count; i++) {
+        if (roster[i].user_id == user_id) {
+            return;
+        }
+    }
+    if (roster_count == ROSTER_SIZE) {
+        return;
+    }
+    roster[roster_count].user_id = user_id;
+    snprintf(roster[roster_count].username, sizeof(roster[roster_count].username), "%.*s", (int)len, name);
+    roster_count++;
+}
+
+static void roster_remove(uint32_t user_id) {
+    for (int i = 0; i < roster_count; i++) {
+        if (roster[i].user_id == user_id) {
+            roster[i] = roster[--roster_count];
+            return;
+        }
+    }
+}
+
+static const char* roster_name(uint32_t user_id) {
+    for (int i = 0; i < roster_count; i++) {
+        if (roster[i].user_id == user_id) {
+            return roster[i].username;
+        }
+    }
+    return "unknown";
+}
+
+// Handles one v2 frame body, returns -1 when the server is shutting down
+static int handle_binary_frame(uint8_t *body, size_t len) {
+    wire_reader_t r;
+    wire_reader_init(&r, body + 1, len - 1);
+    
+    switch (body[0]) {
+    case WIRE_OP_TEXT: {
+        // Replies without an opcode keep their text form; the frame is
+        // NUL-terminated past its end, so the last field can be terminated in place
+        size_t text_len;
+        char *text = (char *)wire_read_string(&r, &text_len);
+        if (r.error) {
+            break;
+        }
+        text[text_len] = '\0';
+        return handle_text_frame(text);
+    }
+    case WIRE_OP_JOINED: {
+        size_t name_len;
+        uint64_t room_id = wire_read_varint(&r);
+        uint64_t members = wire_read_varint(&r);
+        uint64_t capacity = wire_read_varint(&r);
+        const char *name = wire_read_string(&r, &name_len);
+        if (r.error) {
+            break;
+        }
+        current_room_id = room_id;
+        snprintf(current_room, sizeof(current_room), "%.*s", (int)name_len, name);
+        roster_count = 0;
+        printf("\nJoined room '%s' (%llu/%llu clients)\n", current_room,
+               (unsigned long long)members, (unsigned long long)capacity);
+        printf("Enter a command: ");
+        fflush(stdout);
+        return 0;
+    }
+    case WIRE_OP_LEFT:
+        wire_read_varint(&r);
+        if (r.error) {
+            break;
+        }
+        printf("\nLeft room '%s'\n", current_room);
+        current_room_id = 0;
+        current_room[0] = '\0';
+        roster_count = 0;
+        printf("Enter a command: ");
+        fflush(stdout);
+        return 0;
+    case WIRE_OP_MEMBER: {
+        static const char *events[] = { "is in the room", "joined the room", "left the room", "disconnected" };
+        size_t name_len;
+        uint64_t room_id = wire_read_varint(&r);
+        uint32_t user_id = (uint32_t)wire_read_varint(&r);
+        uint64_t event = wire_read_varint(&r);
+        const char *name = wire_read_string(&r, &name_len);
+        if (r.error || event > WIRE_MEMBER_DISCONNECTED || room_id != current_room_id) {
+            break;
+        }
+        if (event == WIRE_MEMBER_PRESENT || event == WIRE_MEMBER_JOINED) {
+            roster_add(user_id, name, name_len);
+        } else {
+            roster_remove(user_id);
+        }
+        if (event != WIRE_MEMBER_PRESENT) {
+            printf("\n%.*s %s\n", (int)name_len, name, events[event]);
+            printf("Enter a command: ");
+            fflush(stdout);
+        }
+        return 0;
+    }
+    case WIRE_OP_ROOM_MESSAGE: {
+        size_t message_len;
+        wire_read_varint(&r);
+        uint32_t user_id = (uint32_t)wire_read_varint(&r);
+        const char *message = wire_read_string(&r, &message_len);
+        if (r.error) {
+            break;
+        }
+        printf("\n[%s@%s]: %.*s\n", roster_name(user_id), current_room, (int)message_len, message);
+        printf("Enter a command: ");
+        fflush(stdout);
+        return 0;
+    }
+    case WIRE_OP_BROADCAST_ACK: {
+        wire_read_varint(&r);
+        uint64_t delivered = wire_read_varint(&r);
+        uint64_t recipients = wire_read_varint(&r);
+        if (r.error) {
+            break;
+        }
+        printf("\nMessage delivered to %llu/%llu recipient(s) in room '%s'\n",
+               (unsigned long long)delivered, (unsigned long long)recipients, current_room);
+        printf("Enter a command: ");
+        fflush(stdout);
+        return 0;
+    }
+    case WIRE_OP_WHISPER_MESSAGE: {
+        size_t name_len, message_len;
+        wire_read_varint(&r);
+        const char *name = wire_read_string(&r, &name_len);
+        const char *message = wire_read_string(&r, &message_len);
+        if (r.error) {
+            break;
+        }
+        printf("\nWHISPER [%.*s]: %.*s\n", (int)name_len, name, (int)message_len, message);
+        printf("Enter a command: ");
+        fflush(stdout);
+        return 0;
+    }
+    case WIRE_OP_WHISPER_ACK: {
+        size_t name_len;
+        wire_read_varint(&r);
+        const char *name = wire_read_string(&r, &name_len);
+        if (r.error) {
+            break;
+        }
+        printf("\nWhisper sent to %.*s\n", (int)name_len, name);
+        printf("Enter a command: ");
+        fflush(stdout);
+        return 0;
+    }
+    case WIRE_OP_UPLOAD_REQUEST: {
+        char filename[257];
+        char target_username[17];
+        size_t filename_len, target_len;
+        const char *f = wire_read_string(&r, &filename_len);
+        const char *t = wire_read_string(&r, &target_len);
+        if (r.error || filename_len >= sizeof(filename) || target_len >= sizeof(target_username)) {
+            break;
+        }
+        memcpy(filename, f, filename_len);
+        filename[filename_len] = '\0';
+        memcpy(target_username, t, target_len);
+        target_username[target_len] = '\0';
+        
+        uint32_t transfer_id = 0;
+        uint64_t offset = 0;
+        if (r.pos < r.end) {
+            transfer_id = (uint32_t)wire_read_varint(&r);
+            offset = wire_read_varint(&r);
+        }
+        if (r.error) {
+            break;
+        }
+        
+        printf("\n Server requesting upload of: %s to %s\n", filename, target_username);
+        if (upload_file_to_server(filename, target_username, transfer_id, offset) != 0) {
+            printf(" Failed to upload file: %s\n", filename);
+        }
+        printf("Enter a command: ");
+        fflush(stdout);
+        return 0;
+    }
+    case WIRE_OP_FILE_DOWNLOAD: {
+        char filename[257];
+        char sender[17];
+        size_t filename_len, sender_len;
+        uint64_t file_size = wire_read_varint(&r);
+        wire_read_varint(&r);
+        const char *f = wire_read_string(&r, &filename_len);
+        const char *u = wire_read_string(&r, &sender_len);
+        uint32_t transfer_id = 0;
+        uint64_t offset = 0;
+        if (r.pos < r.end) {
+            transfer_id = (uint32_t)wire_read_varint(&r);
+            offset = wire_read_varint(&r);
+        }
+        if (r.error || filename_len >= sizeof(filename) || sender_len >= sizeof(sender)) {
+            // The payload that follows cannot be skipped safely
+            printf("\n Malformed file header from server\n");
+            client_running = 0;
+            return -1;
+        }
+        memcpy(filename, f, filename_len);
+        filename[filename_len] = '\0';
+        memcpy(sender, u, sender_len);
+        sender[sender_len] = '\0';
+        
+        printf("\n Receiving file from server...\n");
+        if (receive_file_data(filename, file_size, sender, transfer_id, offset) != 0) {
+            printf(" Failed to receive file\n");
+            printf("Enter a command: ");
+            fflush(stdout);
+        }
+        return 0;
+    }
+    default:
+        break;
+    }
+    
+    printf("\nIgnoring malformed frame (opcode 0x%02x)\n", body[0]);
+    return 0;
+}
+
+
+
 void *receive_thread(void *arg) {
     (void)arg; 
     char buffer[4096];
@@ -39,7 +378,11 @@ void *receive_thread(void *arg) {
         }
         else {
             if (FD_ISSET(client_socket, &read_fds)) {
-                bytes_received = receive_message(buffer, sizeof(buffer));
+                if (client_protocol == WIRE_PROTO_BINARY) {
+                    bytes_received = receive_frame((uint8_t *)buffer, sizeof(buffer));
+                } else {
+                    bytes_received = receive_message(buffer, sizeof(buffer));
+                }
                 
                 if (bytes_received <= 0) {
                     if (bytes_received == 0) {
@@ -53,61 +396,14 @@ void *receive_thread(void *arg) {
                 
                 buffer[bytes_received] = '\0';
                 
-                if (strncmp(buffer, "FILE_UPLOAD_REQUEST:", 20) == 0) {
-                    char *colon1 = strchr(buffer + 20, ':');
-                    if (colon1) {
-                        *colon1 = '\0';
-                        char *filename = buffer + 20;
-                        char *target_username = colon1 + 1;
-                        
-                        printf("\n Server requesting upload of: %s to %s\n", filename, target_username);
-                        printf("Starting file upload...\n");
-                        
-                        // Upload the file
-                        if (upload_file_to_server(filename, target_username) == 0) {
-                            printf(" File upload completed successfully\n");
-                        } else {
-                            printf(" Failed to upload file: %s\n", filename);
-                        }
-                        
-                        printf("Enter a command: ");
-                        fflush(stdout);
-                    }
-                } 
-                else if (strncmp(buffer, "FILE_DOWNLOAD:", 14) == 0) {
-                    // Handle incoming file download
-                    printf("\n Receiving file from server...\n");
-                    if (receive_file_from_server(buffer) == 0) {
-                        // Success message already printed in receive_file_from_server
-                    } else {
-                        printf(" Failed to receive file\n");
-                        printf("Enter a command: ");
-                        fflush(stdout);
-                    }
-                } 
-                else if (strncmp(buffer, "FILE_TRANSFER_ABORT", 19) == 0) {
-                    printf("\n %s\n", buffer);
-                    printf(" File transfer cancelled due to server shutdown\n");
-                    printf("Enter a command: ");
-                    fflush(stdout);
-                } 
-                else if (strncmp(buffer, "SERVER_SHUTDOWN", 15) == 0) {
-                    printf("\n %s\n", buffer);
-                    printf(" Disconnecting from server...\n");
-                    
-                    // Set flag to stop receive thread
-                    client_running = 0;
-                    
-                    // Don't try to send /exit if server is shutting down - connection might be closed
-                    // Just break out of receive loop
-                    printf("Server initiated shutdown - disconnecting gracefully\n");
-                    break;
+                int result;
+                if (client_protocol == WIRE_PROTO_BINARY) {
+                    result = handle_binary_frame((uint8_t *)buffer, bytes_received);
+                } else {
+                    result = handle_text_frame(buffer);
                 }
-                else {
-                    // Handle regular text messages
-                    printf("\nReceived: %s\n", buffer);
-                    printf("Enter a command: ");
-                    fflush(stdout);
+                if (result != 0) {
+                    break;
                 }
             }
         }
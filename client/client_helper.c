@@ -10,12 +10,22 @@
 #include <ctype.h>  // Add this for isalnum()
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/sendfile.h>
 
 #define CHUNK_SIZE 4096
-#define MAX_FILE_SIZE (3 * 1024 * 1024 )
+#define MAX_FILE_SIZE (3 * 1024 * 1024 )  // what servers that don't offer size64=1 take
+#define FILE_STREAM_CHUNK (256 * 1024)  // bytes per sendfile() or recv() of a plain transfer
+#define FILE_ACK_INTERVAL (256 * 1024)  // fewest downloaded bytes between chunk acks
+#define FILE_ACK_COUNT 64               // most acks a chunked download sends
 
 int client_socket = -1;
 int client_running = 1;
+int client_protocol = WIRE_PROTO_TEXT;
+static char last_download[256];  // most recent file written by receive_file_data
+static size_t max_file_size = MAX_FILE_SIZE;  // raised by the login reply
+
+// The input loop sends commands while the receive thread uploads and acks
+static pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
 extern pthread_t thread_id;
 
 
@@ -100,43 +110,64 @@ void cleanup_client() {
 }
 
 
-int send_message(const char *message) {
-    if (client_socket == -1 || message == NULL) {
+// Frames every message and writes them with a single writev, advancing past
+// partial writes
+int send_messages(const char **messages, int count) {
+    if (client_socket == -1 || messages == NULL || count < 1 || count > MAX_BATCH_FRAMES) {
         return -1;
     }
     
-    // Calculate message length
-    uint32_t message_len = strlen(message);
-    uint32_t network_len = htonl(message_len);  // Convert to network byte order
+    uint32_t network_lens[MAX_BATCH_FRAMES];
+    struct iovec iov[MAX_BATCH_FRAMES * 2];
     
-    // Send length first (4 bytes)
-    int total_sent = 0;
-    int bytes_to_send = sizeof(network_len);
-    char *len_ptr = (char *)&network_len;
-    
-    while (total_sent < bytes_to_send) {
-        int sent = send(client_socket, len_ptr + total_sent, bytes_to_send - total_sent, 0);
-        if (sent <= 0) {
-            perror("Failed to send message length");
+    for (int i = 0; i < count; i++) {
+        if (messages[i] == NULL) {
             return -1;
         }
-        total_sent += sent;
+        size_t message_len = strlen(messages[i]);
+        network_lens[i] = htonl((uint32_t)message_len);  // Convert to network byte order
+        iov[i * 2].iov_base = &network_lens[i];
+        iov[i * 2].iov_len = sizeof(uint32_t);
+        iov[i * 2 + 1].iov_base = (void *)messages[i];
+        iov[i * 2 + 1].iov_len = message_len;
     }
     
-    // Send actual message
-    total_sent = 0;
-    bytes_to_send = message_len;
+    struct iovec *cur = iov;
+    int remaining = count * 2;
+    int result = 0;
     
-    while (total_sent < bytes_to_send) {
-        int sent = send(client_socket, message + total_sent, bytes_to_send - total_sent, 0);
+    pthread_mutex_lock(&send_mutex);
+    while (remaining > 0) {
+        ssize_t sent = writev(client_socket, cur, remaining);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
         if (sent <= 0) {
-            perror("Failed to send message data");
-            return -1;
+            perror("Failed to send message");
+            result = -1;
+            break;
+        }
+        
+        while (remaining > 0 && (size_t)sent >= cur->iov_len) {
+            sent -= cur->iov_len;
+            cur++;
+            remaining--;
+        }
+        if (remaining > 0) {
+            cur->iov_base = (char *)cur->iov_base + sent;
+            cur->iov_len -= sent;
         }
-        total_sent += sent;
     }
+    pthread_mutex_unlock(&send_mutex);
     
-    return 0;  // Success
+    return result;
+}
+
+int send_message(const char *message) {
+    if (message == NULL) {
+        return -1;
+    }
+    return send_messages(&message, 1);
 }
 
 
@@ -199,6 +230,177 @@ int receive_message(char *buffer, size_t buffer_size) {
 }
 
 
+// Reads one v2 frame body (opcode + fields). The varint prefix is read a
+// byte at a time because raw file bytes share the socket.
+int receive_frame(uint8_t *buffer, size_t buffer_size) {
+    if (client_socket == -1 || buffer == NULL || buffer_size < 1) {
+        return -1;
+    }
+    
+    uint8_t prefix[WIRE_LENGTH_MAX];
+    uint64_t body_len = 0;
+    size_t used = 0;
+    size_t have = 0;
+    int status = 1;
+    
+    while (status == 1 && have < sizeof(prefix)) {
+        ssize_t received = recv(client_socket, prefix + have, 1, 0);
+        if (received <= 0) {
+            if (received == 0) {
+                return 0;  // Connection closed
+            }
+            perror("Failed to receive frame length");
+            return -1;
+        }
+        have++;
+        status = wire_get_varint(prefix, have, &body_len, &used);
+    }
+    
+    if (status != 0 || body_len == 0 || body_len >= buffer_size) {
+        fprintf(stderr, "Bad frame length from server\n");
+        return -1;
+    }
+    
+    if (recv(client_socket, buffer, body_len, MSG_WAITALL) != (ssize_t)body_len) {
+        fprintf(stderr, "Connection closed while receiving frame body\n");
+        return -1;
+    }
+    
+    return (int)body_len;
+}
+
+
+// Caller holds send_mutex
+static int send_all_locked(const void *data, size_t len) {
+    const char *ptr = data;
+    
+    while (len > 0) {
+        ssize_t sent = send(client_socket, ptr, len, 0);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            perror("Failed to send message");
+            return -1;
+        }
+        ptr += sent;
+        len -= sent;
+    }
+    
+    return 0;
+}
+
+static int send_all(const void *data, size_t len) {
+    pthread_mutex_lock(&send_mutex);
+    int result = send_all_locked(data, len);
+    pthread_mutex_unlock(&send_mutex);
+    return result;
+}
+
+
+typedef struct {
+    const char *name;
+    uint8_t opcode;
+    int words;          // leading single-word fields
+    int has_rest;       // remainder of the line as the last field
+} wire_command_t;
+
+static const wire_command_t wire_commands[] = {
+    { "join",      WIRE_OP_JOIN,      0, 1 },
+    { "leave",     WIRE_OP_LEAVE,     0, 0 },
+    { "broadcast", WIRE_OP_BROADCAST, 0, 1 },
+    { "whisper",   WIRE_OP_WHISPER,   1, 1 },
+    { "sendfile",  WIRE_OP_SENDFILE,  1, 1 },
+    { "exit",      WIRE_OP_EXIT,      0, 0 },
+    { "resume",    WIRE_OP_RESUME,    0, 1 },
+    { "ack",       WIRE_OP_FILE_ACK,  1, 1 },
+    { "size64",    WIRE_OP_SIZE64,    0, 0 }
+};
+
+static const char* skip_blanks(const char *p) {
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return p;
+}
+
+// Sends a validated "/command args" line, as text or as a v2 opcode frame
+int send_command(const char *command) {
+    if (client_protocol != WIRE_PROTO_BINARY) {
+        return send_message(command);
+    }
+    
+    const char *p = command + 1;
+    size_t name_len = strcspn(p, " \t");
+    const wire_command_t *cmd = NULL;
+    
+    for (size_t i = 0; i < sizeof(wire_commands) / sizeof(wire_commands[0]); i++) {
+        if (strlen(wire_commands[i].name) == name_len &&
+            strncmp(wire_commands[i].name, p, name_len) == 0) {
+            cmd = &wire_commands[i];
+            break;
+        }
+    }
+    if (!cmd) {
+        return send_message(command);
+    }
+    
+    uint8_t frame[1024 + WIRE_VARINT_MAX * 4];
+    wire_writer_t w;
+    wire_writer_init(&w, frame, sizeof(frame), cmd->opcode);
+    
+    p = skip_blanks(p + name_len);
+    for (int i = 0; i < cmd->words; i++) {
+        size_t word_len = strcspn(p, " \t");
+        wire_write_string(&w, p, word_len);
+        p = skip_blanks(p + word_len);
+    }
+    if (cmd->has_rest) {
+        wire_write_string(&w, p, strlen(p));
+    }
+    
+    size_t frame_len;
+    const uint8_t *data = wire_writer_finish(&w, &frame_len);
+    if (!data) {
+        fprintf(stderr, "Command too long\n");
+        return -1;
+    }
+    
+    return send_all(data, frame_len);
+}
+
+
+// Picks protocol v2 when the login reply offers it. Replies stay in the
+// text format until PROTO_OK has been received.
+int negotiate_protocol(const char *login_reply) {
+    const char *offer = strstr(login_reply, "proto=");
+    if (!offer || !strchr(offer, '0' + WIRE_PROTO_BINARY)) {
+        return 0;
+    }
+    
+    if (send_message("PROTO 2") < 0) {
+        return -1;
+    }
+    
+    char response[512];
+    while (1) {
+        int bytes_received = receive_message(response, sizeof(response));
+        if (bytes_received <= 0) {
+            return -1;
+        }
+        
+        if (strncmp(response, "PROTO_OK", 8) == 0) {
+            client_protocol = WIRE_PROTO_BINARY;
+            return 0;
+        }
+        if (strncmp(response, "PROTO_ERR", 9) == 0) {
+            return 0;
+        }
+        printf("%s\n", response);
+    }
+}
+
+
 int login_to_server(void) {
     char username[17];
     char response[128];
@@ -221,18 +423,15 @@ int login_to_server(void) {
             username[len - 1] = '\0';
         }
         
-        if (send_message(username) < 0) {
-            perror("Failed to send username");
-            return -1;
-        }
-        
         char cwd[1024];
         if (getcwd(cwd, sizeof(cwd)) == NULL) {
             strcpy(cwd, ".");  // Default fallback
         }
         
-        if (send_message(cwd) < 0) {
-            perror("Failed to send file path");
+        // Username and file path frames go out in one write
+        const char *login_frames[2] = { username, cwd };
+        if (send_messages(login_frames, 2) < 0) {
+            perror("Failed to send login");
             return -1;
         }
         
@@ -246,6 +445,26 @@ int login_to_server(void) {
         
         if (strncmp(response, "LOGIN_SUCCESS", 13) == 0) {
             printf("Logged in as %s\n", username);
+            if (negotiate_protocol(response) != 0) {
+                perror("Failed to negotiate protocol");
+                return -1;
+            }
+            // Chunked transfers pick up where a dropped connection left
+            // them; the server answers with the downloads this user missed
+            if (strstr(response, "chunks=1") && send_command("/resume") < 0) {
+                perror("Failed to turn on resumable transfers");
+                return -1;
+            }
+            // 64-bit sizes lift the 3 MB cap, up to the stored-upload limit
+            // a store-mode server names
+            if (strstr(response, "size64=1")) {
+                if (send_command("/size64") < 0) {
+                    perror("Failed to turn on 64-bit file sizes");
+                    return -1;
+                }
+                const char *limit = strstr(response, "maxfile=");
+                max_file_size = limit ? (size_t)strtoull(limit + 8, NULL, 10) : SIZE_MAX;
+            }
             return 0;  // Success
         } 
         else {
@@ -319,7 +538,7 @@ void process_user_input(void) {
                     }
                     
                     if (strncmp(input, "/exit", 5) == 0) {
-                        if (send_message(input) < 0) {
+                        if (send_command(input) < 0) {
                             perror("Failed to send exit command");
                         }
                         printf("Disconnecting from server...\n");
@@ -330,7 +549,7 @@ void process_user_input(void) {
                         display_help_menu();
                     }
                     else {
-                        if (send_message(input) < 0) {
+                        if (send_command(input) < 0) {
                             perror("Failed to send command");
                         } else {
                             printf("Command sent: %s\n", input);
@@ -479,9 +698,9 @@ command_result_t validate_command(const char *command) {
         
         size_t file_size;
         if (get_file_size(args[1], &file_size) == 0) {
-            if (file_size > MAX_FILE_SIZE) {
+            if (file_size > max_file_size) {
                 red();
-                printf("Error: File too large (%zu bytes, max %d bytes)\n", file_size, MAX_FILE_SIZE);
+                printf("Error: File too large (%zu bytes, max %zu bytes)\n", file_size, max_file_size);
                 reset();
                 return CMD_INVALID_COMMAND;
             }
@@ -578,7 +797,61 @@ int handle_command(const char *command) {
 
 
 
-int upload_file_to_server(const char *filename, const char *target_username) {
+// Sends the file from offset on as addressed chunks. Caller holds send_mutex.
+static int send_file_chunks(int fd, const char *filename, size_t file_size, uint32_t transfer_id, size_t offset) {
+    if (offset > 0) {
+        printf("[FILE-UPLOAD] Resuming %s at %zu/%zu bytes\n", filename, offset, file_size);
+    }
+    if (offset < file_size && lseek(fd, offset, SEEK_SET) < 0) {
+        perror("lseek");
+        return -1;
+    }
+    
+    char *buffer = malloc(WIRE_CHUNK_MAX);
+    if (!buffer) {
+        return -1;
+    }
+    
+    size_t total_sent = offset;
+    while (total_sent < file_size) {
+        size_t remaining = file_size - total_sent;
+        ssize_t bytes_read = read(fd, buffer, (remaining < WIRE_CHUNK_MAX) ? remaining : WIRE_CHUNK_MAX);
+        if (bytes_read <= 0) {
+            red();
+            printf("[FILE-UPLOAD] Error: Failed to read from file\n");
+            reset();
+            free(buffer);
+            return -1;
+        }
+        
+        uint8_t header[WIRE_CHUNK_HEADER];
+        wire_put_chunk_header(header, transfer_id, total_sent, (uint32_t)bytes_read);
+        if (send_all_locked(header, sizeof(header)) != 0 || send_all_locked(buffer, bytes_read) != 0) {
+            red();
+            printf("[FILE-UPLOAD] Error: Connection lost during upload\n");
+            reset();
+            free(buffer);
+            return -1;
+        }
+        
+        total_sent += bytes_read;
+        
+        int progress = (int)((total_sent * 100) / file_size);
+        if (progress % 10 == 0 || total_sent == file_size) {
+            green();
+            printf("[FILE-UPLOAD] Progress: %zu/%zu bytes (%d%%)\n", 
+                   total_sent, file_size, progress);
+            reset();
+        }
+    }
+    
+    free(buffer);
+    return 0;
+}
+
+// Streams the file the server asked for. With a transfer id it goes in chunks
+// starting at the offset the server already holds.
+int upload_file_to_server(const char *filename, const char *target_username, uint32_t transfer_id, size_t offset) {
     printf("[FILE-UPLOAD] Starting upload of: %s to %s\n", filename, target_username);
     
     if (!validate_local_file(filename)) {
@@ -590,9 +863,9 @@ int upload_file_to_server(const char *filename, const char *target_username) {
         return -1;  
     }
     
-    if (file_size > MAX_FILE_SIZE) {
+    if (file_size > max_file_size) {
         red();
-        printf("Error: File too large (%zu bytes, max %d bytes)\n", file_size, MAX_FILE_SIZE);
+        printf("Error: File too large (%zu bytes, max %zu bytes)\n", file_size, max_file_size);
         reset();
         return -1;
     }
@@ -626,8 +899,12 @@ int upload_file_to_server(const char *filename, const char *target_username) {
     
     printf("[FILE-UPLOAD] File size: %zu bytes\n", file_size);
     
-    uint32_t network_size = htonl((uint32_t)file_size);
-    if (send(client_socket, &network_size, sizeof(network_size), 0) != sizeof(network_size)) {
+    // Nothing else may go out on the socket until the last byte has
+    pthread_mutex_lock(&send_mutex);
+    
+    uint8_t raw_size[WIRE_SIZE_LONG];
+    if (send_all_locked(raw_size, wire_put_file_size(raw_size, file_size)) != 0) {
+        pthread_mutex_unlock(&send_mutex);
         red();
         printf("[FILE-UPLOAD] Error: Failed to send file size\n");
         reset();
@@ -635,42 +912,47 @@ int upload_file_to_server(const char *filename, const char *target_username) {
         return -1;
     }
     
-    char buffer[CHUNK_SIZE];
+    if (transfer_id) {
+        int result = send_file_chunks(fd, filename, file_size, transfer_id, offset);
+        pthread_mutex_unlock(&send_mutex);
+        close(fd);
+        if (result == 0) {
+            green();
+            printf("[FILE-UPLOAD] Upload completed: %s (%zu bytes)\n", filename, file_size);
+            reset();
+        }
+        return result;
+    }
+    
+    // The kernel moves the file straight to the socket
     size_t total_sent = 0;
+    int reported = 0;
     
     while (total_sent < file_size) {
-        ssize_t bytes_read = read(fd, buffer, CHUNK_SIZE);
-        if (bytes_read < 0) {
+        size_t remaining = file_size - total_sent;
+        ssize_t sent = sendfile(client_socket, fd, NULL, (remaining < FILE_STREAM_CHUNK) ? remaining : FILE_STREAM_CHUNK);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            pthread_mutex_unlock(&send_mutex);
             red();
-            printf("[FILE-UPLOAD] Error: Failed to read from file\n");
-            perror("read");
+            if (sent == 0) {
+                printf("[FILE-UPLOAD] Error: File shrank during upload\n");
+            } else {
+                printf("[FILE-UPLOAD] Error: Connection lost during upload\n");
+                perror("sendfile");
+            }
             reset();
             close(fd);
             return -1;
         }
         
-        if (bytes_read == 0) {
-            break;
-        }
-        
-        size_t total_chunk_sent = 0;
-        while (total_chunk_sent < (size_t)bytes_read) {
-            ssize_t sent = send(client_socket, buffer + total_chunk_sent, 
-                              bytes_read - total_chunk_sent, 0);
-            if (sent <= 0) {
-                red();
-                printf("[FILE-UPLOAD] Error: Connection lost during upload\n");
-                reset();
-                close(fd);
-                return -1;
-            }
-            total_chunk_sent += sent;
-        }
-        
-        total_sent += bytes_read;
+        total_sent += sent;
         
         int progress = (int)((total_sent * 100) / file_size);
-        if (progress % 10 == 0 || total_sent == file_size) {
+        if (progress / 10 != reported / 10 || total_sent == file_size) {
+            reported = progress;
             green();
             printf("[FILE-UPLOAD] Progress: %zu/%zu bytes (%d%%)\n", 
                    total_sent, file_size, progress);
@@ -678,6 +960,7 @@ int upload_file_to_server(const char *filename, const char *target_username) {
         }
     }
     
+    pthread_mutex_unlock(&send_mutex);
     close(fd);
     green();
     printf("[FILE-UPLOAD] Upload completed: %s (%zu bytes)\n", filename, total_sent);
@@ -709,7 +992,7 @@ int receive_file_from_server(const char *message) {
         free(msg_copy);
         return -1;
     }
-    size_t file_size = atol(token);
+    size_t file_size = (size_t)strtoull(token, NULL, 10);
     
     token = strtok(NULL, ":");
     if (!token) {
@@ -720,50 +1003,254 @@ int receive_file_from_server(const char *message) {
     char *sender = malloc(strlen(token) + 1);
     strcpy(sender, token);
     
+    // A chunked download carries its transfer id and starting offset
+    uint32_t transfer_id = 0;
+    size_t offset = 0;
+    token = strtok(NULL, ":");
+    if (token) {
+        transfer_id = (uint32_t)strtoul(token, NULL, 10);
+        token = strtok(NULL, ":");
+        offset = token ? (size_t)strtoull(token, NULL, 10) : 0;
+    }
+    
     free(msg_copy);
     
+    int result = receive_file_data(filename, file_size, sender, transfer_id, offset);
+    
+    free(filename);
+    free(sender);
+    return result;
+}
+
+
+static void finish_download(const char *filename, size_t file_size, const char *sender) {
+    strncpy(last_download, filename, sizeof(last_download) - 1);
+    last_download[sizeof(last_download) - 1] = '\0';
+    
+    printf("[FILE-DOWNLOAD] Download completed: %s (%zu bytes) from %s\n", 
+           filename, file_size, sender);
+    
+    printf("\n File received: '%s' from %s (%zu bytes)\n", filename, sender, file_size);
+    printf("Enter a command: ");
+    fflush(stdout);
+}
+
+// A chunked download is written to <file>.part, with <file>.resume naming
+// its transfer, until the last chunk is in
+static void partial_paths(const char *filename, char *part, char *info, size_t size) {
+    snprintf(part, size, "%s.part", filename);
+    snprintf(info, size, "%s.resume", filename);
+}
+
+// Where a chunked download can pick up: the length of the partial file, if
+// it belongs to this transfer of this file
+static size_t partial_offset(const char *filename, uint32_t transfer_id, size_t file_size) {
+    char part[512], info[512];
+    partial_paths(filename, part, info, sizeof(part));
+    
+    FILE *f = fopen(info, "r");
+    if (!f) {
+        return 0;
+    }
+    unsigned int saved_id = 0;
+    size_t saved_size = 0;
+    int matches = fscanf(f, "%u %zu", &saved_id, &saved_size) == 2 &&
+                  saved_id == transfer_id && saved_size == file_size;
+    fclose(f);
+    
+    struct stat part_stat;
+    if (!matches || stat(part, &part_stat) != 0) {
+        return 0;
+    }
+    return ((size_t)part_stat.st_size < file_size) ? (size_t)part_stat.st_size : file_size;
+}
+
+// Writes each chunk where it belongs and acknowledges progress every so
+// often. A dropped connection leaves the partial file for a later /resume.
+static int receive_file_chunks(const char *filename, size_t file_size, const char *sender,
+                               uint32_t transfer_id, size_t offset) {
+    char part[512], info[512];
+    partial_paths(filename, part, info, sizeof(part));
+    
+    // Without a file to write to the chunks are still read, the stream has
+    // to stay framed
+    int fd = open(part, O_WRONLY | O_CREAT | (offset == 0 ? O_TRUNC : 0), 0644);
+    if (fd < 0) {
+        printf("[FILE-DOWNLOAD] Error: Cannot create file '%s'\n", part);
+        perror("open");
+    } else {
+        FILE *f = fopen(info, "w");
+        if (f) {
+            fprintf(f, "%u %zu %s\n", transfer_id, file_size, sender);
+            fclose(f);
+        }
+    }
+    
+    if (offset > 0) {
+        printf("[FILE-DOWNLOAD] Resuming at %zu/%zu bytes\n", offset, file_size);
+    }
+    
+    char *buffer = malloc(WIRE_CHUNK_MAX);
+    size_t ack_step = (file_size / FILE_ACK_COUNT > FILE_ACK_INTERVAL) ? file_size / FILE_ACK_COUNT : FILE_ACK_INTERVAL;
+    size_t total_received = offset;
+    size_t acked = offset;
+    int result = (fd >= 0 && buffer) ? 0 : -1;
+    
+    while (total_received < file_size) {
+        uint8_t header[WIRE_CHUNK_HEADER];
+        uint32_t id, len;
+        uint64_t chunk_offset;
+        if (recv(client_socket, header, sizeof(header), MSG_WAITALL) != sizeof(header)) {
+            printf("[FILE-DOWNLOAD] Error: Connection lost during download\n");
+            result = -1;
+            break;
+        }
+        
+        wire_get_chunk_header(header, &id, &chunk_offset, &len);
+        if (!buffer || id != transfer_id || chunk_offset != total_received || len == 0 ||
+            len > WIRE_CHUNK_MAX || len > file_size - total_received) {
+            // Nothing after this can be trusted to be framed
+            printf("[FILE-DOWNLOAD] Error: Bad chunk from server\n");
+            client_running = 0;
+            result = -1;
+            break;
+        }
+        
+        if (recv(client_socket, buffer, len, MSG_WAITALL) != (ssize_t)len) {
+            printf("[FILE-DOWNLOAD] Error: Connection lost during download\n");
+            result = -1;
+            break;
+        }
+        
+        if (fd >= 0 && pwrite(fd, buffer, len, chunk_offset) != (ssize_t)len) {
+            printf("[FILE-DOWNLOAD] Error: Failed to write to file\n");
+            perror("write");
+            close(fd);
+            fd = -1;
+            result = -1;
+        }
+        
+        total_received += len;
+        
+        if (result == 0 && (total_received - acked >= ack_step || total_received == file_size)) {
+            char ack[64];
+            snprintf(ack, sizeof(ack), "/ack %u %zu", transfer_id, total_received);
+            send_command(ack);
+            acked = total_received;
+        }
+        
+        int progress = (int)((total_received * 100) / file_size);
+        if (progress % 10 == 0 || total_received == file_size) {
+            printf("[FILE-DOWNLOAD] Progress: %zu/%zu bytes (%d%%)\n", 
+                   total_received, file_size, progress);
+        }
+    }
+    
+    free(buffer);
+    if (fd >= 0) {
+        close(fd);
+    }
+    
+    if (result != 0) {
+        if (total_received > 0 && total_received < file_size) {
+            printf("[FILE-DOWNLOAD] Partial file kept as '%s' (%zu/%zu bytes), it resumes on the next login\n",
+                   part, total_received, file_size);
+        }
+        return -1;
+    }
+    
+    if (rename(part, filename) != 0) {
+        printf("[FILE-DOWNLOAD] Error: Cannot move '%s' to '%s'\n", part, filename);
+        perror("rename");
+        return -1;
+    }
+    unlink(info);
+    
+    finish_download(filename, file_size, sender);
+    return 0;
+}
+
+// "FILE_RESUME <id> <size> <acked> <sender> <filename>": a download that broke
+// off while this user was away. Asks for the rest of it, or all of it again
+// when the partial file is gone.
+int answer_resume_offer(const char *message) {
+    unsigned int transfer_id;
+    size_t file_size, acked;
+    char sender[17];
+    char filename[256];
+    if (sscanf(message, "FILE_RESUME %u %zu %zu %16s %255s", &transfer_id, &file_size, &acked, sender, filename) != 5) {
+        return -1;
+    }
+    
+    size_t offset = partial_offset(filename, transfer_id, file_size);
+    printf("\n Resuming '%s' from %s at %zu/%zu bytes (%zu acknowledged)\n",
+           filename, sender, offset, file_size, acked);
+    
+    char command[64];
+    snprintf(command, sizeof(command), "/resume %u %zu", transfer_id, offset);
+    return send_command(command);
+}
+
+
+// Receives the raw size confirmation and payload that follow a download header
+int receive_file_data(const char *filename, size_t file_size, const char *sender,
+                      uint32_t transfer_id, size_t offset) {
     printf("[FILE-DOWNLOAD] Receiving file: %s (%zu bytes) from %s\n", 
            filename, file_size, sender);
     
-    uint32_t network_size;
-    if (recv(client_socket, &network_size, sizeof(network_size), MSG_WAITALL) != sizeof(network_size)) {
+    // 4 bytes, or the escape and a u64 once /size64 is on
+    uint8_t raw_size[WIRE_SIZE_LONG];
+    uint64_t confirmed_size = 0;
+    if (recv(client_socket, raw_size, WIRE_SIZE_SHORT, MSG_WAITALL) != WIRE_SIZE_SHORT) {
         printf("[FILE-DOWNLOAD] Error: Failed to receive file size confirmation\n");
-        free(filename);
-        free(sender);
         return -1;
     }
+    size_t size_len = wire_get_file_size(raw_size, WIRE_SIZE_SHORT, &confirmed_size);
+    if (size_len > WIRE_SIZE_SHORT) {
+        if (recv(client_socket, raw_size + WIRE_SIZE_SHORT, size_len - WIRE_SIZE_SHORT, MSG_WAITALL) !=
+            (ssize_t)(size_len - WIRE_SIZE_SHORT)) {
+            printf("[FILE-DOWNLOAD] Error: Failed to receive file size confirmation\n");
+            return -1;
+        }
+        wire_get_file_size(raw_size, size_len, &confirmed_size);
+    }
     
-    size_t confirmed_size = ntohl(network_size);
     if (confirmed_size != file_size) {
         printf("[FILE-DOWNLOAD] Error: File size mismatch\n");
-        free(filename);
-        free(sender);
         return -1;
     }
     
+    if (transfer_id) {
+        return receive_file_chunks(filename, file_size, sender, transfer_id, offset);
+    }
+    
     int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (fd < 0) {
         printf("[FILE-DOWNLOAD] Error: Cannot create file '%s'\n", filename);
         perror("open");
-        free(filename);
-        free(sender);
         return -1;
     }
     
-    char buffer[CHUNK_SIZE];
+    char *buffer = malloc(FILE_STREAM_CHUNK);
+    if (!buffer) {
+        printf("[FILE-DOWNLOAD] Error: Out of memory\n");
+        close(fd);
+        unlink(filename);
+        return -1;
+    }
     size_t total_received = 0;
+    int reported = 0;
     
     while (total_received < file_size) {
         size_t remaining = file_size - total_received;
-        size_t chunk_size = (remaining < CHUNK_SIZE) ? remaining : CHUNK_SIZE;
+        size_t chunk_size = (remaining < FILE_STREAM_CHUNK) ? remaining : FILE_STREAM_CHUNK;
         
         ssize_t received = recv(client_socket, buffer, chunk_size, 0);
         if (received <= 0) {
             printf("[FILE-DOWNLOAD] Error: Connection lost during download\n");
+            free(buffer);
             close(fd);
             unlink(filename);  
-            free(filename);
-            free(sender);
             return -1;
         }
         
@@ -773,10 +1260,9 @@ int receive_file_from_server(const char *message) {
             if (written < 0) {
                 printf("[FILE-DOWNLOAD] Error: Failed to write to file\n");
                 perror("write");
+                free(buffer);
                 close(fd);
                 unlink(filename);
-                free(filename);
-                free(sender);
                 return -1;
             }
             total_written += written;
@@ -785,23 +1271,17 @@ int receive_file_from_server(const char *message) {
         total_received += received;
         
         int progress = (int)((total_received * 100) / file_size);
-        if (progress % 10 == 0 || total_received == file_size) {
+        if (progress / 10 != reported / 10 || total_received == file_size) {
+            reported = progress;
             printf("[FILE-DOWNLOAD] Progress: %zu/%zu bytes (%d%%)\n", 
                    total_received, file_size, progress);
         }
     }
     
+    free(buffer);
     close(fd);
     
-    printf("[FILE-DOWNLOAD] Download completed: %s (%zu bytes) from %s\n", 
-           filename, total_received, sender);
-    
-    printf("\n File received: '%s' from %s (%zu bytes)\n", filename, sender, file_size);
-    printf("Enter a command: ");
-    fflush(stdout);
-    
-    free(filename);
-    free(sender);
+    finish_download(filename, total_received, sender);
     return 0;
 }
 
@@ -863,3 +1343,13 @@ int get_file_size(const char *filename, size_t *file_size) {
     *file_size = file_stat.st_size;
     return 0;
 }
+
+// A relayed upload that broke off was padded to its announced size; only the
+// file this client last downloaded may be removed
+int discard_download(const char *filename) {
+    if (last_download[0] == '\0' || strcmp(filename, last_download) != 0) {
+        return -1;
+    }
+    last_download[0] = '\0';
+    return unlink(filename);
+}
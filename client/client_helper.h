@@ -14,13 +14,18 @@
 #include <pthread.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #include "../utils/utils.h" 
+#include "../utils/wire.h"
+
+#define MAX_BATCH_FRAMES 16
 
 
 
 
 extern int client_socket;
 extern int client_running;
+extern int client_protocol;
 
 typedef enum {
     CMD_VALID,
@@ -38,7 +43,11 @@ void setup_signal_handlers();
 void handle_sigint(int sig);
 int connect_to_server(const char *server_ip, int port);
 int send_message(const char *message);
+int send_messages(const char **messages, int count);
 int receive_message(char *buffer, size_t buffer_size);
+int receive_frame(uint8_t *buffer, size_t buffer_size);
+int send_command(const char *command);
+int negotiate_protocol(const char *login_reply);
 int login_to_server(void);
 
 
@@ -52,8 +61,12 @@ void process_user_input(void);
 
 int handle_command(const char *command);
 
-int upload_file_to_server(const char *filename, const char *target_username);
+int upload_file_to_server(const char *filename, const char *target_username, uint32_t transfer_id, size_t offset);
 int receive_file_from_server(const char *message);
+int receive_file_data(const char *filename, size_t file_size, const char *sender,
+                      uint32_t transfer_id, size_t offset);
+int answer_resume_offer(const char *message);
+int discard_download(const char *filename);
 
 int validate_local_file(const char *filename);
 int get_file_size(const char *filename, size_t *file_size);
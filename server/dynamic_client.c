@@ -1,22 +1,158 @@
 #include "server_helper.h"
 
+#define CLIENT_INDEX_MIN_BUCKETS 256
+
 client_info_t *client_list_head = NULL;
 int active_client_count = 0;
-pthread_mutex_t client_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Lookups share the read side, only add/remove take the write side
+pthread_rwlock_t client_list_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Acquisitions that found the lock unavailable and had to wait
+static unsigned long read_acquires = 0;
+static unsigned long read_contended = 0;
+static unsigned long write_acquires = 0;
+static unsigned long write_contended = 0;
+
+// Hash indexes over client_list_head, both sized to index_buckets (power of two)
+static client_info_t **socket_index = NULL;
+static client_info_t **name_index = NULL;
+static size_t index_buckets = 0;
+
+static uint32_t next_user_id = 0;
+
+
+
+void client_registry_read_lock(void) {
+    if (pthread_rwlock_tryrdlock(&client_list_lock) != 0) {
+        __atomic_add_fetch(&read_contended, 1, __ATOMIC_RELAXED);
+        pthread_rwlock_rdlock(&client_list_lock);
+    }
+    __atomic_add_fetch(&read_acquires, 1, __ATOMIC_RELAXED);
+}
+
+void client_registry_write_lock(void) {
+    if (pthread_rwlock_trywrlock(&client_list_lock) != 0) {
+        __atomic_add_fetch(&write_contended, 1, __ATOMIC_RELAXED);
+        pthread_rwlock_wrlock(&client_list_lock);
+    }
+    __atomic_add_fetch(&write_acquires, 1, __ATOMIC_RELAXED);
+}
+
+void client_registry_unlock(void) {
+    pthread_rwlock_unlock(&client_list_lock);
+}
+
+void client_registry_log_stats(void) {
+    log_message(LOG_SERVER, "Client registry: %lu reads (%lu waited), %lu writes (%lu waited)",
+               __atomic_load_n(&read_acquires, __ATOMIC_RELAXED),
+               __atomic_load_n(&read_contended, __ATOMIC_RELAXED),
+               __atomic_load_n(&write_acquires, __ATOMIC_RELAXED),
+               __atomic_load_n(&write_contended, __ATOMIC_RELAXED));
+}
+
+
+
+static size_t hash_socket(int socket_fd) {
+    return ((uint32_t)socket_fd * 2654435761u) & (index_buckets - 1);
+}
+
+// FNV-1a
+static size_t hash_username(const char *username) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)username; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash & (index_buckets - 1);
+}
+
+// Caller holds the registry write lock
+static void index_insert(client_info_t *client) {
+    size_t s = hash_socket(client->socket_fd);
+    client->socket_next = socket_index[s];
+    socket_index[s] = client;
+
+    size_t n = hash_username(client->username);
+    client->name_next = name_index[n];
+    name_index[n] = client;
+}
+
+// Caller holds the registry write lock
+static void index_remove(client_info_t *client) {
+    client_info_t **link = &socket_index[hash_socket(client->socket_fd)];
+    while (*link && *link != client) {
+        link = &(*link)->socket_next;
+    }
+    if (*link) {
+        *link = client->socket_next;
+    }
+
+    link = &name_index[hash_username(client->username)];
+    while (*link && *link != client) {
+        link = &(*link)->name_next;
+    }
+    if (*link) {
+        *link = client->name_next;
+    }
+}
+
+// Rebuilds both indexes with the given bucket count. Caller holds the write lock.
+static int index_resize(size_t buckets) {
+    client_info_t **new_socket_index = calloc(buckets, sizeof(client_info_t *));
+    client_info_t **new_name_index = calloc(buckets, sizeof(client_info_t *));
+    if (!new_socket_index || !new_name_index) {
+        free(new_socket_index);
+        free(new_name_index);
+        return -1;
+    }
+
+    free(socket_index);
+    free(name_index);
+    socket_index = new_socket_index;
+    name_index = new_name_index;
+    index_buckets = buckets;
+
+    for (client_info_t *current = client_list_head; current; current = current->next) {
+        index_insert(current);
+    }
+    return 0;
+}
+
+// Caller holds the registry write lock
+static void unlink_client(client_info_t *client) {
+    index_remove(client);
+
+    if (client->prev) {
+        client->prev->next = client->next;
+    } else {
+        client_list_head = client->next;
+    }
+    if (client->next) {
+        client->next->prev = client->prev;
+    }
+    __atomic_sub_fetch(&active_client_count, 1, __ATOMIC_RELAXED);
+}
+
 
 
 void init_clients(void) {
-    pthread_mutex_lock(&client_list_mutex);
+    client_registry_write_lock();
     client_list_head = NULL;
     active_client_count = 0;
-    pthread_mutex_unlock(&client_list_mutex);
+    if (index_resize(CLIENT_INDEX_MIN_BUCKETS) != 0) {
+        red();
+        printf("Failed to allocate client index\n");
+        reset();
+    }
+    client_registry_unlock();
     // printf("[CLIENT-INIT] Client list initialized\n");
 }
 
 void cleanup_clients(void) {
     // printf("[CLIENT-CLEANUP] Cleaning up all clients...\n");
     
-    pthread_mutex_lock(&client_list_mutex);
+    client_registry_write_lock();
     
     client_info_t *current = client_list_head;
     int cleanup_count = 0;
@@ -27,10 +163,7 @@ void cleanup_clients(void) {
         // printf("[CLIENT-CLEANUP] Cleaning up client '%s' (socket %d)\n", 
         //        current->username, current->socket_fd);
         
-        if (current->socket_fd >= 0) {
-            close(current->socket_fd);
-        }
-        
+        // The socket belongs to its connection and closes with it
         free(current);
         cleanup_count++;
         current = next;
@@ -39,8 +172,15 @@ void cleanup_clients(void) {
     client_list_head = NULL;
     active_client_count = 0;
     
-    pthread_mutex_unlock(&client_list_mutex);
+    free(socket_index);
+    free(name_index);
+    socket_index = NULL;
+    name_index = NULL;
+    index_buckets = 0;
+    
+    client_registry_unlock();
     
+    client_registry_log_stats();
     // printf("[CLIENT-CLEANUP] Cleaned up %d clients\n", cleanup_count);
 }
 
@@ -67,10 +207,12 @@ client_info_t* add_client(const char *username, int socket_fd, pthread_t thread_
     
     new_client->socket_fd = socket_fd;
     new_client->thread_id = thread_id;
+    new_client->user_id = __atomic_add_fetch(&next_user_id, 1, __ATOMIC_RELAXED);
     
     // Clear room information
     new_client->current_room_name[0] = '\0';
     new_client->current_room_index = -1;
+    new_client->current_room_generation = 0;
     
     // Set connection information
     if (client_ip) {
@@ -94,150 +236,186 @@ client_info_t* add_client(const char *username, int socket_fd, pthread_t thread_
     new_client->is_active = 1;
     new_client->is_uploading = 0;
     new_client->is_downloading = 0;
+    new_client->chunked_transfers = 0;
+    new_client->wide_file_sizes = 0;
     
     // Add to linked list
-    pthread_mutex_lock(&client_list_mutex);
+    client_registry_write_lock();
+    
+    // Keep the load factor at or below one
+    if (index_buckets == 0 || (size_t)active_client_count >= index_buckets) {
+        size_t buckets = index_buckets ? index_buckets * 2 : CLIENT_INDEX_MIN_BUCKETS;
+        if (index_resize(buckets) != 0 && index_buckets == 0) {
+            client_registry_unlock();
+            free(new_client);
+            return NULL;
+        }
+    }
     
     // Insert at head of list
+    new_client->prev = NULL;
     new_client->next = client_list_head;
+    if (client_list_head) {
+        client_list_head->prev = new_client;
+    }
     client_list_head = new_client;
-    active_client_count++;
+    index_insert(new_client);
+    __atomic_add_fetch(&active_client_count, 1, __ATOMIC_RELAXED);
     
     // printf("[CLIENT-ADD] Added client '%s' (socket %d, path: %s). Total: %d\n",
     //        username, socket_fd, file_path ? file_path : ".", active_client_count);
     
-    pthread_mutex_unlock(&client_list_mutex);
+    client_registry_unlock();
     
     return new_client;
 }
 
 
 
+// Caller holds the registry lock
+static client_info_t* lookup_socket(int socket_fd) {
+    if (index_buckets == 0) {
+        return NULL;
+    }
+    client_info_t *current = socket_index[hash_socket(socket_fd)];
+    while (current && current->socket_fd != socket_fd) {
+        current = current->socket_next;
+    }
+    return current;
+}
+
+// Caller holds the registry lock
+static client_info_t* lookup_username(const char *username) {
+    if (index_buckets == 0) {
+        return NULL;
+    }
+    client_info_t *current = name_index[hash_username(username)];
+    while (current && strcmp(current->username, username) != 0) {
+        current = current->name_next;
+    }
+    return current;
+}
+
 int remove_client(int socket_fd) {
-    pthread_mutex_lock(&client_list_mutex);
-    
-    client_info_t *current = client_list_head;
-    client_info_t *previous = NULL;
+    client_registry_write_lock();
     
-    while (current) {
-        if (current->socket_fd == socket_fd) {
-            // Remove from list
-            if (previous) {
-                previous->next = current->next;
-            } else {
-                client_list_head = current->next;
-            }
-            
-            // printf("[CLIENT-REMOVE] Removing client '%s' (socket %d)\n", 
-            //        current->username, current->socket_fd);
-            
-            free(current);
-            active_client_count--;
-            
-            // printf("[CLIENT-REMOVE] Client removed. Total: %d\n", active_client_count);
-            
-            pthread_mutex_unlock(&client_list_mutex);
-            return 0;
-        }
-        
-        previous = current;
-        current = current->next;
+    client_info_t *client = lookup_socket(socket_fd);
+    if (!client) {
+        client_registry_unlock();
+        // printf("[CLIENT-WARNING] Client with socket %d not found\n", socket_fd);
+        return -1;
     }
     
-    pthread_mutex_unlock(&client_list_mutex);
-    // printf("[CLIENT-WARNING] Client with socket %d not found\n", socket_fd);
-    return -1;
+    // printf("[CLIENT-REMOVE] Removing client '%s' (socket %d)\n", 
+    //        client->username, client->socket_fd);
+    
+    unlink_client(client);
+    free(client);
+    
+    // printf("[CLIENT-REMOVE] Client removed. Total: %d\n", active_client_count);
+    
+    client_registry_unlock();
+    return 0;
+}
+
+// Unlinks the entry a session registered, without trusting the descriptor
+// number, which another connection may already own
+int remove_client_entry(client_info_t *client) {
+    if (!client) return -1;
+    
+    client_registry_write_lock();
+    unlink_client(client);
+    free(client);
+    client_registry_unlock();
+    return 0;
 }
 
 int remove_client_by_username(const char *username) {
     if (!username) return -1;
     
-    pthread_mutex_lock(&client_list_mutex);
+    client_registry_write_lock();
     
-    client_info_t *current = client_list_head;
-    client_info_t *previous = NULL;
-    
-    while (current) {
-        if (strcmp(current->username, username) == 0) {
-            // Remove from list
-            if (previous) {
-                previous->next = current->next;
-            } else {
-                client_list_head = current->next;
-            }
-            
-            // printf("[CLIENT-REMOVE] Removing client '%s' by username\n", username);
-            
-            free(current);
-            active_client_count--;
-            
-            pthread_mutex_unlock(&client_list_mutex);
-            return 0;
-        }
-        
-        previous = current;
-        current = current->next;
+    client_info_t *client = lookup_username(username);
+    if (!client) {
+        client_registry_unlock();
+        return -1;
     }
     
-    pthread_mutex_unlock(&client_list_mutex);
-    return -1;
+    // printf("[CLIENT-REMOVE] Removing client '%s' by username\n", username);
+    
+    unlink_client(client);
+    free(client);
+    
+    client_registry_unlock();
+    return 0;
 }
 
 
+// The entry can be freed as soon as the lock is dropped, the result is only
+// good as a presence check. find_client_connection() is the one to read it.
 client_info_t* find_client_by_username(const char *username) {
     if (!username) return NULL;
     
-    pthread_mutex_lock(&client_list_mutex);
+    client_registry_read_lock();
     
-    client_info_t *current = client_list_head;
-    while (current) {
-        if (current->is_active && strcmp(current->username, username) == 0) {
-            pthread_mutex_unlock(&client_list_mutex);
-            return current;
-        }
-        current = current->next;
+    client_info_t *client = lookup_username(username);
+    if (client && !client->is_active) {
+        client = NULL;
     }
     
-    pthread_mutex_unlock(&client_list_mutex);
-    return NULL;
+    client_registry_unlock();
+    return client;
 }
 
-client_info_t* find_client_by_socket(int socket_fd) {
-    pthread_mutex_lock(&client_list_mutex);
+// Copies the entry out under the lock and returns its connection with a
+// reference, so the socket can't close and be reused while it is in use.
+// NULL if the user is offline or already on the way out.
+connection_t* find_client_connection(const char *username, client_info_t *copy) {
+    if (!username) return NULL;
     
-    client_info_t *current = client_list_head;
-    while (current) {
-        if (current->socket_fd == socket_fd) {
-            pthread_mutex_unlock(&client_list_mutex);
-            return current;
+    connection_t *conn = NULL;
+    client_registry_read_lock();
+    
+    client_info_t *client = lookup_username(username);
+    if (client && client->is_active) {
+        conn = connection_get(client->socket_fd);
+        if (conn && copy) {
+            *copy = *client;
         }
-        current = current->next;
     }
     
-    pthread_mutex_unlock(&client_list_mutex);
-    return NULL;
+    client_registry_unlock();
+    return conn;
+}
+
+client_info_t* find_client_by_socket(int socket_fd) {
+    client_registry_read_lock();
+    client_info_t *client = lookup_socket(socket_fd);
+    client_registry_unlock();
+    return client;
 }
 
+// Thread ids are not indexed, with the worker pool they no longer identify a client
 client_info_t* find_client_by_thread(pthread_t thread_id) {
-    pthread_mutex_lock(&client_list_mutex);
+    client_registry_read_lock();
     
     client_info_t *current = client_list_head;
     while (current) {
         if (pthread_equal(current->thread_id, thread_id)) {
-            pthread_mutex_unlock(&client_list_mutex);
+            client_registry_unlock();
             return current;
         }
         current = current->next;
     }
     
-    pthread_mutex_unlock(&client_list_mutex);
+    client_registry_unlock();
     return NULL;
 }
 
 
 
 void list_clients(void) {
-    pthread_mutex_lock(&client_list_mutex);
+    client_registry_read_lock();
     
     printf("\n=== CLIENT LIST (%d clients) ===\n", active_client_count);
     
@@ -256,14 +434,11 @@ void list_clients(void) {
     
     printf("===============================\n\n");
     
-    pthread_mutex_unlock(&client_list_mutex);
+    client_registry_unlock();
 }
 
 int count_clients(void) {
-    pthread_mutex_lock(&client_list_mutex);
-    int count = active_client_count;
-    pthread_mutex_unlock(&client_list_mutex);
-    return count;
+    return __atomic_load_n(&active_client_count, __ATOMIC_RELAXED);
 }
 
 
@@ -1,46 +1,152 @@
 #include "server_helper.h"
 
+#define ROOM_INDEX_MIN_BUCKETS 64
+#define ROOM_SLOTS_MIN 64
+
 
 
 room_info_t *room_list_head = NULL;
 int total_room_count = 0;
-pthread_mutex_t room_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Lookups take the read side, only add/remove serialize on the write side
+pthread_rwlock_t room_list_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Name index over the live rooms, index_buckets is a power of two
+static room_info_t **room_index = NULL;
+static size_t index_buckets = 0;
+
+// room_id -> room. Room memory is recycled through free_slots, never freed
+// before cleanup_rooms(), so a handle always points at a valid room_info_t.
+static room_info_t **room_slots = NULL;
+static int slot_capacity = 0;
+static int slots_used = 0;
+static room_info_t *free_slots = NULL;
+
+
+
+// FNV-1a
+static size_t hash_room_name(const char *room_name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)room_name; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash & (index_buckets - 1);
+}
+
+// Caller holds room_list_lock
+static room_info_t* lookup_room(const char *room_name) {
+    if (index_buckets == 0) {
+        return NULL;
+    }
+    room_info_t *current = room_index[hash_room_name(room_name)];
+    while (current && strcmp(current->room_name, room_name) != 0) {
+        current = current->hash_next;
+    }
+    return current;
+}
+
+// Caller holds room_list_lock for writing
+static int index_resize(size_t buckets) {
+    room_info_t **new_index = calloc(buckets, sizeof(room_info_t *));
+    if (!new_index) {
+        return -1;
+    }
+
+    free(room_index);
+    room_index = new_index;
+    index_buckets = buckets;
+
+    for (room_info_t *current = room_list_head; current; current = current->next) {
+        size_t b = hash_room_name(current->room_name);
+        current->hash_next = room_index[b];
+        room_index[b] = current;
+    }
+    return 0;
+}
+
+// Hands out a recycled room or a fresh one with its own slot.
+// Caller holds room_list_lock for writing.
+static room_info_t* allocate_room(void) {
+    if (free_slots) {
+        room_info_t *room = free_slots;
+        free_slots = room->next;
+        return room;
+    }
+
+    if (slots_used == slot_capacity) {
+        int capacity = slot_capacity ? slot_capacity * 2 : ROOM_SLOTS_MIN;
+        room_info_t **slots = realloc(room_slots, sizeof(room_info_t *) * capacity);
+        if (!slots) {
+            return NULL;
+        }
+        room_slots = slots;
+        slot_capacity = capacity;
+    }
+
+    room_info_t *room = malloc(sizeof(room_info_t));
+    if (!room) {
+        return NULL;
+    }
+    memset(room, 0, sizeof(room_info_t));
+
+    if (pthread_mutex_init(&room->room_mutex, NULL) != 0) {
+        free(room);
+        return NULL;
+    }
+
+    room->room_id = slots_used;
+    room_slots[slots_used++] = room;
+    return room;
+}
 
 
 
 void init_rooms(void) {
-    pthread_mutex_lock(&room_list_mutex);
+    pthread_rwlock_wrlock(&room_list_lock);
     room_list_head = NULL;
     total_room_count = 0;
-    pthread_mutex_unlock(&room_list_mutex);
+    if (index_resize(ROOM_INDEX_MIN_BUCKETS) != 0) {
+        printf("[ROOM-ERROR] Failed to allocate room index\n");
+    }
+    pthread_rwlock_unlock(&room_list_lock);
     printf("[ROOM-INIT] Room list initialized\n");
 }
 
 void cleanup_rooms(void) {
     printf("[ROOM-CLEANUP] Cleaning up all rooms...\n");
     
-    pthread_mutex_lock(&room_list_mutex);
+    pthread_rwlock_wrlock(&room_list_lock);
     
-    room_info_t *current = room_list_head;
     int cleanup_count = 0;
     
-    while (current) {
-        room_info_t *next = current->next;
+    for (int i = 0; i < slots_used; i++) {
+        room_info_t *current = room_slots[i];
         
-        printf("[ROOM-CLEANUP] Cleaning up room '%s'\n", current->room_name);
+        if (current->in_use) {
+            printf("[ROOM-CLEANUP] Cleaning up room '%s'\n", current->room_name);
+            cleanup_count++;
+        }
         
         // Destroy room mutex
         pthread_mutex_destroy(&current->room_mutex);
         
         free(current);
-        cleanup_count++;
-        current = next;
     }
     
+    free(room_slots);
+    free(room_index);
+    room_slots = NULL;
+    room_index = NULL;
+    slot_capacity = 0;
+    slots_used = 0;
+    index_buckets = 0;
+    free_slots = NULL;
+    
     room_list_head = NULL;
     total_room_count = 0;
     
-    pthread_mutex_unlock(&room_list_mutex);
+    pthread_rwlock_unlock(&room_list_lock);
     
     printf("[ROOM-CLEANUP] Cleaned up %d rooms\n", cleanup_count);
 }
@@ -52,31 +158,41 @@ room_info_t* add_room(const char *room_name) {
         return NULL;
     }
     
-    pthread_mutex_lock(&room_list_mutex);
+    pthread_rwlock_wrlock(&room_list_lock);
     
     // Check if room already exists
-    room_info_t *existing = room_list_head;
-    while (existing) {
-        if (strcmp(existing->room_name, room_name) == 0) {
-            pthread_mutex_unlock(&room_list_mutex);
-            printf("[ROOM-INFO] Room '%s' already exists\n", room_name);
-            return existing;  // Return existing room
+    room_info_t *existing = lookup_room(room_name);
+    if (existing) {
+        pthread_rwlock_unlock(&room_list_lock);
+        printf("[ROOM-INFO] Room '%s' already exists\n", room_name);
+        return existing;  // Return existing room
+    }
+    
+    // Keep the load factor at or below one
+    if (index_buckets == 0 || (size_t)total_room_count >= index_buckets) {
+        size_t buckets = index_buckets ? index_buckets * 2 : ROOM_INDEX_MIN_BUCKETS;
+        if (index_resize(buckets) != 0 && index_buckets == 0) {
+            pthread_rwlock_unlock(&room_list_lock);
+            perror("[ROOM-ERROR] Failed to allocate room index");
+            return NULL;
         }
-        existing = existing->next;
     }
     
-    // Allocate new room
-    room_info_t *new_room = malloc(sizeof(room_info_t));
+    room_info_t *new_room = allocate_room();
     if (!new_room) {
-        pthread_mutex_unlock(&room_list_mutex);
+        pthread_rwlock_unlock(&room_list_lock);
         perror("[ROOM-ERROR] Failed to allocate memory for new room");
         return NULL;
     }
     
-    // Initialize room data
+    // Initialize room data. The mutex, room_id and generation belong to the
+    // slot and survive recycling.
+    pthread_mutex_lock(&new_room->room_mutex);
+    
     strncpy(new_room->room_name, room_name, sizeof(new_room->room_name) - 1);
     new_room->room_name[sizeof(new_room->room_name) - 1] = '\0';
     
+    new_room->generation++;
     new_room->created_time = time(NULL);
     new_room->client_count = 0;
     new_room->total_messages_sent = 0;
@@ -86,76 +202,108 @@ room_info_t* add_room(const char *room_name) {
     for (int i = 0; i < MAX_CLIENTS_PER_ROOM; i++) {
         new_room->clients[i] = NULL;
     }
+    new_room->in_use = 1;
     
-    // Initialize room mutex
-    if (pthread_mutex_init(&new_room->room_mutex, NULL) != 0) {
-        pthread_mutex_unlock(&room_list_mutex);
-        free(new_room);
-        perror("[ROOM-ERROR] Failed to initialize room mutex");
-        return NULL;
-    }
+    pthread_mutex_unlock(&new_room->room_mutex);
+    
+    // Add to index and list
+    size_t bucket = hash_room_name(new_room->room_name);
+    new_room->hash_next = room_index[bucket];
+    room_index[bucket] = new_room;
     
-    // Add to linked list
+    new_room->prev = NULL;
     new_room->next = room_list_head;
+    if (room_list_head) {
+        room_list_head->prev = new_room;
+    }
     room_list_head = new_room;
     total_room_count++;
     
     printf("[ROOM-ADD] Added room '%s'. Total: %d\n", room_name, total_room_count);
     
-    pthread_mutex_unlock(&room_list_mutex);
+    pthread_rwlock_unlock(&room_list_lock);
     
     return new_room;
 }
 
 
 
+// Takes an empty room out of the directory. Caller holds room_list_lock
+// for writing and current->room_mutex, which is released here.
+static int unlink_room(room_info_t *current) {
+    if (current->client_count > 0) {
+        pthread_mutex_unlock(&current->room_mutex);
+        printf("[ROOM-ERROR] Cannot remove non-empty room '%s'\n", current->room_name);
+        return -1;
+    }
+    current->in_use = 0;
+    pthread_mutex_unlock(&current->room_mutex);
+    
+    // Remove from index and list
+    room_info_t **link = &room_index[hash_room_name(current->room_name)];
+    while (*link != current) {
+        link = &(*link)->hash_next;
+    }
+    *link = current->hash_next;
+    current->hash_next = NULL;
+    
+    if (current->prev) {
+        current->prev->next = current->next;
+    } else {
+        room_list_head = current->next;
+    }
+    if (current->next) {
+        current->next->prev = current->prev;
+    }
+    
+    printf("[ROOM-REMOVE] Removing room '%s'\n", current->room_name);
+    
+    // Slot goes back to the free list, its memory and mutex stay valid
+    current->prev = NULL;
+    current->next = free_slots;
+    free_slots = current;
+    total_room_count--;
+    
+    printf("[ROOM-REMOVE] Room removed. Total: %d\n", total_room_count);
+    return 0;
+}
+
 int remove_room(const char *room_name) {
     if (!room_name) return -1;
     
-    pthread_mutex_lock(&room_list_mutex);
+    pthread_rwlock_wrlock(&room_list_lock);
     
-    room_info_t *current = room_list_head;
-    room_info_t *previous = NULL;
+    room_info_t *current = lookup_room(room_name);
+    if (!current) {
+        pthread_rwlock_unlock(&room_list_lock);
+        printf("[ROOM-WARNING] Room '%s' not found\n", room_name);
+        return -1;
+    }
     
-    while (current) {
-        if (strcmp(current->room_name, room_name) == 0) {
-            // Check if room is empty
-            pthread_mutex_lock(&current->room_mutex);
-            if (current->client_count > 0) {
-                pthread_mutex_unlock(&current->room_mutex);
-                pthread_mutex_unlock(&room_list_mutex);
-                printf("[ROOM-ERROR] Cannot remove non-empty room '%s'\n", room_name);
-                return -1;
-            }
-            pthread_mutex_unlock(&current->room_mutex);
-            
-            // Remove from list
-            if (previous) {
-                previous->next = current->next;
-            } else {
-                room_list_head = current->next;
-            }
-            
-            printf("[ROOM-REMOVE] Removing room '%s'\n", room_name);
-            
-            // Destroy mutex and free room
-            pthread_mutex_destroy(&current->room_mutex);
-            free(current);
-            total_room_count--;
-            
-            printf("[ROOM-REMOVE] Room removed. Total: %d\n", total_room_count);
-            
-            pthread_mutex_unlock(&room_list_mutex);
-            return 0;
-        }
-        
-        previous = current;
-        current = current->next;
+    pthread_mutex_lock(&current->room_mutex);
+    int result = unlink_room(current);
+    
+    pthread_rwlock_unlock(&room_list_lock);
+    return result;
+}
+
+// Removes the room if the slot still holds the given generation and nobody
+// joined it since, without looking its name up
+int remove_room_handle(room_info_t *room, uint32_t generation) {
+    if (!room) return -1;
+    
+    pthread_rwlock_wrlock(&room_list_lock);
+    
+    pthread_mutex_lock(&room->room_mutex);
+    if (!room->in_use || room->generation != generation) {
+        pthread_mutex_unlock(&room->room_mutex);
+        pthread_rwlock_unlock(&room_list_lock);
+        return -1;
     }
+    int result = unlink_room(room);
     
-    pthread_mutex_unlock(&room_list_mutex);
-    printf("[ROOM-WARNING] Room '%s' not found\n", room_name);
-    return -1;
+    pthread_rwlock_unlock(&room_list_lock);
+    return result;
 }
 
 
@@ -163,67 +311,67 @@ int remove_room(const char *room_name) {
 room_info_t* find_room(const char *room_name) {
     if (!room_name) return NULL;
     
-    pthread_mutex_lock(&room_list_mutex);
-    
-    room_info_t *current = room_list_head;
-    while (current) {
-        if (strcmp(current->room_name, room_name) == 0) {
-            pthread_mutex_unlock(&room_list_mutex);
-            return current;
-        }
-        current = current->next;
-    }
+    pthread_rwlock_rdlock(&room_list_lock);
+    room_info_t *room = lookup_room(room_name);
+    pthread_rwlock_unlock(&room_list_lock);
     
-    pthread_mutex_unlock(&room_list_mutex);
-    return NULL;
+    return room;
 }
 
+// Index is the stable room_id handed out by get_room_index()
 room_info_t* get_room_by_index(int index) {
     if (index < 0) return NULL;
     
-    pthread_mutex_lock(&room_list_mutex);
-    
-    room_info_t *current = room_list_head;
-    int current_index = 0;
+    room_info_t *room = NULL;
     
-    while (current) {
-        if (current_index == index) {
-            pthread_mutex_unlock(&room_list_mutex);
-            return current;
-        }
-        current = current->next;
-        current_index++;
+    pthread_rwlock_rdlock(&room_list_lock);
+    if (index < slots_used && room_slots[index]->in_use) {
+        room = room_slots[index];
     }
+    pthread_rwlock_unlock(&room_list_lock);
     
-    pthread_mutex_unlock(&room_list_mutex);
-    return NULL;
+    return room;
 }
 
-int get_room_index(const char *room_name) {
-    if (!room_name) return -1;
+// Returns the room with room_mutex held while the slot still holds the
+// room that was current when the handle was taken, NULL otherwise
+room_info_t* lock_room_handle(int room_id, uint32_t generation) {
+    if (room_id < 0) return NULL;
     
-    pthread_mutex_lock(&room_list_mutex);
+    room_info_t *room = NULL;
     
-    room_info_t *current = room_list_head;
-    int index = 0;
+    pthread_rwlock_rdlock(&room_list_lock);
+    if (room_id < slots_used) {
+        room = room_slots[room_id];
+    }
+    pthread_rwlock_unlock(&room_list_lock);
     
-    while (current) {
-        if (strcmp(current->room_name, room_name) == 0) {
-            pthread_mutex_unlock(&room_list_mutex);
-            return index;
+    if (room) {
+        pthread_mutex_lock(&room->room_mutex);
+        if (!room->in_use || room->generation != generation) {
+            pthread_mutex_unlock(&room->room_mutex);
+            room = NULL;
         }
-        current = current->next;
-        index++;
     }
     
-    pthread_mutex_unlock(&room_list_mutex);
-    return -1;
+    return room;
+}
+
+int get_room_index(const char *room_name) {
+    if (!room_name) return -1;
+    
+    pthread_rwlock_rdlock(&room_list_lock);
+    room_info_t *room = lookup_room(room_name);
+    int index = room ? room->room_id : -1;
+    pthread_rwlock_unlock(&room_list_lock);
+    
+    return index;
 }
 
 
 
 void list_rooms(void) {
-    pthread_mutex_lock(&room_list_mutex);
+    pthread_rwlock_rdlock(&room_list_lock);
     
     printf("\n=== ROOM LIST (%d rooms) ===\n", total_room_count);
     
@@ -253,14 +401,12 @@ void list_rooms(void) {
     
     printf("========================\n\n");
     
-    pthread_mutex_unlock(&room_list_mutex);
+    pthread_rwlock_unlock(&room_list_lock);
 }
 
 int count_rooms(void) {
-    pthread_mutex_lock(&room_list_mutex);
+    pthread_rwlock_rdlock(&room_list_lock);
     int count = total_room_count;
-    pthread_mutex_unlock(&room_list_mutex);
+    pthread_rwlock_unlock(&room_list_lock);
     return count;
 }
-
-
@@ -0,0 +1,279 @@
+// file_resume.c - Chunked store-mode transfers that survive a dropped connection
+
+#include "server_helper.h"
+
+static file_resume_t resumes[FILE_RESUME_SLOTS];
+static uint32_t next_transfer_id = 0;
+static pthread_mutex_t resume_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long parked_total = 0;
+static unsigned long resumed_total = 0;
+static unsigned long expired_total = 0;
+static size_t resumed_bytes = 0;         // bytes a resumed transfer did not have to move again
+
+
+
+// Caller holds resume_mutex. Ids start somewhere new on every run, so a
+// partial download a client kept from an earlier run can't match a new one.
+static uint32_t new_transfer_id(void) {
+    if (next_transfer_id == 0) {
+        next_transfer_id = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    }
+    if (next_transfer_id == 0) {
+        next_transfer_id++;
+    }
+    return next_transfer_id++;
+}
+
+static int is_parked(const file_resume_t *entry) {
+    return entry->state == FILE_RESUME_UPLOAD_PARKED || entry->state == FILE_RESUME_SEND_PARKED;
+}
+
+// Caller holds resume_mutex
+static void free_entry(file_resume_t *entry) {
+    file_stage_release(&entry->stage);
+    memset(entry, 0, sizeof(*entry));
+    entry->stage.spill_fd = -1;
+    entry->state = FILE_RESUME_FREE;
+}
+
+// Caller holds resume_mutex. Drops parked transfers nobody came back for.
+static void expire_parked(time_t now) {
+    for (int i = 0; i < FILE_RESUME_SLOTS; i++) {
+        file_resume_t *entry = &resumes[i];
+        if (is_parked(entry) && now - entry->parked_at > FILE_RESUME_TIMEOUT) {
+            log_message(LOG_SENDFILE, "Interrupted transfer %u expired: %s -> %s (%s)",
+                       entry->id, entry->sender_username, entry->receiver_username, entry->filename);
+            free_entry(entry);
+            expired_total++;
+        }
+    }
+}
+
+// Caller holds resume_mutex. A free slot, or the oldest parked transfer's.
+static file_resume_t* take_slot(const file_queue_item_t *job) {
+    expire_parked(time(NULL));
+
+    file_resume_t *oldest = NULL;
+    for (int i = 0; i < FILE_RESUME_SLOTS; i++) {
+        file_resume_t *entry = &resumes[i];
+        if (entry->state == FILE_RESUME_FREE) {
+            oldest = entry;
+            break;
+        }
+        if (is_parked(entry) && (!oldest || entry->parked_at < oldest->parked_at)) {
+            oldest = entry;
+        }
+    }
+    if (!oldest) {
+        return NULL;
+    }
+    if (oldest->state != FILE_RESUME_FREE) {
+        log_message(LOG_WARNING, "Dropping interrupted transfer %u (%s) to make room", oldest->id, oldest->filename);
+        free_entry(oldest);
+        expired_total++;
+    }
+
+    oldest->stage.spill_fd = -1;
+    oldest->id = new_transfer_id();
+    strncpy(oldest->filename, job->filename, sizeof(oldest->filename) - 1);
+    strncpy(oldest->sender_username, job->sender_username, sizeof(oldest->sender_username) - 1);
+    strncpy(oldest->receiver_username, job->receiver_username, sizeof(oldest->receiver_username) - 1);
+    oldest->sender_user_id = job->sender_user_id;
+    return oldest;
+}
+
+// The upload the same sender left unfinished for the same file and receiver,
+// or a fresh one. NULL when every slot is busy.
+file_resume_t* file_resume_claim_upload(const file_queue_item_t *job) {
+    pthread_mutex_lock(&resume_mutex);
+
+    file_resume_t *entry = NULL;
+    for (int i = 0; i < FILE_RESUME_SLOTS; i++) {
+        file_resume_t *candidate = &resumes[i];
+        if (candidate->state == FILE_RESUME_UPLOAD_PARKED &&
+            strcmp(candidate->sender_username, job->sender_username) == 0 &&
+            strcmp(candidate->receiver_username, job->receiver_username) == 0 &&
+            strcmp(candidate->filename, job->filename) == 0) {
+            entry = candidate;
+            resumed_total++;
+            resumed_bytes += entry->offset;
+            log_message(LOG_SENDFILE, "Resuming upload %u of '%s' from user '%s' at %zu/%zu bytes",
+                       entry->id, entry->filename, entry->sender_username, entry->offset, entry->stage.size);
+            break;
+        }
+    }
+    if (!entry) {
+        entry = take_slot(job);
+    }
+    if (entry) {
+        entry->state = FILE_RESUME_UPLOADING;
+    }
+
+    pthread_mutex_unlock(&resume_mutex);
+    return entry;
+}
+
+// Takes over a stage a plain upload filled, for a chunked download
+file_resume_t* file_resume_adopt(const file_queue_item_t *job, file_stage_t *stage) {
+    pthread_mutex_lock(&resume_mutex);
+    file_resume_t *entry = take_slot(job);
+    if (entry) {
+        entry->stage = *stage;
+        entry->offset = stage->size;
+        entry->state = FILE_RESUME_SENDING;
+    }
+    pthread_mutex_unlock(&resume_mutex);
+    return entry;
+}
+
+// The finished upload is about to go out to the receiver
+void file_resume_start_send(file_resume_t *entry) {
+    pthread_mutex_lock(&resume_mutex);
+    entry->state = FILE_RESUME_SENDING;
+    entry->acked = 0;
+    pthread_mutex_unlock(&resume_mutex);
+}
+
+// Fills in the job for a /resume of a parked download, -1 if the receiver
+// has none by that id
+int file_resume_lookup_send(uint32_t transfer_id, const char *receiver_name, file_queue_item_t *job) {
+    int result = -1;
+    pthread_mutex_lock(&resume_mutex);
+
+    for (int i = 0; i < FILE_RESUME_SLOTS; i++) {
+        file_resume_t *entry = &resumes[i];
+        if (entry->state == FILE_RESUME_SEND_PARKED && entry->id == transfer_id &&
+            strcmp(entry->receiver_username, receiver_name) == 0) {
+            memcpy(job->filename, entry->filename, sizeof(job->filename));
+            memcpy(job->sender_username, entry->sender_username, sizeof(job->sender_username));
+            job->sender_user_id = entry->sender_user_id;
+            result = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&resume_mutex);
+    return result;
+}
+
+// A parked download the receiver asked for again, from offset on
+file_resume_t* file_resume_claim_send(uint32_t transfer_id, const char *receiver_name, size_t offset) {
+    pthread_mutex_lock(&resume_mutex);
+
+    file_resume_t *entry = NULL;
+    for (int i = 0; i < FILE_RESUME_SLOTS; i++) {
+        if (resumes[i].state == FILE_RESUME_SEND_PARKED && resumes[i].id == transfer_id &&
+            strcmp(resumes[i].receiver_username, receiver_name) == 0) {
+            entry = &resumes[i];
+            entry->state = FILE_RESUME_SENDING;
+            resumed_total++;
+            resumed_bytes += (offset < entry->stage.size) ? offset : entry->stage.size;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&resume_mutex);
+    return entry;
+}
+
+// The connection dropped: keep what was staged for the next attempt. An
+// upload that never got a byte in has nothing worth keeping.
+void file_resume_park(file_resume_t *entry) {
+    pthread_mutex_lock(&resume_mutex);
+
+    if (entry->state == FILE_RESUME_UPLOADING && entry->offset == 0) {
+        free_entry(entry);
+        pthread_mutex_unlock(&resume_mutex);
+        return;
+    }
+
+    entry->state = (entry->state == FILE_RESUME_UPLOADING) ? FILE_RESUME_UPLOAD_PARKED : FILE_RESUME_SEND_PARKED;
+    entry->parked_at = time(NULL);
+    parked_total++;
+    log_message(LOG_SENDFILE, "Transfer %u interrupted, kept for %d s: %s -> %s (%s, %s %zu/%zu bytes)",
+               entry->id, FILE_RESUME_TIMEOUT, entry->sender_username, entry->receiver_username, entry->filename,
+               entry->state == FILE_RESUME_UPLOAD_PARKED ? "uploaded" : "acknowledged",
+               entry->state == FILE_RESUME_UPLOAD_PARKED ? entry->offset : entry->acked, entry->stage.size);
+
+    pthread_mutex_unlock(&resume_mutex);
+}
+
+void file_resume_release(file_resume_t *entry) {
+    pthread_mutex_lock(&resume_mutex);
+    free_entry(entry);
+    pthread_mutex_unlock(&resume_mutex);
+}
+
+// Receiver progress on a download in flight or parked, -1 if the transfer
+// isn't this receiver's
+int file_resume_ack(uint32_t transfer_id, const char *receiver_name, size_t offset) {
+    int result = -1;
+    pthread_mutex_lock(&resume_mutex);
+
+    for (int i = 0; i < FILE_RESUME_SLOTS; i++) {
+        file_resume_t *entry = &resumes[i];
+        if ((entry->state == FILE_RESUME_SENDING || entry->state == FILE_RESUME_SEND_PARKED) &&
+            entry->id == transfer_id && strcmp(entry->receiver_username, receiver_name) == 0) {
+            if (offset <= entry->stage.size && offset > entry->acked) {
+                entry->acked = offset;
+            }
+            result = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&resume_mutex);
+    return result;
+}
+
+// Tells a receiver that just turned chunked transfers on about the downloads
+// it missed: "FILE_RESUME <id> <size> <acked> <sender> <filename>". Returns
+// how many there were.
+int file_resume_offer(int client_socket, const char *receiver_name) {
+    char offers[FILE_RESUME_SLOTS][MAX_FILENAME_LENGTH + 96];
+    int count = 0;
+
+    pthread_mutex_lock(&resume_mutex);
+    expire_parked(time(NULL));
+    for (int i = 0; i < FILE_RESUME_SLOTS; i++) {
+        file_resume_t *entry = &resumes[i];
+        if (entry->state == FILE_RESUME_SEND_PARKED && strcmp(entry->receiver_username, receiver_name) == 0) {
+            snprintf(offers[count++], sizeof(offers[0]), "FILE_RESUME %u %zu %zu %s %s",
+                     entry->id, entry->stage.size, entry->acked, entry->sender_username, entry->filename);
+        }
+    }
+    pthread_mutex_unlock(&resume_mutex);
+
+    for (int i = 0; i < count; i++) {
+        send_message(client_socket, offers[i]);
+    }
+    return count;
+}
+
+void file_resume_log_stats(void) {
+    pthread_mutex_lock(&resume_mutex);
+
+    int parked_now = 0;
+    for (int i = 0; i < FILE_RESUME_SLOTS; i++) {
+        parked_now += is_parked(&resumes[i]);
+    }
+    log_message(LOG_SENDFILE, "Resumable transfers: %d/%d parked now, %lu interrupted, %lu resumed "
+               "(%zu bytes not moved again), %lu expired",
+               parked_now, FILE_RESUME_SLOTS, parked_total, resumed_total, resumed_bytes, expired_total);
+
+    pthread_mutex_unlock(&resume_mutex);
+}
+
+// Transfer threads are stopped, nothing is in flight
+void file_resume_cleanup(void) {
+    file_resume_log_stats();
+
+    pthread_mutex_lock(&resume_mutex);
+    for (int i = 0; i < FILE_RESUME_SLOTS; i++) {
+        if (resumes[i].state != FILE_RESUME_FREE) {
+            free_entry(&resumes[i]);
+        }
+    }
+    pthread_mutex_unlock(&resume_mutex);
+}
@@ -0,0 +1,222 @@
+// file_stage.c - Staging for stored uploads under a global memory budget
+
+#define _GNU_SOURCE
+#include "server_helper.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#define FILE_STAGE_SPILL_DIR "/var/tmp"  // disk-backed O_TMPFILE spills, /tmp is often tmpfs
+
+typedef struct stage_block {
+    struct stage_block *next;
+} stage_block_t;
+
+static size_t budget = FILE_STAGE_BUDGET;
+static size_t pooled_bytes = 0;          // blocks allocated, free or in use
+static stage_block_t *free_blocks = NULL;
+static pthread_mutex_t stage_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long pooled_stages = 0;
+static unsigned long spilled_stages = 0;
+static unsigned long budget_spills = 0;  // small enough to pool, but the budget was used up
+static unsigned long disk_spills = 0;    // past the shmem budget, or no memfd
+static size_t spilled_live = 0;
+static size_t spilled_peak = 0;
+static size_t shmem_live = 0;            // memfd pages never leave memory, only swap
+static size_t shmem_peak = 0;
+
+
+
+void file_staging_init(size_t memory_budget) {
+    pthread_mutex_lock(&stage_mutex);
+    budget = memory_budget;
+    pthread_mutex_unlock(&stage_mutex);
+
+    log_message(LOG_SERVER, "File staging: %zu bytes for pooled uploads up to %d bytes, larger ones spill "
+               "to memfd up to %d bytes, then to " FILE_STAGE_SPILL_DIR,
+               memory_budget, FILE_STAGE_BLOCK_SIZE, FILE_STAGE_SHMEM_BUDGET);
+}
+
+void file_staging_cleanup(void) {
+    file_staging_log_stats();
+
+    pthread_mutex_lock(&stage_mutex);
+    while (free_blocks) {
+        stage_block_t *block = free_blocks;
+        free_blocks = block->next;
+        free(block);
+        pooled_bytes -= FILE_STAGE_BLOCK_SIZE;
+    }
+    pthread_mutex_unlock(&stage_mutex);
+}
+
+// A free block, or a new one while the budget allows
+static char* take_block(void) {
+    char *data = NULL;
+
+    pthread_mutex_lock(&stage_mutex);
+    if (free_blocks) {
+        data = (char *)free_blocks;
+        free_blocks = free_blocks->next;
+    } else if (pooled_bytes + FILE_STAGE_BLOCK_SIZE <= budget) {
+        data = malloc(FILE_STAGE_BLOCK_SIZE);
+        if (data) {
+            pooled_bytes += FILE_STAGE_BLOCK_SIZE;
+        }
+    }
+    if (data) {
+        pooled_stages++;
+    } else {
+        budget_spills++;
+    }
+    pthread_mutex_unlock(&stage_mutex);
+    return data;
+}
+
+// A memfd while the shmem budget has room for size, an unlinked temp file
+// on disk after that. The memfd's bytes are reserved here.
+static int open_spill_file(file_stage_t *stage, size_t size) {
+    int fd = -1;
+
+    pthread_mutex_lock(&stage_mutex);
+    int shmem = shmem_live + size <= FILE_STAGE_SHMEM_BUDGET;
+    if (shmem) {
+        shmem_live += size;
+        if (shmem_live > shmem_peak) {
+            shmem_peak = shmem_live;
+        }
+    }
+    pthread_mutex_unlock(&stage_mutex);
+
+    if (shmem) {
+        fd = memfd_create("chatserver-upload", MFD_CLOEXEC);
+        if (fd >= 0) {
+            stage->spill_shmem = 1;
+            return fd;
+        }
+        pthread_mutex_lock(&stage_mutex);
+        shmem_live -= size;
+        pthread_mutex_unlock(&stage_mutex);
+    }
+
+    fd = open(FILE_STAGE_SPILL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        pthread_mutex_lock(&stage_mutex);
+        disk_spills++;
+        pthread_mutex_unlock(&stage_mutex);
+    }
+    return fd;
+}
+
+static void close_spill_file(file_stage_t *stage) {
+    close(stage->spill_fd);
+    if (stage->spill_shmem) {
+        pthread_mutex_lock(&stage_mutex);
+        shmem_live -= stage->size;
+        pthread_mutex_unlock(&stage_mutex);
+    }
+    stage->spill_fd = -1;
+    stage->spill_shmem = 0;
+}
+
+// Small files get a pooled block. Anything larger, or anything once the
+// budget is spent, goes to an unlinked memfd mapped into the address space;
+// its pages stay with the file, not the server, unless they are mapped in.
+// A memfd is still shmem, so past FILE_STAGE_SHMEM_BUDGET the spill goes
+// to a temp file on disk instead.
+int file_stage_alloc(file_stage_t *stage, size_t size) {
+    stage->data = NULL;
+    stage->size = size;
+    stage->spill_fd = -1;
+    stage->spill_shmem = 0;
+    stage->trimmed = 0;
+
+    if (size == 0) {
+        return 0;
+    }
+    if (size <= FILE_STAGE_BLOCK_SIZE && (stage->data = take_block()) != NULL) {
+        return 0;
+    }
+
+    stage->spill_fd = open_spill_file(stage, size);
+    if (stage->spill_fd < 0) {
+        log_message(LOG_ERROR, "Failed to create spill file: %s", strerror(errno));
+        return -1;
+    }
+    if (ftruncate(stage->spill_fd, size) != 0) {
+        log_message(LOG_ERROR, "Failed to size spill file to %zu bytes: %s", size, strerror(errno));
+        close_spill_file(stage);
+        return -1;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, stage->spill_fd, 0);
+    if (map == MAP_FAILED) {
+        log_message(LOG_ERROR, "Failed to map spill file of %zu bytes: %s", size, strerror(errno));
+        close_spill_file(stage);
+        return -1;
+    }
+    stage->data = map;
+
+    pthread_mutex_lock(&stage_mutex);
+    spilled_stages++;
+    spilled_live += size;
+    if (spilled_live > spilled_peak) {
+        spilled_peak = spilled_live;
+    }
+    pthread_mutex_unlock(&stage_mutex);
+    return 0;
+}
+
+// Drops the mapped pages of a spilled stage below offset once a window's
+// worth has been passed, or all of them at the end, so a transfer only keeps
+// the window it is working on resident. The data stays in the spill file.
+void file_stage_trim(file_stage_t *stage, size_t offset) {
+    if (stage->spill_fd < 0 || (offset - stage->trimmed < FILE_STAGE_WINDOW && offset < stage->size)) {
+        return;
+    }
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t end = offset & ~(page - 1);
+    if (end > stage->trimmed) {
+        madvise(stage->data + stage->trimmed, end - stage->trimmed, MADV_DONTNEED);
+        stage->trimmed = end;
+    }
+}
+
+// Rewinds the trim mark before the staged data is read back
+void file_stage_rewind(file_stage_t *stage) {
+    stage->trimmed = 0;
+}
+
+void file_stage_release(file_stage_t *stage) {
+    if (!stage->data) {
+        return;
+    }
+
+    if (stage->spill_fd < 0) {
+        stage_block_t *block = (stage_block_t *)stage->data;
+        pthread_mutex_lock(&stage_mutex);
+        block->next = free_blocks;
+        free_blocks = block;
+        pthread_mutex_unlock(&stage_mutex);
+    } else {
+        munmap(stage->data, stage->size);
+        close_spill_file(stage);
+        pthread_mutex_lock(&stage_mutex);
+        spilled_live -= stage->size;
+        pthread_mutex_unlock(&stage_mutex);
+    }
+
+    stage->data = NULL;
+    stage->spill_fd = -1;
+}
+
+void file_staging_log_stats(void) {
+    pthread_mutex_lock(&stage_mutex);
+    log_message(LOG_SENDFILE, "File staging: %zu/%zu bytes pooled, %lu pooled and %lu spilled uploads "
+               "(%lu over budget, %lu to disk), %zu bytes spilled now, peak %zu, "
+               "shmem %zu/%d bytes, peak %zu",
+               pooled_bytes, budget, pooled_stages, spilled_stages, budget_spills, disk_spills,
+               spilled_live, spilled_peak, shmem_live, FILE_STAGE_SHMEM_BUDGET, shmem_peak);
+    pthread_mutex_unlock(&stage_mutex);
+}
@@ -1,35 +1,55 @@
 // file_transfer.c - Server-Side File Transfer with File Descriptors
 
+#define _GNU_SOURCE
 #include "server_helper.h"
 #include <sys/stat.h>
 #include <fcntl.h>
 
 file_queue_t global_file_queue;
+file_transfer_mode_t file_transfer_mode = FILE_TRANSFER_SPLICE;
 
-static const char* ALLOWED_EXTENSIONS[] = {".txt", ".pdf", ".jpg", ".png" , ".mp4", NULL};
+// Relay totals for the stats line
+static unsigned long relay_count = 0;
+static unsigned long relay_bytes = 0;
+static unsigned long relay_spliced_bytes = 0;
+static unsigned long relay_cpu_ns = 0;
 
+static const char* ALLOWED_EXTENSIONS[] = {".txt", ".pdf", ".jpg", ".png" , ".mp4", ".zip", ".tar", ".gz", NULL};
 
 
-int init_file_queue(void) {
-    global_file_queue.count = 0;
+
+int init_file_queue(int capacity, int notify_position) {
+    memset(&global_file_queue, 0, sizeof(global_file_queue));
     
-    // Initialize all file_data pointers to NULL
-    for (int i = 0; i < MAX_UPLOAD_QUEUE; i++) {
-        global_file_queue.items[i].file_data = NULL;
+    global_file_queue.items = calloc(capacity, sizeof(file_queue_item_t));
+    if (!global_file_queue.items) {
+        perror("[FILE-QUEUE] Failed to allocate queue");
+        return -1;
     }
+    global_file_queue.capacity = capacity;
+    global_file_queue.notify_position = notify_position;
     
     if (pthread_mutex_init(&global_file_queue.mutex, NULL) != 0) {
         perror("[FILE-QUEUE] Failed to initialize mutex");
+        free(global_file_queue.items);
+        return -1;
+    }
+    if (pthread_cond_init(&global_file_queue.job_ready, NULL) != 0) {
+        perror("[FILE-QUEUE] Failed to initialize condition variable");
+        pthread_mutex_destroy(&global_file_queue.mutex);
+        free(global_file_queue.items);
         return -1;
     }
     
-    printf("[FILE-QUEUE] File queue initialized (max %d items)\n", MAX_UPLOAD_QUEUE);
+    printf("[FILE-QUEUE] File queue initialized (max %d items)\n", capacity);
     return 0;
 }
 
 void cleanup_file_queue(void) {
     printf("[FILE-QUEUE] Starting file queue cleanup...\n");
     
+    stop_file_transfer_workers();
+    
     pthread_mutex_lock(&global_file_queue.mutex);
     
     // Free any remaining file data
@@ -37,12 +57,12 @@ void cleanup_file_queue(void) {
     size_t total_freed = 0;
     
     for (int i = 0; i < global_file_queue.count; i++) {
-        if (global_file_queue.items[i].file_data) {
-            total_freed += global_file_queue.items[i].file_size;
-            free(global_file_queue.items[i].file_data);
-            global_file_queue.items[i].file_data = NULL;
+        file_queue_item_t *item = file_queue_waiting_item(i);
+        if (item->file_data) {
+            total_freed += item->file_size;
             freed_count++;
         }
+        release_file_queue_item(item);
     }
     
     if (freed_count > 0) {
@@ -50,87 +70,127 @@ void cleanup_file_queue(void) {
     }
     
     global_file_queue.count = 0;
+    global_file_queue.head = global_file_queue.tail;
     
     pthread_mutex_unlock(&global_file_queue.mutex);
+    
+    file_queue_log_stats();
+    file_relay_log_stats();
+    file_resume_cleanup();
+    file_staging_cleanup();
+    
+    pthread_cond_destroy(&global_file_queue.job_ready);
     pthread_mutex_destroy(&global_file_queue.mutex);
     
     printf("[FILE-QUEUE] File queue cleaned up (freed %d items, %zu bytes)\n", freed_count, total_freed);
 }
 
-int add_to_file_queue(const char *filename, const char *sender, const char *receiver,
-                     char *file_data, size_t file_size, int sender_socket, int receiver_socket) {
-    pthread_mutex_lock(&global_file_queue.mutex);
+// Caller holds the queue mutex. A queued item gives its parked sender back,
+// one a thread is running belongs to that thread.
+void release_file_queue_item(file_queue_item_t *item) {
+    free(item->file_data);
+    item->file_data = NULL;
     
-    if (global_file_queue.count >= MAX_UPLOAD_QUEUE) {
-        pthread_mutex_unlock(&global_file_queue.mutex);
-        return -1;  // Queue full
+    if (!item->active && item->sender_conn) {
+        if (item->parked) {
+            item->parked = 0;
+            connection_resume(item->sender_conn);
+        }
+        connection_put(item->sender_conn);
+        item->sender_conn = NULL;
     }
-    
-    // Add to queue
-    file_queue_item_t *item = &global_file_queue.items[global_file_queue.count];
-    
-    strncpy(item->filename, filename, sizeof(item->filename) - 1);
-    item->filename[sizeof(item->filename) - 1] = '\0';
-    
-    strncpy(item->sender_username, sender, sizeof(item->sender_username) - 1);
-    item->sender_username[sizeof(item->sender_username) - 1] = '\0';
-    
-    strncpy(item->receiver_username, receiver, sizeof(item->receiver_username) - 1);
-    item->receiver_username[sizeof(item->receiver_username) - 1] = '\0';
-    
-    item->file_data = file_data;  // Transfer ownership of allocated memory
-    item->file_size = file_size;
-    item->created_time = time(NULL);
-    item->sender_socket = sender_socket;
-    item->receiver_socket = receiver_socket;
-    
+}
+
+// Caller holds the queue mutex, position 0 is the next to start
+file_queue_item_t* file_queue_waiting_item(int position) {
+    return &global_file_queue.items[(global_file_queue.head + position) % global_file_queue.capacity];
+}
+
+static unsigned long long elapsed_ns(const struct timespec *from, const struct timespec *to) {
+    return (unsigned long long)(to->tv_sec - from->tv_sec) * 1000000000ULL
+           + (to->tv_nsec - from->tv_nsec);
+}
+
+static int ring_full(void) {
+    return global_file_queue.count >= global_file_queue.capacity;
+}
+
+static int running_full(void) {
+    return global_file_queue.running_count >= FILE_TRANSFER_WORKERS;
+}
+
+// Caller holds the queue mutex
+static void add_to_file_queue(const file_queue_item_t *item) {
+    global_file_queue.items[global_file_queue.tail] = *item;
+    global_file_queue.tail = (global_file_queue.tail + 1) % global_file_queue.capacity;
     global_file_queue.count++;
+    global_file_queue.jobs_queued++;
+    if (global_file_queue.count > global_file_queue.count_high_water) {
+        global_file_queue.count_high_water = global_file_queue.count;
+    }
     
-    printf("[FILE-QUEUE] Added: %s -> %s (%s, %zu bytes) [%d/%d]\n",
-           sender, receiver, filename, file_size, global_file_queue.count, MAX_UPLOAD_QUEUE);
-    
-    pthread_mutex_unlock(&global_file_queue.mutex);
-    return global_file_queue.count - 1;  // Return index
+    printf("[FILE-QUEUE] Added: %s -> %s (%s) [%d/%d]\n",
+           item->sender_username, item->receiver_username, item->filename,
+           global_file_queue.count, global_file_queue.capacity);
 }
 
-int remove_from_file_queue(int index) {
-    pthread_mutex_lock(&global_file_queue.mutex);
-    
-    if (index < 0 || index >= global_file_queue.count) {
-        pthread_mutex_unlock(&global_file_queue.mutex);
-        return -1;
-    }
+// Caller holds the queue mutex. Moves the oldest waiting item into a running
+// slot and accounts for how long it waited.
+static file_queue_item_t* take_from_file_queue(int slot) {
+    file_queue_item_t *item = &global_file_queue.running[slot];
     
-    // Free the file data
-    if (global_file_queue.items[index].file_data) {
-        free(global_file_queue.items[index].file_data);
-    }
+    *item = global_file_queue.items[global_file_queue.head];
+    global_file_queue.head = (global_file_queue.head + 1) % global_file_queue.capacity;
+    global_file_queue.count--;
+    item->active = 1;
+    global_file_queue.running_count++;
     
-    // Shift remaining items
-    for (int i = index; i < global_file_queue.count - 1; i++) {
-        global_file_queue.items[i] = global_file_queue.items[i + 1];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long long waited = elapsed_ns(&item->queued_at, &now);
+    global_file_queue.wait_ns += waited;
+    if (waited > global_file_queue.max_wait_ns) {
+        global_file_queue.max_wait_ns = waited;
     }
     
-    global_file_queue.count--;
-    
-    pthread_mutex_unlock(&global_file_queue.mutex);
-    return 0;
+    return item;
 }
 
-int is_file_queue_full(void) {
+// Caller holds the queue mutex
+static void release_running_slot(int slot) {
+    global_file_queue.running[slot].active = 0;
+    global_file_queue.running_count--;
+}
+
+int get_file_queue_waiting(void) {
     pthread_mutex_lock(&global_file_queue.mutex);
-    int full = (global_file_queue.count >= MAX_UPLOAD_QUEUE);
+    int waiting = global_file_queue.count;
     pthread_mutex_unlock(&global_file_queue.mutex);
-    return full;
+    return waiting;
 }
 
 int get_file_queue_count(void) {
     pthread_mutex_lock(&global_file_queue.mutex);
-    int count = global_file_queue.count;
+    int count = global_file_queue.count + global_file_queue.running_count;
     pthread_mutex_unlock(&global_file_queue.mutex);
     return count;
 }
 
+void file_queue_log_stats(void) {
+    pthread_mutex_lock(&global_file_queue.mutex);
+    
+    unsigned long started = global_file_queue.jobs_queued - global_file_queue.count;
+    log_message(LOG_SENDFILE, "File queue: %d running, %d/%d waiting (high water %d), %lu queued, "
+               "wait avg %.1f ms max %.1f ms, %lu rejected when full",
+               global_file_queue.running_count, global_file_queue.count, global_file_queue.capacity,
+               global_file_queue.count_high_water, global_file_queue.jobs_queued,
+               started > 0 ? global_file_queue.wait_ns / 1e6 / started : 0.0,
+               global_file_queue.max_wait_ns / 1e6,
+               global_file_queue.full_rejects);
+    
+    pthread_mutex_unlock(&global_file_queue.mutex);
+}
+
 // ==========================================
 // FILE VALIDATION
 // ==========================================
@@ -150,57 +210,99 @@ int validate_file_extension(const char *filename) {
     return 0;  // Invalid extension
 }
 
+// Lists ALLOWED_EXTENSIONS as ".txt, .pdf, ..." for error messages
+void format_allowed_extensions(char *buffer, size_t size) {
+    size_t used = 0;
+    
+    buffer[0] = '\0';
+    for (int i = 0; ALLOWED_EXTENSIONS[i] != NULL && used < size; i++) {
+        int written = snprintf(buffer + used, size - used, "%s%s", i > 0 ? ", " : "", ALLOWED_EXTENSIONS[i]);
+        if (written < 0) {
+            break;
+        }
+        used += (size_t)written;
+    }
+}
+
+// Only store mode holds a whole upload, relays stream any size through a
+// fixed buffer
 int validate_file_size_limit(size_t file_size) {
-    return (file_size <= MAX_FILE_SIZE) ? 1 : 0;
+    return (file_transfer_mode != FILE_TRANSFER_STORE || file_size <= MAX_FILE_SIZE) ? 1 : 0;
 }
 
 
 
-int receive_file_from_client(int client_socket, const char *filename, char **file_data, size_t *file_size) {
-    uint32_t network_size;
-    ssize_t received = recv(client_socket, &network_size, sizeof(network_size), MSG_WAITALL);
-    if (received != sizeof(network_size)) {
+// Reads the raw size that precedes every upload: 4 bytes, or the escape and
+// 8 more for files of 4 GB and up
+int receive_file_size(int client_socket, const char *filename, size_t *file_size) {
+    uint8_t raw_size[WIRE_SIZE_LONG];
+    uint64_t size = 0;
+    ssize_t received = recv(client_socket, raw_size, WIRE_SIZE_SHORT, MSG_WAITALL);
+    size_t size_len = (received == WIRE_SIZE_SHORT) ? wire_get_file_size(raw_size, WIRE_SIZE_SHORT, &size) : 0;
+    if (size_len > WIRE_SIZE_SHORT) {
+        received = recv(client_socket, raw_size + WIRE_SIZE_SHORT, size_len - WIRE_SIZE_SHORT, MSG_WAITALL);
+        if (received == (ssize_t)(size_len - WIRE_SIZE_SHORT)) {
+            wire_get_file_size(raw_size, size_len, &size);
+        } else {
+            size_len = 0;
+        }
+    }
+    if (size_len == 0) {
         printf("[FILE-RECV] Failed to receive file size from client\n");
         return -1;
     }
     
-    *file_size = ntohl(network_size);
+    *file_size = size;
     printf("[FILE-RECV] Receiving file: %s (%zu bytes)\n", filename, *file_size);
     
     if (!validate_file_size_limit(*file_size)) {
         printf("[FILE-RECV] File too large: %zu bytes (max %d)\n", *file_size, MAX_FILE_SIZE);
         return -1;
     }
+    return 0;
+}
+
+int receive_file_from_client(int client_socket, const char *filename, file_stage_t *stage) {
+    size_t file_size;
+    if (receive_file_size(client_socket, filename, &file_size) != 0) {
+        return -1;
+    }
     
-    *file_data = malloc(*file_size);
-    if (!*file_data) {
-        printf("[FILE-RECV] Failed to allocate memory for file data\n");
+    if (file_stage_alloc(stage, file_size) != 0) {
+        printf("[FILE-RECV] Failed to stage file data\n");
         return -1;
     }
     
     // Receive file data in chunks
     size_t total_received = 0;
-    char *buffer_ptr = *file_data;
+    char *buffer_ptr = stage->data;
+    size_t batch_size = (active_io_backend == IO_BACKEND_URING) ? URING_FILE_BATCH : CHUNK_SIZE;
     
-    while (total_received < *file_size) {
-        size_t remaining = *file_size - total_received;
-        size_t chunk_size = (remaining < CHUNK_SIZE) ? remaining : CHUNK_SIZE;
+    while (total_received < file_size) {
+        size_t remaining = file_size - total_received;
+        size_t chunk_size = (remaining < batch_size) ? remaining : batch_size;
         
-        ssize_t chunk_received = recv(client_socket, buffer_ptr + total_received, chunk_size, 0);
+        ssize_t chunk_received;
+        if (active_io_backend == IO_BACKEND_URING) {
+            chunk_received = (uring_recv_all(client_socket, buffer_ptr + total_received, chunk_size) == 0)
+                ? (ssize_t)chunk_size : -1;
+        } else {
+            chunk_received = recv(client_socket, buffer_ptr + total_received, chunk_size, 0);
+        }
         if (chunk_received <= 0) {
             printf("[FILE-RECV] Connection lost during transfer (received %zd)\n", chunk_received);
-            free(*file_data);
-            *file_data = NULL;
+            file_stage_release(stage);
             return -1;
         }
         
         total_received += chunk_received;
+        file_stage_trim(stage, total_received);
         
         // Show progress
-        int progress = (int)((total_received * 100) / *file_size);
-        if (progress % 10 == 0 || total_received == *file_size) {
+        int progress = (int)((total_received * 100) / file_size);
+        if (progress % 10 == 0 || total_received == file_size) {
             printf("[FILE-RECV] Progress: %zu/%zu bytes (%d%%)\n", 
-                   total_received, *file_size, progress);
+                   total_received, file_size, progress);
         }
     }
     
@@ -208,40 +310,92 @@ int receive_file_from_client(int client_socket, const char *filename, char **fil
     return 0;
 }
 
-int send_file_to_client(int client_socket, const char *filename, const char *sender,
-                       const char *file_data, size_t file_size) {
-    printf("[FILE-SEND] Sending file: %s (%zu bytes) to client\n", filename, file_size);
+// Download header frame and the raw file size go out in one write. A chunked
+// download also names its transfer and the offset its chunks start at.
+static int send_download_header(int client_socket, int protocol, const char *filename,
+                                uint32_t sender_id, const char *sender_name, size_t file_size,
+                                uint32_t transfer_id, size_t offset) {
+    uint8_t raw_size[WIRE_SIZE_LONG];
+    size_t raw_size_len = wire_put_file_size(raw_size, file_size);
+    int header_result;
     
-    // Send file download header message
-    char header[512];
-    snprintf(header, sizeof(header), "FILE_DOWNLOAD:%s:%zu:%s", filename, file_size, sender);
-    if (send_message(client_socket, header) != 0) {
+    if (protocol == WIRE_PROTO_BINARY) {
+        uint8_t frame[MAX_FILENAME_LENGTH + 64];
+        wire_writer_t w;
+        wire_writer_init(&w, frame, sizeof(frame), WIRE_OP_FILE_DOWNLOAD);
+        wire_write_varint(&w, file_size);
+        wire_write_varint(&w, sender_id);
+        wire_write_string(&w, filename, strlen(filename));
+        wire_write_string(&w, sender_name, strlen(sender_name));
+        if (transfer_id) {
+            wire_write_varint(&w, transfer_id);
+            wire_write_varint(&w, offset);
+        }
+        
+        size_t frame_len;
+        const uint8_t *header = wire_writer_finish(&w, &frame_len);
+        if (!header) {
+            printf("[FILE-SEND] Download header too long for %s\n", filename);
+            return -1;
+        }
+        struct iovec iov[2] = {
+            { (void *)header, frame_len },
+            { raw_size, raw_size_len }
+        };
+        header_result = send_iov_all(client_socket, iov, 2);
+    } else {
+        char header[512];
+        int text_len = snprintf(header, sizeof(header), "FILE_DOWNLOAD:%s:%zu:%s", filename, file_size, sender_name);
+        if (transfer_id) {
+            snprintf(header + text_len, sizeof(header) - text_len, ":%u:%zu", transfer_id, offset);
+        }
+        uint32_t header_len = htonl((uint32_t)strlen(header));
+        struct iovec iov[3] = {
+            { &header_len, sizeof(header_len) },
+            { header, strlen(header) },
+            { raw_size, raw_size_len }
+        };
+        header_result = send_iov_all(client_socket, iov, 3);
+    }
+    
+    if (header_result != 0) {
         printf("[FILE-SEND] Failed to send download header\n");
         return -1;
     }
-    
-    // Send file size
-    uint32_t network_size = htonl((uint32_t)file_size);
-    if (send(client_socket, &network_size, sizeof(network_size), 0) != sizeof(network_size)) {
-        printf("[FILE-SEND] Failed to send file size\n");
+    return 0;
+}
+
+static int stream_file_to_client(int client_socket, int protocol, const char *filename,
+                                 uint32_t sender_id, const char *sender_name, file_stage_t *stage) {
+    size_t file_size = stage->size;
+    if (send_download_header(client_socket, protocol, filename, sender_id, sender_name, file_size, 0, 0) != 0) {
         return -1;
     }
     
     // Send file data in chunks
     size_t total_sent = 0;
-    const char *buffer_ptr = file_data;
+    const char *buffer_ptr = stage->data;
+    file_stage_rewind(stage);
+    size_t batch_size = (active_io_backend == IO_BACKEND_URING) ? URING_FILE_BATCH : CHUNK_SIZE;
     
     while (total_sent < file_size) {
         size_t remaining = file_size - total_sent;
-        size_t chunk_size = (remaining < CHUNK_SIZE) ? remaining : CHUNK_SIZE;
+        size_t chunk_size = (remaining < batch_size) ? remaining : batch_size;
         
-        ssize_t sent = send(client_socket, buffer_ptr + total_sent, chunk_size, 0);
+        ssize_t sent;
+        if (active_io_backend == IO_BACKEND_URING) {
+            sent = (uring_send_all(client_socket, buffer_ptr + total_sent, chunk_size) == 0)
+                ? (ssize_t)chunk_size : -1;
+        } else {
+            sent = send(client_socket, buffer_ptr + total_sent, chunk_size, MSG_NOSIGNAL);
+        }
         if (sent <= 0) {
             printf("[FILE-SEND] Connection lost during transfer (sent %zd)\n", sent);
             return -1;
         }
         
         total_sent += sent;
+        file_stage_trim(stage, total_sent);
         
         // Show progress
         int progress = (int)((total_sent * 100) / file_size);
@@ -255,4 +409,869 @@ int send_file_to_client(int client_socket, const char *filename, const char *sen
     return 0;
 }
 
+int send_file_to_client(int client_socket, const char *filename, uint32_t sender_id, const char *sender_name,
+                       file_stage_t *stage) {
+    printf("[FILE-SEND] Sending file: %s (%zu bytes) to client\n", filename, stage->size);
+    
+    // Queued chat frames go first, then the queue holds until the payload is out
+    int protocol;
+    if (connection_begin_raw(client_socket, &protocol) != 0) {
+        printf("[FILE-SEND] Failed to drain pending messages before transfer\n");
+        return -1;
+    }
+    
+    int result = stream_file_to_client(client_socket, protocol, filename, sender_id, sender_name, stage);
+    connection_end_raw(client_socket);
+    return result;
+}
+
+// ==========================================
+// CHUNKED TRANSFERS
+// ==========================================
+
+static int recv_exact(int client_socket, void *buffer, size_t len) {
+    if (active_io_backend == IO_BACKEND_URING) {
+        return uring_recv_all(client_socket, buffer, len);
+    }
+
+    char *ptr = buffer;
+    while (len > 0) {
+        ssize_t received = recv(client_socket, ptr, len, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return -1;
+        }
+        ptr += received;
+        len -= received;
+    }
+    return 0;
+}
+
+// Reads and drops the chunks of an upload that can't be staged, so the
+// sender's stream stays framed
+static int drain_file_chunks(int client_socket, uint32_t transfer_id, size_t offset, size_t file_size) {
+    char buffer[CHUNK_SIZE];
+    
+    while (offset < file_size) {
+        uint8_t header[WIRE_CHUNK_HEADER];
+        uint32_t id, len;
+        uint64_t chunk_offset;
+        if (recv_exact(client_socket, header, sizeof(header)) != 0) {
+            return -1;
+        }
+        wire_get_chunk_header(header, &id, &chunk_offset, &len);
+        if (id != transfer_id || chunk_offset != offset || len == 0 || len > file_size - offset) {
+            return -1;
+        }
+        
+        offset += len;
+        while (len > 0) {
+            uint32_t piece = (len < sizeof(buffer)) ? len : sizeof(buffer);
+            if (recv_exact(client_socket, buffer, piece) != 0) {
+                return -1;
+            }
+            len -= piece;
+        }
+    }
+    return 0;
+}
+
+// Reads the rest of a chunked upload into the entry's stage, from where the
+// last attempt stopped. Returns -1 when the connection broke off, which
+// leaves the entry worth parking, and -2 when the upload can't continue: the
+// file changed size since the last attempt, or the chunks are out of order.
+static int receive_file_chunks(int client_socket, file_resume_t *entry) {
+    size_t file_size;
+    if (receive_file_size(client_socket, entry->filename, &file_size) != 0) {
+        return -1;
+    }
+
+    int resuming = entry->offset > 0;
+    if (resuming && file_size != entry->stage.size) {
+        printf("[FILE-RECV] %s changed size since the interrupted upload (%zu, was %zu)\n",
+               entry->filename, file_size, entry->stage.size);
+        drain_file_chunks(client_socket, entry->id, entry->offset, file_size);
+        return -2;
+    }
+    if (!resuming && file_stage_alloc(&entry->stage, file_size) != 0) {
+        printf("[FILE-RECV] Failed to stage file data\n");
+        drain_file_chunks(client_socket, entry->id, 0, file_size);
+        return -2;
+    }
+
+    if (resuming) {
+        printf("[FILE-RECV] Resuming %s at %zu/%zu bytes\n", entry->filename, entry->offset, file_size);
+    }
+
+    while (entry->offset < file_size) {
+        uint8_t header[WIRE_CHUNK_HEADER];
+        uint32_t transfer_id, len;
+        uint64_t offset;
+        if (recv_exact(client_socket, header, sizeof(header)) != 0) {
+            printf("[FILE-RECV] Connection lost after %zu/%zu bytes\n", entry->offset, file_size);
+            return -1;
+        }
+
+        wire_get_chunk_header(header, &transfer_id, &offset, &len);
+        if (transfer_id != entry->id || offset != entry->offset || len == 0 || len > WIRE_CHUNK_MAX ||
+            len > file_size - entry->offset) {
+            printf("[FILE-RECV] Bad chunk for transfer %u: id %u, %u bytes at %llu\n",
+                   entry->id, transfer_id, len, (unsigned long long)offset);
+            return -2;
+        }
+
+        if (recv_exact(client_socket, entry->stage.data + entry->offset, len) != 0) {
+            printf("[FILE-RECV] Connection lost after %zu/%zu bytes\n", entry->offset, file_size);
+            return -1;
+        }
+        entry->offset += len;
+        file_stage_trim(&entry->stage, entry->offset);
+    }
+
+    printf("[FILE-RECV] Successfully received: %s (%zu bytes)\n", entry->filename, file_size);
+    return 0;
+}
+
+// Sends the entry's staged file from offset on, each chunk addressed so the
+// receiver can write it in place and acknowledge it
+static int send_file_chunks(int client_socket, file_resume_t *entry, size_t offset) {
+    file_stage_t *stage = &entry->stage;
+
+    int protocol;
+    if (connection_begin_raw(client_socket, &protocol) != 0) {
+        printf("[FILE-SEND] Failed to drain pending messages before transfer\n");
+        return -1;
+    }
 
+    int result = send_download_header(client_socket, protocol, entry->filename, entry->sender_user_id,
+                                      entry->sender_username, stage->size, entry->id, offset);
+    file_stage_rewind(stage);
+
+    size_t total_sent = offset;
+    while (result == 0 && total_sent < stage->size) {
+        size_t remaining = stage->size - total_sent;
+        uint32_t len = (remaining < WIRE_CHUNK_MAX) ? remaining : WIRE_CHUNK_MAX;
+
+        uint8_t header[WIRE_CHUNK_HEADER];
+        wire_put_chunk_header(header, entry->id, total_sent, len);
+        struct iovec iov[2] = {
+            { header, sizeof(header) },
+            { stage->data + total_sent, len }
+        };
+        if (send_iov_all(client_socket, iov, 2) != 0) {
+            printf("[FILE-SEND] Connection lost after %zu/%zu bytes\n", total_sent, stage->size);
+            result = -1;
+            break;
+        }
+
+        total_sent += len;
+        entry->offset = total_sent;
+        file_stage_trim(stage, total_sent);
+    }
+
+    connection_end_raw(client_socket);
+    if (result == 0) {
+        printf("[FILE-SEND] Successfully sent: %s (%zu bytes from offset %zu)\n", entry->filename, stage->size, offset);
+    }
+    return result;
+}
+
+// ==========================================
+// STREAMING RELAY
+// ==========================================
+
+static unsigned long thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000ul + (unsigned long)ts.tv_nsec;
+}
+
+// Moves the upload from the sender socket to the receiver socket through a
+// pipe, so the payload never enters user space. Stops early when either side
+// fails or splice() doesn't work on these sockets; *relayed gets the bytes
+// taken from the sender.
+static void splice_relay(int sender_socket, int receiver_socket, size_t file_size, size_t *relayed,
+                         int *sender_ok, int *receiver_ok) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) != 0) {
+        printf("[FILE-RELAY] No pipe for splice, relaying through user space: %s\n", strerror(errno));
+        return;
+    }
+    // The pipe is the relay's only buffer, a failed resize leaves the default
+    fcntl(pipefd[1], F_SETPIPE_SZ, RELAY_BUFFER_SIZE);
+    
+    while (*relayed < file_size) {
+        size_t remaining = file_size - *relayed;
+        size_t chunk_size = (remaining < RELAY_BUFFER_SIZE) ? remaining : RELAY_BUFFER_SIZE;
+        
+        ssize_t received = splice(sender_socket, NULL, pipefd[1], NULL, chunk_size, SPLICE_F_MOVE);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received < 0 && errno == EINVAL && *relayed == 0) {
+            printf("[FILE-RELAY] splice() unsupported, relaying through user space\n");
+            break;
+        }
+        if (received <= 0) {
+            printf("[FILE-RELAY] Sender connection lost after %zu/%zu bytes\n", *relayed, file_size);
+            *sender_ok = 0;
+            break;
+        }
+        
+        size_t pending = received;
+        while (pending > 0) {
+            ssize_t sent = splice(pipefd[0], NULL, receiver_socket, NULL, pending, SPLICE_F_MOVE);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                printf("[FILE-RELAY] Receiver connection lost after %zu/%zu bytes\n", *relayed, file_size);
+                *receiver_ok = 0;
+                break;
+            }
+            pending -= sent;
+        }
+        
+        *relayed += received;
+        if (!*receiver_ok) {
+            break;
+        }
+    }
+    
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
+
+// Forwards the upload to the receiver chunk by chunk as it arrives, so at most
+// RELAY_BUFFER_SIZE bytes of it are held at once. The caller owns the sender's
+// raw section and has already read the size; receiver_socket -1 only drains
+// the upload. Returns -1 if the sender's upload broke off, the receiver's
+// connection is then shut down mid-payload. *delivered says whether the
+// receiver got all of it.
+int relay_file_to_client(int sender_socket, int receiver_socket, const char *filename,
+                         uint32_t sender_id, const char *sender_name, size_t file_size, int *delivered) {
+    *delivered = 0;
+    unsigned long cpu_start = thread_cpu_ns();
+    
+    printf("[FILE-RELAY] Relaying file: %s (%zu bytes)\n", filename, file_size);
+    
+    // Once the receiver fails its bytes are dropped, the rest of the upload
+    // is still read so the sender's stream stays framed
+    int protocol;
+    int receiver_raw = 0;
+    int receiver_ok = 0;
+    if (receiver_socket >= 0) {
+        receiver_raw = connection_begin_raw(receiver_socket, &protocol) == 0;
+        if (receiver_raw) {
+            receiver_ok = send_download_header(receiver_socket, protocol, filename, sender_id, sender_name,
+                                               file_size, 0, 0) == 0;
+        } else {
+            printf("[FILE-RELAY] Failed to drain pending messages before transfer\n");
+        }
+    }
+    
+    size_t total_relayed = 0;
+    int sender_ok = 1;
+    
+    // io_uring keeps the copy path, its file data moves through the ring
+    if (receiver_ok && file_transfer_mode == FILE_TRANSFER_SPLICE && active_io_backend == IO_BACKEND_EPOLL) {
+        splice_relay(sender_socket, receiver_socket, file_size, &total_relayed, &sender_ok, &receiver_ok);
+    }
+    size_t spliced = total_relayed;
+    
+    char *buffer = NULL;
+    if (total_relayed < file_size && !(buffer = malloc(RELAY_BUFFER_SIZE))) {
+        printf("[FILE-RELAY] Failed to allocate relay buffer\n");
+        sender_ok = 0;
+        receiver_ok = 0;
+    }
+    
+    while (sender_ok && total_relayed < file_size) {
+        size_t remaining = file_size - total_relayed;
+        size_t chunk_size = (remaining < RELAY_BUFFER_SIZE) ? remaining : RELAY_BUFFER_SIZE;
+        
+        ssize_t received;
+        if (active_io_backend == IO_BACKEND_URING) {
+            received = (uring_recv_all(sender_socket, buffer, chunk_size) == 0) ? (ssize_t)chunk_size : -1;
+        } else {
+            received = recv(sender_socket, buffer, chunk_size, 0);
+        }
+        if (received <= 0) {
+            printf("[FILE-RELAY] Sender connection lost after %zu/%zu bytes\n", total_relayed, file_size);
+            sender_ok = 0;
+            break;
+        }
+        
+        if (receiver_ok) {
+            struct iovec iov = { buffer, (size_t)received };
+            if (send_iov_all(receiver_socket, &iov, 1) != 0) {
+                printf("[FILE-RELAY] Receiver connection lost after %zu/%zu bytes\n", total_relayed, file_size);
+                receiver_ok = 0;
+            }
+        }
+        
+        total_relayed += received;
+    }
+    
+    // The receiver was promised file_size bytes and the sender can't supply
+    // them, end its stream rather than hand it a file of made-up bytes
+    if (!sender_ok && receiver_ok) {
+        printf("[FILE-RELAY] Aborting download to receiver after %zu/%zu bytes\n", total_relayed, file_size);
+        connection_abort_raw(receiver_socket);
+        receiver_ok = 0;
+    }
+    
+    if (receiver_raw) {
+        connection_end_raw(receiver_socket);
+    }
+    free(buffer);
+    
+    unsigned long cpu_ns = thread_cpu_ns() - cpu_start;
+    __atomic_add_fetch(&relay_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&relay_bytes, total_relayed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&relay_spliced_bytes, spliced, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&relay_cpu_ns, cpu_ns, __ATOMIC_RELAXED);
+    
+    if (sender_ok && receiver_ok) {
+        printf("[FILE-RELAY] Successfully relayed: %s (%zu bytes, %zu spliced, %.2f ms CPU)\n",
+               filename, file_size, spliced, cpu_ns / 1e6);
+        *delivered = 1;
+    }
+    return sender_ok ? 0 : -1;
+}
+
+void file_relay_log_stats(void) {
+    unsigned long bytes = __atomic_load_n(&relay_bytes, __ATOMIC_RELAXED);
+    unsigned long cpu_ns = __atomic_load_n(&relay_cpu_ns, __ATOMIC_RELAXED);
+    double gigabytes = bytes / 1e9;
+    
+    log_message(LOG_SENDFILE, "File relay: %lu transfers, %lu bytes relayed (%lu spliced), %.1f ms CPU per GB",
+               __atomic_load_n(&relay_count, __ATOMIC_RELAXED), bytes,
+               __atomic_load_n(&relay_spliced_bytes, __ATOMIC_RELAXED),
+               gigabytes > 0 ? (cpu_ns / 1e6) / gigabytes : 0.0);
+}
+
+// ==========================================
+// TRANSFER ENGINE
+// ==========================================
+
+static pthread_t transfer_threads[FILE_TRANSFER_WORKERS];
+static int transfer_thread_count = 0;
+
+// Completion notices are queued, never written inline. Once the sender is
+// resumed its socket may close and the number be reused, so they only go
+// out while the descriptor still belongs to the same connection.
+static void notify_sender(const file_queue_item_t *job, const char *message) {
+    connection_t *current = connection_get(job->sender_socket);
+    if (!current || current == job->sender_conn) {
+        send_message(job->sender_socket, message);
+    }
+    if (current) {
+        connection_put(current);
+    }
+}
+
+static void report_transfer_result(const file_queue_item_t *job, size_t file_size, int sent) {
+    if (sent) {
+        char success_msg[512];
+        snprintf(success_msg, sizeof(success_msg), 
+                 "FILE_TRANSFER_SUCCESS File '%.*s' sent successfully to %s (%zu bytes)",
+                 MAX_FILENAME_LENGTH - 1, job->filename, job->receiver_username, file_size);
+        notify_sender(job, success_msg);
+        
+        log_message(LOG_SENDFILE, "Transfer completed: %s -> %s (%s, %zu bytes)", 
+                   job->sender_username, job->receiver_username, job->filename, file_size);
+        green();
+        printf("File transfer completed: %s -> %s (%s)\n",
+               job->sender_username, job->receiver_username, job->filename);
+        reset();
+    } else {
+        char error_msg[512];
+        snprintf(error_msg, sizeof(error_msg), 
+                 "FILE_TRANSFER_FAILED Failed to send '%.*s' to %s",
+                 MAX_FILENAME_LENGTH - 1, job->filename, job->receiver_username);
+        notify_sender(job, error_msg);
+        
+        log_message(LOG_ERROR, "Transfer failed: %s -> %s (%s)", job->sender_username, job->receiver_username, job->filename);
+        red();
+        printf("File transfer failed: %s -> %s (%s)\n",
+               job->sender_username, job->receiver_username, job->filename);
+        reset();
+    }
+}
+
+static void resume_sender(file_queue_item_t *job) {
+    if (job->parked) {
+        job->parked = 0;
+        connection_resume(job->sender_conn);
+    }
+}
+
+// Asks the sender's client to start streaming the file. A chunked upload is
+// told its transfer id and the offset the server already has.
+static int request_file_upload(const file_queue_item_t *job, const file_resume_t *entry) {
+    char upload_request[512];
+    int text_len = snprintf(upload_request, sizeof(upload_request), "FILE_UPLOAD_REQUEST:%.*s:%s",
+                            MAX_FILENAME_LENGTH - 1, job->filename, job->receiver_username);
+    
+    uint8_t body[MAX_FILENAME_LENGTH + 64];
+    wire_writer_t w;
+    wire_writer_init(&w, body, sizeof(body), WIRE_OP_UPLOAD_REQUEST);
+    wire_write_string(&w, job->filename, strlen(job->filename));
+    wire_write_string(&w, job->receiver_username, strlen(job->receiver_username));
+    
+    if (entry) {
+        snprintf(upload_request + text_len, sizeof(upload_request) - text_len, ":%u:%zu", entry->id, entry->offset);
+        wire_write_varint(&w, entry->id);
+        wire_write_varint(&w, entry->offset);
+    }
+    
+    return send_reply(job->sender_socket, upload_request, &w);
+}
+
+// Relay modes: the sender's socket carries the upload until the receiver has all of it.
+// A receiver that never sent /size64 can't be told a size of 4 GB or more,
+// such an upload is drained so the sender's stream stays framed.
+static void relay_transfer(file_queue_item_t *job, int receiver_socket, int receiver_wide) {
+    size_t file_size = 0;
+    if (receive_file_size(job->sender_socket, job->filename, &file_size) != 0) {
+        connection_end_raw(job->sender_socket);
+        log_message(LOG_ERROR, "Failed to receive file data '%s' from user '%s'", job->filename, job->sender_username);
+        notify_sender(job, "ERROR Failed to receive file data");
+        return;
+    }
+    
+    int too_wide = file_size >= WIRE_SIZE_ESCAPE && !receiver_wide;
+    if (too_wide) {
+        log_message(LOG_WARNING, "User '%s' can't take '%s' (%zu bytes) from user '%s', draining the upload",
+                   job->receiver_username, job->filename, file_size, job->sender_username);
+    } else {
+        log_message(LOG_SENDFILE, "Relaying transfer: %s -> %s (%s, %zu bytes)",
+                   job->sender_username, job->receiver_username, job->filename, file_size);
+    }
+    
+    int delivered;
+    int upload_result = relay_file_to_client(job->sender_socket, too_wide ? -1 : receiver_socket, job->filename,
+                                             job->sender_user_id, job->sender_username, file_size, &delivered);
+    connection_end_raw(job->sender_socket);
+    
+    if (too_wide) {
+        char error_msg[256];
+        snprintf(error_msg, sizeof(error_msg), "ERROR %s's client can't receive files of 4 GB or more",
+                 job->receiver_username);
+        notify_sender(job, error_msg);
+    } else if (upload_result != 0) {
+        log_message(LOG_ERROR, "Upload of '%s' from user '%s' broke off during relay", job->filename, job->sender_username);
+        notify_sender(job, "ERROR Failed to receive file data");
+    } else {
+        report_transfer_result(job, file_size, delivered);
+    }
+}
+
+// A chunked download broke off, the receiver gets it offered again on return
+static void report_transfer_interrupted(const file_queue_item_t *job, const file_resume_t *entry) {
+    char interrupted_msg[512];
+    snprintf(interrupted_msg, sizeof(interrupted_msg),
+             "FILE_TRANSFER_INTERRUPTED Sending '%.*s' to %s was interrupted, it resumes when %s reconnects",
+             MAX_FILENAME_LENGTH - 1, job->filename, job->receiver_username, job->receiver_username);
+    notify_sender(job, interrupted_msg);
+    
+    log_message(LOG_WARNING, "Transfer %u interrupted: %s -> %s (%s)",
+               entry->id, job->sender_username, job->receiver_username, job->filename);
+    yellow();
+    printf("File transfer interrupted: %s -> %s (%s), kept for resume\n",
+           job->sender_username, job->receiver_username, job->filename);
+    reset();
+}
+
+// Store mode: once the upload is in memory the sender is free to chat
+// while the download goes out. Chunked transfers stage into a resume entry,
+// which a dropped connection parks instead of throwing away.
+static void store_transfer(file_queue_item_t *job, int receiver_socket, int receiver_chunked, file_resume_t *entry) {
+    file_stage_t stage;
+    int upload_result = entry ? receive_file_chunks(job->sender_socket, entry)
+                              : receive_file_from_client(job->sender_socket, job->filename, &stage);
+    connection_end_raw(job->sender_socket);
+    
+    if (upload_result == -2) {
+        log_message(LOG_ERROR, "Chunked upload of '%s' from user '%s' can't continue", job->filename, job->sender_username);
+        file_resume_release(entry);
+        notify_sender(job, "ERROR Upload could not be staged or resumed, send the file again");
+        return;
+    }
+    if (upload_result != 0) {
+        log_message(LOG_ERROR, "Failed to receive file data '%s' from user '%s'", job->filename, job->sender_username);
+        if (entry) {
+            file_resume_park(entry);
+        }
+        notify_sender(job, "ERROR Failed to receive file data");
+        return;
+    }
+    
+    resume_sender(job);
+    
+    if (entry) {
+        stage = entry->stage;
+    }
+    size_t file_size = stage.size;
+    log_message(LOG_SENDFILE, "Processing transfer: %s -> %s (%s, %zu bytes)",
+               job->sender_username, job->receiver_username, job->filename, file_size);
+    
+    // Receivers that take chunks get a download they can resume
+    if (receiver_chunked) {
+        if (entry) {
+            file_resume_start_send(entry);
+        } else {
+            entry = file_resume_adopt(job, &stage);
+        }
+    } else if (entry) {
+        entry->stage.data = NULL;   // the plain download below owns it now
+        file_resume_release(entry);
+        entry = NULL;
+    }
+    
+    if (!entry) {
+        int sent = send_file_to_client(receiver_socket, job->filename, job->sender_user_id, job->sender_username,
+                                       &stage) == 0;
+        report_transfer_result(job, file_size, sent);
+        file_stage_release(&stage);
+        return;
+    }
+    
+    if (send_file_chunks(receiver_socket, entry, 0) != 0) {
+        report_transfer_interrupted(job, entry);
+        file_resume_park(entry);
+        return;
+    }
+    report_transfer_result(job, file_size, 1);
+    file_resume_release(entry);
+}
+
+// Runs one /sendfile start to finish on the calling thread, job is a copy of
+// the item in the given running slot
+static void run_file_transfer(file_queue_item_t *job, int slot) {
+    // The receiver may have gone while the job was queued. Its connection is
+    // held until the transfer is over so the socket stays the receiver's.
+    client_info_t receiver;
+    connection_t *receiver_conn = find_client_connection(job->receiver_username, &receiver);
+    
+    if (!receiver_conn) {
+        log_message(LOG_WARNING, "Sendfile target '%s' left before the transfer started (from user '%s')",
+                   job->receiver_username, job->sender_username);
+        char error_msg[256];
+        snprintf(error_msg, sizeof(error_msg), "ERROR User '%s' not found or offline", job->receiver_username);
+        notify_sender(job, error_msg);
+        resume_sender(job);
+        return;
+    }
+    
+    int receiver_socket = receiver.socket_fd;
+    
+    // Only stored uploads have a copy to resume from. Without a free entry the
+    // upload goes the plain way.
+    file_resume_t *entry = NULL;
+    if (job->chunked && file_transfer_mode == FILE_TRANSFER_STORE) {
+        entry = file_resume_claim_upload(job);
+    }
+    
+    if (request_file_upload(job, entry) != 0) {
+        log_message(LOG_ERROR, "Failed to send upload request to user '%s'", job->sender_username);
+        notify_sender(job, "ERROR Failed to initiate file transfer");
+        if (entry) {
+            file_resume_park(entry);
+        }
+        resume_sender(job);
+        connection_put(receiver_conn);
+        return;
+    }
+    
+    // The request may still sit in the outbound queue, it has to reach the
+    // client before this thread blocks waiting for the upload
+    int protocol;
+    if (connection_begin_raw(job->sender_socket, &protocol) != 0) {
+        log_message(LOG_ERROR, "Failed to receive file data '%s' from user '%s'", job->filename, job->sender_username);
+        notify_sender(job, "ERROR Failed to receive file data");
+        if (entry) {
+            file_resume_park(entry);
+        }
+        resume_sender(job);
+        connection_put(receiver_conn);
+        return;
+    }
+    
+    pthread_mutex_lock(&global_file_queue.mutex);
+    global_file_queue.running[slot].receiver_socket = receiver_socket;
+    pthread_mutex_unlock(&global_file_queue.mutex);
+    
+    if (file_transfer_mode == FILE_TRANSFER_STORE) {
+        store_transfer(job, receiver_socket, receiver.chunked_transfers, entry);
+    } else {
+        relay_transfer(job, receiver_socket, receiver.wide_file_sizes);
+    }
+    resume_sender(job);
+    connection_put(receiver_conn);
+}
+
+// A /resume from a receiver that came back: sends what it is missing of a
+// parked download. The job's sender fields are the receiver's connection.
+static void run_resumed_download(file_queue_item_t *job, int slot) {
+    file_resume_t *entry = file_resume_claim_send(job->resume_id, job->receiver_username, job->resume_offset);
+    if (!entry) {
+        notify_sender(job, "ERROR Interrupted transfer not found or already resumed");
+        return;
+    }
+    
+    size_t file_size = entry->stage.size;
+    size_t offset = (job->resume_offset < file_size) ? job->resume_offset : file_size;
+    
+    pthread_mutex_lock(&global_file_queue.mutex);
+    global_file_queue.running[slot].receiver_socket = job->sender_socket;
+    pthread_mutex_unlock(&global_file_queue.mutex);
+    
+    log_message(LOG_SENDFILE, "Resuming transfer %u: %s -> %s (%s, at %zu/%zu bytes)",
+               entry->id, job->sender_username, job->receiver_username, job->filename, offset, file_size);
+    
+    if (send_file_chunks(job->sender_socket, entry, offset) != 0) {
+        log_message(LOG_WARNING, "Resumed transfer %u interrupted again", entry->id);
+        file_resume_park(entry);
+        return;
+    }
+    file_resume_release(entry);
+    
+    // The original sender hears about it if still around
+    client_info_t sender;
+    connection_t *sender_conn = find_client_connection(job->sender_username, &sender);
+    if (sender_conn) {
+        char success_msg[512];
+        snprintf(success_msg, sizeof(success_msg),
+                 "FILE_TRANSFER_SUCCESS File '%.*s' sent successfully to %s (%zu bytes, resumed at %zu)",
+                 MAX_FILENAME_LENGTH - 1, job->filename, job->receiver_username, file_size, offset);
+        send_message(sender.socket_fd, success_msg);
+        connection_put(sender_conn);
+    }
+    
+    log_message(LOG_SENDFILE, "Transfer completed: %s -> %s (%s, %zu bytes, resumed at %zu)",
+               job->sender_username, job->receiver_username, job->filename, file_size, offset);
+    green();
+    printf("File transfer completed: %s -> %s (%s, resumed)\n",
+           job->sender_username, job->receiver_username, job->filename);
+    reset();
+}
+
+static void run_job(file_queue_item_t *job, int slot) {
+    if (job->resume_id) {
+        run_resumed_download(job, slot);
+    } else {
+        run_file_transfer(job, slot);
+    }
+}
+
+// Caller holds the queue mutex. Jobs an idle worker is about to take are
+// left out, everyone else hears where they stand.
+static void notify_queue_position(const file_queue_item_t *item, int position) {
+    if (!global_file_queue.notify_position || position <= global_file_queue.idle_workers) {
+        return;
+    }
+    
+    char queued_msg[512];
+    snprintf(queued_msg, sizeof(queued_msg), "FILE_QUEUED Transfer of '%.*s' to %s queued, position %d",
+             MAX_FILENAME_LENGTH - 1, item->filename, item->receiver_username, position);
+    notify_sender(item, queued_msg);
+}
+
+static void *file_transfer_worker(void *arg) {
+    int slot = (int)(intptr_t)arg;
+    
+    // SIGINT belongs to the main thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    
+    pthread_mutex_lock(&global_file_queue.mutex);
+    while (!global_file_queue.stopping) {
+        if (global_file_queue.count == 0) {
+            global_file_queue.idle_workers++;
+            pthread_cond_wait(&global_file_queue.job_ready, &global_file_queue.mutex);
+            global_file_queue.idle_workers--;
+            continue;
+        }
+        
+        file_queue_item_t job = *take_from_file_queue(slot);
+        for (int i = 0; i < global_file_queue.count; i++) {
+            notify_queue_position(file_queue_waiting_item(i), i + 1);
+        }
+        pthread_mutex_unlock(&global_file_queue.mutex);
+        
+        run_job(&job, slot);
+        connection_put(job.sender_conn);
+        
+        pthread_mutex_lock(&global_file_queue.mutex);
+        release_running_slot(slot);
+    }
+    pthread_mutex_unlock(&global_file_queue.mutex);
+    return NULL;
+}
+
+// Queues a job from the connection's own handler. With transfer workers
+// running a parking job's connection sits out until its upload has been
+// read, if none could be started the job runs right here. This runs on a
+// shared command worker, so a full queue turns the request down with EBUSY
+// at once rather than holding the worker.
+static int submit_job(connection_t *conn, file_queue_item_t *item_in, int park) {
+    file_queue_item_t item = *item_in;
+    item.created_time = time(NULL);
+    clock_gettime(CLOCK_MONOTONIC, &item.queued_at);
+    item.sender_socket = conn->fd;
+    item.receiver_socket = -1;
+    item.sender_conn = conn;
+    
+    pthread_mutex_lock(&global_file_queue.mutex);
+    
+    if (transfer_thread_count == 0 || global_file_queue.stopping) {
+        // Inline transfers only need a running slot
+        if (running_full()) {
+            global_file_queue.full_rejects++;
+            pthread_mutex_unlock(&global_file_queue.mutex);
+            errno = EBUSY;
+            return -1;
+        }
+        int slot = 0;
+        while (global_file_queue.running[slot].active) {
+            slot++;
+        }
+        item.active = 1;
+        global_file_queue.running[slot] = item;
+        global_file_queue.running_count++;
+        pthread_mutex_unlock(&global_file_queue.mutex);
+        
+        run_job(&item, slot);
+        
+        pthread_mutex_lock(&global_file_queue.mutex);
+        release_running_slot(slot);
+        pthread_mutex_unlock(&global_file_queue.mutex);
+        return 0;
+    }
+    
+    if (ring_full()) {
+        global_file_queue.full_rejects++;
+        pthread_mutex_unlock(&global_file_queue.mutex);
+        errno = EBUSY;
+        return -1;
+    }
+    
+    // One reference keeps the connection around for the completion notice,
+    // a parked one has another that connection_resume() hands back
+    item.sender_conn = connection_get(conn->fd);
+    if (item.sender_conn != conn) {
+        if (item.sender_conn) {
+            connection_put(item.sender_conn);
+        }
+        pthread_mutex_unlock(&global_file_queue.mutex);
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (park) {
+        connection_get(conn->fd);
+        item.parked = 1;
+    }
+    
+    add_to_file_queue(&item);
+    notify_queue_position(&item, global_file_queue.count);
+    if (park) {
+        connection_park(conn);
+    }
+    pthread_cond_signal(&global_file_queue.job_ready);
+    pthread_mutex_unlock(&global_file_queue.mutex);
+    return 0;
+}
+
+// A /sendfile: the sender's connection is parked until its upload is in
+int submit_file_transfer(connection_t *conn, const char *filename, const char *receiver_name) {
+    file_queue_item_t item;
+    memset(&item, 0, sizeof(item));
+    
+    strncpy(item.filename, filename, sizeof(item.filename) - 1);
+    strncpy(item.sender_username, conn->client->username, sizeof(item.sender_username) - 1);
+    strncpy(item.receiver_username, receiver_name, sizeof(item.receiver_username) - 1);
+    item.sender_user_id = conn->client->user_id;
+    item.chunked = conn->client->chunked_transfers;
+    
+    return submit_job(conn, &item, 1);
+}
+
+// A /resume: the receiver keeps chatting while the rest of the download
+// queues, the chunks go out through its outbound queue's raw section
+int submit_file_resume(connection_t *conn, uint32_t transfer_id, size_t offset) {
+    file_queue_item_t item;
+    memset(&item, 0, sizeof(item));
+    
+    if (file_resume_lookup_send(transfer_id, conn->client->username, &item) != 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    strncpy(item.receiver_username, conn->client->username, sizeof(item.receiver_username) - 1);
+    item.chunked = 1;
+    item.resume_id = transfer_id;
+    item.resume_offset = offset;
+    
+    return submit_job(conn, &item, 0);
+}
+
+int start_file_transfer_workers(int count) {
+    pthread_mutex_lock(&global_file_queue.mutex);
+    global_file_queue.stopping = 0;
+    
+    for (int i = 0; i < count && i < FILE_TRANSFER_WORKERS; i++) {
+        if (pthread_create(&transfer_threads[i], NULL, file_transfer_worker, (void *)(intptr_t)i) != 0) {
+            log_message(LOG_ERROR, "Failed to start file transfer worker %d", i);
+            break;
+        }
+        transfer_thread_count++;
+    }
+    
+    int started = transfer_thread_count;
+    pthread_mutex_unlock(&global_file_queue.mutex);
+    
+    if (started == 0) {
+        return -1;
+    }
+    log_message(LOG_SERVER, "Started %d file transfer workers", started);
+    return 0;
+}
+
+void stop_file_transfer_workers(void) {
+    pthread_mutex_lock(&global_file_queue.mutex);
+    
+    int count = transfer_thread_count;
+    if (count == 0) {
+        pthread_mutex_unlock(&global_file_queue.mutex);
+        return;
+    }
+    
+    // Running transfers block on their sockets, cut them loose
+    global_file_queue.stopping = 1;
+    for (int i = 0; i < count; i++) {
+        file_queue_item_t *item = &global_file_queue.running[i];
+        if (item->active) {
+            shutdown(item->sender_socket, SHUT_RDWR);
+            if (item->receiver_socket >= 0) {
+                shutdown(item->receiver_socket, SHUT_RDWR);
+            }
+        }
+    }
+    pthread_cond_broadcast(&global_file_queue.job_ready);
+    pthread_mutex_unlock(&global_file_queue.mutex);
+    
+    for (int i = 0; i < count; i++) {
+        pthread_join(transfer_threads[i], NULL);
+    }
+    
+    pthread_mutex_lock(&global_file_queue.mutex);
+    transfer_thread_count = 0;
+    pthread_mutex_unlock(&global_file_queue.mutex);
+    
+    log_message(LOG_SERVER, "File transfer workers stopped");
+}
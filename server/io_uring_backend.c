@@ -0,0 +1,882 @@
+// io_uring_backend.c - Optional completion-based I/O backend (raw syscalls, no liburing)
+//
+// The ring thread only accepts and reaps. A completed receive or POLLOUT is
+// handed to the worker pool like an epoll event, and the worker re-arms the
+// connection through reactor_arm() when it lets go.
+
+#define _GNU_SOURCE
+#include "server_helper.h"
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <poll.h>
+
+#define URING_LOOP_ENTRIES 1024
+#define URING_SYNC_ENTRIES 64
+
+#define URING_BUF_GROUP 1
+#define URING_BUF_COUNT 512            // must be a power of two
+#define URING_BUF_SIZE  8192
+
+// Connection pointers are aligned, so odd values are free and bit 1 tags
+// a POLLOUT request
+#define URING_UD_ACCEPT  1ULL
+#define URING_UD_CANCEL  3ULL
+#define URING_UD_POLLOUT 2ULL
+#define URING_UD_WAKE    4ULL
+
+// Sync batches tag their requests with the iov index, so the cancel that
+// takes a batch down needs a tag past the last one
+#define URING_UD_BATCH_CANCEL ((uint64_t)URING_SYNC_ENTRIES)
+
+#define URING_OP_RECV    1             // connection_t.ring_ops bits
+#define URING_OP_POLLOUT 2
+
+typedef struct {
+    int fd;
+    unsigned features;
+
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_local_tail;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    size_t sqes_size;
+} uring_t;
+
+static uring_t loop_ring = { .fd = -1 };
+static pthread_mutex_t loop_sq_mutex = PTHREAD_MUTEX_INITIALIZER;   // workers arm requests while the ring thread waits
+static int requests_in_flight = 0;     // connection requests, each holding a reference
+
+// Synchronous helpers run on whichever thread moves file data, so each
+// thread gets its own small ring, torn down when the thread exits
+static pthread_key_t thread_ring_key;
+static pthread_once_t thread_ring_once = PTHREAD_ONCE_INIT;
+
+static struct io_uring_buf_ring *buf_ring = NULL;
+static char *buf_base = NULL;
+static unsigned short buf_ring_tail = 0;
+static pthread_mutex_t buf_ring_mutex = PTHREAD_MUTEX_INITIALIZER;  // workers hand buffers back too
+
+static int accept_armed = 0;
+static int pool_running = 0;
+
+// The completion loop is a single shard of its own
+static reactor_shard_t uring_shard;
+
+
+
+static int uring_setup(uring_t *r, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return -1;
+    }
+
+    r->fd = fd;
+    r->features = params.features;
+    r->sq_entries = params.sq_entries;
+
+    r->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_size > r->sq_map_size) {
+            r->sq_map_size = r->cq_map_size;
+        }
+        r->cq_map_size = r->sq_map_size;
+    }
+
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        close(fd);
+        r->fd = -1;
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+    } else {
+        r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            munmap(r->sq_map, r->sq_map_size);
+            close(fd);
+            r->fd = -1;
+            return -1;
+        }
+    }
+
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (r->cq_map != r->sq_map) {
+            munmap(r->cq_map, r->cq_map_size);
+        }
+        munmap(r->sq_map, r->sq_map_size);
+        close(fd);
+        r->fd = -1;
+        return -1;
+    }
+
+    char *sq = r->sq_map;
+    char *cq = r->cq_map;
+    r->sq_head = (unsigned *)(sq + params.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + params.sq_off.array);
+    r->sq_local_tail = *r->sq_tail;
+    r->cq_head = (unsigned *)(cq + params.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+static void uring_teardown(uring_t *r) {
+    if (r->fd < 0) {
+        return;
+    }
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_map != r->sq_map) {
+        munmap(r->cq_map, r->cq_map_size);
+    }
+    munmap(r->sq_map, r->sq_map_size);
+    close(r->fd);
+    r->fd = -1;
+}
+
+// Submits what was queued and optionally waits. Only the thread that owns
+// the submission queue, or holds loop_sq_mutex for the loop ring, calls it.
+static int uring_enter(uring_t *r, unsigned min_complete) {
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0;
+
+    if (to_submit == 0 && min_complete == 0) {
+        return 0;
+    }
+    return syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Waits for a completion without touching the submission queue
+static int uring_wait(uring_t *r, struct __kernel_timespec *timeout) {
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)timeout;
+    return syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                   &arg, sizeof(arg));
+}
+
+static struct io_uring_sqe* uring_get_sqe(uring_t *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    if (r->sq_local_tail - head >= r->sq_entries) {
+        uring_enter(r, 0);
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sq_local_tail - head >= r->sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned index = r->sq_local_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[index] = index;
+    r->sq_local_tail++;
+    return sqe;
+}
+
+// Copies out the next completion, if any, and hands the slot back to the kernel
+static int uring_next_cqe(uring_t *r, struct io_uring_cqe *out) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    *out = r->cqes[head & *r->cq_mask];
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+
+// ==========================================
+// SYNCHRONOUS HELPERS
+// ==========================================
+
+static void thread_ring_destroy(void *arg) {
+    uring_t *r = arg;
+    uring_teardown(r);
+    free(r);
+}
+
+static void thread_ring_key_init(void) {
+    pthread_key_create(&thread_ring_key, thread_ring_destroy);
+}
+
+static uring_t* get_thread_ring(void) {
+    pthread_once(&thread_ring_once, thread_ring_key_init);
+
+    uring_t *r = pthread_getspecific(thread_ring_key);
+    if (r) {
+        return r;
+    }
+
+    r = malloc(sizeof(uring_t));
+    if (!r) {
+        return NULL;
+    }
+    if (uring_setup(r, URING_SYNC_ENTRIES) != 0) {
+        free(r);
+        return NULL;
+    }
+
+    pthread_setspecific(thread_ring_key, r);
+    return r;
+}
+
+static void drop_thread_ring(void) {
+    pthread_once(&thread_ring_once, thread_ring_key_init);
+
+    uring_t *r = pthread_getspecific(thread_ring_key);
+    if (r) {
+        pthread_setspecific(thread_ring_key, NULL);
+        thread_ring_destroy(r);
+    }
+}
+
+// After a failed enter: entries the kernel never consumed are taken back,
+// the ones it did are cancelled. Returns how many completions are still
+// owed, the cancel request's own included.
+static int uring_cancel_batch(uring_t *r, unsigned batch_start, int queued) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    int consumed = (int)(head - batch_start);
+
+    if (consumed < queued) {
+        r->sq_local_tail = head;
+        __atomic_store_n(r->sq_tail, head, __ATOMIC_RELEASE);
+    }
+    if (consumed <= 0) {
+        return 0;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (!sqe) {
+        return consumed;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = URING_UD_BATCH_CANCEL;
+    return consumed + 1;
+}
+
+// Runs a batch of linked SEND/RECV operations with a single io_uring_enter.
+// A short transfer breaks the link, so whatever is left is finished with
+// plain syscalls. Returns 0 when every byte was moved. Every completion of
+// the batch is reaped before returning, even on failure: the kernel must be
+// done with iov and the next batch must not see stale ones.
+static int uring_run_linked(int fd, int opcode, const struct iovec *iov, int iovcnt) {
+    uring_t *r = get_thread_ring();
+    if (!r || iovcnt > URING_SYNC_ENTRIES) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // A full ring only shortens the batch, the plain loop below moves the rest
+    unsigned batch_start = r->sq_local_tail;
+    struct io_uring_sqe *last = NULL;
+    int queued = 0;
+    while (queued < iovcnt) {
+        struct io_uring_sqe *sqe = uring_get_sqe(r);
+        if (!sqe) {
+            break;
+        }
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)iov[queued].iov_base;
+        sqe->len = iov[queued].iov_len;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = queued;
+        sqe->flags = IOSQE_IO_LINK;
+        last = sqe;
+        queued++;
+    }
+    if (last) {
+        last->flags = 0;
+    }
+
+    int owed = queued;
+    int reaped = 0;
+    size_t done[URING_SYNC_ENTRIES];
+    int failed = 0;
+    int enter_errno = 0;
+    memset(done, 0, sizeof(done));
+
+    while (reaped < owed) {
+        int ret = uring_enter(r, owed - reaped);
+        if (ret < 0 && errno != EINTR && errno != EBUSY) {
+            if (enter_errno) {
+                // Nothing can be waited for on this ring any more, closing
+                // it is the last way to take the requests down
+                drop_thread_ring();
+                errno = enter_errno;
+                return -1;
+            }
+            enter_errno = errno;
+            failed = 1;
+            owed = uring_cancel_batch(r, batch_start, queued);
+            continue;
+        }
+
+        struct io_uring_cqe cqe;
+        while (uring_next_cqe(r, &cqe)) {
+            reaped++;
+            if (cqe.user_data == URING_UD_BATCH_CANCEL) {
+                continue;
+            }
+            if (cqe.res > 0) {
+                done[cqe.user_data] = cqe.res;
+            } else if (cqe.res < 0 && cqe.res != -ECANCELED) {
+                errno = -cqe.res;
+                failed = 1;
+            } else if (cqe.res == 0 && opcode == IORING_OP_RECV && iov[cqe.user_data].iov_len > 0) {
+                errno = ECONNRESET;
+                failed = 1;
+            }
+        }
+    }
+
+    if (failed) {
+        if (enter_errno) {
+            errno = enter_errno;
+        }
+        return -1;
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        char *ptr = iov[i].iov_base;
+        while (done[i] < iov[i].iov_len) {
+            ssize_t n = (opcode == IORING_OP_SEND)
+                ? send(fd, ptr + done[i], iov[i].iov_len - done[i], MSG_NOSIGNAL)
+                : recv(fd, ptr + done[i], iov[i].iov_len - done[i], 0);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n == 0) {
+                    errno = ECONNRESET;
+                }
+                return -1;
+            }
+            done[i] += n;
+        }
+    }
+
+    return 0;
+}
+
+int uring_send_iov(int fd, const struct iovec *iov, int iovcnt) {
+    return uring_run_linked(fd, IORING_OP_SEND, iov, iovcnt);
+}
+
+// Splits a large buffer into CHUNK_SIZE pieces submitted as linked batches
+static int uring_transfer_all(int fd, int opcode, char *ptr, size_t len) {
+    struct iovec iov[URING_SYNC_ENTRIES];
+
+    while (len > 0) {
+        int count = 0;
+        while (len > 0 && count < URING_SYNC_ENTRIES) {
+            size_t piece = (len < CHUNK_SIZE) ? len : CHUNK_SIZE;
+            iov[count].iov_base = ptr;
+            iov[count].iov_len = piece;
+            ptr += piece;
+            len -= piece;
+            count++;
+        }
+        if (uring_run_linked(fd, opcode, iov, count) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int uring_send_all(int fd, const void *buf, size_t len) {
+    return uring_transfer_all(fd, IORING_OP_SEND, (char *)buf, len);
+}
+
+int uring_recv_all(int fd, void *buf, size_t len) {
+    return uring_transfer_all(fd, IORING_OP_RECV, buf, len);
+}
+
+
+
+// ==========================================
+// COMPLETION LOOP
+// ==========================================
+
+static void buf_ring_recycle(unsigned short bid) {
+    pthread_mutex_lock(&buf_ring_mutex);
+    struct io_uring_buf *buf = &buf_ring->bufs[buf_ring_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(buf_base + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    buf_ring_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_ring_tail, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&buf_ring_mutex);
+}
+
+static int setup_buffer_ring(void) {
+    size_t ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    buf_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring == MAP_FAILED) {
+        buf_ring = NULL;
+        return -1;
+    }
+
+    buf_base = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (!buf_base) {
+        munmap(buf_ring, ring_size);
+        buf_ring = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+
+    if (syscall(__NR_io_uring_register, loop_ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        free(buf_base);
+        buf_base = NULL;
+        munmap(buf_ring, ring_size);
+        buf_ring = NULL;
+        return -1;
+    }
+
+    buf_ring_tail = 0;
+    for (unsigned i = 0; i < URING_BUF_COUNT; i++) {
+        buf_ring_recycle(i);
+    }
+
+    return 0;
+}
+
+static void arm_accept(void) {
+    pthread_mutex_lock(&loop_sq_mutex);
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop_ring);
+    if (sqe) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = server_socket;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = URING_UD_ACCEPT;
+        accept_armed = 1;
+        uring_enter(&loop_ring, 0);
+    }
+    pthread_mutex_unlock(&loop_sq_mutex);
+}
+
+// SIGINT writes the shutdown eventfd, this poll ends the wait so the loop
+// sees server_running drop
+static void arm_wake(void) {
+    if (shutdown_event_fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&loop_sq_mutex);
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop_ring);
+    if (sqe) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = shutdown_event_fd;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = URING_UD_WAKE;
+        uring_enter(&loop_ring, 0);
+    }
+    pthread_mutex_unlock(&loop_sq_mutex);
+}
+
+// Single-shot on purpose: a multishot recv would keep reading in the
+// background and steal bytes from the synchronous file upload path.
+// Caller holds io_mutex and loop_sq_mutex.
+static int arm_recv(connection_t *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop_ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = (uint64_t)(uintptr_t)conn;
+
+    conn->ring_ops |= URING_OP_RECV;
+    connection_hold(conn);
+    __atomic_add_fetch(&requests_in_flight, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Caller holds io_mutex and loop_sq_mutex
+static int arm_pollout(connection_t *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop_ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | URING_UD_POLLOUT;
+
+    conn->ring_ops |= URING_OP_POLLOUT;
+    connection_hold(conn);
+    __atomic_add_fetch(&requests_in_flight, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Backs reactor_arm(). A ring has no registration to modify, so each kind of
+// readiness the connection waits for is a request of its own, armed unless
+// one is already in flight. Caller holds io_mutex and no worker owns the
+// connection, which keeps reads to one reader at a time.
+int uring_arm(connection_t *conn) {
+    if (conn->closed) {
+        return 0;
+    }
+
+    int wanted = URING_OP_RECV;
+    if (conn->out_count > 0 && !conn->out_raw) {
+        wanted |= URING_OP_POLLOUT;
+    }
+    wanted &= ~conn->ring_ops;
+    if (!wanted) {
+        return 0;
+    }
+
+    int result = 0;
+    pthread_mutex_lock(&loop_sq_mutex);
+    if ((wanted & URING_OP_RECV) && arm_recv(conn) != 0) {
+        result = -1;
+    }
+    if ((wanted & URING_OP_POLLOUT) && arm_pollout(conn) != 0) {
+        result = -1;
+    }
+    // A failed submit leaves the entries queued, the ring thread retries
+    uring_enter(&loop_ring, 0);
+    pthread_mutex_unlock(&loop_sq_mutex);
+
+    if (result != 0) {
+        log_message(LOG_ERROR, "Submission queue full, cannot arm socket %d", conn->fd);
+    }
+    return result;
+}
+
+// Copies what a completed receive left on the connection into the free
+// space of its input ring and hands the buffer back once it is empty.
+// Returns the bytes copied, 0 when nothing was waiting.
+ssize_t uring_take_input(connection_t *conn, const struct iovec *iov, int iovcnt) {
+    pthread_mutex_lock(&conn->io_mutex);
+
+    int bid = conn->ring_buffer;
+    if (bid < 0) {
+        pthread_mutex_unlock(&conn->io_mutex);
+        return 0;
+    }
+
+    const char *data = buf_base + (size_t)bid * URING_BUF_SIZE;
+    size_t copied = 0;
+    for (int i = 0; i < iovcnt && conn->ring_buffer_offset < conn->ring_buffer_len; i++) {
+        size_t left = conn->ring_buffer_len - conn->ring_buffer_offset;
+        size_t take = (left < iov[i].iov_len) ? left : iov[i].iov_len;
+        memcpy(iov[i].iov_base, data + conn->ring_buffer_offset, take);
+        conn->ring_buffer_offset += take;
+        copied += take;
+    }
+
+    if (conn->ring_buffer_offset == conn->ring_buffer_len) {
+        conn->ring_buffer = -1;
+        buf_ring_recycle(bid);
+    }
+
+    pthread_mutex_unlock(&conn->io_mutex);
+    return copied;
+}
+
+// Caller holds io_mutex
+void uring_release_input(connection_t *conn) {
+    if (conn->ring_buffer >= 0) {
+        buf_ring_recycle(conn->ring_buffer);
+        conn->ring_buffer = -1;
+    }
+}
+
+// Caller holds io_mutex, released here along with the request's reference.
+// The completion goes to a worker like an epoll event, or is folded into
+// the job that already owns the connection.
+static void complete_request(connection_t *conn, uint32_t events) {
+    __atomic_sub_fetch(&requests_in_flight, 1, __ATOMIC_RELAXED);
+
+    if (conn->closed || conn->busy) {
+        if (!conn->closed) {
+            conn->pending_events |= events;
+        }
+        pthread_mutex_unlock(&conn->io_mutex);
+        connection_put(conn);
+        return;
+    }
+
+    conn->busy = 1;
+    pthread_mutex_unlock(&conn->io_mutex);
+
+    if (worker_pool_submit(conn, events) != 0) {
+        connection_put(conn);
+    }
+}
+
+static void handle_accept(const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        accept_armed = 0;
+    }
+
+    if (cqe->res < 0) {
+        if (cqe->res != -EINTR && cqe->res != -ECONNABORTED && cqe->res != -ECANCELED) {
+            log_message(LOG_ERROR, "Failed to accept client connection: %s", strerror(-cqe->res));
+        }
+        return;
+    }
+
+    int client_socket = cqe->res;
+    if (!server_running) {
+        close(client_socket);
+        return;
+    }
+
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    char client_ip[INET_ADDRSTRLEN] = "unknown";
+    int client_port = 0;
+
+    if (getpeername(client_socket, (struct sockaddr *)&client_addr, &client_len) == 0) {
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+        client_port = ntohs(client_addr.sin_port);
+    }
+
+    connection_t *conn = connection_create(&uring_shard, client_socket, client_ip, client_port);
+    if (!conn) {
+        log_message(LOG_ERROR, "Memory allocation failed for connection from %s:%d", client_ip, client_port);
+        close(client_socket);
+        return;
+    }
+
+    uring_shard.accepted_count++;
+
+    pthread_mutex_lock(&conn->io_mutex);
+    int armed = uring_arm(conn);
+    pthread_mutex_unlock(&conn->io_mutex);
+    if (armed != 0) {
+        log_message(LOG_ERROR, "Dropping connection from %s:%d", client_ip, client_port);
+        connection_close(conn);
+        return;
+    }
+
+    cyan();
+    printf("New client connected from %s:%d\n", client_ip, client_port);
+    reset();
+    log_message(LOG_CLIENT, "New connection from %s:%d (socket %d)", client_ip, client_port, client_socket);
+    log_message(LOG_CLIENT, "Starting login process for client %s:%d", client_ip, client_port);
+}
+
+// The bytes stay in the provided buffer until the worker copies them out,
+// the worker then drains the rest of the socket itself. Without a buffer
+// (ENOBUFS) the completion is just a readiness event.
+static void handle_recv(connection_t *conn, const struct io_uring_cqe *cqe) {
+    uint32_t events = EPOLLIN;
+
+    if (cqe->res == 0) {
+        events |= EPOLLRDHUP;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+        log_message(LOG_ERROR, "recv failed for socket %d: %s", conn->fd, strerror(-cqe->res));
+        events |= EPOLLERR;
+    }
+
+    pthread_mutex_lock(&conn->io_mutex);
+    conn->ring_ops &= ~URING_OP_RECV;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (conn->closed || cqe->res <= 0) {
+            buf_ring_recycle(bid);
+        } else {
+            conn->ring_buffer = bid;
+            conn->ring_buffer_offset = 0;
+            conn->ring_buffer_len = cqe->res;
+        }
+    }
+
+    complete_request(conn, events);
+}
+
+static void handle_pollout(connection_t *conn, const struct io_uring_cqe *cqe) {
+    pthread_mutex_lock(&conn->io_mutex);
+    conn->ring_ops &= ~URING_OP_POLLOUT;
+    complete_request(conn, cqe->res < 0 ? EPOLLOUT | EPOLLERR : EPOLLOUT);
+}
+
+static void reap_completions(void) {
+    struct io_uring_cqe cqe;
+    while (uring_next_cqe(&loop_ring, &cqe)) {
+        if (cqe.user_data == URING_UD_ACCEPT) {
+            handle_accept(&cqe);
+        } else if (cqe.user_data == URING_UD_CANCEL || cqe.user_data == URING_UD_WAKE) {
+            continue;
+        } else if (cqe.user_data & URING_UD_POLLOUT) {
+            handle_pollout((connection_t *)(uintptr_t)(cqe.user_data & ~URING_UD_POLLOUT), &cqe);
+        } else {
+            handle_recv((connection_t *)(uintptr_t)cqe.user_data, &cqe);
+        }
+    }
+}
+
+// Requests still in flight hold connection references. Cancel them and
+// reap the completions so those connections are freed before the ring goes.
+static void cancel_pending_requests(void) {
+    pthread_mutex_lock(&loop_sq_mutex);
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop_ring);
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+        sqe->user_data = URING_UD_CANCEL;
+    }
+    uring_enter(&loop_ring, 0);
+    pthread_mutex_unlock(&loop_sq_mutex);
+
+    time_t deadline = time(NULL) + 2;
+    while (__atomic_load_n(&requests_in_flight, __ATOMIC_RELAXED) > 0 && time(NULL) < deadline) {
+        struct __kernel_timespec timeout = { .tv_sec = 0, .tv_nsec = 100000000 };
+        uring_wait(&loop_ring, &timeout);
+        reap_completions();
+    }
+
+    int left = __atomic_load_n(&requests_in_flight, __ATOMIC_RELAXED);
+    if (left > 0) {
+        log_message(LOG_WARNING, "%d io_uring requests still in flight at shutdown", left);
+    }
+}
+
+int uring_backend_init(int worker_count) {
+    memset(&uring_shard, 0, sizeof(uring_shard));
+    uring_shard.listen_fd = server_socket;
+    uring_shard.epoll_fd = -1;
+    pthread_mutex_init(&uring_shard.connection_mutex, NULL);
+
+    if (uring_setup(&loop_ring, URING_LOOP_ENTRIES) != 0) {
+        log_message(LOG_WARNING, "io_uring unavailable: %s", strerror(errno));
+        return -1;
+    }
+
+    if (!(loop_ring.features & IORING_FEAT_EXT_ARG)) {
+        log_message(LOG_WARNING, "io_uring lacks timed waits on this kernel");
+        uring_teardown(&loop_ring);
+        return -1;
+    }
+
+    if (setup_buffer_ring() != 0) {
+        log_message(LOG_WARNING, "io_uring provided buffer rings unsupported: %s", strerror(errno));
+        uring_teardown(&loop_ring);
+        return -1;
+    }
+
+    // Make sure the synchronous send path works on this thread before committing
+    if (!get_thread_ring()) {
+        log_message(LOG_WARNING, "io_uring send ring setup failed: %s", strerror(errno));
+        uring_backend_cleanup();
+        return -1;
+    }
+
+    if (worker_pool_init(worker_count, WORKER_QUEUE_CAPACITY) != 0) {
+        uring_backend_cleanup();
+        return -1;
+    }
+    pool_running = 1;
+
+    arm_accept();
+    arm_wake();
+    log_message(LOG_SERVER, "io_uring backend initialized (%d buffers of %d bytes)", URING_BUF_COUNT, URING_BUF_SIZE);
+    return 0;
+}
+
+void uring_backend_run(void) {
+    time_t last_stats = time(NULL);
+
+    while (server_running) {
+        if (!accept_armed) {
+            arm_accept();
+        }
+
+        // Entries a worker queued while a submit failed
+        pthread_mutex_lock(&loop_sq_mutex);
+        uring_enter(&loop_ring, 0);
+        pthread_mutex_unlock(&loop_sq_mutex);
+
+        struct __kernel_timespec timeout = { .tv_sec = 1, .tv_nsec = 0 };
+        int ret = uring_wait(&loop_ring, &timeout);
+        if (ret < 0 && errno != EINTR && errno != ETIME && errno != EBUSY) {
+            log_message(LOG_ERROR, "io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+
+        reap_completions();
+
+        if (time(NULL) - last_stats >= REACTOR_STATS_INTERVAL) {
+            reactor_log_stats();
+            last_stats = time(NULL);
+        }
+    }
+}
+
+void uring_backend_cleanup(void) {
+    // Workers may still hold connections, stop them before freeing anything
+    if (pool_running) {
+        worker_pool_shutdown();
+        pool_running = 0;
+    }
+
+    connection_release_all(&uring_shard);
+    if (loop_ring.fd >= 0 && buf_ring) {
+        cancel_pending_requests();
+    }
+
+    if (buf_ring) {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = URING_BUF_GROUP;
+        syscall(__NR_io_uring_register, loop_ring.fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+        buf_ring = NULL;
+    }
+    free(buf_base);
+    buf_base = NULL;
+
+    uring_teardown(&loop_ring);
+    drop_thread_ring();
+
+    log_message(LOG_SERVER, "io_uring backend cleaned up");
+}
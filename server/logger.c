@@ -0,0 +1,820 @@
+// logger.c - Lock-free log buffers filled by every thread and drained by one writer thread
+
+#include "server_helper.h"
+#include "../utils/binlog.h"
+#include <fcntl.h>
+#include <semaphore.h>
+#include <strings.h>
+#include <sys/uio.h>
+
+typedef struct {
+    size_t seq;                         // position when free, position + 1 once published
+    time_t time;
+    log_level_t level;
+    char text[LOG_RECORD_SIZE];
+} log_record_t;
+
+// A format the binary log has seen, indexed by its id
+typedef struct {
+    const char *format;
+    int arg_count;
+    binlog_arg_t args[BINLOG_MAX_ARGS];
+} log_format_t;
+
+// Binary events are staged per thread: the owner appends finished records at
+// tail, the writer thread writes out everything up to tail straight from
+// the stage and moves head. Producers never touch a shared cache line.
+typedef struct log_stage {
+    size_t tail __attribute__((aligned(64)));  // owner only, published with release
+    size_t head_seen;                   // owner's last look at head
+    size_t head __attribute__((aligned(64)));  // writer only
+    size_t drain_to;                    // writer: tail as of the last writev()
+    int retired;                        // owner thread exited, freed once drained
+    struct log_stage *next;
+    char data[LOG_STAGE_BYTES];
+} log_stage_t;
+
+// The per-event path is forced inline so a log_message() costs a single call
+// whatever CFLAGS the file is built with
+#define LOG_HOT static inline __attribute__((always_inline))
+
+// Event header (kind, format id, level, time, length) plus the arguments
+#define LOG_EVENT_MAX (10 + LOG_RECORD_SIZE)
+
+_Static_assert(LOG_MAX_FORMATS < UINT16_MAX, "binary events carry a 16-bit format id");
+
+// The binary log keeps l, z, j, t and pointer arguments in 8 bytes
+_Static_assert(sizeof(long) == 8 && sizeof(size_t) == 8 && sizeof(void *) == 8,
+               "binary log assumes an LP64 target");
+
+volatile sig_atomic_t logging_shutdown = 0;
+
+uint32_t log_category_mask = LOG_MASK_DEFAULT;
+static uint32_t startup_mask = LOG_MASK_DEFAULT;
+static volatile sig_atomic_t reload_requested = 0;
+
+// Text log: a bounded multi-producer queue. A producer claims a position
+// with one CAS on ring_tail, formats into the slot in place and publishes
+// it through the slot's seq. Only the writer thread moves ring_head.
+static log_record_t *ring = NULL;
+static size_t ring_tail __attribute__((aligned(64))) = 0;
+static size_t ring_head __attribute__((aligned(64))) = 0;
+static unsigned long records_dropped = 0;
+
+static int log_fd = -1;
+static pthread_t writer_thread;
+static int writer_started = 0;
+static int writer_idle = 0;             // writer is (about to be) asleep on wakeup
+static int writer_stop = 0;
+static sem_t wakeup;
+
+static log_stage_t *stages = NULL;
+static pthread_mutex_t stage_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stage_key;
+static __thread log_stage_t *thread_stage = NULL;
+
+static int log_binary = 0;
+static log_format_t formats[LOG_MAX_FORMATS + 1];
+static uint32_t format_count = 0;
+static pthread_mutex_t format_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+const char* log_level_to_string(log_level_t level) {
+    switch (level) {
+        case LOG_INFO:      return "INFO";
+        case LOG_ERROR:     return "ERROR";
+        case LOG_WARNING:   return "WARNING";
+        case LOG_DEBUG:     return "DEBUG";
+        case LOG_CLIENT:    return "CLIENT";
+        case LOG_ROOM:      return "ROOM";
+        case LOG_FILE:      return "FILE";
+        case LOG_SERVER:    return "SERVER";
+        case LOG_JOIN:      return "JOIN";
+        case LOG_BROADCAST: return "BROADCAST";
+        case LOG_WHISPER:   return "WHISPER";
+        case LOG_LEAVE:     return "LEAVE";
+        case LOG_SENDFILE:  return "SENDFILE";
+        default:            return "UNKNOWN";
+    }
+}
+
+// "all", "none" or a comma separated list of category names, each optionally
+// prefixed with '-' to remove it, applied left to right: "all,-debug"
+int log_parse_categories(const char *spec, uint32_t *mask) {
+    uint32_t result = 0;
+    const char *p = spec;
+
+    while (*p) {
+        while (*p == ',' || isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
+
+        int remove = *p == '-';
+        if (remove) {
+            p++;
+        }
+        size_t len = strcspn(p, ", \t\r\n");
+
+        uint32_t bits = 0;
+        if (len == 3 && strncasecmp(p, "all", 3) == 0) {
+            bits = LOG_MASK_ALL;
+        } else if (len == 4 && strncasecmp(p, "none", 4) == 0) {
+            bits = 0;
+            if (!remove) {
+                result = 0;
+            }
+        } else {
+            for (int level = 0; level < LOG_CATEGORY_COUNT; level++) {
+                const char *name = log_level_to_string(level);
+                if (strlen(name) == len && strncasecmp(p, name, len) == 0) {
+                    bits = LOG_BIT(level);
+                    break;
+                }
+            }
+            if (!bits) {
+                return -1;
+            }
+        }
+
+        result = remove ? result & ~bits : result | bits;
+        p += len;
+    }
+
+    *mask = result;
+    return 0;
+}
+
+void log_format_categories(uint32_t mask, char *buf, size_t size) {
+    size_t len = 0;
+
+    buf[0] = '\0';
+    for (int level = 0; level < LOG_CATEGORY_COUNT && len < size; level++) {
+        if (mask & LOG_BIT(level)) {
+            len += snprintf(buf + len, size - len, "%s%s", len ? "," : "", log_level_to_string(level));
+        }
+    }
+    if (len == 0) {
+        snprintf(buf, size, "none");
+    }
+}
+
+static void set_categories(uint32_t mask, const char *source) {
+    __atomic_store_n(&log_category_mask, mask, __ATOMIC_RELAXED);
+
+    char names[256];
+    log_format_categories(mask & LOG_COMPILED_MASK, names, sizeof(names));
+    log_write(LOG_SERVER, "Log categories (%s): %s", source, names);
+}
+
+// SIGHUP re-reads LOG_MASK_FILE, or goes back to the startup categories if
+// there is none. Runs on the writer thread, not in the handler.
+static void reload_categories(void) {
+    uint32_t mask = startup_mask;
+    const char *source = "startup";
+
+    FILE *file = fopen(LOG_MASK_FILE, "r");
+    if (file) {
+        char spec[256];
+        if (fgets(spec, sizeof(spec), file) && log_parse_categories(spec, &mask) == 0) {
+            source = LOG_MASK_FILE;
+        } else {
+            mask = startup_mask;
+            log_write(LOG_WARNING, "Ignoring malformed %s", LOG_MASK_FILE);
+        }
+        fclose(file);
+    }
+
+    set_categories(mask, source);
+}
+
+// SIGUSR1 toggles LOG_DEBUG, SIGHUP asks the writer to reload the mask.
+// Both only touch atomics and the semaphore, which is async-signal-safe.
+void log_signal_handler(int sig) {
+    if (sig == SIGUSR1) {
+        __atomic_xor_fetch(&log_category_mask, LOG_BIT(LOG_DEBUG), __ATOMIC_RELAXED);
+    } else if (sig == SIGHUP && writer_started) {
+        reload_requested = 1;
+        sem_post(&wakeup);
+    }
+}
+
+static void write_all(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(log_fd, data, len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return;
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+// strftime only runs when the second changes
+static const char* format_timestamp(time_t when, time_t *cached, char *stamp, size_t size) {
+    if (when != *cached) {
+        struct tm tm_info;
+        localtime_r(&when, &tm_info);
+        strftime(stamp, size, "%Y-%m-%d %H:%M:%S", &tm_info);
+        *cached = when;
+    }
+    return stamp;
+}
+
+LOG_HOT char *put_bytes(char *out, const void *data, size_t len) {
+    memcpy(out, data, len);
+    return out + len;
+}
+
+// Fixed size fields: a constant size memcpy is inlined even without -O
+#define put_value(out, value) (memcpy((out), &(value), sizeof(value)), (out) += sizeof(value))
+
+static void writev_all(struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(log_fd, iov, count);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+static int record_ready(void) {
+    log_record_t *rec = &ring[ring_head & (LOG_RING_RECORDS - 1)];
+    return __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) == ring_head + 1;
+}
+
+static int stages_ready(void) {
+    int ready = 0;
+    pthread_mutex_lock(&stage_mutex);
+    for (log_stage_t *stage = stages; stage && !ready; stage = stage->next) {
+        ready = __atomic_load_n(&stage->tail, __ATOMIC_ACQUIRE) != stage->head;
+    }
+    pthread_mutex_unlock(&stage_mutex);
+    return ready;
+}
+
+static int backlog_ready(void) {
+    return log_binary ? stages_ready() : record_ready();
+}
+
+
+
+// ==========================================
+// WRITER THREAD
+// ==========================================
+
+// Format definitions are written here, ahead of the first event that uses
+// them, instead of going through the ring where they could be dropped.
+// Always leaves room for one more event.
+static size_t append_formats(char *batch, size_t len, uint32_t upto, uint32_t *written) {
+    while (*written < upto) {
+        uint32_t id = *written + 1;
+        uint16_t format_len = strlen(formats[id].format);
+
+        if (len + 7 + format_len + LOG_RECORD_SIZE + 64 > LOG_BATCH_BYTES) {
+            write_all(batch, len);
+            len = 0;
+        }
+
+        char *out = batch + len;
+        *out++ = BINLOG_RECORD_FORMAT;
+        put_value(out, id);
+        put_value(out, format_len);
+        out = put_bytes(out, formats[id].format, format_len);
+        len = out - batch;
+        *written = id;
+    }
+    return len;
+}
+
+// Writes batch, then everything the thread stages hold, in one writev().
+// The format definitions go into batch after the stage tails are read, so
+// every format an event uses is defined ahead of it. Returns the bytes
+// written.
+static size_t drain_stages(char *batch, size_t len, uint32_t *formats_written) {
+    struct iovec iov[1 + 2 * LOG_STAGE_IOVECS];
+    int count = 1;
+    size_t total = 0;
+
+    // Stages are only ever added at the front and only this thread frees
+    // them, so the list can be used unlocked until the release below
+    pthread_mutex_lock(&stage_mutex);
+    log_stage_t *first = stages;
+    pthread_mutex_unlock(&stage_mutex);
+
+    for (log_stage_t *stage = first; stage && count < 1 + 2 * LOG_STAGE_IOVECS; stage = stage->next) {
+        size_t tail = __atomic_load_n(&stage->tail, __ATOMIC_ACQUIRE);
+        size_t pending = tail - stage->head;
+        if (pending == 0) {
+            continue;
+        }
+
+        size_t start = stage->head & (LOG_STAGE_BYTES - 1);
+        size_t part = LOG_STAGE_BYTES - start;
+        if (part > pending) {
+            part = pending;
+        }
+        iov[count++] = (struct iovec){ stage->data + start, part };
+        if (pending > part) {
+            iov[count++] = (struct iovec){ stage->data, pending - part };
+        }
+        stage->drain_to = tail;
+        total += pending;
+    }
+
+    len = append_formats(batch, len, __atomic_load_n(&format_count, __ATOMIC_ACQUIRE), formats_written);
+    iov[0] = (struct iovec){ batch, len };
+    total += len;
+    if (total > 0) {
+        writev_all(iov, count);
+    }
+
+    // Hand the space back, and free the stages of threads that are gone
+    pthread_mutex_lock(&stage_mutex);
+    log_stage_t **link = &stages;
+    while (*link) {
+        log_stage_t *stage = *link;
+        __atomic_store_n(&stage->head, stage->drain_to, __ATOMIC_RELEASE);
+        if (__atomic_load_n(&stage->retired, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&stage->tail, __ATOMIC_ACQUIRE) == stage->head) {
+            *link = stage->next;
+            free(stage);
+            continue;
+        }
+        link = &stage->next;
+    }
+    pthread_mutex_unlock(&stage_mutex);
+
+    return total;
+}
+
+static void *log_writer(void *arg) {
+    (void)arg;
+
+    // SIGINT belongs to the main thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    static char batch[LOG_BATCH_BYTES];
+    char stamp[32] = "";
+    time_t stamp_time = (time_t)-1;
+    unsigned long drops_reported = 0;
+    uint32_t formats_written = 0;
+
+    while (1) {
+        size_t len = 0;
+
+        if (reload_requested) {
+            reload_requested = 0;
+            reload_categories();
+        }
+
+        while (!log_binary && len + LOG_RECORD_SIZE + 64 <= sizeof(batch) && record_ready()) {
+            log_record_t *rec = &ring[ring_head & (LOG_RING_RECORDS - 1)];
+            len += snprintf(batch + len, sizeof(batch) - len, "[%s] [%s] %s\n",
+                            format_timestamp(rec->time, &stamp_time, stamp, sizeof(stamp)),
+                            log_level_to_string(rec->level), rec->text);
+
+            // Hand the slot back for the next lap
+            __atomic_store_n(&rec->seq, ring_head + LOG_RING_RECORDS, __ATOMIC_RELEASE);
+            __atomic_store_n(&ring_head, ring_head + 1, __ATOMIC_RELAXED);
+        }
+
+        unsigned long drops = __atomic_load_n(&records_dropped, __ATOMIC_RELAXED);
+        if (drops != drops_reported) {
+            if (log_binary) {
+                uint32_t now = time(NULL);
+                uint64_t count = drops;
+                char *out = batch + len;
+                *out++ = BINLOG_RECORD_DROPPED;
+                put_value(out, now);
+                put_value(out, count);
+                len = out - batch;
+            } else {
+                len += snprintf(batch + len, sizeof(batch) - len,
+                                "[%s] [WARNING] Log ring full, %lu records dropped so far\n",
+                                format_timestamp(time(NULL), &stamp_time, stamp, sizeof(stamp)), drops);
+            }
+            drops_reported = drops;
+        }
+
+        if (log_binary) {
+            if (drain_stages(batch, len, &formats_written) > 0) {
+                continue;
+            }
+        } else if (len > 0) {
+            write_all(batch, len);
+            continue;
+        }
+
+        // A record claimed but never published (its producer was interrupted
+        // by the shutdown) is left behind rather than waited for
+        if (__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        // Producers only post when they see writer_idle, so check the backlog
+        // again after announcing it
+        __atomic_store_n(&writer_idle, 1, __ATOMIC_SEQ_CST);
+        if (backlog_ready() || __atomic_load_n(&writer_stop, __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(&writer_idle, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        if (log_binary) {
+            deadline.tv_nsec += LOG_BINARY_FLUSH_MS * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+        } else {
+            deadline.tv_sec += 1;
+        }
+        while (sem_timedwait(&wakeup, &deadline) != 0 && errno == EINTR) {
+        }
+        __atomic_store_n(&writer_idle, 0, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+static void wake_writer(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&writer_idle, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&writer_idle, 0, __ATOMIC_ACQ_REL)) {
+        sem_post(&wakeup);
+    }
+}
+
+static void stage_detach(void *arg) {
+    log_stage_t *stage = arg;
+    __atomic_store_n(&stage->retired, 1, __ATOMIC_RELEASE);
+}
+
+// A thread's first binary event gives it a stage, the thread-specific key
+// only exists so the stage is retired when the thread exits
+static log_stage_t *stage_attach(void) {
+    log_stage_t *stage = aligned_alloc(64, sizeof(log_stage_t));
+    if (!stage) {
+        return NULL;
+    }
+    stage->tail = 0;
+    stage->head_seen = 0;
+    stage->head = 0;
+    stage->drain_to = 0;
+    stage->retired = 0;
+
+    pthread_mutex_lock(&stage_mutex);
+    stage->next = stages;
+    stages = stage;
+    pthread_mutex_unlock(&stage_mutex);
+
+    pthread_setspecific(stage_key, stage);
+    thread_stage = stage;
+    return stage;
+}
+
+
+
+// ==========================================
+// PUBLIC API
+// ==========================================
+
+// Header plus the level names, so the decoder needs nothing from the server
+static int write_binary_preamble(void) {
+    binlog_header_t header;
+    struct timespec now;
+
+    memcpy(header.magic, BINLOG_MAGIC, BINLOG_MAGIC_LEN);
+    clock_gettime(CLOCK_REALTIME, &now);
+    header.realtime_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+
+    char preamble[sizeof(header) + LOG_CATEGORY_COUNT * 32];
+    char *out = put_bytes(preamble, &header, sizeof(header));
+    for (int level = 0; level < LOG_CATEGORY_COUNT; level++) {
+        const char *name = log_level_to_string(level);
+        *out++ = BINLOG_RECORD_LEVEL;
+        *out++ = level;
+        *out++ = strlen(name);
+        out = put_bytes(out, name, strlen(name));
+    }
+
+    if (write(log_fd, preamble, out - preamble) != out - preamble) {
+        return -1;
+    }
+
+    // Id BINLOG_FORMAT_TEXT carries messages whose format can't be encoded
+    formats[BINLOG_FORMAT_TEXT].format = "%s";
+    formats[BINLOG_FORMAT_TEXT].arg_count = 1;
+    formats[BINLOG_FORMAT_TEXT].args[0] = BINLOG_ARG_STRING;
+    format_count = BINLOG_FORMAT_TEXT;
+    return 0;
+}
+
+void init_logging(uint32_t categories, int binary) {
+    logging_shutdown = 0;  // Initialize shutdown flag
+    startup_mask = categories;
+    __atomic_store_n(&log_category_mask, categories, __ATOMIC_RELAXED);
+    log_binary = binary;
+
+    const char *path = binary ? LOG_BINARY_FILE : "server.log";
+
+    // Open log file in write mode (overwrites existing file)
+    log_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (log_fd < 0 || (binary && write_binary_preamble() != 0)) {
+        fprintf(stderr, "[LOGGING] Failed to open %s: %s\n", path, strerror(errno));
+        if (log_fd >= 0) {
+            close(log_fd);
+            log_fd = -1;
+        }
+        return;
+    }
+
+    // Binary events are staged per thread, only the text log needs the ring
+    if (!binary) {
+        ring = malloc(sizeof(log_record_t) * LOG_RING_RECORDS);
+    }
+    if ((binary ? pthread_key_create(&stage_key, stage_detach) != 0 : !ring) ||
+        sem_init(&wakeup, 0, 0) != 0) {
+        perror("[LOGGING] Failed to allocate log buffers");
+        free(ring);
+        ring = NULL;
+        close(log_fd);
+        log_fd = -1;
+        return;
+    }
+    for (size_t i = 0; ring && i < LOG_RING_RECORDS; i++) {
+        ring[i].seq = i;
+    }
+    ring_head = 0;
+    ring_tail = 0;
+
+    if (pthread_create(&writer_thread, NULL, log_writer, NULL) != 0) {
+        perror("[LOGGING] Failed to start log writer thread");
+        sem_destroy(&wakeup);
+        free(ring);
+        ring = NULL;
+        close(log_fd);
+        log_fd = -1;
+        return;
+    }
+    writer_started = 1;
+
+    log_message(LOG_SERVER, "=== Server logging system initialized ===");
+    set_categories(categories, "startup");
+    printf("[LOGGING] Logging system initialized - writing to %s\n", path);
+}
+
+void cleanup_logging(void) {
+    static volatile sig_atomic_t cleanup_done = 0;
+
+    // Prevent multiple cleanup calls
+    if (cleanup_done) {
+        return;
+    }
+    cleanup_done = 1;
+
+    if (!writer_started) {
+        logging_shutdown = 1;
+        return;
+    }
+
+    log_message(LOG_SERVER, "=== Server shutting down - logging system cleanup ===");
+    logging_shutdown = 1;
+
+    // The writer drains everything published before it stops
+    __atomic_store_n(&writer_stop, 1, __ATOMIC_SEQ_CST);
+    sem_post(&wakeup);
+    pthread_join(writer_thread, NULL);
+    writer_started = 0;
+
+    close(log_fd);
+    log_fd = -1;
+    sem_destroy(&wakeup);
+
+    printf("[LOGGING] Logging system cleaned up (%lu records dropped)\n",
+           __atomic_load_n(&records_dropped, __ATOMIC_RELAXED));
+}
+
+// The first call from a log_message() site parses its format once and gives
+// it an id. Formats the binary log can't carry get BINLOG_FORMAT_TEXT.
+static uint32_t register_site(log_site_t *site, const char *format) {
+    pthread_mutex_lock(&format_mutex);
+
+    uint32_t id = site->id;
+    if (id == 0) {
+        log_format_t *entry = &formats[format_count + 1];
+
+        id = BINLOG_FORMAT_TEXT;
+        if (format_count < LOG_MAX_FORMATS && strlen(format) < LOG_RECORD_SIZE) {
+            entry->arg_count = binlog_parse_format(format, entry->args, BINLOG_MAX_ARGS);
+            if (entry->arg_count >= 0) {
+                entry->format = format;
+                id = format_count + 1;
+                // The writer reads format_count to know what it may define
+                __atomic_store_n(&format_count, id, __ATOMIC_RELEASE);
+            }
+        }
+        __atomic_store_n(&site->id, id, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&format_mutex);
+    return id;
+}
+
+// Raw argument values, strings cut short so every later argument still fits
+LOG_HOT uint16_t encode_arguments(const log_format_t *entry, char *out, va_list args) {
+    char *start = out;
+    char *end = out + LOG_RECORD_SIZE;
+
+    for (int i = 0; i < entry->arg_count; i++) {
+        switch (entry->args[i]) {
+            case BINLOG_ARG_INT: {
+                int32_t value = va_arg(args, int);
+                put_value(out, value);
+                break;
+            }
+            case BINLOG_ARG_LONG: {
+                int64_t value = va_arg(args, long long);
+                put_value(out, value);
+                break;
+            }
+            case BINLOG_ARG_PTR: {
+                uint64_t value = (uintptr_t)va_arg(args, void *);
+                put_value(out, value);
+                break;
+            }
+            case BINLOG_ARG_DOUBLE: {
+                double value = va_arg(args, double);
+                put_value(out, value);
+                break;
+            }
+            case BINLOG_ARG_STRING: {
+                const char *value = va_arg(args, const char *);
+                if (!value) {
+                    value = "(null)";
+                }
+                size_t room = (end - out) - sizeof(uint16_t) - 8 * (entry->arg_count - i - 1);
+                uint16_t len = strnlen(value, room);
+                put_value(out, len);
+                out = put_bytes(out, value, len);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    return out - start;
+}
+
+// Encodes the event straight into the calling thread's stage, or on the
+// stack when it could run past the end and wrap. Never blocks: a stage
+// without room for the largest event drops it and counts it.
+LOG_HOT void stage_event(uint32_t id, log_level_t level, const char *format, va_list args) {
+    log_stage_t *stage = thread_stage ? thread_stage : stage_attach();
+    if (!stage) {
+        __atomic_add_fetch(&records_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    size_t tail = stage->tail;
+    if (tail + LOG_EVENT_MAX - stage->head_seen > LOG_STAGE_BYTES) {
+        stage->head_seen = __atomic_load_n(&stage->head, __ATOMIC_ACQUIRE);
+        if (tail + LOG_EVENT_MAX - stage->head_seen > LOG_STAGE_BYTES) {
+            __atomic_add_fetch(&records_dropped, 1, __ATOMIC_RELAXED);
+            wake_writer();
+            return;
+        }
+    }
+
+    char scratch[LOG_EVENT_MAX];
+    size_t start = tail & (LOG_STAGE_BYTES - 1);
+    char *record = (start + LOG_EVENT_MAX <= LOG_STAGE_BYTES) ? stage->data + start : scratch;
+    char *out = record;
+    uint16_t short_id = id;
+    uint8_t level_byte = level;
+    uint32_t now = time(NULL);
+    uint16_t len;
+
+    *out++ = BINLOG_RECORD_EVENT;
+    put_value(out, short_id);
+    put_value(out, level_byte);
+    put_value(out, now);
+    char *args_at = out + sizeof(len);
+
+    if (id != BINLOG_FORMAT_TEXT) {
+        len = encode_arguments(&formats[id], args_at, args);
+    } else {
+        // Formatted here after all, as a single string argument
+        char *text = args_at + sizeof(uint16_t);
+        size_t room = LOG_RECORD_SIZE - sizeof(uint16_t);
+        text[0] = '\0';
+        vsnprintf(text, room, format, args);
+        uint16_t text_len = strnlen(text, room);
+        memcpy(args_at, &text_len, sizeof(text_len));
+        len = sizeof(text_len) + text_len;
+    }
+    put_value(out, len);
+    size_t size = (args_at - record) + len;
+
+    if (record == scratch) {
+        size_t part = LOG_STAGE_BYTES - start;
+        memcpy(stage->data + start, scratch, part < size ? part : size);
+        if (part < size) {
+            memcpy(stage->data, scratch + part, size - part);
+        }
+    }
+    __atomic_store_n(&stage->tail, tail + size, __ATOMIC_RELEASE);
+
+    // Nobody tails the binary log, so its writer runs on a timer and a stage
+    // only wakes it early on filling past half
+    size_t half = LOG_STAGE_BYTES / 2;
+    if (tail - stage->head_seen < half && tail + size - stage->head_seen >= half) {
+        stage->head_seen = __atomic_load_n(&stage->head, __ATOMIC_ACQUIRE);
+        if (tail + size - stage->head_seen >= half) {
+            wake_writer();
+        }
+    }
+}
+
+// Never blocks: a full ring drops the record and counts it
+LOG_HOT void log_vwrite(log_site_t *site, log_level_t level, const char *format, va_list args) {
+    if (!format || logging_shutdown || !writer_started) return;
+
+    if (log_binary) {
+        uint32_t id = site ? __atomic_load_n(&site->id, __ATOMIC_ACQUIRE) : BINLOG_FORMAT_TEXT;
+        if (id == 0) {
+            id = register_site(site, format);
+        }
+        if (formats[id].format != format) {
+            id = BINLOG_FORMAT_TEXT;
+        }
+        stage_event(id, level, format, args);
+        return;
+    }
+
+    size_t pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+    log_record_t *rec;
+
+    while (1) {
+        rec = &ring[pos & (LOG_RING_RECORDS - 1)];
+        size_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        intptr_t lap = (intptr_t)(seq - pos);
+
+        if (lap == 0) {
+            if (__atomic_compare_exchange_n(&ring_tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (lap < 0) {
+            // The writer has not freed this slot from the previous lap yet
+            __atomic_add_fetch(&records_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    rec->level = level;
+    rec->time = time(NULL);
+    vsnprintf(rec->text, sizeof(rec->text), format, args);
+
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+    wake_writer();
+}
+
+// Callers go through log_message(), which filters by category first
+void log_write_site(log_site_t *site, log_level_t level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_vwrite(site, level, format, args);
+    va_end(args);
+}
+
+void log_write(log_level_t level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_vwrite(NULL, level, format, args);
+    va_end(args);
+}
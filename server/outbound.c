@@ -0,0 +1,507 @@
+// outbound.c - Bounded per-connection send queues drained by the reactor
+
+#include "server_helper.h"
+#include <sys/resource.h>
+#include <poll.h>
+
+#define OUTBOUND_MAX_TABLE (1 << 20)     // largest descriptor tracked by the fd table
+#define OUTBOUND_FLUSH_IOV 64            // frames gathered into one sendmsg
+#define OUTBOUND_RAW_WAIT_MS 1000        // poll interval while draining before a raw stream
+
+static size_t high_watermark = OUTBOUND_HIGH_WATERMARK;
+static size_t low_watermark = OUTBOUND_LOW_WATERMARK;
+
+// fd -> connection, so code that only knows a socket can reach its queue
+static connection_t **connection_table = NULL;
+static int connection_table_size = 0;
+static pthread_mutex_t connection_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long overflow_drops = 0;
+static unsigned long throttle_events = 0;
+static unsigned long frames_queued = 0;
+
+
+
+int outbound_init(size_t high, size_t low) {
+    if (low >= high) {
+        log_message(LOG_ERROR, "Outbound low watermark (%zu) must be below the high watermark (%zu)", low, high);
+        return -1;
+    }
+    high_watermark = high;
+    low_watermark = low;
+
+    struct rlimit limit;
+    rlim_t slots = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_max != RLIM_INFINITY) {
+        slots = limit.rlim_max;
+    }
+    if (slots > OUTBOUND_MAX_TABLE) {
+        slots = OUTBOUND_MAX_TABLE;
+    }
+
+    connection_table = calloc(slots, sizeof(connection_t *));
+    if (!connection_table) {
+        log_message(LOG_ERROR, "Memory allocation failed for connection table");
+        return -1;
+    }
+    connection_table_size = (int)slots;
+
+    log_message(LOG_SERVER, "Outbound queues: high watermark %zu bytes, low watermark %zu bytes",
+               high_watermark, low_watermark);
+    return 0;
+}
+
+void outbound_cleanup(void) {
+    outbound_log_stats();
+
+    pthread_mutex_lock(&connection_table_mutex);
+    free(connection_table);
+    connection_table = NULL;
+    connection_table_size = 0;
+    pthread_mutex_unlock(&connection_table_mutex);
+}
+
+void outbound_log_stats(void) {
+    log_message(LOG_SERVER, "Outbound queues: %lu frames queued, %lu dropped on overflow, %lu throttle events",
+               __atomic_load_n(&frames_queued, __ATOMIC_RELAXED),
+               __atomic_load_n(&overflow_drops, __ATOMIC_RELAXED),
+               __atomic_load_n(&throttle_events, __ATOMIC_RELAXED));
+}
+
+
+
+// ==========================================
+// FD TABLE
+// ==========================================
+
+void connection_register(connection_t *conn) {
+    pthread_mutex_lock(&connection_table_mutex);
+    if (conn->fd >= 0 && conn->fd < connection_table_size) {
+        connection_table[conn->fd] = conn;
+    }
+    pthread_mutex_unlock(&connection_table_mutex);
+}
+
+void connection_unregister(connection_t *conn) {
+    pthread_mutex_lock(&connection_table_mutex);
+    if (conn->fd >= 0 && conn->fd < connection_table_size && connection_table[conn->fd] == conn) {
+        connection_table[conn->fd] = NULL;
+    }
+    pthread_mutex_unlock(&connection_table_mutex);
+}
+
+// Returns the connection with an extra reference, release it with connection_put()
+connection_t* connection_get(int fd) {
+    connection_t *conn = NULL;
+
+    pthread_mutex_lock(&connection_table_mutex);
+    if (fd >= 0 && fd < connection_table_size) {
+        conn = connection_table[fd];
+        if (conn) {
+            conn->refs++;
+        }
+    }
+    pthread_mutex_unlock(&connection_table_mutex);
+
+    return conn;
+}
+
+// Another reference on a connection the caller already holds one on
+void connection_hold(connection_t *conn) {
+    pthread_mutex_lock(&connection_table_mutex);
+    conn->refs++;
+    pthread_mutex_unlock(&connection_table_mutex);
+}
+
+void connection_put(connection_t *conn) {
+    pthread_mutex_lock(&connection_table_mutex);
+    int remaining = --conn->refs;
+    pthread_mutex_unlock(&connection_table_mutex);
+
+    // The descriptor goes with the last reference, until then its number
+    // can't be handed to a new client
+    if (remaining == 0) {
+        if (conn->fd >= 0) {
+            close(conn->fd);
+        }
+        connection_drop_queue(conn);
+        pthread_mutex_destroy(&conn->io_mutex);
+        free(conn->inbuf);
+        free(conn);
+    }
+}
+
+
+
+// ==========================================
+// SHARED FRAMES
+// ==========================================
+
+// Serializes the messages once. Fan-out then costs a reference per recipient.
+shared_frame_t* frame_create(const char **messages, int count) {
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += sizeof(uint32_t) + strlen(messages[i]);
+    }
+
+    shared_frame_t *frame = malloc(sizeof(shared_frame_t) + total);
+    if (!frame) {
+        log_message(LOG_ERROR, "Memory allocation failed for outbound frame (%zu bytes)", total);
+        return NULL;
+    }
+    frame->refs = 1;
+    frame->protocol = WIRE_PROTO_TEXT;
+    frame->len = total;
+
+    char *ptr = frame->data;
+    for (int i = 0; i < count; i++) {
+        uint32_t message_len = strlen(messages[i]);
+        uint32_t network_len = htonl(message_len);  // Convert to network byte order
+        memcpy(ptr, &network_len, sizeof(network_len));
+        memcpy(ptr + sizeof(network_len), messages[i], message_len);
+        ptr += sizeof(network_len) + message_len;
+    }
+
+    return frame;
+}
+
+static shared_frame_t* frame_alloc_binary(size_t total) {
+    shared_frame_t *frame = malloc(sizeof(shared_frame_t) + total);
+    if (!frame) {
+        log_message(LOG_ERROR, "Memory allocation failed for outbound frame (%zu bytes)", total);
+        return NULL;
+    }
+    frame->refs = 1;
+    frame->protocol = WIRE_PROTO_BINARY;
+    frame->len = total;
+    return frame;
+}
+
+// Builds the bytes msg takes on the wire in the given protocol. Protocol 2
+// carries the texts as WIRE_OP_TEXT frames when there is no dedicated body.
+shared_frame_t* frame_encode(const wire_message_t *msg, int protocol) {
+    const char **texts = msg->texts;
+    int count = msg->count;
+    const char *rendered;
+
+    if (!texts && (protocol != WIRE_PROTO_BINARY || !msg->body)) {
+        rendered = msg->render(msg->render_ctx);
+        texts = &rendered;
+        count = 1;
+    }
+
+    if (protocol != WIRE_PROTO_BINARY) {
+        return frame_create(texts, count);
+    }
+
+    uint8_t prefix[WIRE_VARINT_MAX];
+
+    if (msg->body) {
+        size_t prefix_len = wire_put_varint(prefix, msg->body_len);
+        shared_frame_t *frame = frame_alloc_binary(prefix_len + msg->body_len);
+        if (frame) {
+            memcpy(frame->data, prefix, prefix_len);
+            memcpy(frame->data + prefix_len, msg->body, msg->body_len);
+        }
+        return frame;
+    }
+
+    size_t lens[MAX_BATCH_FRAMES];
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        lens[i] = strlen(texts[i]);
+        size_t body_len = 1 + wire_put_varint(prefix, lens[i]) + lens[i];
+        total += wire_put_varint(prefix, body_len) + body_len;
+    }
+
+    shared_frame_t *frame = frame_alloc_binary(total);
+    if (!frame) {
+        return NULL;
+    }
+
+    uint8_t *ptr = (uint8_t *)frame->data;
+    for (int i = 0; i < count; i++) {
+        size_t body_len = 1 + wire_put_varint(prefix, lens[i]) + lens[i];
+        ptr += wire_put_varint(ptr, body_len);
+        *ptr++ = WIRE_OP_TEXT;
+        ptr += wire_put_varint(ptr, lens[i]);
+        memcpy(ptr, texts[i], lens[i]);
+        ptr += lens[i];
+    }
+
+    return frame;
+}
+
+shared_frame_t* frame_ref(shared_frame_t *frame) {
+    __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+    return frame;
+}
+
+void frame_release(shared_frame_t *frame) {
+    if (frame && __atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(frame);
+    }
+}
+
+
+
+// ==========================================
+// QUEUE
+// ==========================================
+
+// Caller holds io_mutex
+void connection_drop_queue(connection_t *conn) {
+    for (int i = 0; i < conn->out_count; i++) {
+        frame_release(conn->out_ring[(conn->out_first + i) % conn->out_capacity]);
+    }
+    free(conn->out_ring);
+    conn->out_ring = NULL;
+    conn->out_capacity = 0;
+    conn->out_first = 0;
+    conn->out_count = 0;
+    conn->out_offset = 0;
+    conn->out_bytes = 0;
+}
+
+// Grows the pointer ring, the watermark bounds it so this stays rare
+static int queue_reserve(connection_t *conn) {
+    if (conn->out_count < conn->out_capacity) {
+        return 0;
+    }
+
+    int capacity = conn->out_capacity ? conn->out_capacity * 2 : 16;
+    shared_frame_t **ring = malloc(sizeof(shared_frame_t *) * capacity);
+    if (!ring) {
+        return -1;
+    }
+    for (int i = 0; i < conn->out_count; i++) {
+        ring[i] = conn->out_ring[(conn->out_first + i) % conn->out_capacity];
+    }
+
+    free(conn->out_ring);
+    conn->out_ring = ring;
+    conn->out_capacity = capacity;
+    conn->out_first = 0;
+    return 0;
+}
+
+// Writes as much of the queue as the socket takes without blocking.
+// Caller holds io_mutex. Returns 0 while the socket is healthy, -1 once
+// it has failed and the queue was discarded.
+int connection_flush(connection_t *conn) {
+    if (conn->closed || conn->out_raw) {
+        return 0;
+    }
+
+    while (conn->out_count > 0) {
+        struct iovec iov[OUTBOUND_FLUSH_IOV];
+        int iovcnt = 0;
+        size_t offset = conn->out_offset;
+
+        for (int i = 0; i < conn->out_count && iovcnt < OUTBOUND_FLUSH_IOV; i++) {
+            shared_frame_t *frame = conn->out_ring[(conn->out_first + i) % conn->out_capacity];
+            iov[iovcnt].iov_base = frame->data + offset;
+            iov[iovcnt].iov_len = frame->len - offset;
+            iovcnt++;
+            offset = 0;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t sent = sendmsg(conn->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            log_message(LOG_ERROR, "Failed to flush outbound queue of socket %d: %s", conn->fd, strerror(errno));
+            connection_drop_queue(conn);
+            return -1;
+        }
+
+        conn->out_bytes -= sent;
+        while (conn->out_count > 0) {
+            shared_frame_t *frame = conn->out_ring[conn->out_first];
+            size_t left = frame->len - conn->out_offset;
+            if ((size_t)sent < left) {
+                conn->out_offset += sent;
+                break;
+            }
+            sent -= left;
+            conn->out_offset = 0;
+            conn->out_first = (conn->out_first + 1) % conn->out_capacity;
+            conn->out_count--;
+            frame_release(frame);
+        }
+    }
+
+    if (conn->out_throttled && conn->out_bytes <= low_watermark) {
+        conn->out_throttled = 0;
+        log_message(LOG_INFO, "Socket %d drained below low watermark, accepting messages again", conn->fd);
+    }
+
+    return 0;
+}
+
+// Caller holds io_mutex
+static int queue_frame(connection_t *conn, shared_frame_t *frame) {
+    if (conn->closed) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    // Encoded before a protocol switch landed, the caller re-encodes
+    if (frame->protocol != conn->protocol) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (conn->out_throttled || conn->out_bytes + frame->len > high_watermark) {
+        if (!conn->out_throttled) {
+            conn->out_throttled = 1;
+            __atomic_add_fetch(&throttle_events, 1, __ATOMIC_RELAXED);
+            log_message(LOG_WARNING, "Outbound queue of socket %d over high watermark (%zu bytes queued), dropping",
+                       conn->fd, conn->out_bytes);
+        }
+        conn->out_dropped++;
+        __atomic_add_fetch(&overflow_drops, 1, __ATOMIC_RELAXED);
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (queue_reserve(conn) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    conn->out_ring[(conn->out_first + conn->out_count) % conn->out_capacity] = frame_ref(frame);
+    conn->out_count++;
+    conn->out_bytes += frame->len;
+    __atomic_add_fetch(&frames_queued, 1, __ATOMIC_RELAXED);
+
+    if (connection_flush(conn) != 0) {
+        return -1;
+    }
+    if (conn->out_count > 0 && !conn->busy && !conn->out_raw) {
+        // The owning worker re-arms on its way out, otherwise ask for EPOLLOUT now
+        reactor_arm(conn);
+    }
+    return 0;
+}
+
+// Queues a reference to the frame, pushes what the socket takes right away
+// and leaves the rest to the reactor. Never blocks on the peer.
+int connection_enqueue(connection_t *conn, shared_frame_t *frame) {
+    pthread_mutex_lock(&conn->io_mutex);
+    int result = queue_frame(conn, frame);
+    pthread_mutex_unlock(&conn->io_mutex);
+    return result;
+}
+
+// The acknowledgement goes out in the old format and is the last frame in
+// it, everything queued afterwards uses the new one
+int connection_switch_protocol(connection_t *conn, int protocol, shared_frame_t *ack) {
+    pthread_mutex_lock(&conn->io_mutex);
+    int result = queue_frame(conn, ack);
+    if (result == 0) {
+        conn->protocol = protocol;
+    }
+    pthread_mutex_unlock(&conn->io_mutex);
+    return result;
+}
+
+
+
+// ==========================================
+// RAW STREAMS
+// ==========================================
+
+// File payloads bypass the queue. Drain what is queued first, then hold the
+// queue until connection_end_raw() so frames can't land inside the payload.
+// *protocol gets the format the peer expects the raw section's header in.
+int connection_begin_raw(int fd, int *protocol) {
+    *protocol = WIRE_PROTO_TEXT;
+
+    connection_t *conn = connection_get(fd);
+    if (!conn) {
+        return -1;
+    }
+
+    int result = 0;
+    pthread_mutex_lock(&conn->io_mutex);
+
+    while (conn->out_count > 0 && !conn->closed) {
+        if (connection_flush(conn) != 0) {
+            result = -1;
+            break;
+        }
+        if (conn->out_count == 0) {
+            break;
+        }
+
+        pthread_mutex_unlock(&conn->io_mutex);
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        int ready = poll(&pfd, 1, OUTBOUND_RAW_WAIT_MS);
+        pthread_mutex_lock(&conn->io_mutex);
+
+        if (ready < 0 && errno != EINTR) {
+            result = -1;
+            break;
+        }
+        if (!server_running) {
+            result = -1;
+            break;
+        }
+    }
+
+    if (conn->closed) {
+        result = -1;
+    }
+    if (result == 0) {
+        conn->out_raw = 1;
+        *protocol = conn->protocol;
+    }
+
+    pthread_mutex_unlock(&conn->io_mutex);
+    connection_put(conn);
+    return result;
+}
+
+// The payload broke off short of the size in its header and nothing can
+// frame the rest. Shut the socket down so the peer sees the stream end, the
+// reactor then closes the connection the usual way.
+void connection_abort_raw(int fd) {
+    connection_t *conn = connection_get(fd);
+    if (!conn) {
+        return;
+    }
+
+    pthread_mutex_lock(&conn->io_mutex);
+    if (!conn->closed) {
+        shutdown(fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&conn->io_mutex);
+
+    connection_put(conn);
+}
+
+void connection_end_raw(int fd) {
+    connection_t *conn = connection_get(fd);
+    if (!conn) {
+        return;
+    }
+
+    pthread_mutex_lock(&conn->io_mutex);
+    conn->out_raw = 0;
+    if (connection_flush(conn) == 0 && conn->out_count > 0 && !conn->busy) {
+        reactor_arm(conn);
+    }
+    pthread_mutex_unlock(&conn->io_mutex);
+
+    connection_put(conn);
+}
@@ -0,0 +1,716 @@
+// reactor.c - Edge-triggered epoll event loop that owns every client socket
+
+#define _GNU_SOURCE
+#include "server_helper.h"
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+
+#define REACTOR_MAX_EVENTS 256
+
+io_backend_t active_io_backend = IO_BACKEND_EPOLL;
+
+static reactor_shard_t shards[MAX_REACTOR_SHARDS];
+static int shard_count = 0;
+static int pool_running = 0;
+
+
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Idle connections are cheap now, the descriptor limit is what runs out first
+static void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return;
+    }
+
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+            log_message(LOG_WARNING, "Could not raise descriptor limit: %s", strerror(errno));
+            return;
+        }
+    }
+
+    log_message(LOG_SERVER, "Descriptor limit: %llu", (unsigned long long)limit.rlim_cur);
+}
+
+
+
+static int shard_init(reactor_shard_t *shard, int id, int listen_fd) {
+    memset(shard, 0, sizeof(reactor_shard_t));
+    shard->id = id;
+    shard->listen_fd = listen_fd;
+    pthread_mutex_init(&shard->connection_mutex, NULL);
+
+    shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (shard->epoll_fd < 0) {
+        log_message(LOG_ERROR, "epoll_create1 failed: %s", strerror(errno));
+        red();
+        perror("epoll_create1 failed");
+        reset();
+        return -1;
+    }
+
+    if (set_nonblocking(listen_fd) != 0) {
+        log_message(LOG_ERROR, "Failed to make listening socket non-blocking: %s", strerror(errno));
+        close(shard->epoll_fd);
+        shard->epoll_fd = -1;
+        return -1;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = listen_fd;
+
+    if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) != 0) {
+        log_message(LOG_ERROR, "Failed to register listening socket with epoll: %s", strerror(errno));
+        close(shard->epoll_fd);
+        shard->epoll_fd = -1;
+        return -1;
+    }
+
+    // Level-triggered and never read, so once SIGINT writes it every shard
+    // wakes and sees server_running drop
+    if (shutdown_event_fd >= 0) {
+        ev.events = EPOLLIN;
+        ev.data.fd = shutdown_event_fd;
+        if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shutdown_event_fd, &ev) != 0) {
+            log_message(LOG_WARNING, "Shard %d cannot watch the shutdown eventfd: %s", id, strerror(errno));
+        }
+    }
+
+    return 0;
+}
+
+// Shard 0 reuses server_socket, every other shard binds its own listener on
+// the same port so accept() load spreads across cores. Shards only wait and
+// dispatch, commands run on the worker pool.
+int reactor_init(int port, int requested_shards, int worker_count) {
+    raise_fd_limit();
+
+    if (requested_shards < 1) {
+        requested_shards = 1;
+    }
+    if (requested_shards > MAX_REACTOR_SHARDS) {
+        requested_shards = MAX_REACTOR_SHARDS;
+    }
+
+    for (int i = 0; i < requested_shards; i++) {
+        int listen_fd = (i == 0) ? server_socket : create_listening_socket(port, 1);
+        if (listen_fd < 0) {
+            reactor_cleanup();
+            return -1;
+        }
+
+        if (shard_init(&shards[i], i, listen_fd) != 0) {
+            if (i > 0) {
+                close(listen_fd);
+            }
+            reactor_cleanup();
+            return -1;
+        }
+        shard_count++;
+    }
+
+    if (worker_pool_init(worker_count, WORKER_QUEUE_CAPACITY) != 0) {
+        reactor_cleanup();
+        return -1;
+    }
+    pool_running = 1;
+
+    log_message(LOG_SERVER, "Reactor initialized with %d shard(s)", shard_count);
+    return 0;
+}
+
+
+
+connection_t* connection_create(reactor_shard_t *shard, int fd, const char *client_ip, int client_port) {
+    connection_t *conn = malloc(sizeof(connection_t));
+    if (!conn) {
+        return NULL;
+    }
+
+    memset(conn, 0, sizeof(connection_t));
+    conn->fd = fd;
+    strncpy(conn->client_ip, client_ip, sizeof(conn->client_ip) - 1);
+    conn->client_port = client_port;
+    conn->state = CONN_STATE_LOGIN_USERNAME;
+    conn->protocol = WIRE_PROTO_TEXT;
+    conn->shard = shard;
+    conn->refs = 1;  // dropped by connection_close()
+    conn->ring_buffer = -1;
+    pthread_mutex_init(&conn->io_mutex, NULL);
+
+    pthread_mutex_lock(&shard->connection_mutex);
+    conn->prev = NULL;
+    conn->next = shard->connection_head;
+    if (shard->connection_head) {
+        shard->connection_head->prev = conn;
+    }
+    shard->connection_head = conn;
+    shard->connection_count++;
+    pthread_mutex_unlock(&shard->connection_mutex);
+
+    connection_register(conn);
+    return conn;
+}
+
+static void connection_unlink(connection_t *conn) {
+    reactor_shard_t *shard = conn->shard;
+
+    pthread_mutex_lock(&shard->connection_mutex);
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        shard->connection_head = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    shard->connection_count--;
+    pthread_mutex_unlock(&shard->connection_mutex);
+}
+
+void connection_close(connection_t *conn) {
+    int client_socket = conn->fd;
+
+    log_message(LOG_CLIENT, "Message loop ended for socket %d", client_socket);
+
+    // Senders that already hold a reference see closed and back off before
+    // the descriptor number can be reused
+    pthread_mutex_lock(&conn->io_mutex);
+    conn->closed = 1;
+    if (conn->out_dropped > 0) {
+        log_message(LOG_WARNING, "Socket %d dropped %lu outbound messages on overflow", client_socket, conn->out_dropped);
+    }
+    connection_drop_queue(conn);
+    if (active_io_backend == IO_BACKEND_URING) {
+        uring_release_input(conn);
+    } else {
+        epoll_ctl(conn->shard->epoll_fd, EPOLL_CTL_DEL, client_socket, NULL);
+    }
+    // The descriptor stays open until the last reference is dropped, this
+    // ends the session for whoever still holds one and completes ring
+    // requests in flight
+    shutdown(client_socket, SHUT_RDWR);
+    pthread_mutex_unlock(&conn->io_mutex);
+    connection_unregister(conn);
+
+    cleanup_client_connection(conn);
+    if (conn->client) {
+        remove_client_entry(conn->client);
+        conn->client = NULL;
+    }
+
+    connection_unlink(conn);
+    connection_put(conn);
+}
+
+static int connection_ensure_inbuf(connection_t *conn) {
+    if (conn->inbuf) {
+        return 0;
+    }
+
+    conn->inbuf = malloc(CONN_INBUF_SIZE);
+    if (!conn->inbuf) {
+        log_message(LOG_ERROR, "Memory allocation failed for input buffer of socket %d", conn->fd);
+        return -1;
+    }
+    conn->inbuf_head = 0;
+    conn->inbuf_len = 0;
+    return 0;
+}
+
+// Copies len bytes starting offset bytes past the ring head, across the wrap
+static void inbuf_copy_out(const connection_t *conn, size_t offset, void *dst, size_t len) {
+    size_t start = (conn->inbuf_head + offset) % CONN_INBUF_SIZE;
+    size_t first = CONN_INBUF_SIZE - start;
+
+    if (first > len) {
+        first = len;
+    }
+    memcpy(dst, conn->inbuf + start, first);
+    memcpy((char *)dst + first, conn->inbuf, len - first);
+}
+
+// Describes the free space of the ring as at most two segments
+static int inbuf_free_segments(connection_t *conn, struct iovec iov[2]) {
+    size_t tail = (conn->inbuf_head + conn->inbuf_len) % CONN_INBUF_SIZE;
+    size_t space = CONN_INBUF_SIZE - conn->inbuf_len;
+
+    if (space == 0) {
+        return 0;
+    }
+
+    size_t first = CONN_INBUF_SIZE - tail;
+    if (first >= space) {
+        iov[0].iov_base = conn->inbuf + tail;
+        iov[0].iov_len = space;
+        return 1;
+    }
+
+    iov[0].iov_base = conn->inbuf + tail;
+    iov[0].iov_len = first;
+    iov[1].iov_base = conn->inbuf;
+    iov[1].iov_len = space - first;
+    return 2;
+}
+
+// Reads the length prefix of the next frame in the connection's protocol.
+// Returns 0 with the prefix size, 1 while it is incomplete, -1 if malformed.
+static int inbuf_frame_length(const connection_t *conn, uint32_t *message_len, size_t *prefix_len) {
+    if (conn->protocol == WIRE_PROTO_BINARY) {
+        uint8_t prefix[WIRE_LENGTH_MAX];
+        size_t avail = conn->inbuf_len < sizeof(prefix) ? conn->inbuf_len : sizeof(prefix);
+        uint64_t value;
+
+        inbuf_copy_out(conn, 0, prefix, avail);
+        int status = wire_get_varint(prefix, avail, &value, prefix_len);
+        if (status == 1 && avail == sizeof(prefix)) {
+            return -1;
+        }
+        if (status != 0) {
+            return status;
+        }
+        *message_len = value > UINT32_MAX ? UINT32_MAX : (uint32_t)value;
+        return 0;
+    }
+
+    if (conn->inbuf_len < sizeof(uint32_t)) {
+        return 1;
+    }
+    uint32_t network_len;
+    inbuf_copy_out(conn, 0, &network_len, sizeof(network_len));
+    *message_len = ntohl(network_len);
+    *prefix_len = sizeof(uint32_t);
+    return 0;
+}
+
+// Hands every complete frame in the ring to client_process_frame in order,
+// leaving a trailing partial frame for the next read
+int connection_dispatch_frames(connection_t *conn) {
+    while (conn->inbuf_len > 0) {
+        uint32_t message_len;
+        size_t prefix_len;
+        int status = inbuf_frame_length(conn, &message_len, &prefix_len);
+
+        if (status < 0) {
+            log_message(LOG_ERROR, "Malformed frame length from socket %d", conn->fd);
+            return -1;
+        }
+        if (status > 0) {
+            break;
+        }
+
+        if (message_len == 0) {
+            log_message(LOG_CLIENT, "Client (socket %d) disconnected", conn->fd);
+            return -1;
+        }
+        if (message_len >= MAX_FRAME_SIZE) {
+            log_message(LOG_ERROR, "Message too large from socket %d: %u bytes (buffer size: %d)",
+                       conn->fd, message_len, MAX_FRAME_SIZE);
+            return -1;
+        }
+        if (conn->inbuf_len - prefix_len < message_len) {
+            break;
+        }
+
+        char frame[MAX_FRAME_SIZE];
+        inbuf_copy_out(conn, prefix_len, frame, message_len);
+        frame[message_len] = '\0';
+
+        conn->inbuf_head = (conn->inbuf_head + prefix_len + message_len) % CONN_INBUF_SIZE;
+        conn->inbuf_len -= prefix_len + message_len;
+
+        if (client_process_frame(conn, frame, message_len) != 0) {
+            return -1;
+        }
+        if (connection_is_parked(conn)) {
+            break;
+        }
+    }
+
+    if (conn->inbuf_len == 0) {
+        conn->inbuf_head = 0;
+    }
+    return 0;
+}
+
+// Pulls everything the kernel has for this socket into the free space of
+// the ring with a single recvmsg. Returns bytes read, 0 on EOF, -1 on error
+// (errno EAGAIN once the socket is drained).
+ssize_t connection_fill(connection_t *conn) {
+    if (connection_ensure_inbuf(conn) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct iovec iov[2];
+    int iovcnt = inbuf_free_segments(conn, iov);
+    if (iovcnt == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    // A completed io_uring receive may hold the next bytes already
+    if (active_io_backend == IO_BACKEND_URING) {
+        ssize_t taken = uring_take_input(conn, iov, iovcnt);
+        if (taken > 0) {
+            conn->inbuf_len += taken;
+            return taken;
+        }
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    ssize_t received = recvmsg(conn->fd, &msg, MSG_DONTWAIT);
+    if (received > 0) {
+        conn->inbuf_len += received;
+    }
+    return received;
+}
+
+void connection_release_all(reactor_shard_t *shard) {
+    int pending = 0;
+    int total = shard->connection_count;
+
+    connection_t *conn = shard->connection_head;
+    while (conn) {
+        connection_t *next = conn->next;
+
+        // Best effort for whatever shutdown notices are still queued
+        pthread_mutex_lock(&conn->io_mutex);
+        connection_flush(conn);
+        conn->closed = 1;
+        pthread_mutex_unlock(&conn->io_mutex);
+        connection_unregister(conn);
+
+        if (conn->state != CONN_STATE_ACTIVE) {
+            pending++;
+        }
+
+        connection_put(conn);
+        conn = next;
+    }
+
+    shard->connection_head = NULL;
+    shard->connection_count = 0;
+
+    log_message(LOG_SERVER, "Shard %d released %d connections (%d pending logins closed, %lu accepted in total)",
+               shard->id, total, pending, shard->accepted_count);
+}
+
+
+
+static void accept_new_connections(reactor_shard_t *shard) {
+    while (server_running) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        int client_socket = accept4(shard->listen_fd, (struct sockaddr *)&client_addr, &client_len, SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            log_message(LOG_ERROR, "Failed to accept client connection: %s", strerror(errno));
+            red();
+            perror("Accept failed");
+            reset();
+            return;
+        }
+
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+        int client_port = ntohs(client_addr.sin_port);
+
+        connection_t *conn = connection_create(shard, client_socket, client_ip, client_port);
+        if (!conn) {
+            log_message(LOG_ERROR, "Memory allocation failed for connection from %s:%d", client_ip, client_port);
+            close(client_socket);
+            continue;
+        }
+
+        shard->accepted_count++;
+
+        // One-shot so a connection is never handed to two workers at once
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+        ev.data.fd = client_socket;
+
+        if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) != 0) {
+            log_message(LOG_ERROR, "Failed to register socket %d with epoll: %s", client_socket, strerror(errno));
+            connection_unregister(conn);
+            connection_unlink(conn);
+            connection_put(conn);
+            continue;
+        }
+
+        cyan();
+        printf("New client connected from %s:%d\n", client_ip, client_port);
+        reset();
+        log_message(LOG_CLIENT, "New connection from %s:%d (socket %d, shard %d)",
+                   client_ip, client_port, client_socket, shard->id);
+        log_message(LOG_CLIENT, "Starting login process for client %s:%d", client_ip, client_port);
+    }
+}
+
+// Re-registers a disarmed connection. Caller holds io_mutex and either owns
+// the connection as its worker or knows no worker does.
+int reactor_arm(connection_t *conn) {
+    if (active_io_backend == IO_BACKEND_URING) {
+        return uring_arm(conn);
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+    if (conn->out_count > 0 && !conn->out_raw) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.fd = conn->fd;
+
+    if (epoll_ctl(conn->shard->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) != 0) {
+        log_message(LOG_ERROR, "Failed to re-arm socket %d: %s", conn->fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// ==========================================
+// PARKING
+// ==========================================
+
+// parked: 0, or PARK_HELD while a file transfer owns the connection, or
+// PARK_IDLE once the worker that parked it has let go
+#define PARK_HELD 1
+#define PARK_IDLE 2
+
+int connection_is_parked(connection_t *conn) {
+    return __atomic_load_n(&conn->parked, __ATOMIC_ACQUIRE) != 0;
+}
+
+// Called by a handler on its own connection: the worker stops reading and
+// lets go without re-arming, the connection stays busy until resumed
+void connection_park(connection_t *conn) {
+    pthread_mutex_lock(&conn->io_mutex);
+    __atomic_store_n(&conn->parked, PARK_HELD, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&conn->io_mutex);
+}
+
+// Hands a parked connection back and consumes the caller's reference. If
+// its worker is still on the way out it simply carries on, otherwise the
+// connection goes back to the pool to flush and read what arrived meanwhile.
+void connection_resume(connection_t *conn) {
+    pthread_mutex_lock(&conn->io_mutex);
+    int idle = conn->parked == PARK_IDLE;
+    __atomic_store_n(&conn->parked, 0, __ATOMIC_RELEASE);
+    if (!idle) {
+        conn->pending_events |= EPOLLIN | EPOLLOUT;
+    }
+    pthread_mutex_unlock(&conn->io_mutex);
+
+    if (!idle || worker_pool_submit(conn, EPOLLIN | EPOLLOUT) != 0) {
+        connection_put(conn);
+    }
+}
+
+// Runs on a worker: flush queued output, drain the socket, then either tear
+// the connection down or re-arm it for the next edge. Events that fired
+// while the worker held the connection are handled before letting go.
+static void connection_service(connection_t *conn, uint32_t events) {
+    while (1) {
+        if (events & EPOLLOUT) {
+            pthread_mutex_lock(&conn->io_mutex);
+            int flushed = connection_flush(conn);
+            pthread_mutex_unlock(&conn->io_mutex);
+            if (flushed != 0) {
+                connection_close(conn);
+                return;
+            }
+        }
+
+        // Drain whatever is buffered before acting on a hangup, the last
+        // frames (usually /exit) arrive together with the FIN
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            if (client_message_loop(conn) != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+                connection_close(conn);
+                return;
+            }
+        }
+
+        pthread_mutex_lock(&conn->io_mutex);
+        if (conn->parked == PARK_HELD) {
+            conn->parked = PARK_IDLE;
+            pthread_mutex_unlock(&conn->io_mutex);
+            return;
+        }
+        if (conn->pending_events) {
+            events = conn->pending_events;
+            conn->pending_events = 0;
+            pthread_mutex_unlock(&conn->io_mutex);
+            continue;
+        }
+
+        conn->busy = 0;
+        int armed = reactor_arm(conn);
+        pthread_mutex_unlock(&conn->io_mutex);
+
+        if (armed != 0) {
+            pthread_mutex_lock(&conn->io_mutex);
+            conn->busy = 1;
+            pthread_mutex_unlock(&conn->io_mutex);
+            connection_close(conn);
+        }
+        return;
+    }
+}
+
+// Consumes the reference shard_run() took when it looked the connection up
+void reactor_handle_ready(connection_t *conn, uint32_t events) {
+    connection_service(conn, events);
+    connection_put(conn);
+}
+
+void reactor_log_stats(void) {
+    worker_pool_log_stats();
+    outbound_log_stats();
+    client_registry_log_stats();
+    file_queue_log_stats();
+    file_relay_log_stats();
+    file_staging_log_stats();
+    file_resume_log_stats();
+}
+
+static void shard_run(reactor_shard_t *shard) {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    time_t last_stats = time(NULL);
+
+    while (server_running) {
+        int ready = epoll_wait(shard->epoll_fd, events, REACTOR_MAX_EVENTS, 1000);
+
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_message(LOG_ERROR, "epoll_wait failed on shard %d: %s", shard->id, strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.fd == shard->listen_fd) {
+                accept_new_connections(shard);
+                continue;
+            }
+            if (events[i].data.fd == shutdown_event_fd) {
+                continue;
+            }
+
+            // Events carry the descriptor, not the pointer: a worker may have
+            // closed the connection since this batch was collected
+            connection_t *conn = connection_get(events[i].data.fd);
+            if (!conn) {
+                continue;
+            }
+
+            // A sender may re-arm for EPOLLOUT while the connection is still
+            // queued, fold those events into the job that owns it
+            pthread_mutex_lock(&conn->io_mutex);
+            if (conn->busy) {
+                conn->pending_events |= events[i].events;
+                pthread_mutex_unlock(&conn->io_mutex);
+                connection_put(conn);
+                continue;
+            }
+            conn->busy = 1;
+            pthread_mutex_unlock(&conn->io_mutex);
+
+            if (worker_pool_submit(conn, events[i].events) != 0) {
+                connection_put(conn);
+                break;  // pool is shutting down
+            }
+        }
+
+        if (shard->id == 0 && time(NULL) - last_stats >= REACTOR_STATS_INTERVAL) {
+            reactor_log_stats();
+            last_stats = time(NULL);
+        }
+    }
+}
+
+static void *shard_thread(void *arg) {
+    reactor_shard_t *shard = arg;
+
+    // SIGINT belongs to the main thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    shard_run(shard);
+    return NULL;
+}
+
+// The calling thread drives shard 0, every other shard gets its own thread
+void reactor_run(void) {
+    for (int i = 1; i < shard_count; i++) {
+        if (pthread_create(&shards[i].thread, NULL, shard_thread, &shards[i]) != 0) {
+            log_message(LOG_ERROR, "Failed to start reactor shard %d", i);
+            red();
+            perror("Thread creation failed");
+            reset();
+            shards[i].thread = 0;
+        }
+    }
+
+    shard_run(&shards[0]);
+
+    for (int i = 1; i < shard_count; i++) {
+        if (shards[i].thread) {
+            pthread_join(shards[i].thread, NULL);
+        }
+    }
+}
+
+void reactor_cleanup(void) {
+    // Workers may still hold connections, stop them before freeing anything
+    if (pool_running) {
+        worker_pool_shutdown();
+        pool_running = 0;
+    }
+
+    for (int i = 0; i < shard_count; i++) {
+        reactor_shard_t *shard = &shards[i];
+
+        connection_release_all(shard);
+
+        if (shard->epoll_fd >= 0) {
+            close(shard->epoll_fd);
+            shard->epoll_fd = -1;
+        }
+        // Shard 0's listener is server_socket, closed by cleanup_server()
+        if (i > 0 && shard->listen_fd >= 0) {
+            close(shard->listen_fd);
+            shard->listen_fd = -1;
+        }
+        pthread_mutex_destroy(&shard->connection_mutex);
+    }
+
+    shard_count = 0;
+    log_message(LOG_SERVER, "Reactor cleaned up");
+}
@@ -8,25 +8,29 @@
 #include "../utils/utils.h"
 #include "server_helper.h"
 
-client_thread_data_t *current_thread_data = NULL;
-pthread_mutex_t thread_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 int main(int argc, char **argv) {
     struct server_parameter params;
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
     
     if (parse_server_args(argc, argv, &params) != 0) {
         return 1;
     }
     
+    uint32_t log_categories = LOG_MASK_DEFAULT;
+    if (params.log_categories[0] != '\0' &&
+        log_parse_categories(params.log_categories, &log_categories) != 0) {
+        red();
+        fprintf(stderr, "Invalid log categories '%s'\n", params.log_categories);
+        reset();
+        return 1;
+    }
+    
     blue();
     printf("Server Port: %d\n", params.port);
     reset();
     
     setup_signal_handlers();
     
-    if (initialize_server(params.port) != 0) {
+    if (initialize_server(params.port, params.shards) != 0) {
         red();
         fprintf(stderr, "Failed to initialize server\n");
         reset();
@@ -36,7 +40,7 @@ int main(int argc, char **argv) {
     init_clients();
     init_rooms();
 
-    if (init_file_queue() != 0) {
+    if (init_file_queue(params.file_queue_capacity, params.file_queue_position) != 0) {
         red();
         fprintf(stderr, "Failed to initialize file transfer queue\n");
         reset();
@@ -46,105 +50,89 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    init_logging();
+    init_logging(log_categories, params.log_binary);
     log_message(LOG_SERVER, "Server starting on port %d", params.port);
     log_message(LOG_SERVER, "Client management system initialized");
     log_message(LOG_SERVER, "Room management system initialized");
     log_message(LOG_SERVER, "File transfer queue initialized");
+    file_staging_init(params.file_stage_budget);
     
     green();
     printf("Server listening on port %d...\n", params.port);
     reset();
     log_message(LOG_SERVER, "Server ready - listening for client connections");
     
-    while (server_running) {
-        client_thread_data_t *thread_data = malloc(sizeof(client_thread_data_t));
-        if (thread_data == NULL) {
-            log_message(LOG_ERROR, "Memory allocation failed for client thread data");
-            red();
-            perror("Memory allocation failed");
-            reset();
-            continue;
-        }
-
-        memset(thread_data, 0, sizeof(client_thread_data_t));
-        thread_data->client_socket = -1;
-        thread_data->client_port = 0;
-        thread_data->client_ip[0] = '\0';
-
-        pthread_mutex_lock(&thread_mutex);
-        current_thread_data = thread_data;
-        pthread_mutex_unlock(&thread_mutex);
-        
-        thread_data->client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
-        if (thread_data->client_socket < 0) {
-            log_message(LOG_ERROR, "Failed to accept client connection: %s", strerror(errno));
-            red();
-            perror("Accept failed");
+    if (strcmp(params.io_backend, "uring") == 0) {
+        if (uring_backend_init(params.workers) == 0) {
+            active_io_backend = IO_BACKEND_URING;
+        } else {
+            yellow();
+            printf("io_uring backend unavailable, falling back to epoll\n");
             reset();
-            
-            pthread_mutex_lock(&thread_mutex);
-            current_thread_data = NULL;
-            pthread_mutex_unlock(&thread_mutex);
-            free(thread_data);
-            continue;
+            log_message(LOG_WARNING, "io_uring backend unavailable, falling back to epoll");
         }
-        
-        inet_ntop(AF_INET, &client_addr.sin_addr, thread_data->client_ip, INET_ADDRSTRLEN);
-        thread_data->client_port = ntohs(client_addr.sin_port);
-        
-        cyan();
-        printf("New client connected from %s:%d\n", 
-               thread_data->client_ip, thread_data->client_port);
+    }
+    
+    if (active_io_backend == IO_BACKEND_URING && params.shards > 1) {
+        log_message(LOG_WARNING, "Listener sharding is only supported by the epoll backend, using 1 shard");
+    }
+    
+    if (outbound_init(params.out_high_watermark, params.out_low_watermark) != 0 ||
+        (active_io_backend == IO_BACKEND_EPOLL && reactor_init(params.port, params.shards, params.workers) != 0)) {
+        red();
+        fprintf(stderr, "Failed to initialize event loop\n");
         reset();
-        log_message(LOG_CLIENT, "New connection from %s:%d (socket %d)", 
-                   thread_data->client_ip, thread_data->client_port, thread_data->client_socket);
-        
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, handle_client, (void *)thread_data) != 0) {
-            log_message(LOG_ERROR, "Failed to create thread for client %s:%d", 
-                       thread_data->client_ip, thread_data->client_port);
-            red();
-            perror("Thread creation failed");
-            reset();
-            close(thread_data->client_socket);
-
-            pthread_mutex_lock(&thread_mutex);
-            current_thread_data = NULL;
-            pthread_mutex_unlock(&thread_mutex);
-            free(thread_data);
-            continue;
+        if (active_io_backend == IO_BACKEND_URING) {
+            uring_backend_cleanup();
         }
-        
-        log_message(LOG_CLIENT, "Created handler thread for client %s:%d", 
-                   thread_data->client_ip, thread_data->client_port);
-        
-        pthread_mutex_lock(&thread_mutex);
-        current_thread_data = NULL;
-        pthread_mutex_unlock(&thread_mutex);
-        
-        pthread_detach(thread_id);
+        cleanup_file_queue();
+        cleanup_rooms();
+        cleanup_clients();
+        cleanup_server();
+        cleanup_logging();
+        return 1;
+    }
+    
+    log_message(LOG_SERVER, "Using %s I/O backend", active_io_backend == IO_BACKEND_URING ? "io_uring" : "epoll");
+    
+    if (start_file_transfer_workers(FILE_TRANSFER_WORKERS) != 0) {
+        log_message(LOG_WARNING, "No file transfer workers, transfers run on the command threads");
+    }
+    
+    if (strcmp(params.file_transfer, "store") == 0) {
+        file_transfer_mode = FILE_TRANSFER_STORE;
+    } else if (strcmp(params.file_transfer, "relay") == 0) {
+        file_transfer_mode = FILE_TRANSFER_RELAY;
+    } else {
+        file_transfer_mode = FILE_TRANSFER_SPLICE;
+    }
+    log_message(LOG_SERVER, "File transfer mode: %s", params.file_transfer);
+    
+    if (active_io_backend == IO_BACKEND_URING) {
+        uring_backend_run();
+    } else {
+        reactor_run();
     }
 
-    printf("\nServer shutting down normally...\n");
+    red();
+    printf("\nServer shutting down...\n");
+    reset();
+    log_message(LOG_SERVER, "Shutdown requested - initiating graceful shutdown");
     
-    int client_count = count_active_threads();
-    if (client_count > 0) {
-        printf("Notifying %d connected clients about shutdown...\n", client_count);
+    // The outbound queues are flushed by the backend cleanup below
+    if (count_active_threads() > 0 || get_file_queue_count() > 0) {
         shutdown_all_clients();
-        
-        sleep(2);
-        
-        client_count = count_active_threads();
-        if (client_count > 0) {
-            printf("Force disconnecting %d remaining clients\n", client_count);
-        }
     }
-
-
-
     
     log_message(LOG_SERVER, "Server shutdown initiated");
+    stop_file_transfer_workers();
+    if (active_io_backend == IO_BACKEND_URING) {
+        uring_backend_cleanup();
+    } else {
+        reactor_cleanup();
+    }
+    outbound_cleanup();
+    log_message(LOG_SERVER, "Event loop cleaned up");
     cleanup_file_queue();
     log_message(LOG_SERVER, "File transfer queue cleaned up");
     cleanup_clients();
@@ -155,5 +143,8 @@ int main(int argc, char **argv) {
     log_message(LOG_SERVER, "Server shutdown complete");
     cleanup_logging();
     
+    green();
+    printf("Server shutdown complete.\n");
+    reset();
     return 0;
 }
\ No newline at end of file
@@ -7,117 +7,45 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <ctype.h>  
+#include <sys/eventfd.h>
 
 
-pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
-FILE *log_file = NULL;
-
-
-extern client_thread_data_t *current_thread_data;
-extern pthread_mutex_t thread_mutex;
-volatile sig_atomic_t logging_shutdown = 0;
-
 int server_socket = -1;
+int shutdown_event_fd = -1;
 volatile sig_atomic_t server_running = 1;
 
+// Only async-signal-safe work here. The shards wake on shutdown_event_fd,
+// see server_running drop and return to main(), which does the teardown.
 void handle_sigint(int sig) {
     (void)sig;
-    red();
-    printf("\nServer shutting down...\n");
-    reset();
-    
-    log_message(LOG_SERVER, "SIGINT received - initiating graceful shutdown");
-    
+    int saved_errno = errno;
     server_running = 0;
-    
-    pthread_mutex_lock(&thread_mutex);
-    if (current_thread_data != NULL) {
-        log_message(LOG_CLIENT, "Cleaning up pending client connection during shutdown");
-        
-        if (current_thread_data->client_socket >= 0) {
-            log_message(LOG_CLIENT, "Force closing socket %d during shutdown", current_thread_data->client_socket);
-            close(current_thread_data->client_socket);
-        }
-        
-        free(current_thread_data);
-        current_thread_data = NULL;
+    if (shutdown_event_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t ignored = write(shutdown_event_fd, &one, sizeof(one));
+        (void)ignored;
     }
-    pthread_mutex_unlock(&thread_mutex);
-    
-    int initial_client_count = count_active_threads();
-    int file_queue_count = get_file_queue_count();
-    
-    printf("[SHUTDOWN] Found %d active clients and %d pending file transfers\n", 
-           initial_client_count, file_queue_count);
-    
-    if (initial_client_count > 0 || file_queue_count > 0) {
-        shutdown_all_clients();
-        
-        printf("[SHUTDOWN] Waiting for clients to disconnect gracefully...\n");
-        log_message(LOG_SERVER, "Waiting for %d clients to disconnect gracefully", initial_client_count);
-        
-        int wait_seconds = 3;
-        int current_client_count;
-        
-        for (int i = 0; i < wait_seconds; i++) {
-            sleep(1);
-            current_client_count = count_active_threads();
-            
-            printf("[SHUTDOWN] Waiting... %d clients remaining (%d/%d seconds)\n", 
-                   current_client_count, i + 1, wait_seconds);
-            
-            if (current_client_count == 0) {
-                printf("[SHUTDOWN] All clients disconnected gracefully\n");
-                log_message(LOG_SERVER, "All clients disconnected gracefully");
-                break;
-            }
-        }
-        
-        current_client_count = count_active_threads();
-        if (current_client_count > 0) {
-            printf("[SHUTDOWN] Force disconnecting %d remaining clients\n", current_client_count);
-            log_message(LOG_SERVER, "Force disconnecting %d remaining clients", current_client_count);
-        }
-    } else {
-        printf("[SHUTDOWN] No active clients or file transfers to handle\n");
-    }
-    
-    log_message(LOG_SERVER, "Emergency cleanup: file transfer queue");
-    cleanup_file_queue();
-    
-    log_message(LOG_SERVER, "Emergency cleanup: client connections");
-    cleanup_clients();
-    
-    log_message(LOG_SERVER, "Emergency cleanup: room management");
-    cleanup_rooms();
-    
-    if (server_socket != -1) {
-        log_message(LOG_SERVER, "Closing server socket");
-        close(server_socket);
-        server_socket = -1;
-    }
-    
-    log_message(LOG_SERVER, "Graceful shutdown complete");
-    
-    cleanup_logging();
-    
-    green();
-    printf("Server shutdown complete.\n");
-    reset();
-    exit(0);
+    errno = saved_errno;
 }
 
 void setup_signal_handlers() {
+    shutdown_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shutdown_event_fd < 0) {
+        perror("eventfd failed");
+    }
     signal(SIGINT, handle_sigint);
-    
+    signal(SIGUSR1, log_signal_handler);
+    signal(SIGHUP, log_signal_handler);
+    // splice() has no MSG_NOSIGNAL, a receiver that hung up would kill the server
+    signal(SIGPIPE, SIG_IGN);
 }
 
 
-int initialize_server(int port) {
+int create_listening_socket(int port, int reuse_port) {
     struct sockaddr_in server_addr;
     
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
+    int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket < 0) {
         log_message(LOG_ERROR, "Socket creation failed: %s", strerror(errno));
         red();
         perror("Socket creation failed");
@@ -126,12 +54,22 @@ int initialize_server(int port) {
     }
     
     int opt = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
         log_message(LOG_ERROR, "setsockopt failed: %s", strerror(errno));
         red();
         perror("setsockopt failed");
         reset();
-        close(server_socket);
+        close(listen_socket);
+        return -1;
+    }
+    
+    // Every shard binds the same port, the kernel hashes new connections across them
+    if (reuse_port && setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        log_message(LOG_ERROR, "setsockopt SO_REUSEPORT failed: %s", strerror(errno));
+        red();
+        perror("setsockopt SO_REUSEPORT failed");
+        reset();
+        close(listen_socket);
         return -1;
     }
     
@@ -140,21 +78,30 @@ int initialize_server(int port) {
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(port);
     
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    if (bind(listen_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         log_message(LOG_ERROR, "Bind failed on port %d: %s", port, strerror(errno));
         red();
         perror("Bind failed");
         reset();
-        close(server_socket);
+        close(listen_socket);
         return -1;
     }
     
-    if (listen(server_socket, 30) < 0) {  // Allow queue of up to 30 clients
+    if (listen(listen_socket, SOMAXCONN) < 0) {
         log_message(LOG_ERROR, "Listen failed: %s", strerror(errno));
         red();
         perror("Listen failed");
         reset();
-        close(server_socket);
+        close(listen_socket);
+        return -1;
+    }
+    
+    return listen_socket;
+}
+
+int initialize_server(int port, int shard_count) {
+    server_socket = create_listening_socket(port, shard_count > 1);
+    if (server_socket < 0) {
         return -1;
     }
     
@@ -162,40 +109,153 @@ int initialize_server(int port) {
     return 0;
 }
 
-int send_message(int client_socket, const char* message) {
-    if (client_socket == -1 || message == NULL) {
-        return -1;
+// Writes the whole iovec array, advancing past partial writes.
+// MSG_NOSIGNAL so a peer that vanished mid-write can't SIGPIPE the server.
+int send_iov_all(int client_socket, struct iovec *iov, int iovcnt) {
+    if (active_io_backend == IO_BACKEND_URING) {
+        return uring_send_iov(client_socket, iov, iovcnt);
+    }
+    
+    while (iovcnt > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        
+        ssize_t sent = sendmsg(client_socket, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (sent == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        
+        while (iovcnt > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
     }
     
-    uint32_t message_len = strlen(message);
-    uint32_t network_len = htonl(message_len);  // Convert to network byte order
+    return 0;
+}
+
+// Queues msg for reactor-owned sockets so a slow reader can't stall the
+// sending thread, encoded for the protocol the connection speaks. cache
+// holds each encoding once built so a fan-out serializes it only once.
+// Other sockets get the text form written directly.
+static int send_encoded(int client_socket, const wire_message_t *msg, shared_frame_t *cache[2]) {
+    connection_t *conn = connection_get(client_socket);
+    int protocol = conn ? conn->protocol : WIRE_PROTO_TEXT;
+    int result = -1;
+    
+    // A protocol switch can land between the encode and the enqueue,
+    // the queue refuses the stale encoding and it is built again
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int slot = protocol == WIRE_PROTO_BINARY;
+        if (!cache[slot]) {
+            cache[slot] = frame_encode(msg, protocol);
+            if (!cache[slot]) {
+                break;
+            }
+        }
+        
+        if (!conn) {
+            struct iovec iov = { cache[slot]->data, cache[slot]->len };
+            result = send_iov_all(client_socket, &iov, 1);
+            if (result != 0) {
+                log_message(LOG_ERROR, "Failed to send message to socket %d: %s", client_socket, strerror(errno));
+            }
+            return result;
+        }
+        
+        result = connection_enqueue(conn, cache[slot]);
+        if (result == 0 || errno != EPROTO) {
+            break;
+        }
+        protocol = conn->protocol;
+    }
     
-    int total_sent = 0;
-    int bytes_to_send = sizeof(network_len);
-    char *len_ptr = (char *)&network_len;
+    if (conn) {
+        // Overflow drops are counted by the queue, only report real failures
+        if (result != 0 && errno != ENOBUFS) {
+            log_message(LOG_WARNING, "Failed to queue message for socket %d: %s", client_socket, strerror(errno));
+        }
+        connection_put(conn);
+    }
+    return result;
+}
+
+int send_wire_message(int client_socket, const wire_message_t *msg) {
+    if (client_socket == -1 || msg == NULL) {
+        return -1;
+    }
     
-    while (total_sent < bytes_to_send) {
-        int sent = send(client_socket, len_ptr + total_sent, bytes_to_send - total_sent, 0);
-        if (sent <= 0) {
-            log_message(LOG_ERROR, "Failed to send message length to socket %d: %s", client_socket, strerror(errno));
+    shared_frame_t *cache[2] = { NULL, NULL };
+    int result = send_encoded(client_socket, msg, cache);
+    frame_release(cache[0]);
+    frame_release(cache[1]);
+    return result;
+}
+
+// Frames every message and hands them to the kernel in a single write, so a
+// reply and a follow-up to the same socket leave together
+int send_messages(int client_socket, const char **messages, int count) {
+    if (client_socket == -1 || messages == NULL || count < 1 || count > MAX_BATCH_FRAMES) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (messages[i] == NULL) {
             return -1;
         }
-        total_sent += sent;
     }
     
-    total_sent = 0;
-    bytes_to_send = message_len;
+    wire_message_t msg = { .texts = messages, .count = count };
+    return send_wire_message(client_socket, &msg);
+}
+
+int send_message(int client_socket, const char* message) {
+    if (message == NULL) {
+        return -1;
+    }
+    return send_messages(client_socket, &message, 1);
+}
+
+// Caller holds room->room_mutex. Each encoding is built at most once and
+// every active member except skip gets a reference to the same buffer.
+// Returns how many members it reached, *recipients gets how many it tried.
+int room_send_all(room_info_t *room, const client_info_t *skip, const wire_message_t *msg, int *recipients) {
+    int delivered = 0;
+    int attempted = 0;
+    shared_frame_t *cache[2] = { NULL, NULL };
     
-    while (total_sent < bytes_to_send) {
-        int sent = send(client_socket, message + total_sent, bytes_to_send - total_sent, 0);
-        if (sent <= 0) {
-            log_message(LOG_ERROR, "Failed to send message data to socket %d: %s", client_socket, strerror(errno));
-            return -1;
+    for (int i = 0; i < MAX_CLIENTS_PER_ROOM; i++) {
+        client_info_t *member = room->clients[i];
+        if (member && member->is_active && member != skip) {
+            attempted++;
+            if (send_encoded(member->socket_fd, msg, cache) == 0) {
+                delivered++;
+            } else {
+                log_message(LOG_WARNING, "Failed to deliver message to '%s'", member->username);
+            }
         }
-        total_sent += sent;
     }
     
-    return 0;  
+    frame_release(cache[0]);
+    frame_release(cache[1]);
+    
+    if (recipients) {
+        *recipients = attempted;
+    }
+    return delivered;
 }
 
 int receive_message(int client_socket, char* buffer, size_t buffer_size) {
@@ -258,251 +318,524 @@ void cleanup_server() {
         close(server_socket);
         server_socket = -1;
     }
-    
+    if (shutdown_event_fd != -1) {
+        close(shutdown_event_fd);
+        shutdown_event_fd = -1;
+    }
 }
 
 
-int setup_client_connection(void *arg, char *client_ip, int *client_port) {
-    if (arg == NULL) {
-        log_message(LOG_ERROR, "Invalid client argument in setup_client_connection");
+int handle_client_login(connection_t *conn, char *username, char *file_path) {
+    int client_socket = conn->fd;
+    const char *client_ip = conn->client_ip;
+    int client_port = conn->client_port;
+    
+    char *end = username + strlen(username) - 1;
+    while (end > username && (*end == ' ' || *end == '\n' || *end == '\t')) {
+        *end = '\0';
+        end--;
+    }
+    
+    end = file_path + strlen(file_path) - 1;
+    while (end > file_path && (*end == ' ' || *end == '\n' || *end == '\t')) {
+        *end = '\0';
+        end--;
+    }
+    
+    log_message(LOG_CLIENT, "Login attempt: user '%s' from %s:%d, path: %s", username, client_ip, client_port, file_path);
+    
+    if (validate_username(username) != 0) {
+        log_message(LOG_WARNING, "Invalid username format: %s from %s:%d", username, client_ip, client_port);
+        yellow();
+        printf("Invalid username format: %s\n", username);
+        reset();
+        send_message(client_socket, "Invalid username format");
+        return -1;
+    }
+    
+    if (find_client_by_username(username) != NULL) {
+        log_message(LOG_WARNING, "Username already taken: %s from %s:%d", username, client_ip, client_port);
+        yellow();
+        printf("Username already taken: %s\n", username);
+        reset();
+        send_message(client_socket, "Username already taken");
+        return -1;
+    }
+    
+    
+    client_info_t *client = add_client(username, client_socket, pthread_self(), 
+                                      client_ip, client_port, file_path);
+    
+    if (client == NULL) {
+        log_message(LOG_ERROR, "Failed to add client '%s' to list", username);
         red();
-        fprintf(stderr, "Invalid client argument\n");
+        printf("Failed to add client to list\n");
         reset();
+        send_message(client_socket, "Server error");
         return -1;
     }
     
-    client_thread_data_t *thread_data = (client_thread_data_t *)arg;
+    conn->client = client;
+    conn->room = NULL;
     
-    int client_socket = thread_data->client_socket;
-    strcpy(client_ip, thread_data->client_ip);
-    *client_port = thread_data->client_port;
+    // Resumable chunked transfers need a stored upload to resume from, and
+    // stored uploads are capped at maxfile; relayed ones stream at any size.
+    // Old clients only look at the prefix.
+    char login_reply[96];
+    int reply_len = snprintf(login_reply, sizeof(login_reply), "LOGIN_SUCCESS proto=1,2 size64=1");
+    if (file_transfer_mode == FILE_TRANSFER_STORE) {
+        snprintf(login_reply + reply_len, sizeof(login_reply) - reply_len, " chunks=1 maxfile=%d", MAX_FILE_SIZE);
+    }
+    send_message(client_socket, login_reply);
+    log_message(LOG_CLIENT, "User '%s' successfully logged in from %s:%d", username, client_ip, client_port);
+    green();
+    printf("User '%s' connected\n", username);
+    reset();
     
-    free(thread_data);
+    return 0; 
+}
+
+// "PROTO <version>" right after LOGIN_SUCCESS. The reply is the last frame
+// in the old format, both directions use the new one from there on.
+void handle_protocol_request(connection_t *conn, const char *request) {
+    int client_socket = conn->fd;
+    int version = atoi(request);
+    
+    if (version == conn->protocol) {
+        char reply[32];
+        snprintf(reply, sizeof(reply), "PROTO_OK %d", version);
+        send_message(client_socket, reply);
+        return;
+    }
     
-    log_message(LOG_CLIENT, "Client connection setup: socket %d from %s:%d", client_socket, client_ip, *client_port);
+    if (version != WIRE_PROTO_BINARY) {
+        log_message(LOG_WARNING, "Unsupported protocol version '%s' requested by socket %d", request, client_socket);
+        send_message(client_socket, "PROTO_ERR Unsupported protocol version");
+        return;
+    }
+    
+    char reply[32];
+    snprintf(reply, sizeof(reply), "PROTO_OK %d", version);
+    const char *texts[1] = { reply };
+    wire_message_t msg = { .texts = texts, .count = 1 };
     
-    return client_socket;
+    shared_frame_t *ack = frame_encode(&msg, conn->protocol);
+    if (!ack || connection_switch_protocol(conn, version, ack) != 0) {
+        log_message(LOG_ERROR, "Failed to switch socket %d to protocol %d", client_socket, version);
+        frame_release(ack);
+        return;
+    }
+    frame_release(ack);
+    
+    log_message(LOG_CLIENT, "User '%s' switched to protocol %d", conn->client->username, version);
 }
 
-int handle_client_login(int client_socket, pthread_t thread_id, 
-                       const char *client_ip, int client_port) {
-    char username[1024];
-    char file_path[1024];
-    int bytes_received;
+int validate_username(const char *username) {
+    if (username == NULL) {
+        return -1;
+    }
+    
+    size_t len = strlen(username);
     
-    log_message(LOG_CLIENT, "Starting login process for client %s:%d", client_ip, client_port);
+    if (len == 0 || len > 16) {
+        log_message(LOG_WARNING, "Username validation failed: invalid length (%zu)", len);
+        return -1;
+    }
     
-    while (1) {
-        bytes_received = receive_message(client_socket, username, sizeof(username));
-        if (bytes_received <= 0) {
-            log_message(LOG_ERROR, "Failed to receive username from %s:%d", client_ip, client_port);
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum(username[i])) {
+            log_message(LOG_WARNING, "Username validation failed: non-alphanumeric character in '%s'", username);
             return -1;
         }
-        username[bytes_received] = '\0';
-        
-        bytes_received = receive_message(client_socket, file_path, sizeof(file_path));
-        if (bytes_received <= 0) {
-            log_message(LOG_ERROR, "Failed to receive file path from %s:%d", client_ip, client_port);
+    }
+    
+    return 0;
+}
+
+
+// Login frames and commands share one path regardless of which I/O backend
+// delivered them. Returns -1 when the connection should be torn down.
+int client_process_frame(connection_t *conn, char *buffer, size_t len) {
+    int client_socket = conn->fd;
+    
+    if (conn->state == CONN_STATE_LOGIN_USERNAME) {
+        strncpy(conn->pending_username, buffer, sizeof(conn->pending_username) - 1);
+        conn->pending_username[sizeof(conn->pending_username) - 1] = '\0';
+        conn->state = CONN_STATE_LOGIN_PATH;
+        return 0;
+    }
+    
+    if (conn->state == CONN_STATE_LOGIN_PATH) {
+        if (handle_client_login(conn, conn->pending_username, buffer) == 0) {
+            conn->state = CONN_STATE_ACTIVE;
+        } else {
+            conn->state = CONN_STATE_LOGIN_USERNAME;
+        }
+        return 0;
+    }
+    
+    if (conn->protocol == WIRE_PROTO_BINARY) {
+        if (process_binary_command(conn, buffer, len) != 0) {
+            log_message(LOG_CLIENT, "Client (socket %d) requested exit", client_socket);
             return -1;
         }
-        file_path[bytes_received] = '\0';
-        
-        char *end = username + strlen(username) - 1;
-        while (end > username && (*end == ' ' || *end == '\n' || *end == '\t')) {
-            *end = '\0';
-            end--;
+        return 0;
+    }
+    
+    log_message(LOG_DEBUG, "Received command from socket %d: %s", client_socket, buffer);
+    
+    if (strncmp(buffer, "PROTO ", 6) == 0) {
+        handle_protocol_request(conn, buffer + 6);
+        return 0;
+    }
+    
+    if (process_client_command(conn, buffer) != 0) {
+        log_message(LOG_CLIENT, "Client (socket %d) requested exit", client_socket);
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Called by the epoll reactor when the socket turns readable. Edge-triggered,
+// so keep pulling frames until the kernel buffer is empty.
+// Reads a burst with one syscall and dispatches every complete frame in it,
+// repeating until the socket is drained
+int client_message_loop(connection_t *conn) {
+    int client_socket = conn->fd;
+    
+    // Frames that arrived behind a /sendfile wait here until its transfer is done
+    if (conn->inbuf_len > 0) {
+        if (connection_dispatch_frames(conn) != 0) {
+            return -1;
         }
-        
-        end = file_path + strlen(file_path) - 1;
-        while (end > file_path && (*end == ' ' || *end == '\n' || *end == '\t')) {
-            *end = '\0';
-            end--;
+        if (connection_is_parked(conn)) {
+            return 0;
         }
+    }
+    
+    while (server_running) {
+        ssize_t bytes_received = connection_fill(conn);
         
-        log_message(LOG_CLIENT, "Login attempt: user '%s' from %s:%d, path: %s", username, client_ip, client_port, file_path);
+        if (bytes_received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            log_message(LOG_ERROR, "recv failed in client message loop for socket %d: %s", client_socket, strerror(errno));
+            return -1;
+        }
         
-        if (validate_username(username) != 0) {
-            log_message(LOG_WARNING, "Invalid username format: %s from %s:%d", username, client_ip, client_port);
-            yellow();
-            printf("Invalid username format: %s\n", username);
+        if (bytes_received == 0) {
+            log_message(LOG_CLIENT, "Client (socket %d) disconnected", client_socket);
+            cyan();
+            printf("Client disconnected\n");
             reset();
-            send_message(client_socket, "Invalid username format");
-            continue;
+            return -1;
         }
         
-        if (find_client_by_username(username) != NULL) {
-            log_message(LOG_WARNING, "Username already taken: %s from %s:%d", username, client_ip, client_port);
-            yellow();
-            printf("Username already taken: %s\n", username);
-            reset();
-            send_message(client_socket, "Username already taken");
+        if (connection_dispatch_frames(conn) != 0) {
+            return -1;
+        }
+        // A file transfer owns the socket now
+        if (connection_is_parked(conn)) {
+            return 0;
+        }
+    }
+    
+    return 0;
+}
+
+
+// Returns the caller's room with room_mutex held, or NULL when the room is
+// gone. The handle is valid while the slot still carries the generation the
+// client joined; room memory is never freed, so locking a stale one is safe.
+static room_info_t* session_lock_room(connection_t *conn) {
+    client_info_t *client = conn->client;
+    room_info_t *room = conn->room;
+    
+    if (room) {
+        pthread_mutex_lock(&room->room_mutex);
+        if (room->in_use && room->generation == client->current_room_generation) {
+            return room;
+        }
+        pthread_mutex_unlock(&room->room_mutex);
+    }
+    
+    room = lock_room_handle(client->current_room_index, client->current_room_generation);
+    conn->room = room;
+    return room;
+}
+
+static void session_clear_room(connection_t *conn) {
+    client_info_t *client = conn->client;
+    
+    client->current_room_name[0] = '\0';
+    client->current_room_index = -1;
+    client->current_room_generation = 0;
+    conn->room = NULL;
+}
+
+// Text for protocol 1 peers, the writer's body for protocol 2 peers. A body
+// that overflowed its buffer falls back to the text wrapped in WIRE_OP_TEXT.
+int send_reply(int client_socket, const char *text, const wire_writer_t *w) {
+    const char *texts[1] = { text };
+    wire_message_t msg = { .texts = texts, .count = 1 };
+    msg.body = wire_writer_body(w, &msg.body_len);
+    return send_wire_message(client_socket, &msg);
+}
+
+// Caller holds room->room_mutex
+static void room_announce_member(room_info_t *room, const client_info_t *client, const client_info_t *skip,
+                                 int event, const char *text) {
+    uint8_t body[128];
+    wire_writer_t w;
+    wire_writer_init(&w, body, sizeof(body), WIRE_OP_MEMBER);
+    wire_write_varint(&w, room->room_id);
+    wire_write_varint(&w, client->user_id);
+    wire_write_varint(&w, event);
+    wire_write_string(&w, client->username, strlen(client->username));
+    
+    const char *texts[1] = { text };
+    wire_message_t msg = { .texts = texts, .count = 1 };
+    msg.body = wire_writer_body(&w, &msg.body_len);
+    room_send_all(room, skip, &msg, NULL);
+}
+
+// Protocol 2 clients learn the ids of the members already in the room they
+// joined, room messages only carry the sender's id. Caller holds room_mutex.
+static void send_room_roster(connection_t *conn, room_info_t *room) {
+    for (int i = 0; i < MAX_CLIENTS_PER_ROOM; i++) {
+        client_info_t *member = room->clients[i];
+        if (!member || member == conn->client || !member->is_active) {
             continue;
         }
         
+        uint8_t body[128];
+        wire_writer_t w;
+        wire_writer_init(&w, body, sizeof(body), WIRE_OP_MEMBER);
+        wire_write_varint(&w, room->room_id);
+        wire_write_varint(&w, member->user_id);
+        wire_write_varint(&w, WIRE_MEMBER_PRESENT);
+        wire_write_string(&w, member->username, strlen(member->username));
         
-        client_info_t *client = add_client(username, client_socket, thread_id, 
-                                          client_ip, client_port, file_path);
-        
-        if (client == NULL) {
-            log_message(LOG_ERROR, "Failed to add client '%s' to list", username);
-            red();
-            printf("Failed to add client to list\n");
-            reset();
-            send_message(client_socket, "Server error");
-            continue;
+        char text[64];
+        snprintf(text, sizeof(text), "ROOM_NOTIFICATION %s is in the room", member->username);
+        send_reply(conn->fd, text, &w);
+    }
+}
+
+
+
+// ==========================================
+// COMMAND DISPATCH
+// ==========================================
+
+#define COMMAND(name, opcode, words, needs_rest, closes, usage, handler) \
+    { name, sizeof(name) - 1, opcode, words, needs_rest, closes, usage, handler }
+
+// One row per command, adding a command is adding a row
+static const command_desc_t command_table[] = {
+    COMMAND("/join",      WIRE_OP_JOIN,      0, 1, 0, "ERROR Usage: /join <room_name>",              handle_join_command),
+    COMMAND("/leave",     WIRE_OP_LEAVE,     0, 0, 0, NULL,                                          handle_leave_command),
+    COMMAND("/broadcast", WIRE_OP_BROADCAST, 0, 1, 0, "ERROR Usage: /broadcast <message>",           handle_broadcast_command),
+    COMMAND("/whisper",   WIRE_OP_WHISPER,   1, 1, 0, "ERROR Usage: /whisper <username> <message>",  handle_whisper_command),
+    COMMAND("/sendfile",  WIRE_OP_SENDFILE,  1, 1, 0, "ERROR Usage: /sendfile <filename> <username>", handle_sendfile_command),
+    COMMAND("/exit",      WIRE_OP_EXIT,      0, 0, 1, NULL,                                          handle_exit_command),
+    COMMAND("/resume",    WIRE_OP_RESUME,    0, 0, 0, NULL,                                          handle_resume_command),
+    COMMAND("/ack",       WIRE_OP_FILE_ACK,  1, 1, 0, "ERROR Usage: /ack <transfer_id> <offset>",    handle_ack_command),
+    COMMAND("/size64",    WIRE_OP_SIZE64,    0, 0, 0, NULL,                                          handle_size64_command),
+};
+
+#define COMMAND_COUNT ((int)(sizeof(command_table) / sizeof(command_table[0])))
+
+static int is_command_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Splits the leading words off text and trims the remainder, terminating
+// every view in place. Returns the number of words found.
+static int tokenize_arguments(char *text, int words, command_args_t *args) {
+    memset(args, 0, sizeof(*args));
+    char *ptr = text;
+    int found = 0;
+    
+    while (found < words) {
+        while (is_command_space(*ptr)) {
+            ptr++;
+        }
+        if (*ptr == '\0') {
+            break;
         }
         
-        send_message(client_socket, "LOGIN_SUCCESS");
-        log_message(LOG_CLIENT, "User '%s' successfully logged in from %s:%d", username, client_ip, client_port);
-        green();
-        printf("User '%s' connected\n", username);
-        reset();
+        char *word = ptr;
+        while (*ptr != '\0' && !is_command_space(*ptr)) {
+            ptr++;
+        }
+        args->words[found].ptr = word;
+        args->words[found].len = ptr - word;
+        found++;
         
-        return 0; 
+        if (*ptr != '\0') {
+            *ptr++ = '\0';
+        }
+    }
+    
+    while (is_command_space(*ptr)) {
+        ptr++;
     }
+    char *end = ptr + strlen(ptr);
+    while (end > ptr && is_command_space(end[-1])) {
+        end--;
+    }
+    *end = '\0';
+    args->rest.ptr = ptr;
+    args->rest.len = end - ptr;
+    
+    return found;
 }
 
-int validate_username(const char *username) {
-    if (username == NULL) {
-        return -1;
+static const command_desc_t* find_command(const char *name, size_t len) {
+    for (int i = 0; i < COMMAND_COUNT; i++) {
+        if (command_table[i].name_len == len && memcmp(command_table[i].name, name, len) == 0) {
+            return &command_table[i];
+        }
+    }
+    return NULL;
+}
+
+static const command_desc_t* find_opcode(uint8_t opcode) {
+    for (int i = 0; i < COMMAND_COUNT; i++) {
+        if (command_table[i].opcode == opcode) {
+            return &command_table[i];
+        }
+    }
+    return NULL;
+}
+
+// Checks the arguments against the descriptor and runs the handler.
+// Returns -1 when the command ends the session.
+static int run_command(connection_t *conn, const command_desc_t *desc, const command_args_t *args, int words) {
+    if (words < desc->words || (desc->needs_rest && args->rest.len == 0)) {
+        log_message(LOG_WARNING, "Missing arguments for %s from socket %d", desc->name, conn->fd);
+        send_message(conn->fd, desc->usage);
+        return 0;
     }
     
-    size_t len = strlen(username);
+    desc->handler(conn, args);
     
-    if (len == 0 || len > 16) {
-        log_message(LOG_WARNING, "Username validation failed: invalid length (%zu)", len);
-        return -1;
+    return desc->closes_connection ? -1 : 0;
+}
+
+// Protocol 2 command: opcode, the descriptor's words, then the remainder.
+// The fields are terminated in place once all of them have been read, the
+// byte after each string belongs to a length that is already consumed.
+int process_binary_command(connection_t *conn, char *body, size_t len) {
+    int client_socket = conn->fd;
+    
+    const command_desc_t *desc = find_opcode((uint8_t)body[0]);
+    if (!desc) {
+        log_message(LOG_WARNING, "Unknown opcode 0x%02x from socket %d", (uint8_t)body[0], client_socket);
+        send_message(client_socket, "ERROR Unknown command");
+        return 0;
     }
     
-    for (size_t i = 0; i < len; i++) {
-        if (!isalnum(username[i])) {
-            log_message(LOG_WARNING, "Username validation failed: non-alphanumeric character in '%s'", username);
-            return -1;
-        }
+    wire_reader_t reader;
+    wire_reader_init(&reader, body + 1, len - 1);
+    
+    command_args_t args;
+    memset(&args, 0, sizeof(args));
+    int words = 0;
+    
+    while (words < desc->words && reader.pos < reader.end) {
+        args.words[words].ptr = (char *)wire_read_string(&reader, &args.words[words].len);
+        words++;
+    }
+    if (reader.pos < reader.end) {
+        args.rest.ptr = (char *)wire_read_string(&reader, &args.rest.len);
     }
     
-    return 0;
-}
-
-
-void client_message_loop(int client_socket) {
-    char buffer[4096];
-    int bytes_received;
+    if (reader.error || reader.pos != reader.end) {
+        log_message(LOG_WARNING, "Malformed %s frame from socket %d", desc->name, client_socket);
+        send_message(client_socket, "ERROR Malformed command");
+        return 0;
+    }
     
-    log_message(LOG_CLIENT, "Starting message loop for socket %d", client_socket);
+    token_view_t *fields[MAX_COMMAND_WORDS + 1];
+    int field_count = 0;
+    for (int i = 0; i < words; i++) {
+        fields[field_count++] = &args.words[i];
+    }
+    fields[field_count++] = &args.rest;
     
-    while (server_running) {
-        fd_set read_fds;
-        struct timeval timeout;
-        
-        FD_ZERO(&read_fds);
-        FD_SET(client_socket, &read_fds);
-        
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        
-        int select_result = select(client_socket + 1, &read_fds, NULL, NULL, &timeout);
-        
-        if (select_result < 0) {
-            if (errno == EINTR) {
-                // printf("select() interrupted by signal for client (socket %d)\n", client_socket);
-                continue;
-            }
-            log_message(LOG_ERROR, "select failed in client message loop for socket %d: %s", client_socket, strerror(errno));
-            // perror("select failed in client message loop");
-            break;
-        }
-        else if (select_result == 0) {
+    for (int i = 0; i < field_count; i++) {
+        if (!fields[i]->ptr) {
+            fields[i]->ptr = body + len;    // the frame terminator
             continue;
         }
-        else {
-            if (FD_ISSET(client_socket, &read_fds)) {
-                // printf("Data available from client (socket %d), receiving...\n", client_socket);
-                
-                bytes_received = receive_message(client_socket, buffer, sizeof(buffer));
-                
-                if (bytes_received <= 0) {
-                    if (bytes_received == 0) {
-                        log_message(LOG_CLIENT, "Client (socket %d) disconnected", client_socket);
-                        cyan();
-                        printf("Client disconnected\n");
-                        reset();
-                    } else {
-                        log_message(LOG_ERROR, "Failed to receive message from socket %d", client_socket);
-                        // perror("Failed to receive message");
-                    }
-                    break;
-                }
-                
-                buffer[bytes_received] = '\0';
-                log_message(LOG_DEBUG, "Received command from socket %d: %s", client_socket, buffer);
-                // printf("Received command from client (socket %d): %s\n", client_socket, buffer);
-                
-                process_client_command(client_socket, buffer);
-                
-                if (strncmp(buffer, "/exit", 5) == 0) {
-                    log_message(LOG_CLIENT, "Client (socket %d) requested exit", client_socket);
-                    // printf("Client (socket %d) requested exit\n", client_socket);
-                    break;
-                }
-            }
+        if (memchr(fields[i]->ptr, '\0', fields[i]->len)) {
+            log_message(LOG_WARNING, "Embedded NUL in %s frame from socket %d", desc->name, client_socket);
+            send_message(client_socket, "ERROR Malformed command");
+            return 0;
         }
+        fields[i]->ptr[fields[i]->len] = '\0';
     }
     
-    log_message(LOG_CLIENT, "Message loop ended for socket %d", client_socket);
-    // printf("Message loop ended for client (socket %d)\n", client_socket);
+    return run_command(conn, desc, &args, words);
 }
 
-
-void process_client_command(int client_socket, const char *command) {
-    if (command == NULL || strlen(command) == 0) {
+// Returns -1 when the command ends the session
+int process_client_command(connection_t *conn, char *command) {
+    int client_socket = conn->fd;
+    
+    while (command && is_command_space(*command)) {
+        command++;
+    }
+    
+    if (command == NULL || *command == '\0') {
         log_message(LOG_WARNING, "Empty command received from socket %d", client_socket);
         send_message(client_socket, "ERROR Empty command");
-        return;
+        return 0;
     }
     
     log_message(LOG_DEBUG, "Processing command from socket %d: %s", client_socket, command);
     // printf("Processing command: %s\n", command);
     
-    if (strncmp(command, "/join ", 6) == 0) {
-        handle_join_command(client_socket, command + 6);
-    }
-    else if (strncmp(command, "/leave", 6) == 0) {
-        handle_leave_command(client_socket);
-    }
-    else if (strncmp(command, "/broadcast ", 11) == 0) {
-        handle_broadcast_command(client_socket, command + 11);
-    }
-    else if (strncmp(command, "/whisper ", 9) == 0) {
-        handle_whisper_command(client_socket, command + 9);
+    size_t name_len = 0;
+    while (command[name_len] != '\0' && !is_command_space(command[name_len])) {
+        name_len++;
     }
-    else if (strncmp(command, "/sendfile ", 10) == 0) {
-        handle_sendfile_command(client_socket, command + 10);
-    }
-    else if (strncmp(command, "/exit", 5) == 0) {
-        handle_exit_command(client_socket);
-    }
-    else {
+    
+    const command_desc_t *desc = find_command(command, name_len);
+    if (!desc) {
         log_message(LOG_WARNING, "Unknown command from socket %d: %s", client_socket, command);
         char error_msg[256];
         snprintf(error_msg, sizeof(error_msg), "ERROR Unknown command: %s", command);
         send_message(client_socket, error_msg);
+        return 0;
     }
+    
+    command_args_t args;
+    int words = tokenize_arguments(command + name_len, desc->words, &args);
+    
+    return run_command(conn, desc, &args, words);
 }
 
 
-void cleanup_client_connection(int client_socket) {
+void cleanup_client_connection(connection_t *conn) {
+    int client_socket = conn->fd;
+    
     if (client_socket != -1) {
         log_message(LOG_CLIENT, "Cleaning up client connection (socket %d)", client_socket);
         // printf("Cleaning up client (socket %d)\n", client_socket);
         
-        client_info_t *client = find_client_by_socket(client_socket);
+        client_info_t *client = conn->client;
         if (client) {
-            if (strlen(client->current_room_name) > 0) {
-                room_info_t *current_room = find_room(client->current_room_name);
+            if (client->current_room_index >= 0) {
+                room_info_t *current_room = session_lock_room(conn);
                 if (current_room) {
-                    pthread_mutex_lock(&current_room->room_mutex);
-                    
                     for (int i = 0; i < MAX_CLIENTS_PER_ROOM; i++) {
                         if (current_room->clients[i] == client) {
                             current_room->clients[i] = NULL;
@@ -519,11 +852,7 @@ void cleanup_client_connection(int client_socket) {
                     char notification[256];
                     snprintf(notification, sizeof(notification), "ROOM_NOTIFICATION %s disconnected", client->username);
                     
-                    for (int i = 0; i < MAX_CLIENTS_PER_ROOM; i++) {
-                        if (current_room->clients[i] && current_room->clients[i]->is_active) {
-                            send_message(current_room->clients[i]->socket_fd, notification);
-                        }
-                    }
+                    room_announce_member(current_room, client, NULL, WIRE_MEMBER_DISCONNECTED, notification);
                     
                     char room_name_copy[MAX_ROOM_NAME_LENGTH + 1];
                     strncpy(room_name_copy, current_room->room_name, sizeof(room_name_copy));
@@ -532,13 +861,15 @@ void cleanup_client_connection(int client_socket) {
                     
                     pthread_mutex_unlock(&current_room->room_mutex);
                     
-                    if (room_client_count == 0) {
+                    if (room_client_count == 0 &&
+                        remove_room_handle(current_room, client->current_room_generation) == 0) {
                         log_message(LOG_ROOM, "Room '%s' is empty, removing", room_name_copy);
                         yellow();
                         printf("Room '%s' removed (empty)\n", room_name_copy);
                         reset();
                     }
                 }
+                session_clear_room(conn);
             }
             
             log_message(LOG_CLIENT, "User '%s' disconnected from %s:%d", client->username, client->client_ip, client->client_port);
@@ -546,48 +877,16 @@ void cleanup_client_connection(int client_socket) {
             printf("User '%s' disconnected\n", client->username);
             reset();
         }
-        
-        close(client_socket);
         // printf("Client (socket %d) cleanup complete\n", client_socket);
     }
 }
 
-void handle_join_command(int client_socket, const char *room_name) {
-    if (!room_name || strlen(room_name) == 0) {
-        log_message(LOG_WARNING, "Empty room name in join command from socket %d", client_socket);
-        send_message(client_socket, "ERROR Usage: /join <room_name>");
-        return;
-    }
-    
-    client_info_t *client = find_client_by_socket(client_socket);
-    if (!client) {
-        log_message(LOG_ERROR, "Unable to identify client for socket %d in join command", client_socket);
-        send_message(client_socket, "ERROR Unable to identify client");
-        return;
-    }
-    
-    char clean_room_name[MAX_ROOM_NAME_LENGTH + 1];
-    strncpy(clean_room_name, room_name, sizeof(clean_room_name) - 1);
-    clean_room_name[sizeof(clean_room_name) - 1] = '\0';
-    
-    char *start = clean_room_name;
-    while (*start == ' ' || *start == '\t') {
-        start++;
-    }
+void handle_join_command(connection_t *conn, const command_args_t *args) {
+    int client_socket = conn->fd;
+    client_info_t *client = conn->client;
+    const char *start = args->rest.ptr;
     
-    char *end = start + strlen(start) - 1;
-    while (end > start && (*end == ' ' || *end == '\t' || *end == '\n')) {
-        *end = '\0';
-        end--;
-    }
-    
-    if (strlen(start) == 0) {
-        log_message(LOG_WARNING, "Empty room name after cleaning from user '%s'", client->username);
-        send_message(client_socket, "ERROR Room name cannot be empty");
-        return;
-    }
-    
-    if (strlen(start) > MAX_ROOM_NAME_LENGTH) {
+    if (args->rest.len > MAX_ROOM_NAME_LENGTH) {
         log_message(LOG_WARNING, "Room name too long from user '%s': %s", client->username, start);
         char error_msg[128];
         snprintf(error_msg, sizeof(error_msg), "ERROR Room name too long (max %d characters)", MAX_ROOM_NAME_LENGTH);
@@ -595,8 +894,8 @@ void handle_join_command(int client_socket, const char *room_name) {
         return;
     }
     
-    for (char *ptr = start; *ptr != '\0'; ptr++) {
-        if (!isalnum(*ptr)) {
+    for (size_t i = 0; i < args->rest.len; i++) {
+        if (!isalnum((unsigned char)start[i])) {
             log_message(LOG_WARNING, "Invalid room name format from user '%s': %s", client->username, start);
             send_message(client_socket, "ERROR Room name must be alphanumeric only (no spaces or special characters)");
             return;
@@ -611,11 +910,11 @@ void handle_join_command(int client_socket, const char *room_name) {
         return;
     }
     
-    if (strlen(client->current_room_name) > 0) {
-        room_info_t *old_room = find_room(client->current_room_name);
+    if (client->current_room_index >= 0) {
+        room_info_t *old_room = session_lock_room(conn);
+        uint32_t old_generation = client->current_room_generation;
+        session_clear_room(conn);
         if (old_room) {
-            pthread_mutex_lock(&old_room->room_mutex);
-            
             for (int i = 0; i < MAX_CLIENTS_PER_ROOM; i++) {
                 if (old_room->clients[i] == client) {
                     old_room->clients[i] = NULL;
@@ -628,32 +927,44 @@ void handle_join_command(int client_socket, const char *room_name) {
                 }
             }
             
+            char old_name[MAX_ROOM_NAME_LENGTH + 1];
+            memcpy(old_name, old_room->room_name, sizeof(old_name));
+            int old_client_count = old_room->client_count;
             pthread_mutex_unlock(&old_room->room_mutex);
             
-            if (old_room->client_count == 0) {
-                log_message(LOG_ROOM, "Room '%s' is empty, removing", old_room->room_name);
+            if (old_client_count == 0 && remove_room_handle(old_room, old_generation) == 0) {
+                log_message(LOG_ROOM, "Room '%s' is empty, removing", old_name);
                 // printf("[ROOM] Room '%s' is empty, removing...\n", old_room->room_name);
-                remove_room(old_room->room_name);
             }
         }
     }
     
-    room_info_t *target_room = find_room(start);
-    if (!target_room) {
-        target_room = add_room(start);
+    room_info_t *target_room = NULL;
+    while (!target_room) {
+        target_room = find_room(start);
         if (!target_room) {
-            log_message(LOG_ERROR, "Failed to create room '%s' for user '%s'", start, client->username);
-            send_message(client_socket, "ERROR Failed to create room");
-            return;
+            target_room = add_room(start);
+            if (!target_room) {
+                log_message(LOG_ERROR, "Failed to create room '%s' for user '%s'", start, client->username);
+                send_message(client_socket, "ERROR Failed to create room");
+                return;
+            }
+            log_message(LOG_ROOM, "Created new room '%s'", start);
+            green();
+            printf("Room '%s' created\n", start);
+            reset();
+        }
+        
+        pthread_mutex_lock(&target_room->room_mutex);
+        
+        // An empty room can be removed and its slot recycled between the
+        // lookup and the lock, look it up again
+        if (!target_room->in_use || strcmp(target_room->room_name, start) != 0) {
+            pthread_mutex_unlock(&target_room->room_mutex);
+            target_room = NULL;
         }
-        log_message(LOG_ROOM, "Created new room '%s'", start);
-        green();
-        printf("Room '%s' created\n", start);
-        reset();
     }
     
-    pthread_mutex_lock(&target_room->room_mutex);
-    
     if (target_room->client_count >= MAX_CLIENTS_PER_ROOM) {
         pthread_mutex_unlock(&target_room->room_mutex);
         log_message(LOG_WARNING, "Room '%s' is full, user '%s' cannot join", start, client->username);
@@ -685,33 +996,48 @@ void handle_join_command(int client_socket, const char *room_name) {
     
     strncpy(client->current_room_name, start, sizeof(client->current_room_name) - 1);
     client->current_room_name[sizeof(client->current_room_name) - 1] = '\0';
-    client->current_room_index = get_room_index(start);
+    client->current_room_index = target_room->room_id;
+    client->current_room_generation = target_room->generation;
+    conn->room = target_room;
+    
+    // Once unlocked the slot can be freed and recycled, only these copies
+    // are safe to use until it is locked and checked again
+    int room_id = target_room->room_id;
+    int room_client_count = target_room->client_count;
+    uint32_t room_generation = target_room->generation;
     
     pthread_mutex_unlock(&target_room->room_mutex);
     
     char success_msg[256];
     snprintf(success_msg, sizeof(success_msg), "JOIN_SUCCESS Joined room '%s' (%d/%d clients)", 
-             start, target_room->client_count, MAX_CLIENTS_PER_ROOM);
-    send_message(client_socket, success_msg);
+             start, room_client_count, MAX_CLIENTS_PER_ROOM);
     
-    pthread_mutex_lock(&target_room->room_mutex);
+    uint8_t body[128];
+    wire_writer_t w;
+    wire_writer_init(&w, body, sizeof(body), WIRE_OP_JOINED);
+    wire_write_varint(&w, room_id);
+    wire_write_varint(&w, room_client_count);
+    wire_write_varint(&w, MAX_CLIENTS_PER_ROOM);
+    wire_write_string(&w, start, args->rest.len);
+    send_reply(client_socket, success_msg, &w);
     
-    char notification[256];
-    snprintf(notification, sizeof(notification), "ROOM_NOTIFICATION %s joined the room", client->username);
+    pthread_mutex_lock(&target_room->room_mutex);
     
-    for (int i = 0; i < MAX_CLIENTS_PER_ROOM; i++) {
-        if (target_room->clients[i] && 
-            target_room->clients[i]->is_active && 
-            target_room->clients[i] != client) {
-            
-            send_message(target_room->clients[i]->socket_fd, notification);
+    if (target_room->in_use && target_room->generation == room_generation) {
+        if (conn->protocol == WIRE_PROTO_BINARY) {
+            send_room_roster(conn, target_room);
         }
+        
+        char notification[256];
+        snprintf(notification, sizeof(notification), "ROOM_NOTIFICATION %s joined the room", client->username);
+        
+        room_announce_member(target_room, client, client, WIRE_MEMBER_JOINED, notification);
     }
     
     pthread_mutex_unlock(&target_room->room_mutex);
     
     log_message(LOG_JOIN, "User '%s' joined room '%s' (%d/%d clients)", 
-               client->username, start, target_room->client_count, MAX_CLIENTS_PER_ROOM);
+               client->username, start, room_client_count, MAX_CLIENTS_PER_ROOM);
     blue();
     printf("User '%s' joined room '%s'\n", client->username, start);
     reset();
@@ -719,30 +1045,25 @@ void handle_join_command(int client_socket, const char *room_name) {
 
 
 
-void handle_leave_command(int client_socket) {
-    client_info_t *client = find_client_by_socket(client_socket);
-    if (!client) {
-        log_message(LOG_ERROR, "Unable to identify client for socket %d in leave command", client_socket);
-        send_message(client_socket, "ERROR Unable to identify client");
-        return;
-    }
+void handle_leave_command(connection_t *conn, const command_args_t *args) {
+    (void)args;
+    int client_socket = conn->fd;
+    client_info_t *client = conn->client;
     
-    if (strlen(client->current_room_name) == 0) {
+    if (client->current_room_index < 0) {
         log_message(LOG_WARNING, "User '%s' tried to leave but not in any room", client->username);
         send_message(client_socket, "ERROR You are not in any room");
         return;
     }
     
-    room_info_t *current_room = find_room(client->current_room_name);
+    room_info_t *current_room = session_lock_room(conn);
     if (!current_room) {
         log_message(LOG_WARNING, "Room '%s' no longer exists for user '%s'", client->current_room_name, client->username);
-        client->current_room_name[0] = '\0';
-        client->current_room_index = -1;
+        session_clear_room(conn);
         send_message(client_socket, "ERROR Room no longer exists");
         return;
     }
-    
-    pthread_mutex_lock(&current_room->room_mutex);
+    uint32_t room_generation = client->current_room_generation;
     
     int client_found = 0;
     for (int i = 0; i < MAX_CLIENTS_PER_ROOM; i++) {
@@ -762,8 +1083,7 @@ void handle_leave_command(int client_socket) {
     if (!client_found) {
         pthread_mutex_unlock(&current_room->room_mutex);
         log_message(LOG_WARNING, "User '%s' was not properly registered in room '%s'", client->username, client->current_room_name);
-        client->current_room_name[0] = '\0';
-        client->current_room_index = -1;
+        session_clear_room(conn);
         send_message(client_socket, "ERROR You were not properly registered in the room");
         return;
     }
@@ -771,28 +1091,29 @@ void handle_leave_command(int client_socket) {
     char notification[256];
     snprintf(notification, sizeof(notification), "ROOM_NOTIFICATION %s left the room", client->username);
     
-    for (int i = 0; i < MAX_CLIENTS_PER_ROOM; i++) {
-        if (current_room->clients[i] && current_room->clients[i]->is_active) {
-            send_message(current_room->clients[i]->socket_fd, notification);
-        }
-    }
+    room_announce_member(current_room, client, NULL, WIRE_MEMBER_LEFT, notification);
     
     char room_name_copy[MAX_ROOM_NAME_LENGTH + 1];
     strncpy(room_name_copy, current_room->room_name, sizeof(room_name_copy));
     room_name_copy[sizeof(room_name_copy) - 1] = '\0';
     
     int room_client_count = current_room->client_count;
+    int room_id = current_room->room_id;
     
     pthread_mutex_unlock(&current_room->room_mutex);
     
-    client->current_room_name[0] = '\0';
-    client->current_room_index = -1;
+    session_clear_room(conn);
     
     char success_msg[256];
     snprintf(success_msg, sizeof(success_msg), "LEAVE_SUCCESS Left room '%s'", room_name_copy);
-    send_message(client_socket, success_msg);
     
-    if (room_client_count == 0) {
+    uint8_t body[16];
+    wire_writer_t w;
+    wire_writer_init(&w, body, sizeof(body), WIRE_OP_LEFT);
+    wire_write_varint(&w, room_id);
+    send_reply(client_socket, success_msg, &w);
+    
+    if (room_client_count == 0 && remove_room_handle(current_room, room_generation) == 0) {
         log_message(LOG_ROOM, "Room '%s' is empty, removing", room_name_copy);
         yellow();
         printf("Room '%s' removed (empty)\n", room_name_copy);
@@ -807,21 +1128,28 @@ void handle_leave_command(int client_socket) {
 
 
 
-void handle_broadcast_command(int client_socket, const char *message) {
-    if (!message || strlen(message) == 0) {
-        log_message(LOG_WARNING, "Empty broadcast message from socket %d", client_socket);
-        send_message(client_socket, "ERROR Usage: /broadcast <message>");
-        return;
-    }
-    
-    client_info_t *sender = find_client_by_socket(client_socket);
-    if (!sender) {
-        log_message(LOG_ERROR, "Unable to identify sender for socket %d in broadcast", client_socket);
-        send_message(client_socket, "ERROR Unable to identify sender");
-        return;
-    }
+typedef struct {
+    char *buf;
+    size_t size;
+    const char *username;
+    const char *room_name;
+    const char *message;
+    int message_len;
+} broadcast_text_t;
+
+static const char* render_broadcast(void *ctx) {
+    broadcast_text_t *text = ctx;
+    snprintf(text->buf, text->size, "BROADCAST [%s@%s]: %.*s",
+             text->username, text->room_name, text->message_len, text->message);
+    return text->buf;
+}
+
+void handle_broadcast_command(connection_t *conn, const command_args_t *args) {
+    int client_socket = conn->fd;
+    client_info_t *sender = conn->client;
+    const char *start = args->rest.ptr;
     
-    if (strlen(sender->current_room_name) == 0) {
+    if (sender->current_room_index < 0) {
         log_message(LOG_WARNING, "User '%s' tried to broadcast but not in any room", sender->username);
         send_message(client_socket, "ERROR You must join a room first to broadcast messages");
         red();
@@ -830,319 +1158,259 @@ void handle_broadcast_command(int client_socket, const char *message) {
         return;
     }
     
-    room_info_t *current_room = find_room(sender->current_room_name);
+    room_info_t *current_room = session_lock_room(conn);
     if (!current_room) {
         log_message(LOG_WARNING, "Room '%s' no longer exists for user '%s' broadcast", sender->current_room_name, sender->username);
-        sender->current_room_name[0] = '\0';
-        sender->current_room_index = -1;
+        session_clear_room(conn);
         send_message(client_socket, "ERROR Room no longer exists. Please join a room first.");
         return;
     }
     
-    char clean_message[1024];
-    strncpy(clean_message, message, sizeof(clean_message) - 1);
-    clean_message[sizeof(clean_message) - 1] = '\0';
-    
-    char *start = clean_message;
-    while (*start == ' ' || *start == '\t') {
-        start++;
-    }
-    
-    char *end = start + strlen(start) - 1;
-    while (end > start && (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r')) {
-        *end = '\0';
-        end--;
-    }
+    size_t message_len = args->rest.len < MAX_BROADCAST_LENGTH ? args->rest.len : MAX_BROADCAST_LENGTH;
     
-    if (strlen(start) == 0) {
-        log_message(LOG_WARNING, "Empty broadcast message after cleaning from user '%s'", sender->username);
-        send_message(client_socket, "ERROR Broadcast message cannot be empty");
-        return;
-    }
+    // The text line is only formatted if a protocol 1 member is in the room
+    broadcast_text_t text = { conn->scratch, sizeof(conn->scratch), sender->username,
+                              current_room->room_name, start, (int)message_len };
     
-    pthread_mutex_lock(&current_room->room_mutex);
+    uint8_t body[MAX_BROADCAST_LENGTH + 32];
+    wire_writer_t w;
+    wire_writer_init(&w, body, sizeof(body), WIRE_OP_ROOM_MESSAGE);
+    wire_write_varint(&w, current_room->room_id);
+    wire_write_varint(&w, sender->user_id);
+    wire_write_string(&w, start, message_len);
     
-    char broadcast_msg[1200];
-    snprintf(broadcast_msg, sizeof(broadcast_msg), "BROADCAST [%s@%s]: %s", 
-             sender->username, current_room->room_name, start);
+    wire_message_t msg = { .render = render_broadcast, .render_ctx = &text };
+    msg.body = wire_writer_body(&w, &msg.body_len);
     
-    int messages_sent = 0;
     int total_recipients = 0;
-    
-    for (int i = 0; i < MAX_CLIENTS_PER_ROOM; i++) {
-        if (current_room->clients[i] && 
-            current_room->clients[i]->is_active && 
-            current_room->clients[i] != sender) {
-            
-            total_recipients++;
-            
-            if (send_message(current_room->clients[i]->socket_fd, broadcast_msg) == 0) {
-                messages_sent++;
-            } else {
-                log_message(LOG_WARNING, "Failed to deliver broadcast to '%s'", current_room->clients[i]->username);
-                // printf("[BROADCAST-WARNING] Failed to deliver message to '%s'\n", 
-                //        current_room->clients[i]->username);
-            }
-        }
-    }
+    int messages_sent = room_send_all(current_room, sender, &msg, &total_recipients);
     
     current_room->total_messages_sent++;
     current_room->last_activity = time(NULL);
+    int room_id = current_room->room_id;
+    char room_name[MAX_ROOM_NAME_LENGTH + 1];
+    memcpy(room_name, current_room->room_name, sizeof(room_name));
     
     pthread_mutex_unlock(&current_room->room_mutex);
     
-    char confirmation[256];
-    if (messages_sent == total_recipients) {
-        snprintf(confirmation, sizeof(confirmation), 
-                 "BROADCAST_SUCCESS Message delivered to %d recipient(s) in room '%s'", 
-                 total_recipients, current_room->room_name);
+    if (conn->protocol == WIRE_PROTO_BINARY) {
+        wire_writer_init(&w, body, sizeof(body), WIRE_OP_BROADCAST_ACK);
+        wire_write_varint(&w, room_id);
+        wire_write_varint(&w, messages_sent);
+        wire_write_varint(&w, total_recipients);
+        
+        wire_message_t ack = { .texts = NULL };
+        ack.body = wire_writer_body(&w, &ack.body_len);
+        send_wire_message(client_socket, &ack);
     } else {
-        snprintf(confirmation, sizeof(confirmation), 
-                 "BROADCAST_PARTIAL Message delivered to %d/%d recipient(s) in room '%s'", 
-                 messages_sent, total_recipients, current_room->room_name);
+        char confirmation[256];
+        if (messages_sent == total_recipients) {
+            snprintf(confirmation, sizeof(confirmation), 
+                     "BROADCAST_SUCCESS Message delivered to %d recipient(s) in room '%s'", 
+                     total_recipients, room_name);
+        } else {
+            snprintf(confirmation, sizeof(confirmation), 
+                     "BROADCAST_PARTIAL Message delivered to %d/%d recipient(s) in room '%s'", 
+                     messages_sent, total_recipients, room_name);
+        }
+        
+        send_message(client_socket, confirmation);
     }
     
-    send_message(client_socket, confirmation);
-    
     log_message(LOG_BROADCAST, "User '%s' in room '%s': %s (sent to %d/%d clients)", 
-               sender->username, current_room->room_name, start, messages_sent, total_recipients);
+               sender->username, room_name, start, messages_sent, total_recipients);
     cyan();
-    printf("Broadcast from %s@%s: %s\n", sender->username, current_room->room_name, start);
+    printf("Broadcast from %s@%s: %s\n", sender->username, room_name, start);
     reset();
 }
 
 
-void handle_whisper_command(int client_socket, const char *whisper_args) {
-    if (!whisper_args || strlen(whisper_args) == 0) {
-        log_message(LOG_WARNING, "Empty whisper arguments from socket %d", client_socket);
-        send_message(client_socket, "ERROR Usage: /whisper <username> <message>");
-        return;
-    }
-    
-    client_info_t *sender = find_client_by_socket(client_socket);
-    if (!sender) {
-        log_message(LOG_ERROR, "Unable to identify sender for socket %d in whisper", client_socket);
-        send_message(client_socket, "ERROR Unable to identify sender");
-        return;
-    }
-    
-    char *args_copy = malloc(strlen(whisper_args) + 1);
-    strcpy(args_copy, whisper_args);
-    
-    char *space = strchr(args_copy, ' ');
-    if (!space) {
-        log_message(LOG_WARNING, "Invalid whisper format from user '%s'", sender->username);
-        send_message(client_socket, "ERROR Usage: /whisper <username> <message>");
-        free(args_copy);
-        return;
-    }
-    
-    *space = '\0';
-    char *target_username = args_copy;
-    char *message = space + 1;
-    
-    while (*message == ' ' || *message == '\t') {
-        message++;
-    }
-    
-    if (strlen(message) == 0) {
-        log_message(LOG_WARNING, "Empty whisper message from user '%s'", sender->username);
-        send_message(client_socket, "ERROR Message cannot be empty");
-        free(args_copy);
-        return;
-    }
+void handle_whisper_command(connection_t *conn, const command_args_t *args) {
+    int client_socket = conn->fd;
+    client_info_t *sender = conn->client;
+    const char *target_username = args->words[0].ptr;
+    const char *message = args->rest.ptr;
     
     if (strcmp(sender->username, target_username) == 0) {
         log_message(LOG_WARNING, "User '%s' tried to whisper to self", sender->username);
         send_message(client_socket, "ERROR Cannot whisper to yourself");
-        free(args_copy);
         return;
     }
     
-    client_info_t *target = find_client_by_username(target_username);
-    if (!target || !target->is_active) {
+    // A copy and a held connection, the entry can be freed and the socket
+    // number reused as soon as the registry lock is dropped
+    client_info_t target;
+    connection_t *target_conn = find_client_connection(target_username, &target);
+    if (!target_conn) {
         log_message(LOG_WARNING, "Whisper target '%s' not found (from user '%s')", target_username, sender->username);
         char error_msg[256];
-        snprintf(error_msg, sizeof(error_msg), "ERROR User '%s' not found or offline", target_username);
+        snprintf(error_msg, sizeof(error_msg), "ERROR User '%.32s' not found or offline", target_username);
         send_message(client_socket, error_msg);
-        free(args_copy);
         return;
     }
     
     char whisper_msg[1024];
     snprintf(whisper_msg, sizeof(whisper_msg), "WHISPER [%s → %s]: %s", 
-             sender->username, target->username, message);
-    
-    if (send_message(target->socket_fd, whisper_msg) < 0) {
+             sender->username, target.username, message);
+    
+    uint8_t body[1024 + 64];
+    wire_writer_t w;
+    wire_writer_init(&w, body, sizeof(body), WIRE_OP_WHISPER_MESSAGE);
+    wire_write_varint(&w, sender->user_id);
+    wire_write_string(&w, sender->username, strlen(sender->username));
+    wire_write_string(&w, message, args->rest.len < 1000 ? args->rest.len : 1000);
+    
+    int delivered = send_reply(target.socket_fd, whisper_msg, &w);
+    connection_put(target_conn);
+    if (delivered < 0) {
         log_message(LOG_ERROR, "Failed to deliver whisper from '%s' to '%s'", sender->username, target_username);
         send_message(client_socket, "ERROR Failed to deliver whisper");
-        free(args_copy);
         return;
     }
     
     char confirm_msg[256];
-    snprintf(confirm_msg, sizeof(confirm_msg), "WHISPER_SENT Whisper sent to %s", target_username);
-    send_message(client_socket, confirm_msg);
+    snprintf(confirm_msg, sizeof(confirm_msg), "WHISPER_SENT Whisper sent to %s", target.username);
     
-    log_message(LOG_WHISPER, "%s → %s: %s", sender->username, target->username, message);
+    wire_writer_init(&w, body, sizeof(body), WIRE_OP_WHISPER_ACK);
+    wire_write_varint(&w, target.user_id);
+    wire_write_string(&w, target.username, strlen(target.username));
+    send_reply(client_socket, confirm_msg, &w);
+    
+    log_message(LOG_WHISPER, "%s → %s: %s", sender->username, target.username, message);
     yellow();
-    printf("Whisper %s → %s: %s\n", sender->username, target->username, message);
+    printf("Whisper %s → %s: %s\n", sender->username, target.username, message);
     reset();
-    
-    free(args_copy);
 }
 
 
-void handle_sendfile_command(int client_socket, const char *file_args) {
-    if (!file_args || strlen(file_args) == 0) {
-        log_message(LOG_WARNING, "Empty sendfile arguments from socket %d", client_socket);
-        send_message(client_socket, "ERROR Usage: /sendfile <filename> <username>");
-        return;
-    }
-    
-    client_info_t *sender = find_client_by_socket(client_socket);
-    if (!sender) {
-        log_message(LOG_ERROR, "Unable to identify sender for socket %d in sendfile", client_socket);
-        send_message(client_socket, "ERROR Unable to identify sender");
-        return;
-    }
-    
-    char *args_copy = malloc(strlen(file_args) + 1);
-    if (!args_copy) {
-        log_message(LOG_ERROR, "Memory allocation failed for sendfile args from user '%s'", sender->username);
-        send_message(client_socket, "ERROR Server memory error");
-        return;
-    }
-    strcpy(args_copy, file_args);
-    
-    char *space = strchr(args_copy, ' ');
-    if (!space) {
-        log_message(LOG_WARNING, "Invalid sendfile format from user '%s'", sender->username);
-        send_message(client_socket, "ERROR Usage: /sendfile <filename> <username>");
-        free(args_copy);
-        return;
-    }
-    
-    *space = '\0';
-    char *filename = args_copy;
-    char *target_username = space + 1;
-    
-    while (*target_username == ' ') target_username++;
-    char *end = filename + strlen(filename) - 1;
-    while (end > filename && *end == ' ') *end-- = '\0';
-    end = target_username + strlen(target_username) - 1;
-    while (end > target_username && *end == ' ') *end-- = '\0';
-    
-    if (strlen(filename) == 0 || strlen(target_username) == 0) {
-        log_message(LOG_WARNING, "Empty filename or username in sendfile from user '%s'", sender->username);
-        send_message(client_socket, "ERROR Filename and username cannot be empty");
-        free(args_copy);
+void handle_sendfile_command(connection_t *conn, const command_args_t *args) {
+    int client_socket = conn->fd;
+    client_info_t *sender = conn->client;
+    const char *filename = args->words[0].ptr;
+    const char *target_username = args->rest.ptr;
+    
+    if (args->words[0].len >= MAX_FILENAME_LENGTH) {
+        log_message(LOG_WARNING, "Filename too long from user '%s'", sender->username);
+        send_message(client_socket, "ERROR Filename too long");
         return;
     }
     
     if (!validate_file_extension(filename)) {
         log_message(LOG_WARNING, "Invalid file extension '%s' from user '%s'", filename, sender->username);
-        send_message(client_socket, "ERROR Invalid file type. Allowed: .txt, .pdf, .jpg, .png");
-        free(args_copy);
+        char allowed[128];
+        char error_msg[192];
+        format_allowed_extensions(allowed, sizeof(allowed));
+        snprintf(error_msg, sizeof(error_msg), "ERROR Invalid file type. Allowed: %s", allowed);
+        send_message(client_socket, error_msg);
         return;
     }
     
     if (strcmp(sender->username, target_username) == 0) {
         log_message(LOG_WARNING, "User '%s' tried to send file to self", sender->username);
         send_message(client_socket, "ERROR Cannot send file to yourself");
-        free(args_copy);
         return;
     }
     
-    client_info_t *receiver = find_client_by_username(target_username);
-    if (!receiver || !receiver->is_active) {
+    client_info_t receiver;
+    connection_t *receiver_conn = find_client_connection(target_username, &receiver);
+    if (!receiver_conn) {
         log_message(LOG_WARNING, "Sendfile target '%s' not found (from user '%s')", target_username, sender->username);
         char error_msg[256];
-        snprintf(error_msg, sizeof(error_msg), "ERROR User '%s' not found or offline", target_username);
+        snprintf(error_msg, sizeof(error_msg), "ERROR User '%.32s' not found or offline", target_username);
         send_message(client_socket, error_msg);
-        free(args_copy);
         return;
     }
-    
-    if (is_file_queue_full()) {
-        log_message(LOG_WARNING, "File queue full, rejecting sendfile from user '%s'", sender->username);
-        char error_msg[256];
-        snprintf(error_msg, sizeof(error_msg), 
-                 "ERROR Upload queue is full (%d/%d). Please try again later.", 
-                 MAX_UPLOAD_QUEUE, MAX_UPLOAD_QUEUE);
-        send_message(client_socket, error_msg);
-        free(args_copy);
-        return;
+    // The transfer looks the receiver up again by name when it starts
+    connection_put(receiver_conn);
+    
+    char receiver_name[sizeof(receiver.username)];
+    memcpy(receiver_name, receiver.username, sizeof(receiver_name));
+    
+    // The upload is requested once a transfer worker picks the job up, the
+    // connection sits out until then
+    if (submit_file_transfer(conn, filename, receiver_name) != 0) {
+        if (errno == EBUSY) {
+            log_message(LOG_WARNING, "File queue full, rejecting sendfile from user '%s'", sender->username);
+            char error_msg[256];
+            snprintf(error_msg, sizeof(error_msg), 
+                     "ERROR Upload queue is full (%d/%d). Please try again later.", 
+                     get_file_queue_waiting(), global_file_queue.capacity);
+            send_message(client_socket, error_msg);
+            return;
+        }
+        log_message(LOG_ERROR, "Failed to add file transfer to queue: %s from '%s' to '%s'", filename, sender->username, receiver_name);
+        send_message(client_socket, "ERROR Failed to add to transfer queue");
     }
-    
-    char upload_request[512];
-    snprintf(upload_request, sizeof(upload_request), "FILE_UPLOAD_REQUEST:%s:%s", filename, target_username);
-    if (send_message(client_socket, upload_request) != 0) {
-        log_message(LOG_ERROR, "Failed to send upload request to user '%s'", sender->username);
-        send_message(client_socket, "ERROR Failed to initiate file transfer");
-        free(args_copy);
+}
+
+
+// "/resume" turns chunked transfers on and lists the downloads the client
+// missed, "/resume <transfer_id> <offset>" asks for the rest of one of them
+void handle_resume_command(connection_t *conn, const command_args_t *args) {
+    int client_socket = conn->fd;
+    client_info_t *client = conn->client;
+    
+    if (file_transfer_mode != FILE_TRANSFER_STORE) {
+        send_message(client_socket, "ERROR Resumable transfers are only available in store mode");
         return;
     }
     
-    char *file_data = NULL;
-    size_t file_size = 0;
-    
-    if (receive_file_from_client(client_socket, filename, &file_data, &file_size) != 0) {
-        log_message(LOG_ERROR, "Failed to receive file data '%s' from user '%s'", filename, sender->username);
-        send_message(client_socket, "ERROR Failed to receive file data");
-        free(args_copy);
+    if (args->rest.len == 0) {
+        client->chunked_transfers = 1;
+        int offered = file_resume_offer(client_socket, client->username);
+        
+        char reply[32];
+        snprintf(reply, sizeof(reply), "RESUME_OK %d", offered);
+        send_message(client_socket, reply);
+        log_message(LOG_CLIENT, "User '%s' turned chunked transfers on, %d to resume", client->username, offered);
         return;
     }
     
-    int queue_index = add_to_file_queue(filename, sender->username, receiver->username,
-                                       file_data, file_size, sender->socket_fd, receiver->socket_fd);
-    
-    if (queue_index < 0) {
-        log_message(LOG_ERROR, "Failed to add file transfer to queue: %s from '%s' to '%s'", filename, sender->username, receiver->username);
-        send_message(client_socket, "ERROR Failed to add to transfer queue");
-        free(file_data);
-        free(args_copy);
+    unsigned int transfer_id;
+    unsigned long long offset;
+    if (sscanf(args->rest.ptr, "%u %llu", &transfer_id, &offset) != 2 || transfer_id == 0) {
+        send_message(client_socket, "ERROR Usage: /resume [<transfer_id> <offset>]");
         return;
     }
     
-    log_message(LOG_SENDFILE, "Processing transfer: %s -> %s (%s, %zu bytes)", sender->username, receiver->username, filename, file_size);
-    // printf("[SENDFILE] Processing transfer immediately: %s -> %s\n", sender->username, receiver->username);
-    
-    if (send_file_to_client(receiver->socket_fd, filename, sender->username, file_data, file_size) == 0) {
-        char success_msg[512];
-        snprintf(success_msg, sizeof(success_msg), 
-                 "FILE_TRANSFER_SUCCESS File '%s' sent successfully to %s (%zu bytes)",
-                 filename, target_username, file_size);
-        send_message(client_socket, success_msg);
-        
-        log_message(LOG_SENDFILE, "Transfer completed: %s -> %s (%s, %zu bytes)", 
-                   sender->username, receiver->username, filename, file_size);
-        green();
-        printf("File transfer completed: %s -> %s (%s)\n",
-               sender->username, receiver->username, filename);
-        reset();
-    } else {
-        char error_msg[512];
-        snprintf(error_msg, sizeof(error_msg), 
-                 "FILE_TRANSFER_FAILED Failed to send '%s' to %s",
-                 filename, target_username);
+    if (submit_file_resume(conn, transfer_id, (size_t)offset) != 0) {
+        if (errno == EBUSY) {
+            log_message(LOG_WARNING, "File queue full, rejecting resume from user '%s'", client->username);
+            send_message(client_socket, "ERROR Upload queue is full. Please try again later.");
+            return;
+        }
+        log_message(LOG_WARNING, "User '%s' asked to resume unknown transfer %u", client->username, transfer_id);
+        char error_msg[64];
+        snprintf(error_msg, sizeof(error_msg), "ERROR No interrupted transfer %u", transfer_id);
         send_message(client_socket, error_msg);
-        
-        log_message(LOG_ERROR, "Transfer failed: %s -> %s (%s)", sender->username, receiver->username, filename);
-        red();
-        printf("File transfer failed: %s -> %s (%s)\n",
-               sender->username, receiver->username, filename);
-        reset();
     }
+}
+
+// "/ack <transfer_id> <offset>" from a chunked download's receiver
+void handle_ack_command(connection_t *conn, const command_args_t *args) {
+    uint32_t transfer_id = (uint32_t)strtoul(args->words[0].ptr, NULL, 10);
+    size_t offset = (size_t)strtoull(args->rest.ptr, NULL, 10);
     
-    remove_from_file_queue(queue_index);
-    free(args_copy);
+    if (file_resume_ack(transfer_id, conn->client->username, offset) != 0) {
+        log_message(LOG_DEBUG, "Ack for transfer %u from user '%s' matches nothing in flight",
+                   transfer_id, conn->client->username);
+    }
+}
+
+// "/size64": downloads of 4 GB and more may be sent to this client, their raw
+// size as WIRE_SIZE_ESCAPE and a u64. Smaller ones keep the 4-byte size.
+void handle_size64_command(connection_t *conn, const command_args_t *args) {
+    (void)args;
+    conn->client->wide_file_sizes = 1;
+    log_message(LOG_CLIENT, "User '%s' takes 64-bit file sizes", conn->client->username);
 }
 
 
 
-void handle_exit_command(int client_socket) {
-    client_info_t *client = find_client_by_socket(client_socket);
+void handle_exit_command(connection_t *conn, const command_args_t *args) {
+    (void)args;
+    int client_socket = conn->fd;
+    client_info_t *client = conn->client;
     if (client) {
         log_message(LOG_CLIENT, "User '%s' requested exit", client->username);
         green();
@@ -1157,147 +1425,6 @@ void handle_exit_command(int client_socket) {
 
 
 
-void *handle_client(void *arg) {
-    char client_ip[INET_ADDRSTRLEN];
-    int client_port;
-    
-    int client_socket = setup_client_connection(arg, client_ip, &client_port);
-    if (client_socket == -1) {
-        log_message(LOG_ERROR, "Failed to setup client connection");
-        return NULL;
-    }
-    
-    if (handle_client_login(client_socket, pthread_self(), client_ip, client_port) != 0) {
-        log_message(LOG_ERROR, "Login failed for client %s:%d (socket %d)", client_ip, client_port, client_socket);
-        // printf("Login failed for client %s:%d (socket %d)\n", 
-        //        client_ip, client_port, client_socket);
-        cleanup_client_connection(client_socket);
-        return NULL;
-    }
-    
-    client_message_loop(client_socket);
-    
-    cleanup_client_connection(client_socket);
-    remove_client(client_socket);
-    
-    return NULL;
-}
-
-const char* log_level_to_string(log_level_t level) {
-    switch (level) {
-        case LOG_INFO:      return "INFO";
-        case LOG_ERROR:     return "ERROR";
-        case LOG_WARNING:   return "WARNING";
-        case LOG_DEBUG:     return "DEBUG";
-        case LOG_CLIENT:    return "CLIENT";
-        case LOG_ROOM:      return "ROOM";
-        case LOG_FILE:      return "FILE";
-        case LOG_SERVER:    return "SERVER";
-        case LOG_JOIN:      return "JOIN";
-        case LOG_BROADCAST: return "BROADCAST";
-        case LOG_WHISPER:   return "WHISPER";
-        case LOG_LEAVE:     return "LEAVE";
-        case LOG_SENDFILE:  return "SENDFILE";
-        default:            return "UNKNOWN";
-    }
-}
-
-void init_logging(void) {
-    logging_shutdown = 0;  // Initialize shutdown flag
-    
-    pthread_mutex_lock(&log_mutex);
-    
-    // Open log file in write mode (overwrites existing file)
-    log_file = fopen("server.log", "w");
-    
-    if (!log_file) {
-        perror("[LOGGING] Failed to open server.log");
-        pthread_mutex_unlock(&log_mutex);
-        return;
-    }
-    
-    pthread_mutex_unlock(&log_mutex);
-    
-    log_message(LOG_SERVER, "=== Server logging system initialized ===");
-    printf("[LOGGING] Logging system initialized - writing to server.log\n");
-}
-
-void cleanup_logging(void) {
-    static volatile sig_atomic_t cleanup_done = 0;
-    
-    // Prevent multiple cleanup calls
-    if (cleanup_done) {
-        return;
-    }
-    cleanup_done = 1;
-    
-    logging_shutdown = 1;
-    
-    int lock_result = pthread_mutex_trylock(&log_mutex);
-    
-    if (lock_result == 0) {
-        if (log_file) {
-            time_t now = time(NULL);
-            struct tm *tm_info = localtime(&now);
-            char timestamp[64];
-            strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
-            
-            fprintf(log_file, "[%s] [%s] %s\n", timestamp, "SERVER", 
-                    "=== Server shutting down - logging system cleanup ===");
-            fflush(log_file);
-            
-            fclose(log_file);
-            log_file = NULL;
-        }
-        
-        pthread_mutex_unlock(&log_mutex);
-        pthread_mutex_destroy(&log_mutex);
-    } else {
-        if (log_file) {
-            fclose(log_file);
-            log_file = NULL;
-        }
-    }
-    
-    printf("[LOGGING] Logging system cleaned up\n");
-}
-
-void log_message(log_level_t level, const char *format, ...) {
-    if (!format || logging_shutdown) return;
-    
-    pthread_mutex_lock(&log_mutex);
-    
-    if (logging_shutdown) {
-        pthread_mutex_unlock(&log_mutex);
-        return;
-    }
-    
-
-    
-    if (!log_file) {
-        pthread_mutex_unlock(&log_mutex);
-        return;
-    }
-    
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
-    
-    fprintf(log_file, "[%s] [%s] ", timestamp, log_level_to_string(level));
-    
-    va_list args;
-    va_start(args, format);
-    vfprintf(log_file, format, args);
-    va_end(args);
-    
-    fprintf(log_file, "\n");
-    fflush(log_file);
-    
-    pthread_mutex_unlock(&log_mutex);
-}
-
-
 void shutdown_all_clients(void) {
     printf("[SHUTDOWN] Notifying all connected clients...\n");
     log_message(LOG_SERVER, "Sending shutdown notification to all connected clients");
@@ -1319,7 +1446,7 @@ void shutdown_all_clients(void) {
         printf("[SHUTDOWN] No active file transfers found\n");
     }
     
-    pthread_mutex_lock(&client_list_mutex);
+    client_registry_read_lock();
     
     client_info_t *current = client_list_head;
     int notification_count = 0;
@@ -1336,58 +1463,63 @@ void shutdown_all_clients(void) {
         current = current->next;
     }
     
-    pthread_mutex_unlock(&client_list_mutex);
+    client_registry_unlock();
     
     printf("[SHUTDOWN] Sent shutdown notification to %d clients\n", notification_count);
     log_message(LOG_SERVER, "Shutdown notification sent to %d clients", notification_count);
 }
 
 int count_active_threads(void) {
-    pthread_mutex_lock(&client_list_mutex);
-    int count = active_client_count;
-    pthread_mutex_unlock(&client_list_mutex);
-    return count;
+    return count_clients();
 }
 
 
+static void notify_cancelled_transfer(const file_queue_item_t *item) {
+    // Notify sender
+    char sender_msg[512];
+    snprintf(sender_msg, sizeof(sender_msg), 
+            "FILE_TRANSFER_ABORT Server shutting down - file transfer of '%s' to '%s' cancelled", 
+            item->filename, item->receiver_username);
+    
+    if (send_message(item->sender_socket, sender_msg) == 0) {
+        printf("[FILE-SHUTDOWN] Notified sender '%s' about cancelled transfer\n", item->sender_username);
+    }
+    
+    char receiver_msg[512];
+    snprintf(receiver_msg, sizeof(receiver_msg), 
+            "FILE_TRANSFER_ABORT Server shutting down - incoming file '%s' from '%s' cancelled", 
+            item->filename, item->sender_username);
+    
+    if (send_message(item->receiver_socket, receiver_msg) == 0) {
+        printf("[FILE-SHUTDOWN] Notified receiver '%s' about cancelled transfer\n", item->receiver_username);
+    }
+    
+    printf("[FILE-SHUTDOWN] Cancelled transfer: %s -> %s (%s)\n", 
+           item->sender_username, item->receiver_username, item->filename);
+}
+
 void notify_file_transfer_shutdown(void) {
     pthread_mutex_lock(&global_file_queue.mutex);
     
-    printf("[FILE-SHUTDOWN] Checking file transfer queue (%d items)\n", global_file_queue.count);
+    int pending = global_file_queue.count + global_file_queue.running_count;
+    printf("[FILE-SHUTDOWN] Checking file transfer queue (%d items)\n", pending);
     
-    if (global_file_queue.count == 0) {
+    if (pending == 0) {
         pthread_mutex_unlock(&global_file_queue.mutex);
         printf("[FILE-SHUTDOWN] No active file transfers\n");
         return;
     }
     
-    printf("[FILE-SHUTDOWN] Notifying clients about %d pending file transfers\n", global_file_queue.count);
+    printf("[FILE-SHUTDOWN] Notifying clients about %d pending file transfers\n", pending);
     
-    // Notify all clients involved in file transfers
-    for (int i = 0; i < global_file_queue.count; i++) {
-        file_queue_item_t *item = &global_file_queue.items[i];
-        
-        // Notify sender
-        char sender_msg[512];
-        snprintf(sender_msg, sizeof(sender_msg), 
-                "FILE_TRANSFER_ABORT Server shutting down - file transfer of '%s' to '%s' cancelled", 
-                item->filename, item->receiver_username);
-        
-        if (send_message(item->sender_socket, sender_msg) == 0) {
-            printf("[FILE-SHUTDOWN] Notified sender '%s' about cancelled transfer\n", item->sender_username);
-        }
-        
-        char receiver_msg[512];
-        snprintf(receiver_msg, sizeof(receiver_msg), 
-                "FILE_TRANSFER_ABORT Server shutting down - incoming file '%s' from '%s' cancelled", 
-                item->filename, item->sender_username);
-        
-        if (send_message(item->receiver_socket, receiver_msg) == 0) {
-            printf("[FILE-SHUTDOWN] Notified receiver '%s' about cancelled transfer\n", item->receiver_username);
+    // Notify all clients involved in file transfers, running ones first
+    for (int i = 0; i < FILE_TRANSFER_WORKERS; i++) {
+        if (global_file_queue.running[i].active) {
+            notify_cancelled_transfer(&global_file_queue.running[i]);
         }
-        
-        printf("[FILE-SHUTDOWN] Cancelled transfer: %s -> %s (%s)\n", 
-               item->sender_username, item->receiver_username, item->filename);
+    }
+    for (int i = 0; i < global_file_queue.count; i++) {
+        notify_cancelled_transfer(file_queue_waiting_item(i));
     }
     
     pthread_mutex_unlock(&global_file_queue.mutex);
@@ -1399,18 +1531,18 @@ void abort_all_file_transfers(void) {
     
     printf("[FILE-SHUTDOWN] Aborting %d pending file transfers\n", global_file_queue.count);
     
+    // Running transfers are cut off by stop_file_transfer_workers()
     for (int i = 0; i < global_file_queue.count; i++) {
-        if (global_file_queue.items[i].file_data) {
+        file_queue_item_t *item = file_queue_waiting_item(i);
+        if (item->file_data) {
             printf("[FILE-SHUTDOWN] Freeing file data for: %s (%zu bytes)\n", 
-                   global_file_queue.items[i].filename, 
-                   global_file_queue.items[i].file_size);
-            
-            free(global_file_queue.items[i].file_data);
-            global_file_queue.items[i].file_data = NULL;
+                   item->filename, item->file_size);
         }
+        release_file_queue_item(item);
     }
     
     global_file_queue.count = 0;
+    global_file_queue.head = global_file_queue.tail;
     
     pthread_mutex_unlock(&global_file_queue.mutex);
     
@@ -17,15 +17,16 @@
 #include <time.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <sys/uio.h>
 #include "../utils/utils.h"  
+#include "../utils/wire.h"
 
 
 
-extern pthread_mutex_t log_mutex;
-extern FILE *log_file;
 
 
 extern int server_socket;
+extern int shutdown_event_fd;
 extern volatile sig_atomic_t server_running;
 extern volatile sig_atomic_t logging_shutdown;
 
@@ -36,11 +37,32 @@ extern volatile sig_atomic_t logging_shutdown;
 
 
 
-#define MAX_UPLOAD_QUEUE 5
-#define MAX_FILE_SIZE (3 * 1024 * 1024 )  // 3MB
+#define FILE_TRANSFER_WORKERS 4         // threads that run queued /sendfile transfers
+#define MAX_FILE_SIZE (3 * 1024 * 1024 )  // 3MB, largest upload store mode stages; relays stream any size
 #define MAX_FILENAME_LENGTH 256
 #define CHUNK_SIZE 4096
 
+#define FILE_STAGE_BUDGET (1024 * 1024)    // default memory for pooled staging of stored uploads
+#define FILE_STAGE_BLOCK_SIZE (64 * 1024)  // largest upload staged in a pooled block
+#define FILE_STAGE_WINDOW (1024 * 1024)    // spilled bytes a transfer keeps mapped in
+#define FILE_STAGE_SHMEM_BUDGET (64 * 1024 * 1024) // memfd spill bytes, past it uploads spill to disk
+
+#define FILE_RESUME_SLOTS 16            // interrupted chunked transfers kept for a retry
+#define FILE_RESUME_TIMEOUT 600         // seconds an interrupted transfer is kept
+
+#define URING_FILE_BATCH (CHUNK_SIZE * 16)  // file bytes moved per io_uring_enter
+#define RELAY_BUFFER_SIZE (CHUNK_SIZE * 16) // upload bytes a relayed transfer holds at once, pipe or buffer
+
+#define MAX_FRAME_SIZE 4096             // largest command frame, including the terminator
+#define MAX_BROADCAST_LENGTH 1023       // message bytes relayed by /broadcast
+#define MAX_BATCH_FRAMES 16             // frames send_messages() will coalesce into one write
+#define LOG_RING_RECORDS 4096           // pending log records, a power of two
+#define LOG_RECORD_SIZE 512             // formatted message bytes kept per record
+#define LOG_BATCH_BYTES (64 * 1024)     // log bytes the writer thread hands to one write()
+#define CONN_INBUF_SIZE 16384           // per-connection read-ahead, must hold a full frame
+#define OUTBOUND_HIGH_WATERMARK (256 * 1024)  // default queued bytes before a client is throttled
+#define OUTBOUND_LOW_WATERMARK (64 * 1024)    // default level a throttled queue must drain to
+
 
 typedef enum {
     LOG_INFO,       
@@ -55,9 +77,26 @@ typedef enum {
     LOG_BROADCAST,
     LOG_WHISPER,
     LOG_LEAVE,
-    LOG_SENDFILE 
+    LOG_SENDFILE,
+    LOG_CATEGORY_COUNT
 } log_level_t;
 
+#define LOG_BIT(level) (1u << (level))
+#define LOG_MASK_ALL (LOG_BIT(LOG_CATEGORY_COUNT) - 1)
+#define LOG_MASK_DEFAULT (LOG_MASK_ALL & ~LOG_BIT(LOG_DEBUG))
+
+// Categories built into the binary, e.g. make LOG_COMPILED_MASK='~LOG_BIT(LOG_DEBUG)'
+#ifndef LOG_COMPILED_MASK
+#define LOG_COMPILED_MASK LOG_MASK_ALL
+#endif
+
+#define LOG_MASK_FILE "server.logmask"  // categories re-read on SIGHUP
+#define LOG_BINARY_FILE "server.log.bin" // written instead of server.log with -f binary
+#define LOG_MAX_FORMATS 4096            // distinct log_message() formats the binary log can hold
+#define LOG_BINARY_FLUSH_MS 100         // longest a binary record waits for the writer
+#define LOG_STAGE_BYTES (256 * 1024)    // per-thread binary log backlog, a power of two
+#define LOG_STAGE_IOVECS 64             // thread stages the writer drains per writev()
+
 
 
 typedef struct file_queue_item {
@@ -69,32 +108,91 @@ typedef struct file_queue_item {
     time_t created_time;
     int sender_socket;          
     int receiver_socket;        
+    int active;                     // a thread is running the transfer
+    struct timespec queued_at;      // CLOCK_MONOTONIC, for the time spent waiting
+    uint32_t sender_user_id;        // for the download header, the sender may log out first
+    struct connection *sender_conn; // sender's connection, referenced and parked when queued
+    int parked;                     // sender_conn waits for connection_resume()
+    int chunked;                    // sender turned chunked transfers on
+    uint32_t resume_id;             // a /resume download: sender_socket and sender_conn are the receiver's
+    size_t resume_offset;           // where the receiver wants it to pick up
 } file_queue_item_t;
 
 typedef struct {
-    file_queue_item_t items[MAX_UPLOAD_QUEUE];
+    file_queue_item_t *items;       // ring buffer of transfers waiting for a worker
+    int capacity;
+    int head;
+    int tail;
     int count;                   
+    file_queue_item_t running[FILE_TRANSFER_WORKERS];  // by worker slot, or inline transfers
+    int running_count;
+    int idle_workers;
+    int notify_position;            // tell waiting senders their place in line
+    int stopping;                   // transfer workers are shutting down
+    
+    unsigned long jobs_queued;
+    unsigned long full_rejects;     // turned away by a full queue
+    int count_high_water;
+    unsigned long long wait_ns;     // time queued jobs spent waiting for a worker
+    unsigned long long max_wait_ns;
+    
     pthread_mutex_t mutex;        
+    pthread_cond_t job_ready;       // an item was queued for the transfer workers
 } file_queue_t;
 
 extern file_queue_t global_file_queue;
 
+// A stored upload: a pooled block, or a spilled memfd or temp file mapped at data
+typedef struct {
+    char *data;
+    size_t size;
+    int spill_fd;                   // -1 for a pooled block
+    int spill_shmem;                // spill_fd is a memfd, counted against the shmem budget
+    size_t trimmed;                 // spilled bytes already dropped from memory
+} file_stage_t;
 
+typedef enum {
+    FILE_RESUME_FREE,
+    FILE_RESUME_UPLOADING,
+    FILE_RESUME_UPLOAD_PARKED,      // upload broke off, the same /sendfile picks it up
+    FILE_RESUME_SENDING,
+    FILE_RESUME_SEND_PARKED         // download broke off, offered again when the receiver is back
+} file_resume_state_t;
+
+// A chunked store-mode transfer, kept with what it has staged when a
+// connection drops. Only the thread running it touches the stage.
 typedef struct {
-    int client_socket;
-    char client_ip[INET_ADDRSTRLEN];
-    int client_port;
-} client_thread_data_t;
+    uint32_t id;
+    file_resume_state_t state;
+    char filename[MAX_FILENAME_LENGTH];
+    char sender_username[17];
+    char receiver_username[17];
+    uint32_t sender_user_id;
+    file_stage_t stage;             // size 0 until the upload announced it
+    size_t offset;                  // bytes staged, or bytes sent to the receiver
+    size_t acked;                   // bytes the receiver confirmed
+    time_t parked_at;
+} file_resume_t;
+
+// How /sendfile moves the upload to the receiver
+typedef enum {
+    FILE_TRANSFER_SPLICE,        // relay socket to socket through a pipe, epoll only
+    FILE_TRANSFER_RELAY,         // forward each chunk as it arrives
+    FILE_TRANSFER_STORE          // read the whole file first, then send it
+} file_transfer_mode_t;
 
+extern file_transfer_mode_t file_transfer_mode;
 
 
 typedef struct client_info {
     char username[17];                   
     int socket_fd;                        
     pthread_t thread_id;                  
+    uint32_t user_id;                     // wire id, never reused while the server runs
     
     char current_room_name[33];           
-    int current_room_index;               
+    int current_room_index;               // room_id of the room joined, -1 when in none
+    uint32_t current_room_generation;     // generation of that room_id when it was joined
     
     char client_ip[INET_ADDRSTRLEN];      
     int client_port;                      
@@ -105,8 +203,13 @@ typedef struct client_info {
     int is_active;                        
     int is_uploading;                     
     int is_downloading;                   
+    int chunked_transfers;                // turned chunked file transfers on with /resume
+    int wide_file_sizes;                  // reads 64-bit raw file sizes, turned on with /size64
     
-    struct client_info *next; 
+    struct client_info *next;
+    struct client_info *prev;
+    struct client_info *socket_next;      // chain in the socket hash index
+    struct client_info *name_next;        // chain in the username hash index 
 } client_info_t;
 
 
@@ -125,20 +228,121 @@ typedef struct room_info {
     
     pthread_mutex_t room_mutex;    
 
+    int room_id;                               // stable slot in the room directory
+    uint32_t generation;                       // bumped each time the slot holds a new room
+    int in_use;                                // cleared when the slot is recycled
+    struct room_info *hash_next;               // chain in the name index
+
     struct room_info *next;                   
+    struct room_info *prev;
 } room_info_t;
 
 
 
+typedef enum {
+    CONN_STATE_LOGIN_USERNAME,
+    CONN_STATE_LOGIN_PATH,
+    CONN_STATE_ACTIVE
+} connection_state_t;
+
+// Immutable wire bytes (length prefix + text, possibly several frames)
+// built once and shared by every outbound queue that carries them
+typedef struct shared_frame {
+    int refs;
+    int protocol;                       // wire format the bytes are encoded in
+    size_t len;
+    char data[];
+} shared_frame_t;
+
+typedef struct connection {
+    int fd;
+    char client_ip[INET_ADDRSTRLEN];
+    int client_port;
+
+    connection_state_t state;
+    char pending_username[64];          // username frame held until the path frame arrives
+
+    char *inbuf;                        // ring of unparsed input, CONN_INBUF_SIZE bytes
+    size_t inbuf_head;                  // offset of the first unparsed byte
+    size_t inbuf_len;                   // unparsed bytes starting at inbuf_head
+
+    // Session, touched only by the worker currently servicing the connection
+    client_info_t *client;              // registry entry, set once the login succeeds
+    room_info_t *room;                  // cached handle of the client's room, revalidated under room_mutex
+    char scratch[MAX_FRAME_SIZE];       // outgoing text formatted by the command handlers
+
+    int refs;                           // fd table + senders holding it, guarded by the table lock
+
+    pthread_mutex_t io_mutex;           // guards every field below
+    int busy;                           // handed to a worker, epoll registration is disarmed
+    int protocol;                       // wire format in both directions, read unlocked by the owning worker
+    uint32_t pending_events;            // events that fired while busy
+    int closed;
+    shared_frame_t **out_ring;          // bounded outbound queue drained by the reactor
+    int out_capacity;
+    int out_first;                      // ring index of the oldest frame
+    int out_count;
+    size_t out_offset;                  // bytes of the oldest frame already written
+    size_t out_bytes;                   // queued bytes not yet written
+    int out_throttled;                  // crossed the high watermark, dropping until below low
+    int out_raw;                        // raw file bytes being streamed, queue must wait
+    int parked;                         // handed to a file transfer, see connection_park()
+    unsigned long out_dropped;
+    int ring_ops;                       // io_uring requests in flight, URING_OP_* bits
+    int ring_buffer;                    // provided buffer a completed receive left, -1 if none
+    size_t ring_buffer_offset;          // bytes of it already copied into inbuf
+    size_t ring_buffer_len;
+
+    struct reactor_shard *shard;        // event loop that owns this socket
+    struct connection *prev;
+    struct connection *next;
+} connection_t;
+
+
+
+// Command frames are tokenized once, in place, into views that carry their
+// length, handlers never rescan or copy their arguments
+typedef struct {
+    char *ptr;                          // NUL terminated inside the frame buffer
+    size_t len;
+} token_view_t;
+
+#define MAX_COMMAND_WORDS 2
+
+typedef struct {
+    token_view_t words[MAX_COMMAND_WORDS];  // leading whitespace-separated arguments
+    token_view_t rest;                      // trimmed remainder, may contain spaces
+} command_args_t;
+
+typedef void (*command_handler_t)(connection_t *conn, const command_args_t *args);
+
+typedef struct {
+    const char *name;                   // command word including the leading '/'
+    size_t name_len;
+    uint8_t opcode;                     // protocol 2 opcode, fields are the words then the remainder
+    int words;                          // arguments split off before the remainder
+    int needs_rest;                     // remainder must be non-empty
+    int closes_connection;
+    const char *usage;                  // sent when the arguments are missing
+    command_handler_t handler;
+} command_desc_t;
+
+
+
 extern room_info_t *room_list_head;
 extern int total_room_count;
-extern pthread_mutex_t room_list_mutex;
+extern pthread_rwlock_t room_list_lock;
 
 
 
 extern client_info_t *client_list_head;
 extern int active_client_count;
-extern pthread_mutex_t client_list_mutex;
+extern pthread_rwlock_t client_list_lock;
+
+void client_registry_read_lock(void);
+void client_registry_write_lock(void);
+void client_registry_unlock(void);
+void client_registry_log_stats(void);
 
 
 
@@ -148,9 +352,11 @@ void cleanup_clients(void);
 client_info_t* add_client(const char *username, int socket_fd, pthread_t thread_id, 
                          const char *client_ip, int client_port, const char *file_path);
 int remove_client(int socket_fd);
+int remove_client_entry(client_info_t *client);
 int remove_client_by_username(const char *username);
 
 client_info_t* find_client_by_username(const char *username);
+connection_t* find_client_connection(const char *username, client_info_t *copy);
 client_info_t* find_client_by_socket(int socket_fd);
 client_info_t* find_client_by_thread(pthread_t thread_id);
 
@@ -165,10 +371,12 @@ void cleanup_rooms(void);
 
 room_info_t* add_room(const char *room_name);
 int remove_room(const char *room_name);
+int remove_room_handle(room_info_t *room, uint32_t generation);
 
 room_info_t* find_room(const char *room_name);
 room_info_t* get_room_by_index(int index);
 int get_room_index(const char *room_name);
+room_info_t* lock_room_handle(int room_id, uint32_t generation);
 
 void list_rooms(void);
 int count_rooms(void);
@@ -176,59 +384,215 @@ int count_rooms(void);
 
 
 
-int init_file_queue(void);
+int init_file_queue(int capacity, int notify_position);
 void cleanup_file_queue(void);
-int add_to_file_queue(const char *filename, const char *sender, const char *receiver, 
-                     char *file_data, size_t file_size, int sender_socket, int receiver_socket);
-int remove_from_file_queue(int index);
-int is_file_queue_full(void);
+void release_file_queue_item(file_queue_item_t *item);
+file_queue_item_t* file_queue_waiting_item(int position);
+int get_file_queue_waiting(void);
 int get_file_queue_count(void);
+void file_queue_log_stats(void);
+
+void file_staging_init(size_t memory_budget);
+void file_staging_cleanup(void);
+int file_stage_alloc(file_stage_t *stage, size_t size);
+void file_stage_trim(file_stage_t *stage, size_t offset);
+void file_stage_rewind(file_stage_t *stage);
+void file_stage_release(file_stage_t *stage);
+void file_staging_log_stats(void);
+
+file_resume_t* file_resume_claim_upload(const file_queue_item_t *job);
+file_resume_t* file_resume_adopt(const file_queue_item_t *job, file_stage_t *stage);
+int file_resume_lookup_send(uint32_t transfer_id, const char *receiver_name, file_queue_item_t *job);
+file_resume_t* file_resume_claim_send(uint32_t transfer_id, const char *receiver_name, size_t offset);
+void file_resume_start_send(file_resume_t *entry);
+void file_resume_park(file_resume_t *entry);
+void file_resume_release(file_resume_t *entry);
+int file_resume_ack(uint32_t transfer_id, const char *receiver_name, size_t offset);
+int file_resume_offer(int client_socket, const char *receiver_name);
+void file_resume_cleanup(void);
+void file_resume_log_stats(void);
 
 int validate_file_extension(const char *filename);
+void format_allowed_extensions(char *buffer, size_t size);
 int validate_file_size_limit(size_t file_size);
 
-int receive_file_from_client(int client_socket, const char *filename, char **file_data, size_t *file_size);
-int send_file_to_client(int client_socket, const char *filename, const char *sender, 
-                       const char *file_data, size_t file_size);
+int receive_file_size(int client_socket, const char *filename, size_t *file_size);
+int receive_file_from_client(int client_socket, const char *filename, file_stage_t *stage);
+int send_file_to_client(int client_socket, const char *filename, uint32_t sender_id, const char *sender_name,
+                       file_stage_t *stage);
+int relay_file_to_client(int sender_socket, int receiver_socket, const char *filename,
+                         uint32_t sender_id, const char *sender_name, size_t file_size, int *delivered);
+void file_relay_log_stats(void);
+int submit_file_transfer(connection_t *conn, const char *filename, const char *receiver_name);
+int submit_file_resume(connection_t *conn, uint32_t transfer_id, size_t offset);
+int start_file_transfer_workers(int count);
+void stop_file_transfer_workers(void);
 
 int upload_file_to_server(const char *filename, const char *target_username);
 int receive_file_from_server(const char *message);
 
-void handle_sendfile_command(int client_socket, const char *file_args);
 
-
-int initialize_server(int port);
+int initialize_server(int port, int shard_count);
+int create_listening_socket(int port, int reuse_port);
 void cleanup_server();
 
 void setup_signal_handlers();
 void handle_sigint(int sig);
 
+// One outgoing message in both wire formats, each recipient gets the
+// encoding its connection negotiated
+typedef struct {
+    const char **texts;                 // protocol 1 frames
+    int count;
+    const uint8_t *body;                // protocol 2 body, NULL wraps the texts in WIRE_OP_TEXT
+    size_t body_len;
+    const char *(*render)(void *ctx);   // builds the single text on first use when texts is NULL
+    void *render_ctx;
+} wire_message_t;
+
 int send_message(int client_socket, const char* message);
+int send_messages(int client_socket, const char **messages, int count);
+int send_wire_message(int client_socket, const wire_message_t *msg);
+int send_reply(int client_socket, const char *text, const wire_writer_t *w);
+int room_send_all(room_info_t *room, const client_info_t *skip, const wire_message_t *msg, int *recipients);
+int send_iov_all(int client_socket, struct iovec *iov, int iovcnt);
 int receive_message(int client_socket, char* buffer, size_t buffer_size);
 
-void *handle_client(void *arg);
-
+typedef enum {
+    IO_BACKEND_EPOLL,
+    IO_BACKEND_URING
+} io_backend_t;
+
+extern io_backend_t active_io_backend;
+
+#define MAX_REACTOR_SHARDS 64
+#define REACTOR_STATS_INTERVAL 60       // seconds between worker pool stat lines
+
+typedef struct reactor_shard {
+    int id;
+    int listen_fd;                      // SO_REUSEPORT listener owned by this shard
+    int epoll_fd;
+    pthread_t thread;
+
+    connection_t *connection_head;
+    int connection_count;
+    unsigned long accepted_count;
+    pthread_mutex_t connection_mutex;   // workers close connections the shard accepted
+} reactor_shard_t;
+
+int reactor_init(int port, int shard_count, int worker_count);
+void reactor_run(void);
+void reactor_cleanup(void);
+void reactor_handle_ready(connection_t *conn, uint32_t events);
+void reactor_log_stats(void);
+
+connection_t* connection_create(reactor_shard_t *shard, int fd, const char *client_ip, int client_port);
+void connection_close(connection_t *conn);
+ssize_t connection_fill(connection_t *conn);
+int connection_dispatch_frames(connection_t *conn);
+void connection_release_all(reactor_shard_t *shard);
+int reactor_arm(connection_t *conn);
+int connection_is_parked(connection_t *conn);
+void connection_park(connection_t *conn);
+void connection_resume(connection_t *conn);
+
+int outbound_init(size_t high_watermark, size_t low_watermark);
+void outbound_cleanup(void);
+void connection_register(connection_t *conn);
+void connection_unregister(connection_t *conn);
+connection_t* connection_get(int fd);
+void connection_hold(connection_t *conn);
+void connection_put(connection_t *conn);
+shared_frame_t* frame_create(const char **messages, int count);
+shared_frame_t* frame_encode(const wire_message_t *msg, int protocol);
+shared_frame_t* frame_ref(shared_frame_t *frame);
+void frame_release(shared_frame_t *frame);
+int connection_enqueue(connection_t *conn, shared_frame_t *frame);
+int connection_flush(connection_t *conn);
+void connection_drop_queue(connection_t *conn);
+int connection_switch_protocol(connection_t *conn, int protocol, shared_frame_t *ack);
+int connection_begin_raw(int fd, int *protocol);
+void connection_abort_raw(int fd);
+void connection_end_raw(int fd);
+void outbound_log_stats(void);
+
+#define WORKER_QUEUE_CAPACITY 1024
 
-int setup_client_connection(void *arg, char *client_ip, int *client_port);
-int handle_client_login(int client_socket, pthread_t thread_id, 
-                       const char *client_ip, int client_port);
+typedef struct {
+    int thread_count;
+    int queue_capacity;
+    int queue_depth;
+    int queue_high_water;
+    int busy_workers;
+    unsigned long jobs_submitted;
+    unsigned long jobs_completed;
+    unsigned long submit_waits;
+    double utilization;                 // busy time / (wall time * threads) since start
+} worker_pool_stats_t;
+
+int worker_pool_init(int thread_count, int queue_capacity);
+int worker_pool_submit(connection_t *conn, uint32_t events);
+void worker_pool_get_stats(worker_pool_stats_t *stats);
+void worker_pool_log_stats(void);
+void worker_pool_shutdown(void);
+
+int uring_backend_init(int worker_count);
+void uring_backend_run(void);
+void uring_backend_cleanup(void);
+int uring_arm(connection_t *conn);
+ssize_t uring_take_input(connection_t *conn, const struct iovec *iov, int iovcnt);
+void uring_release_input(connection_t *conn);
+int uring_send_iov(int fd, const struct iovec *iov, int iovcnt);
+int uring_send_all(int fd, const void *buf, size_t len);
+int uring_recv_all(int fd, void *buf, size_t len);
+
+
+int handle_client_login(connection_t *conn, char *username, char *file_path);
 int validate_username(const char *username);
-void client_message_loop(int client_socket);
-void process_client_command(int client_socket, const char *command);
-void cleanup_client_connection(int client_socket);
-
-
-void handle_join_command(int client_socket, const char *room_name);
-void handle_leave_command(int client_socket);
-void handle_broadcast_command(int client_socket, const char *message);
-void handle_whisper_command(int client_socket, const char *whisper_args);
-void handle_sendfile_command(int client_socket, const char *file_args);
-void handle_exit_command(int client_socket);
-
-void init_logging(void);
+int client_process_frame(connection_t *conn, char *buffer, size_t len);
+int client_message_loop(connection_t *conn);
+int process_client_command(connection_t *conn, char *command);
+int process_binary_command(connection_t *conn, char *body, size_t len);
+void handle_protocol_request(connection_t *conn, const char *request);
+void cleanup_client_connection(connection_t *conn);
+
+
+void handle_join_command(connection_t *conn, const command_args_t *args);
+void handle_leave_command(connection_t *conn, const command_args_t *args);
+void handle_broadcast_command(connection_t *conn, const command_args_t *args);
+void handle_whisper_command(connection_t *conn, const command_args_t *args);
+void handle_sendfile_command(connection_t *conn, const command_args_t *args);
+void handle_exit_command(connection_t *conn, const command_args_t *args);
+void handle_resume_command(connection_t *conn, const command_args_t *args);
+void handle_ack_command(connection_t *conn, const command_args_t *args);
+void handle_size64_command(connection_t *conn, const command_args_t *args);
+
+extern uint32_t log_category_mask;
+
+// Every log_message() call site, so the binary log can give its format an id once
+typedef struct {
+    uint32_t id;                        // 0 until the site first logs in binary mode
+} log_site_t;
+
+// A category outside LOG_COMPILED_MASK is removed with its arguments, one
+// outside log_category_mask costs a load and a branch
+#define log_message(level, format, ...)                                           \
+    do {                                                                          \
+        if ((LOG_COMPILED_MASK & LOG_BIT(level)) &&                               \
+            (__atomic_load_n(&log_category_mask, __ATOMIC_RELAXED) & LOG_BIT(level))) { \
+            static log_site_t log_site_;                                          \
+            log_write_site(&log_site_, (level), format, ##__VA_ARGS__);           \
+        }                                                                         \
+    } while (0)
+
+void init_logging(uint32_t categories, int binary);
 void cleanup_logging(void);
-void log_message(log_level_t level, const char *format, ...);
+void log_write(log_level_t level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void log_write_site(log_site_t *site, log_level_t level, const char *format, ...) __attribute__((format(printf, 3, 4)));
 const char* log_level_to_string(log_level_t level);
+int log_parse_categories(const char *spec, uint32_t *mask);
+void log_format_categories(uint32_t mask, char *buf, size_t size);
+void log_signal_handler(int sig);
 
 void shutdown_all_clients(void);
 int count_active_threads(void);
@@ -0,0 +1,221 @@
+// worker_pool.c - Fixed pool of worker threads fed with ready connections by the reactor
+
+#include "server_helper.h"
+
+typedef struct {
+    connection_t *conn;
+    uint32_t events;
+} work_item_t;
+
+typedef struct {
+    pthread_t *threads;
+    int thread_count;
+
+    work_item_t *items;              // ring buffer of pending work
+    int capacity;
+    int head;
+    int tail;
+    int depth;
+
+    int busy_workers;
+    int shutting_down;
+
+    unsigned long jobs_submitted;
+    unsigned long jobs_completed;
+    unsigned long submit_waits;      // reactor had to block because the queue was full
+    int depth_high_water;
+    unsigned long long busy_ns;
+    struct timespec started;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} worker_pool_t;
+
+static worker_pool_t pool;
+
+
+
+static unsigned long long elapsed_ns(const struct timespec *from, const struct timespec *to) {
+    return (unsigned long long)(to->tv_sec - from->tv_sec) * 1000000000ULL
+           + (to->tv_nsec - from->tv_nsec);
+}
+
+static void *worker_thread(void *arg) {
+    (void)arg;
+
+    // SIGINT belongs to the main thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while (1) {
+        pthread_mutex_lock(&pool.mutex);
+
+        while (pool.depth == 0 && !pool.shutting_down) {
+            pthread_cond_wait(&pool.not_empty, &pool.mutex);
+        }
+
+        if (pool.shutting_down) {
+            pthread_mutex_unlock(&pool.mutex);
+            break;
+        }
+
+        work_item_t item = pool.items[pool.head];
+        pool.head = (pool.head + 1) % pool.capacity;
+        pool.depth--;
+        pool.busy_workers++;
+
+        pthread_cond_signal(&pool.not_full);
+        pthread_mutex_unlock(&pool.mutex);
+
+        struct timespec job_start, job_end;
+        clock_gettime(CLOCK_MONOTONIC, &job_start);
+
+        reactor_handle_ready(item.conn, item.events);
+
+        clock_gettime(CLOCK_MONOTONIC, &job_end);
+
+        pthread_mutex_lock(&pool.mutex);
+        pool.busy_workers--;
+        pool.jobs_completed++;
+        pool.busy_ns += elapsed_ns(&job_start, &job_end);
+        pthread_mutex_unlock(&pool.mutex);
+    }
+
+    return NULL;
+}
+
+
+
+int worker_pool_init(int thread_count, int queue_capacity) {
+    memset(&pool, 0, sizeof(pool));
+
+    if (thread_count < 1 || queue_capacity < 1) {
+        return -1;
+    }
+
+    pool.items = malloc(sizeof(work_item_t) * queue_capacity);
+    pool.threads = malloc(sizeof(pthread_t) * thread_count);
+    if (!pool.items || !pool.threads) {
+        free(pool.items);
+        free(pool.threads);
+        log_message(LOG_ERROR, "Memory allocation failed for worker pool");
+        return -1;
+    }
+
+    pool.capacity = queue_capacity;
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.not_empty, NULL);
+    pthread_cond_init(&pool.not_full, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &pool.started);
+
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(&pool.threads[i], NULL, worker_thread, NULL) != 0) {
+            log_message(LOG_ERROR, "Failed to create worker thread %d", i);
+            red();
+            perror("Thread creation failed");
+            reset();
+            worker_pool_shutdown();
+            return -1;
+        }
+        pool.thread_count++;
+    }
+
+    log_message(LOG_SERVER, "Worker pool started: %d threads, queue capacity %d", thread_count, queue_capacity);
+    return 0;
+}
+
+// Blocks the calling reactor while the queue is full so the number of
+// in-flight connections stays bounded
+int worker_pool_submit(connection_t *conn, uint32_t events) {
+    pthread_mutex_lock(&pool.mutex);
+
+    if (pool.depth == pool.capacity && !pool.shutting_down) {
+        pool.submit_waits++;
+        while (pool.depth == pool.capacity && !pool.shutting_down) {
+            pthread_cond_wait(&pool.not_full, &pool.mutex);
+        }
+    }
+
+    if (pool.shutting_down) {
+        pthread_mutex_unlock(&pool.mutex);
+        return -1;
+    }
+
+    pool.items[pool.tail].conn = conn;
+    pool.items[pool.tail].events = events;
+    pool.tail = (pool.tail + 1) % pool.capacity;
+    pool.depth++;
+    pool.jobs_submitted++;
+    if (pool.depth > pool.depth_high_water) {
+        pool.depth_high_water = pool.depth;
+    }
+
+    pthread_cond_signal(&pool.not_empty);
+    pthread_mutex_unlock(&pool.mutex);
+    return 0;
+}
+
+void worker_pool_get_stats(worker_pool_stats_t *stats) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&pool.mutex);
+
+    stats->thread_count = pool.thread_count;
+    stats->queue_capacity = pool.capacity;
+    stats->queue_depth = pool.depth;
+    stats->queue_high_water = pool.depth_high_water;
+    stats->busy_workers = pool.busy_workers;
+    stats->jobs_submitted = pool.jobs_submitted;
+    stats->jobs_completed = pool.jobs_completed;
+    stats->submit_waits = pool.submit_waits;
+
+    unsigned long long wall_ns = elapsed_ns(&pool.started, &now) * (pool.thread_count > 0 ? pool.thread_count : 1);
+    stats->utilization = wall_ns > 0 ? (double)pool.busy_ns / (double)wall_ns : 0.0;
+
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+void worker_pool_log_stats(void) {
+    worker_pool_stats_t stats;
+    worker_pool_get_stats(&stats);
+
+    log_message(LOG_SERVER, "Worker pool: %d/%d busy, queue %d/%d (high water %d, %lu full waits), "
+               "%lu/%lu jobs done, utilization %.1f%%",
+               stats.busy_workers, stats.thread_count, stats.queue_depth, stats.queue_capacity,
+               stats.queue_high_water, stats.submit_waits, stats.jobs_completed, stats.jobs_submitted,
+               stats.utilization * 100.0);
+}
+
+void worker_pool_shutdown(void) {
+    if (!pool.items) {
+        return;
+    }
+
+    worker_pool_log_stats();
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.shutting_down = 1;
+    pthread_cond_broadcast(&pool.not_empty);
+    pthread_cond_broadcast(&pool.not_full);
+    pthread_mutex_unlock(&pool.mutex);
+
+    for (int i = 0; i < pool.thread_count; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool.mutex);
+    pthread_cond_destroy(&pool.not_empty);
+    pthread_cond_destroy(&pool.not_full);
+
+    free(pool.threads);
+    free(pool.items);
+    pool.threads = NULL;
+    pool.items = NULL;
+    pool.thread_count = 0;
+
+    log_message(LOG_SERVER, "Worker pool stopped");
+}
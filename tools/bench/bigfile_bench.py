@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+"""Large file throughput: chatclient /sendfile to a second chatclient.
+
+Starts its own server and two clients in a scratch directory, times each
+transfer from /sendfile until the receiver reports the file, compares the
+copies and prints the server's RSS. Usage, from the repository root:
+    tools/bench/bigfile_bench.py [server args...]
+e.g. tools/bench/bigfile_bench.py -t relay
+Environment: SERVER (./chatserver), CLIENT (./chatclient), PORT (5941),
+SIZES (bytes, comma separated, default 10000000,1000000000),
+WORKDIR (scratch directory, default a new one under /tmp),
+WIDE=1 also streams a 4 GB + 12345 byte file to a /size64 socket client.
+"""
+import os
+import queue
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+SERVER = os.path.abspath(os.environ.get("SERVER", "./chatserver"))
+CLIENT = os.path.abspath(os.environ.get("CLIENT", "./chatclient"))
+PORT = int(os.environ.get("PORT", "5941"))
+SIZES = [int(x) for x in os.environ.get("SIZES", "10000000,1000000000").split(",")]
+
+
+def frame(text):
+    data = text.encode() if isinstance(text, str) else text
+    return struct.pack("!I", len(data)) + data
+
+
+class SocketClient:
+    """A raw protocol client, for what chatclient can't be made to do"""
+
+    def __init__(self, name):
+        self.sock = socket.create_connection(("127.0.0.1", PORT))
+        self.sock.settimeout(60)
+        self.buf = b""
+        self.sock.sendall(frame(name) + frame("/tmp"))
+        reply = self.recv()
+        assert reply.startswith("LOGIN_SUCCESS"), reply
+
+    def send(self, text):
+        self.sock.sendall(frame(text))
+
+    def recv_exact(self, n):
+        while len(self.buf) < n:
+            chunk = self.sock.recv(1 << 20)
+            if not chunk:
+                raise EOFError("server closed the connection")
+            self.buf += chunk
+        data, self.buf = self.buf[:n], self.buf[n:]
+        return data
+
+    def recv(self):
+        (n,) = struct.unpack("!I", self.recv_exact(4))
+        return self.recv_exact(n).decode(errors="replace")
+
+    def expect(self, prefix):
+        for _ in range(20):
+            message = self.recv()
+            if message.startswith(prefix):
+                return message
+        raise AssertionError("never got " + prefix)
+
+
+class ChatClient:
+    def __init__(self, name, workdir):
+        self.proc = subprocess.Popen([CLIENT, "127.0.0.1", str(PORT)], stdin=subprocess.PIPE,
+                                     stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                                     cwd=workdir, text=True, bufsize=1)
+        self.lines = queue.Queue()
+        threading.Thread(target=self.pump, daemon=True).start()
+        self.write(name)
+        time.sleep(0.5)
+
+    def pump(self):
+        for line in self.proc.stdout:
+            self.lines.put(line)
+
+    def write(self, line):
+        self.proc.stdin.write(line + "\n")
+        self.proc.stdin.flush()
+
+    def wait_for(self, needle, timeout):
+        end = time.time() + timeout
+        while time.time() < end:
+            try:
+                line = self.lines.get(timeout=1)
+            except queue.Empty:
+                continue
+            if needle in line:
+                return line
+        raise AssertionError("never saw " + needle)
+
+    def close(self):
+        self.write("/exit")
+        self.proc.wait(timeout=10)
+
+
+def server_memory(pid):
+    fields = {}
+    for line in open("/proc/%d/status" % pid):
+        if line.startswith(("VmRSS", "VmHWM")):
+            key, value = line.split(":")
+            fields[key] = value.split()[0]
+    return "RSS %s kB, peak %s kB" % (fields.get("VmRSS"), fields.get("VmHWM"))
+
+
+def wide_transfer(server):
+    size = 4 * 1024 ** 3 + 12345
+    sender = SocketClient("widesend")
+    receiver = SocketClient("widerecv")
+    receiver.send("/size64")
+    time.sleep(0.2)
+
+    result = {}
+
+    def drain():
+        receiver.expect("FILE_DOWNLOAD:")
+        result["header"] = struct.unpack("!IQ", receiver.recv_exact(12))
+        got = len(receiver.buf)
+        receiver.buf = b""
+        while got < size:
+            got += len(receiver.sock.recv(1 << 20))
+
+    reader = threading.Thread(target=drain)
+    reader.start()
+    start = time.time()
+    sender.send("/sendfile wide.zip widerecv")
+    sender.expect("FILE_UPLOAD_REQUEST:")
+    sender.sock.sendall(struct.pack("!IQ", 0xFFFFFFFF, size))
+    block = b"\x5a" * (1 << 20)
+    left = size
+    while left:
+        n = min(left, len(block))
+        sender.sock.sendall(block[:n])
+        left -= n
+    reader.join()
+    elapsed = time.time() - start
+
+    assert result["header"] == (0xFFFFFFFF, size), result
+    sender.expect("FILE_TRANSFER_SUCCESS")
+    print("%12d bytes to a /size64 socket: %.2f s, %.2f GB/s, %s"
+          % (size, elapsed, size / elapsed / 1e9, server_memory(server.pid)))
+
+
+def main():
+    extra = sys.argv[1:]
+    workdir = os.environ.get("WORKDIR") or tempfile.mkdtemp(prefix="chat-bigfile-")
+    send_dir = os.path.join(workdir, "send")
+    recv_dir = os.path.join(workdir, "recv")
+    os.makedirs(send_dir, exist_ok=True)
+    os.makedirs(recv_dir, exist_ok=True)
+
+    server = subprocess.Popen([SERVER, str(PORT)] + extra, stdout=subprocess.DEVNULL, cwd=workdir)
+    time.sleep(1)
+    try:
+        if os.environ.get("WIDE"):
+            wide_transfer(server)
+
+        sender = ChatClient("bigsend", send_dir)
+        receiver = ChatClient("bigrecv", recv_dir)
+        for size in SIZES:
+            name = "f%d.zip" % size
+            source = os.path.join(send_dir, name)
+            copy = os.path.join(recv_dir, name)
+            with open(source, "wb") as out:
+                left = size
+                while left:
+                    n = min(left, 1 << 20)
+                    out.write(os.urandom(n))
+                    left -= n
+            os.sync()
+
+            start = time.time()
+            sender.write("/sendfile %s bigrecv" % name)
+            receiver.wait_for("File received: '%s'" % name, 600)
+            elapsed = time.time() - start
+
+            intact = subprocess.run(["cmp", "-s", source, copy]).returncode == 0
+            print("%12d bytes: %.2f s, %.0f MB/s, intact %s, %s"
+                  % (size, elapsed, size / elapsed / 1e6, intact, server_memory(server.pid)))
+            os.unlink(source)
+            os.unlink(copy)
+
+        sender.close()
+        receiver.close()
+    finally:
+        server.send_signal(2)
+        server.wait()
+        if not os.environ.get("WORKDIR"):
+            shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    main()
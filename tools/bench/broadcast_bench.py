@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+"""Broadcast throughput: one sender pipelines /broadcast to a room of readers.
+
+Starts its own server in a scratch directory. Usage, from the repository root:
+    tools/bench/broadcast_bench.py [server args...]
+e.g. tools/bench/broadcast_bench.py -b uring
+Environment: SERVER (./chatserver), PORT (5920), READERS (8), MESSAGES (20000)
+"""
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+SERVER = os.path.abspath(os.environ.get("SERVER", "./chatserver"))
+PORT = int(os.environ.get("PORT", "5920"))
+READERS = int(os.environ.get("READERS", "8"))
+MESSAGES = int(os.environ.get("MESSAGES", "20000"))
+
+
+def frame(text):
+    data = text.encode()
+    return struct.pack("!I", len(data)) + data
+
+
+def read_exact(sock, n):
+    data = b""
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise EOFError("server closed the connection")
+        data += chunk
+    return data
+
+
+def read_frame(sock):
+    (n,) = struct.unpack("!I", read_exact(sock, 4))
+    return read_exact(sock, n)
+
+
+def drain(sock):
+    sock.setblocking(False)
+    try:
+        while sock.recv(65536):
+            pass
+    except BlockingIOError:
+        pass
+    sock.setblocking(True)
+
+
+def count_frames(sock, wanted):
+    buf = b""
+    seen = 0
+    while seen < wanted:
+        chunk = sock.recv(1 << 20)
+        if not chunk:
+            raise EOFError("server closed the connection")
+        buf += chunk
+        while len(buf) >= 4:
+            (n,) = struct.unpack("!I", buf[:4])
+            if len(buf) < 4 + n:
+                break
+            buf = buf[4 + n:]
+            seen += 1
+
+
+def server_cpu(pid):
+    fields = open("/proc/%d/stat" % pid).read().rsplit(")", 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+
+def main():
+    extra = sys.argv[1:]
+    workdir = tempfile.TemporaryDirectory(prefix="chat-broadcast-")
+    server = subprocess.Popen([SERVER, str(PORT)] + extra, stdout=subprocess.DEVNULL, cwd=workdir.name)
+    time.sleep(0.5)
+    try:
+        clients = []
+        for i in range(READERS + 1):
+            sock = socket.create_connection(("127.0.0.1", PORT))
+            sock.sendall(frame("bench%d" % i) + frame("/tmp"))
+            read_frame(sock)
+            sock.sendall(frame("/join bench"))
+            clients.append(sock)
+        time.sleep(0.3)
+        for sock in clients:
+            drain(sock)
+
+        # The sender gets its own broadcasts echoed, readers get one each
+        threads = [threading.Thread(target=count_frames, args=(sock, MESSAGES)) for sock in clients]
+        for t in threads:
+            t.start()
+
+        payload = b"".join(frame("/broadcast message number %d padding padding" % i) for i in range(MESSAGES))
+        start = time.time()
+        clients[0].sendall(payload)
+        for t in threads:
+            t.join()
+        elapsed = time.time() - start
+
+        print("%s: %d broadcasts x %d readers in %.2f s -> %.0f deliveries/s, server cpu %.2f s"
+              % (" ".join(extra) or "default", MESSAGES, READERS, elapsed,
+                 MESSAGES * READERS / elapsed, server_cpu(server.pid)))
+    finally:
+        server.terminate()
+        server.wait()
+        workdir.cleanup()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,57 @@
+// log_bench.c - CPU cost of log_message() in text and binary mode
+//
+// Links logger.o and binlog.o. Usage: log-bench text|binary|off [events],
+// off logs with every category masked and gives the baseline to subtract.
+// The log file lands in the working directory, run it somewhere scratch.
+
+#include "../../server/server_helper.h"
+
+#define LOG_BENCH_EVENTS 2000000
+
+int main(int argc, char **argv) {
+    const char *mode = (argc > 1) ? argv[1] : "text";
+    long events = (argc > 2) ? atol(argv[2]) : LOG_BENCH_EVENTS;
+    int binary = strcmp(mode, "binary") == 0;
+    uint32_t categories = strcmp(mode, "off") == 0 ? 0 : LOG_MASK_DEFAULT;
+
+    if (!binary && strcmp(mode, "text") != 0 && categories != 0) {
+        fprintf(stderr, "Usage: %s text|binary|off [events]\n", argv[0]);
+        return 1;
+    }
+
+    init_logging(categories, binary);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+
+    // A mix of the server's busiest formats
+    for (long i = 0; i < events; i++) {
+        switch (i & 3) {
+        case 0:
+            log_message(LOG_BROADCAST, "User '%s' broadcast to room '%s' (%d recipients): %s",
+                       "alice", "lobby", 8, "message number 12345 padding padding");
+            break;
+        case 1:
+            log_message(LOG_CLIENT, "User '%s' successfully logged in from %s:%d", "bob", "127.0.0.1", 40000);
+            break;
+        case 2:
+            log_message(LOG_FILE, "Queued file '%s' (%zu bytes) from %s to %s", "x.txt", (size_t)i * 10, "alice", "bob");
+            break;
+        case 3:
+            log_message(LOG_WHISPER, "Whisper from '%s' to '%s': %s", "bob", "alice", "psst");
+            break;
+        }
+
+        // Lets the writer keep up, a full ring would drop events
+        if ((i & 1023) == 1023) {
+            usleep(3000);
+        }
+    }
+
+    cleanup_logging();
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+
+    double cpu = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s: %ld events, cpu %.3f s, %.0f ns/event\n", mode, events, cpu, cpu * 1e9 / events);
+    return 0;
+}
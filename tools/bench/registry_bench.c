@@ -0,0 +1,82 @@
+// registry_bench.c - Lookup cost of the client registry at growing client counts
+//
+// Links dynamic_client.o on its own, logging and the connection table are
+// stubbed out. Usage: registry-bench [sizes] [-q], sizes is how many of
+// 10, 100, 1000, 10000, 100000 to run (default all five), -q scales the
+// iteration count down with the client count for old linear builds.
+
+#include "../../server/server_helper.h"
+
+#define LOOKUP_PATTERN (1 << 16)
+
+static const int client_counts[] = {10, 100, 1000, 10000, 100000};
+
+// Stubs for what dynamic_client.o pulls in from the rest of the server
+uint32_t log_category_mask = 0;
+
+void log_write_site(log_site_t *site, log_level_t level, const char *format, ...) {
+    (void)site;
+    (void)level;
+    (void)format;
+}
+
+connection_t* connection_get(int fd) {
+    (void)fd;
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    int runs = (argc > 1) ? atoi(argv[1]) : 5;
+    int scaled = argc > 2 && strcmp(argv[2], "-q") == 0;
+    static char names[100000][sizeof(((client_info_t *)0)->username)];
+    static unsigned pattern[LOOKUP_PATTERN];
+
+    if (runs < 1 || runs > 5) {
+        runs = 5;
+    }
+
+    for (int r = 0; r < runs; r++) {
+        int count = client_counts[r];
+        init_clients();
+        for (int i = 0; i < count; i++) {
+            snprintf(names[i], sizeof(names[i]), "user%d", i);
+            if (!add_client(names[i], 1000 + i, 0, "127.0.0.1", 1, "/tmp")) {
+                fprintf(stderr, "add_client failed at %d\n", i);
+                return 1;
+            }
+        }
+
+        // Random hits, the same sequence for both lookups
+        unsigned seed = 1;
+        for (int k = 0; k < LOOKUP_PATTERN; k++) {
+            seed = seed * 1103515245 + 12345;
+            pattern[k] = (seed >> 8) % count;
+        }
+
+        long iterations = 4000000L / ((scaled && count > 100) ? count / 100 : 1);
+        volatile long found = 0;
+
+        double start = now();
+        for (long k = 0; k < iterations; k++) {
+            found += find_client_by_socket(1000 + pattern[k & (LOOKUP_PATTERN - 1)]) != NULL;
+        }
+        double by_socket = (now() - start) / iterations * 1e9;
+
+        start = now();
+        for (long k = 0; k < iterations; k++) {
+            found += find_client_by_username(names[pattern[k & (LOOKUP_PATTERN - 1)]]) != NULL;
+        }
+        double by_username = (now() - start) / iterations * 1e9;
+
+        printf("%6d clients: by socket %9.1f ns, by username %9.1f ns\n", count, by_socket, by_username);
+        cleanup_clients();
+    }
+
+    return 0;
+}
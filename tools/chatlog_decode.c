@@ -0,0 +1,268 @@
+// chatlog_decode.c - Renders server.log.bin as the text server.log would have been
+
+#include "../utils/binlog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LINE_SIZE 8192
+
+typedef struct {
+    const char *data;
+    size_t len;
+    size_t pos;
+} payload_t;
+
+static binlog_header_t header;
+static char *level_names[256];
+static char **formats = NULL;
+static uint32_t format_capacity = 0;
+
+static int read_exact(FILE *in, void *buf, size_t len) {
+    return fread(buf, 1, len, in) == len ? 0 : -1;
+}
+
+static int take(payload_t *payload, void *out, size_t len) {
+    if (payload->len - payload->pos < len) {
+        return -1;
+    }
+    memcpy(out, payload->data + payload->pos, len);
+    payload->pos += len;
+    return 0;
+}
+
+static const char* render_timestamp(time_t when, char *stamp, size_t size) {
+    static time_t cached = (time_t)-1;
+
+    if (when != cached) {
+        struct tm tm_info;
+        localtime_r(&when, &tm_info);
+        strftime(stamp, size, "%Y-%m-%d %H:%M:%S", &tm_info);
+        cached = when;
+    }
+    return stamp;
+}
+
+// Copies literal text, turning "%%" back into '%'
+static size_t append_literal(char *line, size_t len, const char *text, size_t text_len) {
+    for (size_t i = 0; i < text_len && len < LINE_SIZE - 1; i++) {
+        line[len++] = text[i];
+        if (text[i] == '%' && i + 1 < text_len && text[i + 1] == '%') {
+            i++;
+        }
+    }
+    line[len] = '\0';
+    return len;
+}
+
+#define RENDER(value)                                                                       \
+    (spec.stars == 0 ? snprintf(line + len, room, conversion, value) :                      \
+     spec.stars == 1 ? snprintf(line + len, room, conversion, stars[0], value) :            \
+                       snprintf(line + len, room, conversion, stars[0], stars[1], value))
+
+// Replays every conversion of the format with the stored argument values
+static void render_message(const char *format, payload_t *payload, char *line) {
+    binlog_spec_t spec;
+    const char *p = format;
+    const char *next;
+    size_t len = 0;
+
+    line[0] = '\0';
+    while ((next = binlog_next_spec(p, &spec)) != NULL) {
+        len = append_literal(line, len, p, next - p);
+        p = next + spec.len;
+
+        int32_t stars[2] = {0, 0};
+        for (int i = 0; i < spec.stars; i++) {
+            if (take(payload, &stars[i], sizeof(stars[i])) != 0) {
+                return;
+            }
+        }
+
+        // Integers stored in 8 bytes are printed through "ll"
+        char conversion[64];
+        size_t prefix = strcspn(spec.start, "hlLqjzt");
+        if (prefix > spec.len - 1) {
+            prefix = spec.len - 1;
+        }
+        if (spec.len >= sizeof(conversion) - 3) {
+            return;
+        }
+        if (spec.arg == BINLOG_ARG_LONG) {
+            snprintf(conversion, sizeof(conversion), "%.*sll%c", (int)prefix, spec.start, spec.start[spec.len - 1]);
+        } else {
+            snprintf(conversion, sizeof(conversion), "%.*s", (int)spec.len, spec.start);
+        }
+
+        size_t room = LINE_SIZE - len;
+        int n = 0;
+        switch (spec.arg) {
+            case BINLOG_ARG_INT: {
+                int32_t value;
+                if (take(payload, &value, sizeof(value)) != 0) return;
+                n = RENDER(value);
+                break;
+            }
+            case BINLOG_ARG_LONG: {
+                long long value;
+                if (take(payload, &value, sizeof(value)) != 0) return;
+                n = RENDER(value);
+                break;
+            }
+            case BINLOG_ARG_PTR: {
+                uint64_t value;
+                if (take(payload, &value, sizeof(value)) != 0) return;
+                n = RENDER((void *)(uintptr_t)value);
+                break;
+            }
+            case BINLOG_ARG_DOUBLE: {
+                double value;
+                if (take(payload, &value, sizeof(value)) != 0) return;
+                n = RENDER(value);
+                break;
+            }
+            case BINLOG_ARG_STRING: {
+                uint16_t value_len;
+                static char value[65536];
+                if (take(payload, &value_len, sizeof(value_len)) != 0 ||
+                    take(payload, value, value_len) != 0) return;
+                value[value_len] = '\0';
+                n = RENDER(value);
+                break;
+            }
+            default:
+                return;
+        }
+
+        if (n < 0) {
+            return;
+        }
+        len += (size_t)n < room ? (size_t)n : room - 1;
+    }
+
+    append_literal(line, len, p, strlen(p));
+}
+
+static int decode(FILE *in, FILE *out) {
+    static char payload_data[65536];
+    char line[LINE_SIZE];
+    char stamp[32] = "";
+    int kind;
+
+    if (read_exact(in, &header, sizeof(header)) != 0 ||
+        memcmp(header.magic, BINLOG_MAGIC, BINLOG_MAGIC_LEN) != 0) {
+        fprintf(stderr, "Not a binary server log\n");
+        return -1;
+    }
+
+    while ((kind = fgetc(in)) != EOF) {
+        switch (kind) {
+            case BINLOG_RECORD_LEVEL: {
+                unsigned char level_and_len[2];
+                if (read_exact(in, level_and_len, 2) != 0) goto truncated;
+                char *name = calloc(1, level_and_len[1] + 1);
+                if (!name || read_exact(in, name, level_and_len[1]) != 0) {
+                    free(name);
+                    goto truncated;
+                }
+                free(level_names[level_and_len[0]]);
+                level_names[level_and_len[0]] = name;
+                break;
+            }
+            case BINLOG_RECORD_FORMAT: {
+                uint32_t id;
+                uint16_t len;
+                if (read_exact(in, &id, sizeof(id)) != 0 || read_exact(in, &len, sizeof(len)) != 0) goto truncated;
+                if (id >= format_capacity) {
+                    uint32_t capacity = format_capacity ? format_capacity : 256;
+                    while (capacity <= id) {
+                        capacity *= 2;
+                    }
+                    char **grown = realloc(formats, capacity * sizeof(char *));
+                    if (!grown) {
+                        perror("realloc");
+                        return -1;
+                    }
+                    memset(grown + format_capacity, 0, (capacity - format_capacity) * sizeof(char *));
+                    formats = grown;
+                    format_capacity = capacity;
+                }
+                char *format = calloc(1, len + 1);
+                if (!format || read_exact(in, format, len) != 0) {
+                    free(format);
+                    goto truncated;
+                }
+                free(formats[id]);
+                formats[id] = format;
+                break;
+            }
+            case BINLOG_RECORD_EVENT: {
+                uint16_t id;
+                uint8_t level;
+                uint32_t when;
+                uint16_t len;
+                if (read_exact(in, &id, sizeof(id)) != 0 || read_exact(in, &level, sizeof(level)) != 0 ||
+                    read_exact(in, &when, sizeof(when)) != 0 || read_exact(in, &len, sizeof(len)) != 0 ||
+                    read_exact(in, payload_data, len) != 0) goto truncated;
+
+                if (id >= format_capacity || !formats[id]) {
+                    fprintf(stderr, "Event uses undefined format %u\n", id);
+                    return -1;
+                }
+                payload_t payload = { payload_data, len, 0 };
+                render_message(formats[id], &payload, line);
+                fprintf(out, "[%s] [%s] %s\n", render_timestamp(when, stamp, sizeof(stamp)),
+                        level_names[level] ? level_names[level] : "UNKNOWN", line);
+                break;
+            }
+            case BINLOG_RECORD_DROPPED: {
+                uint32_t when;
+                uint64_t count;
+                if (read_exact(in, &when, sizeof(when)) != 0 || read_exact(in, &count, sizeof(count)) != 0) goto truncated;
+                fprintf(out, "[%s] [WARNING] Log ring full, %llu records dropped so far\n",
+                        render_timestamp(when, stamp, sizeof(stamp)), (unsigned long long)count);
+                break;
+            }
+            default:
+                fprintf(stderr, "Unknown record type %d at offset %ld\n", kind, ftell(in) - 1);
+                return -1;
+        }
+    }
+    return 0;
+
+truncated:
+    // The server may still be writing, or was killed mid-batch
+    fprintf(stderr, "Log ends with a partial record\n");
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "server.log.bin";
+
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "-h") == 0)) {
+        printf("Usage: %s [server.log.bin]\n", argv[0]);
+        printf("Prints a binary server log (chatserver -f binary) in the server.log text format\n");
+        return argc > 2 ? 1 : 0;
+    }
+
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!in) {
+        perror(path);
+        return 1;
+    }
+
+    int result = decode(in, stdout);
+
+    if (in != stdin) {
+        fclose(in);
+    }
+    for (uint32_t i = 0; i < format_capacity; i++) {
+        free(formats[i]);
+    }
+    free(formats);
+    for (int i = 0; i < 256; i++) {
+        free(level_names[i]);
+    }
+    return result == 0 ? 0 : 1;
+}
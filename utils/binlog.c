@@ -0,0 +1,96 @@
+// binlog.c - printf format parsing shared by the binary log writer and chatlog-decode
+
+#include "binlog.h"
+#include <string.h>
+
+// Finds the next conversion in format, skipping "%%". Returns NULL when
+// there is none left.
+const char* binlog_next_spec(const char *format, binlog_spec_t *spec) {
+    const char *p = format;
+
+    while ((p = strchr(p, '%')) != NULL) {
+        if (p[1] == '%') {
+            p += 2;
+            continue;
+        }
+
+        const char *q = p + 1;
+        int stars = 0;
+
+        q += strspn(q, "-+ #0");
+        if (*q == '*') {
+            stars++;
+            q++;
+        } else {
+            q += strspn(q, "0123456789");
+        }
+        if (*q == '.') {
+            q++;
+            if (*q == '*') {
+                stars++;
+                q++;
+            } else {
+                q += strspn(q, "0123456789");
+            }
+        }
+
+        int wide = 0;
+        int long_double = 0;
+        while (*q && strchr("hlLqjzt", *q)) {
+            if (*q != 'h') {
+                wide = 1;
+            }
+            if (*q == 'L') {
+                long_double = 1;
+            }
+            q++;
+        }
+
+        spec->start = p;
+        spec->stars = stars;
+        spec->arg = BINLOG_ARG_NONE;
+
+        switch (*q) {
+            case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+                spec->arg = wide ? BINLOG_ARG_LONG : BINLOG_ARG_INT;
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                spec->arg = long_double ? BINLOG_ARG_NONE : BINLOG_ARG_DOUBLE;
+                break;
+            case 's':
+                spec->arg = wide ? BINLOG_ARG_NONE : BINLOG_ARG_STRING;
+                break;
+            case 'p':
+                spec->arg = BINLOG_ARG_PTR;
+                break;
+            default:
+                break;
+        }
+
+        spec->len = (*q ? q + 1 : q) - p;
+        return p;
+    }
+
+    return NULL;
+}
+
+// Fills args with the stored type of every argument the format consumes.
+// Returns how many, or -1 if one of them can't be stored.
+int binlog_parse_format(const char *format, binlog_arg_t *args, int max_args) {
+    binlog_spec_t spec;
+    int count = 0;
+    const char *p = format;
+
+    while ((p = binlog_next_spec(p, &spec)) != NULL) {
+        if (spec.arg == BINLOG_ARG_NONE || count + spec.stars + 1 > max_args) {
+            return -1;
+        }
+        for (int i = 0; i < spec.stars; i++) {
+            args[count++] = BINLOG_ARG_INT;
+        }
+        args[count++] = spec.arg;
+        p += spec.len;
+    }
+
+    return count;
+}
@@ -0,0 +1,49 @@
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary server log: a header followed by records. Integers are stored in
+// host byte order, so the decoder has to run on the server's architecture.
+// Events are written in runs per thread, so across threads they can be out
+// of order by up to one writer flush.
+#define BINLOG_MAGIC "CHATLOG2"
+#define BINLOG_MAGIC_LEN 8
+#define BINLOG_MAX_ARGS 16              // arguments a format may take, '*' included
+#define BINLOG_FORMAT_TEXT 1            // id of "%s", carries text formatted by the caller
+
+typedef struct {
+    char magic[BINLOG_MAGIC_LEN];
+    uint64_t realtime_ns;               // wall clock when logging started
+} binlog_header_t;
+
+// Every record starts with its kind byte
+typedef enum {
+    BINLOG_RECORD_LEVEL = 1,            // u8 level, u8 length, name
+    BINLOG_RECORD_FORMAT = 2,           // u32 id, u16 length, format string
+    BINLOG_RECORD_EVENT = 3,            // u16 id, u8 level, u32 seconds since the epoch, u16 length, arguments
+    BINLOG_RECORD_DROPPED = 4           // u32 seconds since the epoch, u64 records dropped so far
+} binlog_record_kind_t;
+
+// How a conversion's argument is stored in an event
+typedef enum {
+    BINLOG_ARG_NONE = -1,               // conversion the binary log cannot carry
+    BINLOG_ARG_INT,                     // int, or anything promoted to it: 4 bytes
+    BINLOG_ARG_LONG,                    // l, ll, z, j and t integers: 8 bytes
+    BINLOG_ARG_PTR,                     // 8 bytes
+    BINLOG_ARG_DOUBLE,                  // 8 bytes
+    BINLOG_ARG_STRING                   // u16 length + bytes, precision applied on decode
+} binlog_arg_t;
+
+typedef struct {
+    const char *start;                  // the '%'
+    size_t len;                         // through the conversion character
+    int stars;                          // '*' width/precision, each an int argument first
+    binlog_arg_t arg;
+} binlog_spec_t;
+
+const char* binlog_next_spec(const char *format, binlog_spec_t *spec);
+int binlog_parse_format(const char *format, binlog_arg_t *args, int max_args);
+
+#endif // BINLOG_H
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 int parse_client_args(int argc, char **argv, struct client_parameter *params) {
     if (argc != 3) {
@@ -23,14 +24,115 @@ int parse_client_args(int argc, char **argv, struct client_parameter *params) {
     return 0;
 }
 
+static void print_server_usage(const char *program) {
+    printf("Usage: %s <port> [-b epoll|uring] [-s shards] [-w workers] [-H bytes] [-L bytes] [-l categories] [-f text|binary] [-t splice|relay|store] [-q jobs] [-p] [-m bytes]\n", program);
+    printf("  -b <backend>   I/O backend (default: epoll, falls back to epoll if uring is unavailable)\n");
+    printf("  -s <shards>    Listener shards, each with its own accept loop (default: 1, epoll only)\n");
+    printf("  -w <workers>   Worker threads that run client commands (default: 4)\n");
+    printf("  -H <bytes>     Outbound queue high watermark per client (default: 262144)\n");
+    printf("  -L <bytes>     Outbound queue low watermark per client (default: 65536)\n");
+    printf("  -l <list>      Log categories, e.g. \"all\", \"error,warning,server\" (default: all,-debug)\n");
+    printf("  -f <format>    Log format: text (server.log) or binary (server.log.bin, read with chatlog-decode)\n");
+    printf("  -t <mode>      File transfers: splice socket to socket, relay through a buffer, or store the whole file first (default: splice)\n");
+    printf("  -q <jobs>      File transfers that may wait for a transfer worker, more are turned away (default: 32)\n");
+    printf("  -p             Tell queued file senders their position in line\n");
+    printf("  -m <bytes>     Memory for staging small stored uploads, the rest spill to memfd (default: 1048576)\n");
+}
+
 int parse_server_args(int argc, char **argv, struct server_parameter *params) {
-    if (argc != 2) {
-        printf("Usage: %s <port>\n", argv[0]);
+    strcpy(params->io_backend, "epoll");
+    params->shards = 1;
+    params->workers = 4;
+    params->out_high_watermark = 256 * 1024;
+    params->out_low_watermark = 64 * 1024;
+    params->log_categories[0] = '\0';
+    params->log_binary = 0;
+    strcpy(params->file_transfer, "splice");
+    params->file_queue_capacity = 32;
+    params->file_queue_position = 0;
+    params->file_stage_budget = 1024 * 1024;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:s:w:H:L:l:f:t:q:pm:")) != -1) {
+        switch (opt) {
+            case 'b':
+                if (strcmp(optarg, "epoll") != 0 && strcmp(optarg, "uring") != 0) {
+                    printf("Invalid I/O backend '%s'. Must be 'epoll' or 'uring'.\n", optarg);
+                    return -1;
+                }
+                strncpy(params->io_backend, optarg, sizeof(params->io_backend) - 1);
+                params->io_backend[sizeof(params->io_backend) - 1] = '\0';
+                break;
+            case 's':
+                params->shards = atoi(optarg);
+                if (params->shards < 1 || params->shards > 64) {
+                    printf("Invalid shard count. Must be between 1 and 64.\n");
+                    return -1;
+                }
+                break;
+            case 'w':
+                params->workers = atoi(optarg);
+                if (params->workers < 1 || params->workers > 256) {
+                    printf("Invalid worker count. Must be between 1 and 256.\n");
+                    return -1;
+                }
+                break;
+            case 'H':
+                params->out_high_watermark = strtoul(optarg, NULL, 10);
+                break;
+            case 'L':
+                params->out_low_watermark = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                strncpy(params->log_categories, optarg, sizeof(params->log_categories) - 1);
+                params->log_categories[sizeof(params->log_categories) - 1] = '\0';
+                break;
+            case 'f':
+                if (strcmp(optarg, "text") != 0 && strcmp(optarg, "binary") != 0) {
+                    printf("Invalid log format '%s'. Must be 'text' or 'binary'.\n", optarg);
+                    return -1;
+                }
+                params->log_binary = strcmp(optarg, "binary") == 0;
+                break;
+            case 't':
+                if (strcmp(optarg, "splice") != 0 && strcmp(optarg, "relay") != 0 && strcmp(optarg, "store") != 0) {
+                    printf("Invalid transfer mode '%s'. Must be 'splice', 'relay' or 'store'.\n", optarg);
+                    return -1;
+                }
+                strcpy(params->file_transfer, optarg);
+                break;
+            case 'q':
+                params->file_queue_capacity = atoi(optarg);
+                if (params->file_queue_capacity < 1 || params->file_queue_capacity > 4096) {
+                    printf("Invalid file queue capacity. Must be between 1 and 4096.\n");
+                    return -1;
+                }
+                break;
+            case 'p':
+                params->file_queue_position = 1;
+                break;
+            case 'm':
+                params->file_stage_budget = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                print_server_usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (argc - optind != 1) {
+        print_server_usage(argv[0]);
+        return -1;
+    }
+
+    // The high watermark has to fit at least one full frame
+    if (params->out_high_watermark < 8192 || params->out_low_watermark >= params->out_high_watermark) {
+        printf("Invalid watermarks. High must be at least 8192 bytes and above the low watermark.\n");
         return -1;
     }
 
     // Parse port number
-    params->port = atoi(argv[1]);
+    params->port = atoi(argv[optind]);
     if (params->port <= 0 || params->port > 65535) {
         printf("Invalid port number. Must be a positive integer between 1 and 65535.\n");
         return -1;
@@ -7,6 +7,17 @@
 
 struct server_parameter {
     int port;
+    char io_backend[16];        // "epoll" (default) or "uring"
+    int shards;                 // SO_REUSEPORT listener shards for the epoll backend
+    int workers;                // command worker threads for the epoll backend
+    size_t out_high_watermark;  // queued bytes per client before messages are dropped
+    size_t out_low_watermark;   // level a throttled client must drain to
+    char log_categories[128];   // log categories to write, "" for the default set
+    int log_binary;             // write the binary log instead of server.log
+    char file_transfer[8];      // "splice" (default), "relay" or "store"
+    int file_queue_capacity;    // /sendfile jobs that may wait for a transfer worker
+    int file_queue_position;    // tell queued senders their place in line
+    size_t file_stage_budget;   // memory for pooled staging of stored uploads
 };
 
 struct client_parameter {
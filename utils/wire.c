@@ -0,0 +1,191 @@
+// wire.c - Varint framing and field codec for protocol v2, shared by client and server
+
+#include "wire.h"
+#include <string.h>
+
+size_t wire_put_varint(uint8_t *out, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+// Returns 0 and the bytes consumed, 1 when more input is needed,
+// -1 when the varint is longer than any 64-bit value
+int wire_get_varint(const uint8_t *data, size_t len, uint64_t *value, size_t *used) {
+    uint64_t result = 0;
+
+    for (size_t i = 0; i < WIRE_VARINT_MAX; i++) {
+        if (i == len) {
+            return 1;
+        }
+        result |= (uint64_t)(data[i] & 0x7f) << (7 * i);
+        if ((data[i] & 0x80) == 0) {
+            *value = result;
+            *used = i + 1;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+
+
+// ==========================================
+// WRITER
+// ==========================================
+
+void wire_writer_init(wire_writer_t *w, uint8_t *buf, size_t cap, uint8_t opcode) {
+    w->buf = buf;
+    w->cap = cap;
+    w->len = WIRE_LENGTH_MAX;
+    w->overflow = cap <= WIRE_LENGTH_MAX;
+    if (!w->overflow) {
+        w->buf[w->len++] = opcode;
+    }
+}
+
+void wire_write_varint(wire_writer_t *w, uint64_t value) {
+    if (w->overflow || w->cap - w->len < WIRE_VARINT_MAX) {
+        w->overflow = 1;
+        return;
+    }
+    w->len += wire_put_varint(w->buf + w->len, value);
+}
+
+void wire_write_string(wire_writer_t *w, const char *s, size_t len) {
+    wire_write_varint(w, len);
+    if (w->overflow || w->cap - w->len < len) {
+        w->overflow = 1;
+        return;
+    }
+    memcpy(w->buf + w->len, s, len);
+    w->len += len;
+}
+
+// Opcode and fields without the length prefix, NULL if the buffer overflowed
+const uint8_t* wire_writer_body(const wire_writer_t *w, size_t *len) {
+    if (w->overflow) {
+        return NULL;
+    }
+    *len = w->len - WIRE_LENGTH_MAX;
+    return w->buf + WIRE_LENGTH_MAX;
+}
+
+// Writes the length prefix in front of the body and returns the whole frame
+const uint8_t* wire_writer_finish(wire_writer_t *w, size_t *len) {
+    size_t body_len;
+    const uint8_t *body = wire_writer_body(w, &body_len);
+    if (!body) {
+        return NULL;
+    }
+
+    uint8_t prefix[WIRE_LENGTH_MAX];
+    size_t prefix_len = wire_put_varint(prefix, body_len);
+    uint8_t *start = w->buf + WIRE_LENGTH_MAX - prefix_len;
+    memcpy(start, prefix, prefix_len);
+
+    *len = prefix_len + body_len;
+    return start;
+}
+
+
+
+// ==========================================
+// READER
+// ==========================================
+
+void wire_reader_init(wire_reader_t *r, const void *body, size_t len) {
+    r->pos = body;
+    r->end = r->pos + len;
+    r->error = 0;
+}
+
+uint64_t wire_read_varint(wire_reader_t *r) {
+    uint64_t value = 0;
+    size_t used = 0;
+
+    if (r->error || wire_get_varint(r->pos, r->end - r->pos, &value, &used) != 0) {
+        r->error = 1;
+        return 0;
+    }
+    r->pos += used;
+    return value;
+}
+
+// Returns a view into the body, it is not NUL terminated
+const char* wire_read_string(wire_reader_t *r, size_t *len) {
+    uint64_t n = wire_read_varint(r);
+    if (r->error || n > (uint64_t)(r->end - r->pos)) {
+        r->error = 1;
+        *len = 0;
+        return NULL;
+    }
+
+    const char *s = (const char *)r->pos;
+    r->pos += n;
+    *len = n;
+    return s;
+}
+
+
+
+// ==========================================
+// FILE SIZES AND CHUNKS
+// ==========================================
+
+static void put_be(uint8_t *out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out[i] = (uint8_t)value;
+        value >>= 8;
+    }
+}
+
+static uint64_t get_be(const uint8_t *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+// Returns the bytes written, WIRE_SIZE_SHORT or WIRE_SIZE_LONG
+size_t wire_put_file_size(uint8_t *out, uint64_t size) {
+    if (size < WIRE_SIZE_ESCAPE) {
+        put_be(out, size, 4);
+        return WIRE_SIZE_SHORT;
+    }
+    put_be(out, WIRE_SIZE_ESCAPE, 4);
+    put_be(out + 4, size, 8);
+    return WIRE_SIZE_LONG;
+}
+
+// Returns how many bytes the raw size at in takes. *size is only set once
+// have covers all of them; the first WIRE_SIZE_SHORT always tell.
+size_t wire_get_file_size(const uint8_t *in, size_t have, uint64_t *size) {
+    uint64_t short_size = get_be(in, 4);
+    if (short_size != WIRE_SIZE_ESCAPE) {
+        *size = short_size;
+        return WIRE_SIZE_SHORT;
+    }
+    if (have >= WIRE_SIZE_LONG) {
+        *size = get_be(in + 4, 8);
+    }
+    return WIRE_SIZE_LONG;
+}
+
+void wire_put_chunk_header(uint8_t *out, uint32_t transfer_id, uint64_t offset, uint32_t len) {
+    put_be(out, transfer_id, 4);
+    put_be(out + 4, offset, 8);
+    put_be(out + 12, len, 4);
+}
+
+void wire_get_chunk_header(const uint8_t *in, uint32_t *transfer_id, uint64_t *offset, uint32_t *len) {
+    *transfer_id = (uint32_t)get_be(in, 4);
+    *offset = get_be(in + 4, 8);
+    *len = (uint32_t)get_be(in + 12, 4);
+}
@@ -0,0 +1,98 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Protocol versions offered in LOGIN_SUCCESS and requested with "PROTO <n>"
+#define WIRE_PROTO_TEXT 1               // 4-byte length + text, the original format
+#define WIRE_PROTO_BINARY 2             // varint length + opcode + fields
+
+#define WIRE_VARINT_MAX 10              // bytes in the longest 64-bit varint
+#define WIRE_LENGTH_MAX 5               // bytes in the longest frame length prefix
+
+// A v2 frame is varint(body length) followed by the body: one opcode byte,
+// then the opcode's fields. Integers are unsigned LEB128 varints, strings
+// are a varint length followed by the bytes, without a terminator.
+typedef enum {
+    // client -> server, fields match the text command's arguments
+    WIRE_OP_JOIN = 0x01,                // room
+    WIRE_OP_LEAVE = 0x02,
+    WIRE_OP_BROADCAST = 0x03,           // message
+    WIRE_OP_WHISPER = 0x04,             // username, message
+    WIRE_OP_SENDFILE = 0x05,            // filename, username
+    WIRE_OP_EXIT = 0x06,
+    WIRE_OP_RESUME = 0x07,              // "" to turn chunked transfers on, or "<transfer_id> <offset>"
+    WIRE_OP_FILE_ACK = 0x08,            // transfer_id, offset received so far
+    WIRE_OP_SIZE64 = 0x09,              // no fields: this client reads 64-bit raw file sizes
+
+    // server -> client
+    WIRE_OP_TEXT = 0x40,                // text: any reply without a dedicated opcode
+    WIRE_OP_JOINED = 0x41,              // room_id, members, capacity, room
+    WIRE_OP_LEFT = 0x42,                // room_id
+    WIRE_OP_MEMBER = 0x43,              // room_id, user_id, event, username
+    WIRE_OP_ROOM_MESSAGE = 0x44,        // room_id, user_id, message
+    WIRE_OP_BROADCAST_ACK = 0x45,       // room_id, delivered, recipients
+    WIRE_OP_WHISPER_MESSAGE = 0x46,     // user_id, username, message
+    WIRE_OP_WHISPER_ACK = 0x47,         // user_id, username
+    WIRE_OP_UPLOAD_REQUEST = 0x48,      // filename, username[, transfer_id, offset]
+    WIRE_OP_FILE_DOWNLOAD = 0x49        // size, user_id, filename, username[, transfer_id, offset]; raw size + bytes follow
+} wire_opcode_t;
+
+// The raw file size ahead of every upload and download is a big-endian u32.
+// Files of 4 GB and more send WIRE_SIZE_ESCAPE in its place, followed by a
+// big-endian u64. Servers offer this as "size64=1" in LOGIN_SUCCESS and only
+// send it to clients that turned it on with /size64.
+#define WIRE_SIZE_ESCAPE 0xFFFFFFFFu
+#define WIRE_SIZE_SHORT 4
+#define WIRE_SIZE_LONG 12
+
+// Chunked transfers, offered as "chunks=1" in LOGIN_SUCCESS and turned on with
+// /resume. After the raw size, the file goes as chunks from the resume offset
+// on: a header of big-endian u32 transfer id, u64 offset and u32 length, then
+// length bytes of the file.
+#define WIRE_CHUNK_HEADER 16
+#define WIRE_CHUNK_MAX (64 * 1024)
+
+// WIRE_OP_MEMBER events
+typedef enum {
+    WIRE_MEMBER_PRESENT = 0,            // already in the room when the receiver joined
+    WIRE_MEMBER_JOINED = 1,
+    WIRE_MEMBER_LEFT = 2,
+    WIRE_MEMBER_DISCONNECTED = 3
+} wire_member_event_t;
+
+// Encodes into a caller buffer. Space for the length prefix is reserved up
+// front so the finished frame never has to be moved.
+typedef struct {
+    uint8_t *buf;
+    size_t cap;
+    size_t len;                         // bytes written, prefix area included
+    int overflow;
+} wire_writer_t;
+
+typedef struct {
+    const uint8_t *pos;
+    const uint8_t *end;
+    int error;                          // set once a field ran past the end
+} wire_reader_t;
+
+size_t wire_put_varint(uint8_t *out, uint64_t value);
+int wire_get_varint(const uint8_t *data, size_t len, uint64_t *value, size_t *used);
+
+void wire_writer_init(wire_writer_t *w, uint8_t *buf, size_t cap, uint8_t opcode);
+void wire_write_varint(wire_writer_t *w, uint64_t value);
+void wire_write_string(wire_writer_t *w, const char *s, size_t len);
+const uint8_t* wire_writer_body(const wire_writer_t *w, size_t *len);
+const uint8_t* wire_writer_finish(wire_writer_t *w, size_t *len);
+
+void wire_reader_init(wire_reader_t *r, const void *body, size_t len);
+uint64_t wire_read_varint(wire_reader_t *r);
+const char* wire_read_string(wire_reader_t *r, size_t *len);
+
+size_t wire_put_file_size(uint8_t *out, uint64_t size);
+size_t wire_get_file_size(const uint8_t *in, size_t have, uint64_t *size);
+void wire_put_chunk_header(uint8_t *out, uint32_t transfer_id, uint64_t offset, uint32_t len);
+void wire_get_chunk_header(const uint8_t *in, uint32_t *transfer_id, uint64_t *offset, uint32_t *len);
+
+#endif // WIRE_H